@@ -0,0 +1,40 @@
+/*
+ * This sketch measures how long the link takes to connect after boot, for tracking the fast start path
+ * 
+ * Pair two devices running this sketch (or one of the other examples) first. After that, each boot reads the saved pairing,
+ * initialises straight away on the saved channel and reports the time from boot to connected on the Serial monitor
+ * 
+ * The device restarts itself a few seconds after connecting, or if it fails to connect, so a run of results builds up
+ * 
+ */
+#include <m2mDirect.h>
+
+const uint32_t restartDelay = 5000;     //How long to stay connected before restarting
+const uint32_t connectTimeout = 60000;  //Restart if not connected by this time, in ms since boot
+bool reported = false;
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  //m2mDirect.debug(Serial);  //Tell the library to use Serial for debug output
+  m2mDirect.begin();  //Start the M2M connection, on the saved channel if there is one
+}
+
+void loop()
+{
+  m2mDirect.housekeeping(); //Maintain the M2M connection
+  if(reported == false && m2mDirect.bootToConnectedTime() != 0)
+  {
+    reported = true;
+    Serial.printf(PSTR("\r\nBoot to connected: %ums"), m2mDirect.bootToConnectedTime());
+  }
+  if((reported == true && millis() - m2mDirect.bootToConnectedTime() > restartDelay) || (reported == false && millis() > connectTimeout))
+  {
+    if(reported == false)
+    {
+      Serial.print(F("\r\nBoot to connected: timed out"));
+    }
+    Serial.flush();
+    ESP.restart();
+  }
+}
@@ -0,0 +1,110 @@
+/*
+ * This sketch measures hub and spoke polling, for tracking per-node latency and aggregate throughput as nodes are added
+ *
+ * Put the MAC address of the hub and of each spoke below and flash the same sketch to all of them. The hub adds every spoke
+ * to its peer table and polls them in turn, each spoke provisions a link to the hub and sends a counter as fast as it is allowed
+ *
+ * Every ten seconds the hub reports the poll cycle time, each spoke's smoothed and worst poll latency and the total messages
+ * received per second. Run it with two spokes, then four, then more, by changing spokeCount, and compare the results. The cycle
+ * time should grow in step with the number of spokes. Each spoke sends once per cycle, so the total throughput is set by the slot
+ * length rather than the number of spokes, until collisions or slow housekeeping make spokes miss their slots
+ *
+ * The peer table holds at most M2M_DIRECT_MAXIMUM_PEERS (18) spokes, so the largest run is 19 devices including the hub.
+ * Encryption is disabled because ESP-Now only allows six encrypted peers
+ *
+ */
+#include <m2mDirect.h>
+
+uint8_t hubMac[6] = {0x24,0x0a,0xc4,0x00,0x00,0x01};  //MAC address of the hub
+uint8_t spokes[M2M_DIRECT_MAXIMUM_PEERS][6] = {        //MAC addresses of the spokes, up to M2M_DIRECT_MAXIMUM_PEERS
+  {0x24,0x0a,0xc4,0x00,0x00,0x02},
+  {0x24,0x0a,0xc4,0x00,0x00,0x03},
+  {0x24,0x0a,0xc4,0x00,0x00,0x04},
+  {0x24,0x0a,0xc4,0x00,0x00,0x05},
+  {0x24,0x0a,0xc4,0x00,0x00,0x06},
+  {0x24,0x0a,0xc4,0x00,0x00,0x07},
+  {0x24,0x0a,0xc4,0x00,0x00,0x08},
+  {0x24,0x0a,0xc4,0x00,0x00,0x09},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0a},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0b},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0c},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0d},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0e},
+  {0x24,0x0a,0xc4,0x00,0x00,0x0f},
+  {0x24,0x0a,0xc4,0x00,0x00,0x10},
+  {0x24,0x0a,0xc4,0x00,0x00,0x11},
+  {0x24,0x0a,0xc4,0x00,0x00,0x12},
+  {0x24,0x0a,0xc4,0x00,0x00,0x13},
+};
+const uint8_t spokeCount = 3;  //How many of the spokes above are in this run, up to M2M_DIRECT_MAXIMUM_PEERS
+uint8_t primaryKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x70,0x72,0x69,0x6d,0x61,0x72};  //Unused with encryption disabled, but required
+uint8_t localKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x6c,0x6f,0x63,0x61,0x6c,0x21};
+const uint8_t channel = 1;  //Every device must use the same channel
+const uint16_t slotLength = 30;  //Time each spoke has to answer a poll, in ms
+const uint32_t sendInterval = 20;  //How often a spoke tries to send, faster than it gets a slot so throughput is set by the schedule
+const uint32_t reportInterval = 10000;  //How often the hub reports
+
+bool isHub = false;
+uint32_t lastSend = 0;
+uint32_t lastReport = 0;
+uint32_t lastMessagesReceived = 0;
+uint32_t counter = 0;
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  delay(500); //Give some time for the Serial Monitor to come online
+  //m2mDirect.debug(Serial);  //Tell the library to use Serial for debug output
+  m2mDirect.disableEncryption();
+  uint8_t localMac[6];
+  WiFi.macAddress(localMac);
+  isHub = memcmp(localMac, hubMac, 6) == 0;
+  if(isHub == false)
+  {
+    m2mDirect.provision(hubMac, primaryKey, localKey, channel);  //Spokes see an ordinary link to the hub
+  }
+  m2mDirect.begin(channel);  //Start the M2M connection
+  if(isHub == true)
+  {
+    for(uint8_t index = 0; index < spokeCount; index++)
+    {
+      if(m2mDirect.addPeer(spokes[index], primaryKey, localKey) == false)
+      {
+        Serial.printf(PSTR("\r\nUnable to add spoke %u"), index);
+      }
+    }
+    m2mDirect.hub(true, slotLength);  //Poll the spokes one slot at a time
+    Serial.printf(PSTR("\r\nHub polling %u spokes, cycle time %ums"), m2mDirect.peerCount(), m2mDirect.hubCycleTime());
+  }
+}
+
+void loop()
+{
+  m2mDirect.housekeeping(); //Maintain the M2M connection, this also sends messages held for the slot. With no callback set, received messages are discarded after counting
+  if(isHub == true)
+  {
+    if(millis() - lastReport > reportInterval)
+    {
+      uint32_t messagesReceived = m2mDirect.statistics().dataMessagesReceived;
+      Serial.printf(PSTR("\r\nCycle %ums, %u messages/s"), m2mDirect.hubCycleTime(), (messagesReceived - lastMessagesReceived) * 1000 / (millis() - lastReport));
+      lastMessagesReceived = messagesReceived;
+      lastReport = millis();
+      m2mDirectPeerInfo info;
+      for(uint8_t index = 0; m2mDirect.peerInfo(index, info); index++)
+      {
+        Serial.printf(PSTR("\r\n  %02x%02x%02x%02x%02x%02x %s latency %ums max %ums received %u"), info.macAddress[0], info.macAddress[1], info.macAddress[2], info.macAddress[3], info.macAddress[4], info.macAddress[5], info.state == m2mDirectState::connected ? "connected" : "not connected", info.pollLatency, info.pollLatencyMaximum, info.dataMessagesReceived);
+      }
+    }
+  }
+  else if(m2mDirect.connected() == true && millis() - lastSend > sendInterval)
+  {
+    lastSend = millis();
+    if(m2mDirect.add(counter))
+    {
+      if(m2mDirect.sendMessage(false))  //Held until the next slot if this spoke isn't being polled right now
+      {
+        counter++;
+      }
+    }
+  }
+}
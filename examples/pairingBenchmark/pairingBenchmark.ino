@@ -0,0 +1,49 @@
+/*
+ * This sketch measures how long pairing takes, for tracking fast pairing
+ * 
+ * Run it on two devices. Each one pairs, reports the time from pairing starting to connected on the Serial monitor,
+ * stays connected for a few seconds then resets its pairing to start again, so a run of results builds up
+ * 
+ * The two devices drift apart over a run, so some attempts include the wait for the other end to reset too.
+ * The lowest figures are the ones that show the pairing handshake itself
+ * 
+ * Every run saves and deletes a pairing, so don't leave it running for days on a device you care about the flash of
+ * 
+ */
+#include <m2mDirect.h>
+
+const uint32_t repairDelay = 5000;      //How long to stay connected before pairing again
+const uint32_t pairingTimeout = 60000;  //Give up and pair again if not connected in this time
+uint32_t pairingStarted = 0;
+bool reported = false;
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  //m2mDirect.debug(Serial);  //Tell the library to use Serial for debug output
+  m2mDirect.fastPairing();  //Pair with random bursts and quick ACKs, the default
+  m2mDirect.begin();  //Start the M2M connection
+  m2mDirect.resetPairing(); //Always start by pairing
+  pairingStarted = millis();
+}
+
+void loop()
+{
+  m2mDirect.housekeeping(); //Maintain the M2M connection
+  if(reported == false && m2mDirect.connected() == true)
+  {
+    reported = true;
+    pairingStarted = millis();
+    Serial.printf(PSTR("\r\nTime to pair: %ums"), m2mDirect.timeToPair());
+  }
+  if((reported == true && millis() - pairingStarted > repairDelay) || (reported == false && millis() - pairingStarted > pairingTimeout))
+  {
+    if(reported == false)
+    {
+      Serial.print(F("\r\nTime to pair: timed out"));
+    }
+    reported = false;
+    pairingStarted = millis();
+    m2mDirect.resetPairing();
+  }
+}
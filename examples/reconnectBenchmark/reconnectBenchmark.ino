@@ -0,0 +1,99 @@
+/*
+ * This sketch measures how long the link takes to come back after an outage, for tracking the fast handshake
+ *
+ * Put the MAC addresses of your two devices below and flash the same sketch to both. Device B makes the outages, once connected
+ * it stays quiet for a while by not calling housekeeping(), so device A stops hearing keepalives and declares the link down.
+ * Device A reports the results on the Serial monitor
+ *
+ * reconnectTime() counts from device A declaring the link down, so it includes the rest of the outage. Device A also notes when
+ * it first hears device B again and reports the time from then to connected, which is the time the handshake itself took.
+ * Set fastHandshake to false on both devices to compare with connecting after a run of good keepalives
+ *
+ */
+#include <m2mDirect.h>
+
+uint8_t deviceA[6] = {0x24,0x0a,0xc4,0x00,0x00,0x01};  //MAC address of the device that reports
+uint8_t deviceB[6] = {0x24,0x0a,0xc4,0x00,0x00,0x02};  //MAC address of the device that makes the outages
+uint8_t primaryKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x70,0x72,0x69,0x6d,0x61,0x72};  //Shared primary encryption key
+uint8_t localKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x6c,0x6f,0x63,0x61,0x6c,0x21};  //Shared local encryption key
+const uint8_t channel = 1;  //Both devices must use the same channel
+const bool fastHandshake = true;  //Connect after one verified round trip
+const uint32_t connectedTime = 5000;  //How long device B stays connected between outages, in ms
+const uint32_t outageTime = 15000;  //How long device B stays quiet, long enough for device A to declare the link down, in ms
+
+bool reporter = false;
+bool wasConnected = false;
+uint32_t connectedAt = 0;
+uint32_t disconnectedAt = 0;
+uint32_t heardAt = 0;
+uint32_t keepalivesReceived = 0;
+uint32_t reconnections = 0;
+uint32_t totalHandshakeTime = 0;
+uint32_t worstHandshakeTime = 0;
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  delay(500); //Give some time for the Serial Monitor to come online
+  uint8_t localMac[6];
+  WiFi.macAddress(localMac);
+  reporter = memcmp(localMac, deviceA, 6) == 0;
+  m2mDirect.fastHandshake(fastHandshake);
+  m2mDirect.provision(reporter ? deviceB : deviceA, primaryKey, localKey, channel);  //Use the pre-configured pairing, for this boot only
+  m2mDirect.begin(channel);  //Start the M2M connection
+  Serial.print(reporter ? F("\n\rDevice A, reporting") : F("\n\rDevice B, making outages"));
+}
+
+void loop()
+{
+  if(reporter == false)
+  {
+    if(m2mDirect.connected() == true && millis() - connectedAt > connectedTime)
+    {
+      Serial.printf(PSTR("\n\rQuiet for %ums"), outageTime);
+      delay(outageTime);  //No housekeeping, so no keepalives
+      connectedAt = millis();
+    }
+    else if(m2mDirect.connected() == false)
+    {
+      connectedAt = millis();
+    }
+    m2mDirect.housekeeping(); //Maintain the M2M connection
+    return;
+  }
+  m2mDirect.housekeeping(); //Maintain the M2M connection
+  uint32_t received = m2mDirect.statistics().keepalivesReceived;
+  if(wasConnected == true && m2mDirect.connected() == false)
+  {
+    wasConnected = false;
+    disconnectedAt = millis();
+    heardAt = 0;
+    Serial.print(F("\n\rDisconnected"));
+  }
+  if(wasConnected == false && heardAt == 0 && disconnectedAt != 0 && received != keepalivesReceived)
+  {
+    heardAt = millis();  //Device B is back
+  }
+  if(wasConnected == false && m2mDirect.connected() == true)
+  {
+    wasConnected = true;
+    if(disconnectedAt != 0 && heardAt != 0)
+    {
+      uint32_t quietTime = heardAt - disconnectedAt;
+      uint32_t handshakeTime = m2mDirect.reconnectTime() > quietTime ? m2mDirect.reconnectTime() - quietTime : 0;  //Heard and connected in the same housekeeping() call
+      reconnections++;
+      totalHandshakeTime += handshakeTime;
+      if(handshakeTime > worstHandshakeTime)
+      {
+        worstHandshakeTime = handshakeTime;
+      }
+      Serial.printf(PSTR("\n\rReconnected after %ums, %ums from hearing the peer again, mean %ums, worst %ums over %u reconnections"),
+        m2mDirect.reconnectTime(), handshakeTime, totalHandshakeTime / reconnections, worstHandshakeTime, reconnections);
+    }
+    else
+    {
+      Serial.print(F("\n\rConnected"));
+    }
+  }
+  keepalivesReceived = received;
+}
@@ -1,18 +1,21 @@
 /*
- * This sketch connects two devices with pre-configured MAC addresses, global and local encryption keys
- * 
- * Once connected it just sends a random number from one node to the other
- * 
+ * This sketch connects two devices with pre-configured MAC addresses, primary and local encryption keys, without pairing over the air
+ *
+ * Put the MAC addresses of your two devices below and flash the same sketch to both. Each one works out which of the pair it is
+ * and provisions the link with the other's MAC address. The keys must be the same on both devices, so make up your own
+ *
+ * Once connected it just sends its uptime from each node to the other
+ *
  * This demonstrates the basic functions of the library, including (optional) callbacks, how to check data is added and sent
- * 
+ *
  */
 #include <m2mDirect.h>
-#include "credentials.h"
 
-#ifndef APSSID
-//#define APSSID "Your WiFi SSID"
-//#define APPSK "Your WiFi PSK"
-#endif
+uint8_t deviceA[6] = {0x24,0x0a,0xc4,0x00,0x00,0x01};  //MAC address of one device
+uint8_t deviceB[6] = {0x24,0x0a,0xc4,0x00,0x00,0x02};  //MAC address of the other device
+uint8_t primaryKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x70,0x72,0x69,0x6d,0x61,0x72};  //Shared primary encryption key
+uint8_t localKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x6c,0x6f,0x63,0x61,0x6c,0x21};  //Shared local encryption key
+const uint8_t channel = 1;  //Both devices must use the same channel
 
 #if defined(ESP8266)
 String name = "Device-" + String(ESP.getChipId(),HEX);  //This will set a name (optional) for the device
@@ -20,80 +23,48 @@ String name = "Device-" + String(ESP.getChipId(),HEX);  //This will set a name (
 String name = "Device-" + String(uint32_t(ESP.getEfuseMac()),HEX);  //This will set a name (optional) for the device
 #endif
 
-bool connected = false; //Variable to show if currently connected and avoid 'polling'
 uint32_t lastSend = 0;  //Used to send data periodically without delay()
 
 /*
- * 
+ *
  * This function is called when the two devices connect
- * 
+ *
  */
 void onConnected()
 {
-  connected = true;
-  if(m2m.remoteNameSet() == true)
-  {
-    Serial.print(F("\nConnected to device: "));
-    Serial.print(m2m.remoteName());
-  }
-  else
-  {
-    Serial.print(F("\nConnected"));
-  }
+  Serial.printf(PSTR("\n\rConnected %ums after boot"), m2mDirect.bootToConnectedTime());
 }
 
 /*
- * 
+ *
  * This function is called when the two devices disconnect
- * 
+ *
  */
 void onDisconnected()
 {
-  connected = false;
-  Serial.print(F("\nDisconnected"));
+  Serial.print(F("\n\rDisconnected"));
 }
 /*
- * 
+ *
  * This function is called when this device receives data
- * 
+ *
  */
 void onMessageReceived()
 {
-  Serial.print(F("\nReceived message "));
-  if(m2m.dataAvailable() > 0) //dataAvailable is the number of fields of data in a message
+  Serial.print(F("\n\rReceived message "));
+  if(m2mDirect.dataAvailable() > 0 && m2mDirect.nextDataType() == m2mDirect.DATA_UINT32_T) //nextDataType means you can check what you are trying to retrieve before doing so
   {
-    if(m2m.nextDataType() == m2m.DATA_UINT32_T) //nextDataType means you can check what you are trying to retrieve before doing so
-    {
-      uint32_t receivedData = 0;
-      if(m2m.retrieveReceivedData(&receivedData)) //You must pass by reference the variable to retrieve the data into
-      {
-        Serial.print(F("data received: "));
-        Serial.print(receivedData);
-        Serial.print(F(" (link quality: "));
-        Serial.print(m2m.linkQuality(),HEX);  //Link quality is expressed as MSB 32-bit time series of success/fail. Higher is better
-        Serial.print(')');
-        if(m2m.dataAvailable() > 0) //dataAvailable is the number of fields of data in a message
-        {
-          m2m.clearReceivedMessage();  //This is not necessary if ALL the data from the message has been retrieved and is only here as an example
-        }
-      }
-      else
-      {
-        Serial.print(F("unable to retrieve received data"));
-        m2m.clearReceivedMessage();  //Clear the received message to wait for the next message
-      }
-    }
-    else
+    uint32_t receivedData = 0;
+    if(m2mDirect.retrieve(&receivedData)) //You must pass by reference the variable to retrieve the data into
     {
-      Serial.print(F("unable to retrieve received data, data wrong type in message"));
-      m2m.clearReceivedMessage();  //Clear the received message to wait for the next message
+      Serial.printf(PSTR("data received: %u (link quality: %08x)"), receivedData, m2mDirect.linkQuality());
     }
   }
   else
   {
-    Serial.print(F("\nNo data in message"));
-    m2m.clearReceivedMessage();  //Clear the received message to wait for the next message
+    Serial.print(F("unexpected contents"));
   }
+  m2mDirect.clearReceivedMessage();  //Clear anything left in the message to wait for the next one
 }
 
 
@@ -101,64 +72,45 @@ void setup()
 {
   Serial.begin(115200); //Start the serial interface for debug
   delay(500); //Give some time for the Serial Monitor to come online
-  #ifdef APSSID
-  WiFi.mode(WIFI_STA);
-  Serial.printf("\nConnecting to \"%s\" with PSK \"%s\"", APSSID, APPSK);
-  WiFi.begin(APSSID, APPSK);
-  while(WiFi.status() != WL_CONNECTED && millis() < 3e4) //Spend 30s trying to connect to WiFi
-  {
-    delay(500);
-    Serial.print(".");
-  }
-  if(WiFi.status() == WL_CONNECTED)
-  {
-    Serial.println(F("connected"));
-  }
-  else
-  {
-    Serial.println(F("not connected"));
-  }
-  #endif
-  m2m.debug(Serial);  //Tell the library to use Serial for debug output
+  //m2mDirect.debug(Serial);  //Tell the library to use Serial for debug output
   #ifdef LED_BUILTIN
-  m2m.indicatorGpio(LED_BUILTIN,true);  //Enable the indicator LED
+  m2mDirect.indicatorGpio(LED_BUILTIN,true);  //Enable the indicator LED
   #endif
-  m2m.localName(name);  //Set the name of the device
-  m2m.setConnectedCallback(onConnected);  //Set the 'connected' callback created above
-  m2m.setDisconnectedCallback(onDisconnected);  //Set the 'disconnected' callback created above
-  m2m.setMessageReceivedCallback(onMessageReceived);  //Set the 'message received' callback created above
-  m2m.begin();  //Start the M2M connection
+  m2mDirect.localName(name);  //Set the name of the device
+  m2mDirect.setConnectedCallback(onConnected);  //Set the 'connected' callback created above
+  m2mDirect.setDisconnectedCallback(onDisconnected);  //Set the 'disconnected' callback created above
+  m2mDirect.setMessageReceivedCallback(onMessageReceived);  //Set the 'message received' callback created above
+  uint8_t localMac[6];
+  WiFi.macAddress(localMac);
+  uint8_t* remoteMac = memcmp(localMac, deviceA, 6) == 0 ? deviceB : deviceA; //Connect to whichever device this isn't
+  if(m2mDirect.provision(remoteMac, primaryKey, localKey, channel) == false)  //Use the pre-configured pairing, for this boot only
+  {
+    Serial.print(F("\n\rProvisioning failed"));
+  }
+  m2mDirect.begin(channel);  //Start the M2M connection, which goes straight to connecting
 }
 
 void loop()
 {
-  m2m.housekeeping(); //Maintain the M2M connection
-  if(connected == true) //Only send data if connected
+  m2mDirect.housekeeping(); //Maintain the M2M connection
+  if(m2mDirect.connected() == true && millis() - lastSend > 10000) //Send data every 10s, only if connected
   {
-    if(millis() - lastSend > 10000) //Send data every 10s
+    lastSend = millis(); //Send the current 'uptime' as test data
+    if(m2mDirect.add(lastSend))
     {
-      lastSend = millis(); //Send the current 'uptime' as test data
-      if(m2m.addData(lastSend))
+      Serial.printf(PSTR("\n\rSending data %u"), lastSend);
+      if(m2mDirect.sendMessage()) //Send it immediately. Note this will 'block' for a short while, until the send is confirmed (or not)
       {
-        Serial.print(F("\nSending data "));
-        Serial.print(lastSend);
-        if(m2m.sendMessage()) //Send it immediately. Note this will 'block' for a short while, until the send is confirmed (or not)
-        {
-          Serial.print(F(" OK"));
-        }
-        else
-        {
-          Serial.print(F(" failed"));
-        }
-        Serial.print(F(" (link quality:"));
-        Serial.print(m2m.linkQuality(),HEX);
-        Serial.print(')');
+        Serial.print(F(" OK"));
       }
       else
       {
-        Serial.print(F("\nUnable to add data "));
-        Serial.print(lastSend);
+        Serial.print(F(" failed"));
       }
     }
+    else
+    {
+      Serial.printf(PSTR("\n\rUnable to add data %u"), lastSend);
+    }
   }
 }
@@ -0,0 +1,116 @@
+/*
+ * This sketch stress tests the statistics snapshot while the counters are being written from housekeeping and the WiFi task
+ *
+ * Put the MAC addresses of your two devices below and flash the same sketch to both. Each one runs housekeeping in the background
+ * and sends as fast as the send queue allows, so counters change all the time. The main loop takes snapshots as fast as it can
+ * and every so often resets the counters, checking each snapshot against the one before
+ *
+ * Between resets every counter must only ever go up, a keepalive is a frame so keepalivesSent can never exceed framesSent, and
+ * after a reset no counter may wrap round to a huge value. Any failure is printed. With no failures, the totals are
+ * printed every ten seconds
+ *
+ */
+#include <m2mDirect.h>
+
+uint8_t deviceA[6] = {0x24,0x0a,0xc4,0x00,0x00,0x01};  //MAC address of one device
+uint8_t deviceB[6] = {0x24,0x0a,0xc4,0x00,0x00,0x02};  //MAC address of the other device
+uint8_t primaryKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x70,0x72,0x69,0x6d,0x61,0x72};  //Shared primary encryption key
+uint8_t localKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x6c,0x6f,0x63,0x61,0x6c,0x21};  //Shared local encryption key
+const uint8_t channel = 1;  //Both devices must use the same channel
+const uint32_t resetInterval = 1000;  //How often the counters are reset, in ms
+const uint32_t reportInterval = 10000;  //How often the totals are printed, in ms
+
+m2mDirectStatistics previous;
+uint32_t lastReset = 0;
+uint32_t lastReport = 0;
+uint32_t snapshots = 0;
+uint32_t resets = 0;
+uint32_t failures = 0;
+uint32_t counter = 0;
+
+/*
+ *
+ * Checks one counter against its value in the previous snapshot
+ *
+ */
+void check(const char* name, uint32_t now, uint32_t before, bool reset)
+{
+  if(now < before && reset == false)
+  {
+    failures++;
+    Serial.printf(PSTR("\n\r%s went backwards from %u to %u"), name, before, now);
+  }
+  else if(reset == true && now > 0x80000000)  //Subtracting a baseline larger than the counter
+  {
+    failures++;
+    Serial.printf(PSTR("\n\r%s wrapped to %u after a reset"), name, now);
+  }
+}
+
+/*
+ *
+ * Takes a snapshot and checks it against the previous one
+ *
+ */
+void checkSnapshot(bool reset)
+{
+  m2mDirectStatistics stats = m2mDirect.statistics();
+  snapshots++;
+  check("framesSent", stats.framesSent, previous.framesSent, reset);
+  check("keepalivesSent", stats.keepalivesSent, previous.keepalivesSent, reset);
+  check("dataMessagesSent", stats.dataMessagesSent, previous.dataMessagesSent, reset);
+  check("framesReceived", stats.framesReceived, previous.framesReceived, reset);
+  check("keepalivesReceived", stats.keepalivesReceived, previous.keepalivesReceived, reset);
+  check("dataMessagesReceived", stats.dataMessagesReceived, previous.dataMessagesReceived, reset);
+  check("eventsCoalesced", stats.eventsCoalesced, previous.eventsCoalesced, reset);
+  if(stats.keepalivesSent > stats.framesSent)
+  {
+    failures++;
+    Serial.printf(PSTR("\n\rkeepalivesSent %u is more than framesSent %u"), stats.keepalivesSent, stats.framesSent);
+  }
+  if(stats.keepalivesReceived + stats.dataMessagesReceived > stats.framesReceived)
+  {
+    failures++;
+    Serial.printf(PSTR("\n\rValid frames %u are more than framesReceived %u"), stats.keepalivesReceived + stats.dataMessagesReceived, stats.framesReceived);
+  }
+  previous = stats;
+}
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  delay(500); //Give some time for the Serial Monitor to come online
+  m2mDirect.setMessageReceivedCallback([]() { m2mDirect.clearReceivedMessage(); });  //Count received messages then throw them away
+  uint8_t localMac[6];
+  WiFi.macAddress(localMac);
+  uint8_t* remoteMac = memcmp(localMac, deviceA, 6) == 0 ? deviceB : deviceA; //Connect to whichever device this isn't
+  m2mDirect.provision(remoteMac, primaryKey, localKey, channel);  //Use the pre-configured pairing, for this boot only
+  m2mDirect.begin(channel);  //Start the M2M connection
+  m2mDirect.backgroundHousekeeping();  //Counters are written from the housekeeping task/Ticker and the WiFi task while loop() reads them
+  previous = m2mDirect.statistics();
+}
+
+void loop()
+{
+  m2mDirect.housekeeping(); //Deliver received messages, the link itself is maintained in the background
+  if(m2mDirect.connected() == true && m2mDirect.add(counter) && m2mDirect.sendMessage())  //Queued, so this never waits
+  {
+    counter++;
+  }
+  if(millis() - lastReset > resetInterval)
+  {
+    lastReset = millis();
+    m2mDirect.resetStatistics();
+    resets++;
+    checkSnapshot(true);
+  }
+  else
+  {
+    checkSnapshot(false);
+  }
+  if(millis() - lastReport > reportInterval)
+  {
+    lastReport = millis();
+    Serial.printf(PSTR("\n\r%u snapshots, %u resets, %u messages sent, %u failures"), snapshots, resets, counter, failures);
+  }
+}
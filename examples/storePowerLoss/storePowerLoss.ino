@@ -0,0 +1,68 @@
+/*
+ * This sketch checks the saved pairing survives power being cut while it is being written, mostly of interest on ESP8266 where the library manages the flash itself
+ *
+ * It saves a provisioned pairing over and over, with a counter in the last four bytes of the local key, printing the counter as it goes.
+ * Cut the power at random, many times, including while it is erasing a sector (watch storeErases). After each boot it reads the pairing
+ * back and prints the counter it recovered. That must always be a counter that was saved, never missing or corrupt, and it should be the
+ * last one printed or the one after it (which was being written when the power went)
+ *
+ * On ESP8266 saves are only power-loss safe with a spare sector, so build with M2M_DIRECT_STORE_SPARE_SECTOR defined as a free sector.
+ * Without one, a power cut between erasing the sector and the next save loses the pairing
+ *
+ * This wears the flash quickly, every 32 saves erase a sector, so only leave it running long enough to test
+ *
+ */
+#include <m2mDirect.h>
+
+uint8_t remoteMac[6] = {0x24,0x0a,0xc4,0x00,0x00,0x02};  //Any MAC address will do, nothing is sent
+uint8_t primaryKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x70,0x72,0x69,0x6d,0x61,0x72};
+uint8_t localKey[16] = {0x6d,0x32,0x6d,0x44,0x69,0x72,0x65,0x63,0x74,0x20,0x6c,0x6f,0x00,0x00,0x00,0x00};  //The last four bytes hold the counter
+const uint8_t channel = 1;
+const uint32_t saveInterval = 20;  //Time between saves, in ms
+
+uint32_t counter = 0;
+uint32_t lastSave = 0;
+
+void setup()
+{
+  Serial.begin(115200); //Start the serial interface for output
+  delay(500); //Give some time for the Serial Monitor to come online
+  m2mDirect.begin(channel);  //Reads the saved pairing. housekeeping() is never called, so provision() can keep saving
+  uint8_t blob[M2M_DIRECT_PROVISIONING_BLOB_SIZE];
+  uint8_t length = m2mDirect.pairingRecord(blob);
+  if(length == 0)
+  {
+    Serial.print(F("\n\rNo saved pairing, starting from 0"));
+  }
+  else if(memcmp(&blob[1], remoteMac, 6) != 0 || memcmp(&blob[7], primaryKey, 16) != 0 || memcmp(&blob[23], localKey, 12) != 0)
+  {
+    Serial.print(F("\n\rFAILED: the saved pairing isn't one this sketch wrote"));
+  }
+  else
+  {
+    counter = uint32_t(blob[35]) << 24 | uint32_t(blob[36]) << 16 | uint32_t(blob[37]) << 8 | blob[38];
+    Serial.printf(PSTR("\n\rRecovered counter %u"), counter);
+  }
+}
+
+void loop()
+{
+  if(millis() - lastSave > saveInterval)
+  {
+    lastSave = millis();
+    counter++;
+    localKey[12] = (counter & 0xff000000) >> 24;
+    localKey[13] = (counter & 0x00ff0000) >> 16;
+    localKey[14] = (counter & 0x0000ff00) >> 8;
+    localKey[15] = (counter & 0x000000ff);
+    if(m2mDirect.provision(remoteMac, primaryKey, localKey, channel, true))  //Save it
+    {
+      m2mDirectStatistics stats = m2mDirect.statistics();
+      Serial.printf(PSTR("\n\rSaved %u (erases %u)"), counter, stats.storeErases);
+    }
+    else
+    {
+      Serial.printf(PSTR("\n\rFailed to save %u"), counter);
+    }
+  }
+}
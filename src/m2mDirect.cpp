@@ -16,10 +16,67 @@
 
 m2mDirectClass::m2mDirectClass()	//Constructor function
 {
+	for(uint8_t slot = 0; slot < M2M_DIRECT_PEER_INDEX_SIZE; slot++)
+	{
+		_peerIndex[slot] = M2M_DIRECT_NO_PEER;
+	}
+	for(uint8_t index = 0; index < 8; index++)
+	{
+		_broadcastGroups[index] = 0;
+	}
+	_registerInstance();	//Register with the shared callbacks, begin() reports it if there was no room
 }
 
 m2mDirectClass::~m2mDirectClass()	//Destructor function
 {
+	#if defined(ESP32)
+	if(_housekeepingTaskHandle != nullptr && xTaskGetCurrentTaskHandle() != _housekeepingTaskHandle)	//Let the task finish its pass rather than kill it part way through an ESP-Now call
+	{
+		_housekeepingTaskStop = true;
+		while(_housekeepingTaskRunning == true)
+		{
+			vTaskDelay(1);
+		}
+		_housekeepingTaskHandle = nullptr;
+	}
+	#elif defined(ESP8266)
+	houseKeepingticker.detach();	//A tick already scheduled finds the instance gone from _instances and does nothing
+	#endif
+	_backgroundHousekeeping = false;
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)	//Stop the callbacks reaching this instance
+	{
+		m2mDirectClass* self = this;
+		_instances[index].compare_exchange_strong(self, nullptr);
+	}
+	m2mDirectClass* self = this;
+	_surveyingInstance.compare_exchange_strong(self, nullptr);
+	if(state != m2mDirectState::uninitialised)	//Free the ESP-Now peers this instance registered, the broadcast address is shared
+	{
+		state = m2mDirectState::uninitialised;
+		if(_remoteMacAddressSet() == true && esp_now_is_peer_exist(_remoteMacAddress))
+		{
+			esp_now_del_peer(_remoteMacAddress);
+		}
+		for(uint8_t peerIndex = 0; peerIndex < M2M_DIRECT_MAXIMUM_PEERS; peerIndex++)
+		{
+			if(_peers[peerIndex].inUse == true && esp_now_is_peer_exist(_peers[peerIndex].macAddress))
+			{
+				esp_now_del_peer(_peers[peerIndex].macAddress);
+			}
+		}
+		if(_instancesRunning() == 0)	//The last one using ESP-Now stops it
+		{
+			esp_now_deinit();
+			_radioState = M2M_DIRECT_RADIO_STOPPED;
+		}
+	}
+	#if defined(ESP32)
+	if(_sendQueue != nullptr)
+	{
+		vQueueDelete(_sendQueue);
+		_sendQueue = nullptr;
+	}
+	#endif
 }
 /*
  *
@@ -96,6 +153,14 @@ void m2mDirectClass::begin(uint8_t communicationChannel, uint8_t pairingChannel)
 	{
 		debug_uart_->print(F("\n\rm2mDirect starting"));
 	}
+	if(_instanceIndex == M2M_DIRECT_MAXIMUM_INSTANCES && _registerInstance() == false)	//One may have been destroyed since
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR("\n\rUnable to start, %u instances already exist"), M2M_DIRECT_MAXIMUM_INSTANCES);
+		}
+		return;
+	}
 	if(_pairingButtonGpio != 255)
 	{
 		if(debug_uart_ != nullptr)
@@ -130,17 +195,364 @@ void m2mDirectClass::begin(uint8_t communicationChannel, uint8_t pairingChannel)
 	}
 	_communicationChannel = communicationChannel;
 	_pairingChannel = pairingChannel;
-	#if defined(ESP8266)
-	EEPROM.begin(EEPROM_DATA_SIZE);	//Reads/writes the saved pairing from EEPROM
-	#endif
-	if(_readPairingInfo() == true)
+	if(_communicationChannel == 0)
+	{
+		_automaticChannel = true;
+		_channelSurveyEnabled = true;	//Automatic channel selection needs survey data
+		_channelMigrationEnabled = true;	//And the link can move if the chosen channel gets worse
+		_channelHuntEnabled = true;	//Or find the peer again if it turns up on another channel
+	}
+	if(_provisioned == false && _readPairingInfo() == true)	//A provisioned pairing takes the place of any saved one
 	{
 		_pairingInfoRead = true;
 	}
-	#if defined(ESP8266)
-	//houseKeepingticker.attach_ms(100,[](){m2mDirect.housekeeping();});
+}
+/*
+ *
+ *	Uses a pairing supplied by the application, for example one set up on a production line, so the link starts connecting without pairing over the air
+ *	Both devices need the same two keys and each needs the MAC address of the other. A channel of 0 leaves the choice to begin()
+ *	Call it before begin(), or after it but before the first housekeeping(). If saved, it replaces any saved pairing, otherwise it's used this boot only
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::provision(const uint8_t* remoteMacAddress, const uint8_t* primaryEncryptionKey, const uint8_t* localEncryptionKey, uint8_t channel, bool save)
+{
+	if(state != m2mDirectState::uninitialised || remoteMacAddress == nullptr || primaryEncryptionKey == nullptr || localEncryptionKey == nullptr || channel > M2M_DIRECT_MAXIMUM_CHANNEL)
+	{
+		return false;
+	}
+	memcpy(_remoteMacAddress, remoteMacAddress, MAC_ADDRESS_LENGTH);
+	memcpy(_primaryEncryptionKey, primaryEncryptionKey, ENCRYPTION_KEY_LENGTH);
+	memcpy(_localEncryptionKey, localEncryptionKey, ENCRYPTION_KEY_LENGTH);
+	_storedChannel = channel;
+	_savedLinkState = m2mDirectLinkState();
+	_savedLinkState.channel = channel;
+	return _usePairing(save);
+}
+/*
+ *
+ *	Uses a pairing from a provisioning blob, which has the same layout as the record the library saves (see _packRecord()) and may include a remote device name
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::provision(const uint8_t* record, uint8_t length, bool save)
+{
+	if(state != m2mDirectState::uninitialised || record == nullptr || length > M2M_DIRECT_STORE_MAXIMUM_RECORD || _unpackRecord(record, length) == false)
+	{
+		return false;
+	}
+	return _usePairing(save);
+}
+/*
+ *
+ *	Copies the pairing in use as a provisioning blob, into a buffer of at least M2M_DIRECT_PROVISIONING_BLOB_SIZE bytes
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::pairingRecord(uint8_t* buffer)
+{
+	if(buffer == nullptr || _remoteMacAddressSet() == false)
+	{
+		return 0;
+	}
+	m2mDirectLinkState linkState = _savedLinkState;
+	linkState.channel = _communicationChannel != 0 ? uint8_t(_communicationChannel) : _storedChannel;
+	return _packRecord(linkState, buffer);
+}
+/*
+ *
+ *	Marks a provisioned pairing as the one to connect with, saving it if asked
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_usePairing(bool save)
+{
+	_provisioned = true;
+	_provisionedTemporarily = (save == false);
+	_pairingInfoRead = true;	//Connect with it exactly as if it had been read at boot
+	_pairingInfoWritten = false;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rProvisioned pairing with %02x%02x%02x%02x%02x%02x channel:%u"), _remoteMacAddress[0], _remoteMacAddress[1], _remoteMacAddress[2], _remoteMacAddress[3], _remoteMacAddress[4], _remoteMacAddress[5], _storedChannel);
+	}
+	if(save == true)
+	{
+		uint8_t record[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+		uint8_t length = _packRecord(_savedLinkState, record);
+		return _storeRecord(record, length);
+	}
+	return true;
+}
+/*
+ *
+ *	Moves the link state machine out of the application loop, into an RTOS task on ESP32 or a Ticker on ESP8266
+ *	housekeeping() must still be called from the loop to deliver received messages but link timing no longer depends on it
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::backgroundHousekeeping(uint32_t interval, int8_t core)
+{
+	if(_backgroundHousekeeping == true)
+	{
+		return true;
+	}
+	_housekeepingInterval = interval;
+	#if defined(ESP32)
+	if(_createSendQueue() == false)
+	{
+		return false;
+	}
+	_backgroundHousekeeping = true;
+	_housekeepingTaskRunning = true;
+	if(xTaskCreatePinnedToCore(_housekeepingTask, "m2mDirect", M2M_DIRECT_HOUSEKEEPING_TASK_STACK, this, M2M_DIRECT_HOUSEKEEPING_TASK_PRIORITY, &_housekeepingTaskHandle, core < 0 ? tskNO_AFFINITY : core) != pdPASS)
+	{
+		_backgroundHousekeeping = false;
+		_housekeepingTaskRunning = false;
+		_housekeepingTaskHandle = nullptr;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rUnable to start housekeeping task"));
+		}
+		return false;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rHousekeeping task started every %ums"), _housekeepingInterval);
+	}
+	#elif defined(ESP8266)
+	_deferSendConfirmation = true;	//Don't hold up the sketch waiting for the send callback
+	_backgroundHousekeeping = true;
+	houseKeepingticker.attach_ms_scheduled(_housekeepingInterval, [this]() { _housekeepingTick(this); });	//Scheduled, as WiFi and flash calls aren't safe in the SYS context plain Ticker callbacks run in
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rHousekeeping Ticker started every %ums"), _housekeepingInterval);
+	}
+	#endif
+	return true;
+}
+/*
+ *
+ *	Returns true if link housekeeping is running in the background
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::backgroundHousekeepingRunning()
+{
+	return _backgroundHousekeeping;
+}
+#if defined(ESP32)
+/*
+ *
+ *	ESP32 RTOS task that runs the link state machine and sends queued application messages, until the destructor asks it to stop
+ *
+ */
+void m2mDirectClass::_housekeepingTask(void* instance)
+{
+	m2mDirectClass* link = (m2mDirectClass*)instance;
+	TickType_t lastWake = xTaskGetTickCount();
+	while(link->_housekeepingTaskStop == false)
+	{
+		link->_linkHousekeeping();
+		link->_sendQueuedMessages();
+		vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(link->_housekeepingInterval));
+	}
+	link->_housekeepingTaskRunning = false;	//The destructor is waiting on this, so the instance can't be used after it
+	vTaskDelete(nullptr);
+}
+#elif defined(ESP8266)
+/*
+ *
+ *	ESP8266 scheduled Ticker callback that runs the link state machine and sends queued application messages, in the same context as loop()
+ *	A tick scheduled before the instance was destroyed can still run, so it checks the instance is still registered
+ *
+ */
+void m2mDirectClass::_housekeepingTick(m2mDirectClass* instance)
+{
+	bool registered = false;
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		if(_instances[index] == instance)
+		{
+			registered = true;
+		}
+	}
+	if(registered == false)
+	{
+		return;
+	}
+	instance->_linkHousekeeping();
+	instance->_sendQueuedMessages();
+}
+#endif
+/*
+ *
+ *	Creates the queue application messages wait in for background housekeeping or a power save wake window. The ESP8266 uses a fixed ring buffer
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_createSendQueue()
+{
+	#if defined(ESP32)
+	if(_sendQueue == nullptr)
+	{
+		_sendQueue = xQueueCreate(M2M_DIRECT_SEND_QUEUE_LENGTH, sizeof(m2mDirectQueuedPacket));
+	}
+	if(_sendQueue == nullptr)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rUnable to create send queue"));
+		}
+		return false;
+	}
+	#endif
+	return true;
+}
+/*
+ *
+ *	Queues an application message for background housekeeping to send
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_queueMessage(uint8_t* buffer, uint8_t length, uint8_t peer)
+{
+	#if defined(ESP32)
+	m2mDirectQueuedPacket packet;
+	packet.length = length;
+	packet.peer = peer;
+	if(peer < M2M_DIRECT_MAXIMUM_PEERS)
+	{
+		memcpy(packet.macAddress, _peers[peer].macAddress, MAC_ADDRESS_LENGTH);
+	}
+	packet.metadata.received = millis();
+	memcpy(packet.buffer, buffer, length);
+	if(xQueueSend(_sendQueue, &packet, 0) == pdTRUE)
+	{
+		return true;
+	}
+	#elif defined(ESP8266)
+	uint8_t nextTail = (_sendQueueTail + 1) % M2M_DIRECT_SEND_QUEUE_LENGTH;
+	if(nextTail != _sendQueueHead)
+	{
+		_sendQueue[_sendQueueTail].length = length;
+		_sendQueue[_sendQueueTail].peer = peer;
+		if(peer < M2M_DIRECT_MAXIMUM_PEERS)
+		{
+			memcpy(_sendQueue[_sendQueueTail].macAddress, _peers[peer].macAddress, MAC_ADDRESS_LENGTH);
+		}
+		_sendQueue[_sendQueueTail].metadata.received = millis();
+		memcpy(_sendQueue[_sendQueueTail].buffer, buffer, length);
+		_sendQueueTail = nextTail;
+		return true;
+	}
+	#endif
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rSend queue full"));
+	}
+	return false;
+}
+/*
+ *
+ *	Sends any application messages queued by sendMessage() while running in the background
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_sendQueuedMessages()
+{
+	#if defined(ESP32)
+	if(_sendQueue == nullptr)
+	{
+		return;
+	}
+	m2mDirectQueuedPacket packet;
+	while(_queuedSendAllowed() == true && xQueueReceive(_sendQueue, &packet, 0) == pdTRUE)	//The slot may close part way through
+	{
+		if(packet.peer == M2M_DIRECT_BROADCAST_PEER)
+		{
+			if(_sendBroadcastPacket(packet.buffer, packet.length))
+			{
+				_statistics.broadcastMessagesSent++;
+			}
+			else
+			{
+				_statistics.queuedMessagesDropped++;
+			}
+		}
+		else if(packet.buffer[0] == M2M_DIRECT_RELAY_FLAG)
+		{
+			_sendRelayFrame(packet);
+		}
+		else if(packet.peer != M2M_DIRECT_NO_PEER)
+		{
+			if(_queuedPeerCurrent(packet) == false || _sendPeerMessage(packet.peer, packet.buffer, packet.length) == false)	//Removed while the message waited
+			{
+				_statistics.queuedMessagesDropped++;
+			}
+		}
+		else if(state == m2mDirectState::connected && _sendApplicationPacket(packet.buffer, packet.length))
+		{
+			_statistics.dataMessagesSent++;
+		}
+		else
+		{
+			_statistics.queuedMessagesDropped++;	//sendMessage() said it was queued, so the application can only see the loss here
+		}
+	}
+	#elif defined(ESP8266)
+	while(_queuedSendAllowed() == true && _sendQueueHead != _sendQueueTail)
+	{
+		if(_sendQueue[_sendQueueHead].peer == M2M_DIRECT_BROADCAST_PEER)
+		{
+			if(_sendBroadcastPacket(_sendQueue[_sendQueueHead].buffer, _sendQueue[_sendQueueHead].length))
+			{
+				_statistics.broadcastMessagesSent++;
+			}
+			else
+			{
+				_statistics.queuedMessagesDropped++;
+			}
+		}
+		else if(_sendQueue[_sendQueueHead].buffer[0] == M2M_DIRECT_RELAY_FLAG)
+		{
+			_sendRelayFrame(_sendQueue[_sendQueueHead]);
+		}
+		else if(_sendQueue[_sendQueueHead].peer != M2M_DIRECT_NO_PEER)
+		{
+			if(_queuedPeerCurrent(_sendQueue[_sendQueueHead]) == false || _sendPeerMessage(_sendQueue[_sendQueueHead].peer, _sendQueue[_sendQueueHead].buffer, _sendQueue[_sendQueueHead].length) == false)	//Removed while the message waited
+			{
+				_statistics.queuedMessagesDropped++;
+			}
+		}
+		else if(state == m2mDirectState::connected && _sendApplicationPacket(_sendQueue[_sendQueueHead].buffer, _sendQueue[_sendQueueHead].length))
+		{
+			_statistics.dataMessagesSent++;
+		}
+		else
+		{
+			_statistics.queuedMessagesDropped++;	//sendMessage() said it was queued, so the application can only see the loss here
+		}
+		_sendQueueHead = (_sendQueueHead + 1) % M2M_DIRECT_SEND_QUEUE_LENGTH;
+	}
 	#endif
 }
+/*
+ *
+ *	Checks the peer a queued message is to or from is still in the slot it was queued for, removePeer() may have freed it and addPeer() reused it since
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_queuedPeerCurrent(const m2mDirectQueuedPacket &packet)
+{
+	return packet.peer < M2M_DIRECT_MAXIMUM_PEERS && _peers[packet.peer].inUse == true && memcmp(_peers[packet.peer].macAddress, packet.macAddress, MAC_ADDRESS_LENGTH) == 0;
+}
+/*
+ *
+ *	Queued messages wait for the wake window in power save, and for this device's slot when a hub is polling it
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_queuedSendAllowed()
+{
+	if(_powerSaveActive == true && _wakeWindowOpen == false)
+	{
+		return false;
+	}
+	if(hubScheduled() == true && _pollSlotOpen() == false)
+	{
+		return false;
+	}
+	return true;
+}
 /*
  *
  *	Configure a pin for the pairing GPIO
@@ -199,29 +611,232 @@ void ICACHE_FLASH_ATTR m2mDirectClass::housekeeping()
 void m2mDirectClass::housekeeping()
 #endif
 {
-	if(_dataReceived == true)	//The application has data waiting
+	if(_backgroundHousekeeping == false)
 	{
-		_dataReceived = false;
-		if(messageReceivedCallback != nullptr) //Check this callback exists
+		_linkHousekeeping();
+		_sendQueuedMessages();	//Messages held for a wake window or hub slot
+	}
+	if(_manualEventDispatch == false)
+	{
+		dispatchEvents();
+	}
+}
+/*
+ *
+ *	Runs the application callbacks for any queued events. This is called from housekeeping() unless manual event dispatch is set
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::dispatchEvents()
+{
+	m2mDirectEvent event;
+	while(_nextEvent(event))
+	{
+		if(event == m2mDirectEvent::messageReceived)
 		{
-			messageReceivedCallback();
+			_deliverReceivedMessages();
 		}
-		else
+		else if(event == m2mDirectEvent::pairing)
 		{
-			clearReceivedMessage();	//Mark it as 'read' so it doesn't clog the buffer
+			if(pairingCallback != nullptr)
+			{
+				pairingCallback();
+			}
 		}
-	}
-	if(state == m2mDirectState::uninitialised)	//Try to initialise if it failed on startup
-	{
-		if(millis() - _localActivityTimer > _pairingInterval)
+		else if(event == m2mDirectEvent::paired)
 		{
-			_advanceTimers();	//Advance the timers for keepalives
-			if(_initialiseWiFi() == true)
+			if(pairedCallback != nullptr)
 			{
-				if(_initialiseEspNow(_pairingChannel) == true)
+				pairedCallback();
+			}
+		}
+		else if(event == m2mDirectEvent::connected)
+		{
+			if(connectedCallback != nullptr)
+			{
+				connectedCallback();
+			}
+		}
+		else if(event == m2mDirectEvent::disconnected)
+		{
+			if(disconnectedCallback != nullptr)
+			{
+				disconnectedCallback();
+			}
+		}
+		else if(event == m2mDirectEvent::peerStateChanged)
+		{
+			if(peerStateChangedCallback != nullptr)
+			{
+				peerStateChangedCallback();
+			}
+		}
+	}
+	_deliverReceivedMessages();	//Messages held back because the application hadn't finished with the previous one
+}
+/*
+ *
+ *	Moves received messages from the receive queue into the application's buffer one at a time, running the callback for each
+ *	A message waits in the queue until the application has retrieved or cleared everything in the previous one
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_deliverReceivedMessages()
+{
+	while(_receivedPacketBuffer[1] == 0)
+	{
+		uint8_t head = _receiveQueueHead.load(std::memory_order_relaxed);
+		if(head == _receiveQueueTail.load(std::memory_order_acquire))
+		{
+			return;	//Nothing waiting
+		}
+		memcpy(_receivedPacketBuffer, _receiveQueue[head].buffer, _receiveQueue[head].length);
+		_receivedPacketBufferPosition = 2;
+		if(_receivedPacketBuffer[0] == M2M_DIRECT_BROADCAST_FLAG)
+		{
+			_receivedPacketBufferPosition += M2M_DIRECT_BROADCAST_HEADER_LENGTH;	//Fields start after the header
+		}
+		else if(_receivedPacketBuffer[0] == M2M_DIRECT_RELAY_FLAG)
+		{
+			_receivedPacketBufferPosition += M2M_DIRECT_RELAY_HEADER_LENGTH;
+		}
+		_receivedMessageMetadata = _receiveQueue[head].metadata;
+		_receivedMessagePeer = _receiveQueue[head].peer;
+		memcpy(_receivedMessagePeerAddress, _receiveQueue[head].macAddress, MAC_ADDRESS_LENGTH);
+		_receiveQueueHead.store((head + 1) % M2M_DIRECT_RECEIVE_QUEUE_LENGTH, std::memory_order_release);	//Free the slot for the receive callback
+		if(messageReceivedCallback != nullptr) //Check this callback exists
+		{
+			messageReceivedCallback();
+		}
+		else
+		{
+			clearReceivedMessage();	//Mark it as 'read' so it doesn't clog the buffer
+		}
+	}
+}
+/*
+ *
+ *	Stops housekeeping() dispatching events, the application must then call dispatchEvents() from the context of its choice
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::manualEventDispatch(bool setting)
+{
+	_manualEventDispatch = setting;
+}
+/*
+ *
+ *	Queues an event for dispatch. Repeated events are coalesced so a burst can't flood the application
+ *	A received message is only ever queued once as there is one receive buffer, a state change is dropped if it repeats the last one queued
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_postEvent(m2mDirectEvent event)
+{
+	#if defined(ESP32)
+	portENTER_CRITICAL(&_eventQueueLock);
+	#endif
+	if((event == m2mDirectEvent::messageReceived && _messageReceivedEventQueued == true) ||
+		(event != m2mDirectEvent::messageReceived && _eventQueueHead != _eventQueueTail && _eventQueue[(_eventQueueTail + M2M_DIRECT_EVENT_QUEUE_LENGTH - 1) % M2M_DIRECT_EVENT_QUEUE_LENGTH] == event))
+	{
+		_statistics.eventsCoalesced++;
+	}
+	else
+	{
+		uint8_t nextTail = (_eventQueueTail + 1) % M2M_DIRECT_EVENT_QUEUE_LENGTH;
+		if(nextTail != _eventQueueHead)
+		{
+			_eventQueue[_eventQueueTail] = event;
+			_eventQueueTail = nextTail;
+			if(event == m2mDirectEvent::messageReceived)
+			{
+				_messageReceivedEventQueued = true;
+			}
+		}
+		else
+		{
+			_statistics.eventsDropped++;
+		}
+	}
+	#if defined(ESP32)
+	portEXIT_CRITICAL(&_eventQueueLock);
+	#endif
+}
+/*
+ *
+ *	Takes the oldest event from the queue, returns false if it is empty
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_nextEvent(m2mDirectEvent &event)
+{
+	bool available = false;
+	#if defined(ESP32)
+	portENTER_CRITICAL(&_eventQueueLock);
+	#endif
+	if(_eventQueueHead != _eventQueueTail)
+	{
+		event = _eventQueue[_eventQueueHead];
+		_eventQueueHead = (_eventQueueHead + 1) % M2M_DIRECT_EVENT_QUEUE_LENGTH;
+		if(event == m2mDirectEvent::messageReceived)
+		{
+			_messageReceivedEventQueued = false;
+		}
+		available = true;
+	}
+	#if defined(ESP32)
+	portEXIT_CRITICAL(&_eventQueueLock);
+	#endif
+	return available;
+}
+/*
+ *
+ *	The link state machine, sends pairing messages and keepalives and handles the pairing button and indicator LED
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_linkHousekeeping()
+{
+	if(_deferredSendPending == true)
+	{
+		_resolveDeferredSend();	//Check for the send callback from the previous tick
+	}
+	if(_peerDeferredSend != M2M_DIRECT_NO_PEER)
+	{
+		_resolveDeferredPeerSend();
+	}
+	if(_powerSaveHousekeeping() == true)
+	{
+		return;	//Radio asleep between wake windows
+	}
+	if(_channelSurveyHousekeeping() == true)
+	{
+		return;	//Off channel, nothing can be sent
+	}
+	_channelMigrationHousekeeping();
+	if(_peerCount > 0 && state != m2mDirectState::uninitialised)	//ESP-Now is running
+	{
+		_peerHousekeeping();
+	}
+	if(state == m2mDirectState::uninitialised)	//Try to initialise if it failed on startup
+	{
+		if(millis() - _localActivityTimer > _pairingInterval || (_fastStart == true && (_pairingInfoRead == true || _fastPairing == true || _peerTableOnly == true)))	//With a saved pairing, fast pairing or only peers, there's nothing to wait for
+		{
+			_fastStart = false;
+			_advanceTimers();	//Advance the timers for keepalives
+			if(_initialiseWiFi() == true)
+			{
+				uint8_t startingChannel = _pairingChannel;
+				if(_pairingInfoRead == true && _storedChannel != 0 && _communicationChannel == _storedChannel)
+				{
+					startingChannel = _storedChannel;	//Go straight back to the channel the link was using
+				}
+				else if(_peerTableOnly == true && _communicationChannel != 0)
+				{
+					startingChannel = _communicationChannel;	//Without a paired device there's no pairing channel to wait on
+				}
+				if(_initialiseEspNow(startingChannel) == true)
 				{
 					if(_pairingInfoRead == false)
 					{
+						if(_peerTableOnly == true && _encyptionEnabled == true)
+						{
+							_setPrimaryEncryptionKey();	//The peers share the key given to addPeer()
+						}
 						state = m2mDirectState::initialised;
 						_indicatorTimerInterval =  M2M_DIRECT_INDICATOR_LED_INITIALISED_INTERVAL;
 						if(debug_uart_ != nullptr)
@@ -231,6 +846,10 @@ void m2mDirectClass::housekeeping()
 					}
 					else
 					{
+						if(_encyptionEnabled == true)
+						{
+							_setPrimaryEncryptionKey();	//Pairing sets this, a saved or provisioned pairing needs it set too so both ends agree
+						}
 						state = m2mDirectState::connecting;
 						_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
 						if(debug_uart_ != nullptr)
@@ -257,10 +876,7 @@ void m2mDirectClass::housekeeping()
 		_keepaliveInterval = _startingKeepaliveInterval;	//Reset to defaults
 		if(_pairingInfoRead == true)
 		{
-			if(m2mDirect.pairedCallback != nullptr)
-			{
-				m2mDirect.pairedCallback();
-			}
+			_postEvent(m2mDirectEvent::paired);
 			state = m2mDirectState::connecting;
 			_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
 			if(debug_uart_ != nullptr)
@@ -268,6 +884,10 @@ void m2mDirectClass::housekeeping()
 				_debugState();
 			}
 		}
+		else if(_peerTableOnly == true)
+		{
+			//Only the peer table is in use, pairing would replace the primary key the peers share
+		}
 		else
 		{
 			if(_encyptionEnabled == true)
@@ -279,11 +899,12 @@ void m2mDirectClass::housekeeping()
 				_clearEncryptionKeys();
 			}
 			_createPairingMessage();
+			_pairingPeerHeard = false;
+			_pairingBurstCount = 0;
+			_nextPairingInterval = 0;	//Send the first message straight away
+			_pairingStartTime = millis();
 			state = m2mDirectState::pairing;
-			if(m2mDirect.pairingCallback != nullptr)
-			{
-				m2mDirect.pairingCallback();
-			}
+			_postEvent(m2mDirectEvent::pairing);
 			_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRING_INTERVAL;
 			if(debug_uart_ != nullptr)
 			{
@@ -294,25 +915,18 @@ void m2mDirectClass::housekeeping()
 	else if(state == m2mDirectState::pairing)
 	{
 		//Send a broadcast pairing message at intervals
-		if(millis() - _localActivityTimer > _pairingInterval)
-		{
-			_sendBroadcastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
-			_advanceTimers();	//Advance the timers for keepalives
-		}
+		_sendPairingMessage();
 	}
 	else if(state == m2mDirectState::paired)
 	{
 		//Having received a pairing message, send a pairing ACK at intervals
-		if(millis() - _localActivityTimer > _pairingInterval)
-		{
-			_sendBroadcastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
-			_advanceTimers();	//Advance the timers for keepalives
-		}
+		_sendPairingMessage();
 	}
 	else if(state == m2mDirectState::connecting)
 	{
-		//Boths ends have keys, start sending keepalives
-		if(millis() - _localActivityTimer > _keepaliveInterval)
+		//Boths ends have keys, start sending keepalives, straight away if the peer is waiting on one to complete its handshake
+		bool established = _handshakeHousekeeping();
+		if(_handshakeReplyDue.exchange(false) == true || millis() - _localActivityTimer > _keepaliveInterval)
 		{
 			_createKeepaliveMessage();
 			_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);	//Send quality and keepalive interval is automatically decremented in _sendUnicastPacket if it fails
@@ -320,54 +934,76 @@ void m2mDirectClass::housekeeping()
 			//Check send quality
 			if(linkQuality() > 0xFF000000)	//Assess AND of send and echo quality
 			{
-				if(_pairingInfoRead == false && _pairingInfoWritten == false) //Write the pairing info
-				{
-					if(_writePairingInfo())
-					{
-						_pairingInfoWritten = true;
-					}
-				}
-				state = m2mDirectState::connected;
-				if(_indicatorLedGpio != 255) //Switch on the indicator
+				established = true;
+			}
+		}
+		if(established == true)
+		{
+			if(_pairingInfoRead == false && _pairingInfoWritten == false) //Write the pairing info
+			{
+				if(_writePairingInfo())
 				{
-					_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTED_INTERVAL;
-					_indicatorOn();
+					_pairingInfoWritten = true;
 				}
+			}
+			state = m2mDirectState::connected;
+			_restoreLinkState();
+			if(_pairingStartTime != 0)
+			{
+				_timeToPair = millis() - _pairingStartTime;
+				_pairingStartTime = 0;
 				if(debug_uart_ != nullptr)
 				{
-					_debugState();
+					debug_uart_->printf_P(PSTR("\n\rPairing took %ums"), _timeToPair);
 				}
-				if(connectedCallback != nullptr)
+			}
+			if(_firstConnectedTime == 0)
+			{
+				_firstConnectedTime = millis();
+				if(debug_uart_ != nullptr)
 				{
-					connectedCallback();
+					debug_uart_->printf_P(PSTR("\n\rConnected %ums after boot"), _firstConnectedTime);
 				}
 			}
+			if(_indicatorLedGpio != 255) //Switch on the indicator
+			{
+				_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTED_INTERVAL;
+				_indicatorOn();
+			}
+			if(debug_uart_ != nullptr)
+			{
+				_debugState();
+			}
+			_postEvent(m2mDirectEvent::connected);
 		}
 	}
 	else if(state == m2mDirectState::connected)
 	{
-		//Connected state, monitor keepalives
-		if(millis() - _localActivityTimer > _keepaliveInterval)
+		//Connected state, monitor keepalives, in power save only while the wake window is open and when polled by a hub only in this device's slot
+		bool polled = hubScheduled();
+		bool keepaliveDue = false;
+		if(polled == true)
+		{
+			keepaliveDue = _pollDue.exchange(false) == true && _pollSlotOpen() == true;	//A late answer would collide with the next spoke
+		}
+		else
+		{
+			_pollDue = false;
+			keepaliveDue = millis() - _localActivityTimer > _keepaliveInterval || _wakeWindowKeepaliveDue == true || _handshakeReplyDue == true;	//Answer a peer that is reconnecting straight away
+		}
+		if((_powerSaveActive == false || _wakeWindowOpen == true) && keepaliveDue == true)
 		{
+			_wakeWindowKeepaliveDue = false;
+			_handshakeReplyDue = false;
 			_createKeepaliveMessage();
+			bool reportReceived = _readLinkReport();
 			if(_automaticTxPower == true)
 			{
-				if(_sendQuality == 0xffffffff)
-				{
-					if(_currentTxPower == _minTxPower && _minTxPower > 9 && millis() - _lastTxPowerChange < _keepaliveInterval * 100) //Try reducing the minimum power after 100 good keepalives at the current minimum
-					{
-						_minTxPower--;
-					}
-					_reduceTxPower();
-				}
-				else
-				{
-					if(_lastTxPowerChangeDownwards == true && millis() - _lastTxPowerChange < _keepaliveInterval * 5) //A recent power reduction _probably_ caused packet loss
-					{
-						_minTxPower++;
-					}
-					_increaseTxPower();
-				}
+				_txPowerControl(reportReceived);
+			}
+			if(reportReceived == true && _fecEnabled == true && _fecAdaptiveBlockSize == true)
+			{
+				_adaptFecBlockSize();
 			}
 			_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);	//Send quality and keepalive interval is automatically decremented in _sendUnicastPacket if it fails
 			_advanceTimers();	//Advance the timers for keepalives
@@ -375,48 +1011,56 @@ void m2mDirectClass::housekeeping()
 			if(_countBits(linkQuality()) < M2M_DIRECT_LINK_QUALITY_LOWER_THRESHOLD)	//Assess AND of send and echo quality
 			{
 				state = m2mDirectState::disconnected;
+				_statistics.disconnections++;
+				_disconnectedTime = millis();
 				_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_DISCONNECTED_INTERVAL;
 				if(debug_uart_ != nullptr)
 				{
 					_debugState();
 				}
-				if(disconnectedCallback != nullptr)
-				{
-					disconnectedCallback();
-				}
+				_postEvent(m2mDirectEvent::disconnected);
 			}
 		}
-		if(millis() - receivedLocalActivityTimer > _keepaliveInterval*3) //We've defintely missed an echo
+		if(_powerSaveActive == false && millis() - receivedLocalActivityTimer > (polled == true ? (_pollSchedule & 0xffff) : _keepaliveInterval)*3) //We've defintely missed an echo, power save checks once per window instead and a hub echoes once a cycle
 		{
 			receivedLocalActivityTimer = millis();
-			_echoQuality = m2mDirect._echoQuality >> 1;	//Reduce echo quality
+			_reduceEchoQuality();
+		}
+		if(_fecSendCount > 0 && millis() - _fecSendBlockStart > M2M_DIRECT_FEC_FLUSH_INTERVAL)	//Don't leave the last messages of a burst unprotected
+		{
+			_sendFecParity();
 		}
+		_linkStateHousekeeping();
 	}
 	else if(state == m2mDirectState::disconnected)
 	{
 		//Disconnected state, try keepalives but also channel hunt if possible
-		if(millis() - _localActivityTimer > _keepaliveInterval)
+		bool established = _handshakeHousekeeping();
+		if(_handshakeReplyDue.exchange(false) == true || millis() - _localActivityTimer > _keepaliveInterval)
 		{
 			_createKeepaliveMessage();
 			_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);	//Send quality and keepalive interval is automatically decremented in _sendUnicastPacket if it fails
 			_advanceTimers();	//Advance the timers for keepalives
 			if(_countBits(linkQuality()) >= M2M_DIRECT_LINK_QUALITY_UPPER_THRESHOLD)	//Assess AND of send and echo quality
 			{
-				state = m2mDirectState::connected;
-				if(_indicatorLedGpio != 255) //Switch on the indicator
-				{
-					_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTED_INTERVAL;
-					_indicatorOn();
-				}
-				if(debug_uart_ != nullptr)
-				{
-					_debugState();
-				}
-				if(connectedCallback != nullptr)
-				{
-					connectedCallback();
-				}
+				established = true;
+			}
+		}
+		if(established == true)
+		{
+			state = m2mDirectState::connected;
+			_reconnectTime = millis() - _disconnectedTime;
+			if(_indicatorLedGpio != 255) //Switch on the indicator
+			{
+				_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTED_INTERVAL;
+				_indicatorOn();
+			}
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rReconnected after %ums"), _reconnectTime);
+				_debugState();
 			}
+			_postEvent(m2mDirectEvent::connected);
 		}
 	}
 	if(_pairingButtonGpio != 255) //Check the pairing button
@@ -486,10 +1130,87 @@ void m2mDirectClass::housekeeping()
 		*/
 	}
 }
+/*
+ *
+ *	Moves the keepalive timers on after a keepalive is sent. The receive callback compares echoes with the previous timer, so both are atomic
+ *
+ */
 void ICACHE_FLASH_ATTR m2mDirectClass::_advanceTimers()
 {
-	_previouslocalActivityTimer = _localActivityTimer;
-	_localActivityTimer = millis();
+	_previouslocalActivityTimer.store(_localActivityTimer.load());
+	_localActivityTimer.store(millis());
+}
+/*
+ *
+ *	Broadcasts the pairing message or ACK in the protocol buffer when it is due
+ *
+ *	Without fast pairing this is every pairing interval. With it, messages go in short bursts, so one lost frame doesn't cost a whole interval,
+ *	separated by a random backoff so two devices that started together don't keep colliding. Once a peer has been heard, or in the paired
+ *	state where the other end is waiting on an ACK, they go at the quicker ACK interval so the handshake completes in a few hundred ms
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_sendPairingMessage()
+{
+	if(_fastPairing == false)
+	{
+		if(millis() - _localActivityTimer > _pairingInterval)
+		{
+			_sendBroadcastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+			_advanceTimers();	//Advance the timers for keepalives
+		}
+		return;
+	}
+	bool peerHeard = state == m2mDirectState::paired || _pairingPeerHeard == true;
+	if(peerHeard == true && _nextPairingInterval > M2M_DIRECT_PAIRING_ACK_INTERVAL)
+	{
+		_nextPairingInterval = M2M_DIRECT_PAIRING_ACK_INTERVAL;	//Cut short any backoff, the peer is listening now
+	}
+	if(millis() - _localActivityTimer < _nextPairingInterval)
+	{
+		return;
+	}
+	_sendBroadcastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+	_advanceTimers();	//Advance the timers for keepalives
+	if(peerHeard == true)
+	{
+		_nextPairingInterval = M2M_DIRECT_PAIRING_ACK_INTERVAL;
+	}
+	else if(++_pairingBurstCount < M2M_DIRECT_PAIRING_BURST_LENGTH)
+	{
+		_nextPairingInterval = M2M_DIRECT_PAIRING_BURST_SPACING;
+	}
+	else
+	{
+		_pairingBurstCount = 0;
+		#if defined(ESP8266)
+		uint32_t randomNumber = *(volatile uint32_t *)0x3FF20E44;	//Hardware random number generator
+		#elif defined ESP32
+		uint32_t randomNumber = esp_random();
+		#endif
+		_nextPairingInterval = M2M_DIRECT_PAIRING_BACKOFF_MINIMUM + randomNumber % (M2M_DIRECT_PAIRING_BACKOFF_MAXIMUM - M2M_DIRECT_PAIRING_BACKOFF_MINIMUM);
+	}
+}
+/*
+ *
+ *	The handshake is complete when, while not connected, a keepalive from the peer echoes the last one sent. That proves frames get through both ways
+ *	The link quality history is then seeded just above the upper threshold so the link is declared up at once. The seeded bits are the oldest, so
+ *	they drop out first and a link that is really marginal falls below the lower threshold after a few lost keepalives, just like one that connected slowly
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_handshakeHousekeeping()
+{
+	if(_handshakeVerified.exchange(false) == false || _fastHandshake == false)
+	{
+		return false;
+	}
+	_sendQuality = M2M_DIRECT_HANDSHAKE_QUALITY;
+	_echoQuality = M2M_DIRECT_HANDSHAKE_QUALITY;
+	_lastMigration = millis();	//The seeded history isn't a measurement, so don't migrate on it
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rHandshake complete"));
+	}
+	return true;
 }
 void ICACHE_FLASH_ATTR m2mDirectClass::_increaseKeepaliveInterval()
 {
@@ -549,14 +1270,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_registerPeer(uint8_t* macaddress, uint8_
 	newPeer.peer_addr[3] = (uint8_t) macaddress[3];
 	newPeer.peer_addr[4] = (uint8_t) macaddress[4];
 	newPeer.peer_addr[5] = (uint8_t) macaddress[5];
-	if(WiFi.getMode() == WIFI_STA)
-	{
-		newPeer.ifidx = WIFI_IF_STA;
-	}
-	else
-	{
-		newPeer.ifidx = WIFI_IF_AP;
-	}
+	newPeer.ifidx = _espNowInterface();
 	newPeer.channel = channel;
 	newPeer.encrypt = false;
 	int result = esp_now_add_peer(&newPeer);
@@ -611,14 +1325,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_registerPeer(uint8_t* macaddress, uint8_
 	newPeer.lmk[13] = (uint8_t) key[13];
 	newPeer.lmk[14] = (uint8_t) key[14];
 	newPeer.lmk[15] = (uint8_t) key[15];
-	if(WiFi.getMode() == WIFI_STA)
-	{
-		newPeer.ifidx = WIFI_IF_STA;
-	}
-	else
-	{
-		newPeer.ifidx = WIFI_IF_AP;
-	}
+	newPeer.ifidx = _espNowInterface();
 	newPeer.channel = channel;
 	newPeer.encrypt = true;
 	int result = esp_now_add_peer(&newPeer);
@@ -642,75 +1349,518 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_registerPeer(uint8_t* macaddress, uint8_
 }
 /*
  *
- *	This method scans for the least congested 2.4Ghz channel and uses a simple heuristic to pick the least congested one
+ *	This method returns the least congested channel from the background survey without blocking, or the pairing channel if the survey is incomplete
  *
  */
 uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_leastCongestedChannel()
 {
-	WiFi.disconnect();
-	uint8_t numberOfSsids = WiFi.scanNetworks();
-	int16_t rssi[14] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-	if(debug_uart_ != nullptr)
-	{
-		debug_uart_->print(F("\n\rScanning for least congested channel: "));
-		debug_uart_->print(numberOfSsids);
-		debug_uart_->print(F(" SSIDs found"));
-	}
-	for(uint8_t ssid = 0; ssid < numberOfSsids; ssid++)
+	uint8_t channel = leastCongestedChannel();
+	if(channel == 0)
 	{
 		if(debug_uart_ != nullptr)
 		{
-			debug_uart_->print(F("\n\r"));
-			debug_uart_->print(ssid);
-			debug_uart_->print(F(" SSID: "));
-			debug_uart_->print(WiFi.SSID(ssid));
-			debug_uart_->print(F(" channel: "));
-			debug_uart_->print(WiFi.channel(ssid));
-			debug_uart_->print(F(" RSSI: "));
-			debug_uart_->print(WiFi.RSSI(ssid));
-			#if defined(ESP8266)
-			debug_uart_->print(F(" hidden: "));
-			debug_uart_->print(WiFi.isHidden(ssid));
-			#endif
+			debug_uart_->print(F("\n\rChannel survey incomplete, using pairing channel"));
 		}
-		rssi[WiFi.channel(ssid) - 1]+=(WiFi.RSSI(ssid) > -85 ? WiFi.RSSI(ssid) + 85 : 0);	//Total up the RSSI for each channel, shifted to -85 means 0;
+		return _pairingChannel;
 	}
 	if(debug_uart_ != nullptr)
 	{
-		for(uint8_t channel = 0; channel < 14; channel++)
+		for(uint8_t surveyed = 1; surveyed <= M2M_DIRECT_MAXIMUM_CHANNEL; surveyed++)
 		{
-			debug_uart_->print(F("\n\rChannel: "));
-			debug_uart_->print(channel+1);
-			debug_uart_->print(F(" RSSI congestion: "));
-			debug_uart_->print(rssi[channel]);
+			debug_uart_->printf_P(PSTR("\n\rChannel: %u congestion: %u"), surveyed, channelCongestion(surveyed));
 		}
 	}
-	WiFi.scanDelete();
-	if(rssi[0] < rssi[5] && rssi[0] < rssi[10])
-	{
-		return 1;
-	}
-	else if(rssi[5] < rssi[0] && rssi[5] < rssi[10])
-	{
-		return 6;
-	}
-	else
-	{
-		return 11;
-	}
-	return 1;
+	return channel;
 }
 /*
  *
- *	This method manages the changing of the Wi-Fi channel with some verification that it happened
+ *	Enables the background channel survey. It hops to one channel at a time for a short dwell, counting traffic in promiscuous mode
+ *	Off-channel dwells lose any frames from the peer so by default it only runs while the link is not connected
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_changeChannel(uint8_t channel)
+void ICACHE_FLASH_ATTR m2mDirectClass::channelSurvey(bool enabled, bool whileConnected)
 {
-	if(_currentChannel() != channel)
-	{
-		//Channel 14 is only usable in Japan
-		if (channel > 13)
+	_channelSurveyEnabled = enabled;
+	_channelSurveyWhileConnected = whileConnected;
+}
+/*
+ *
+ *	Returns the channel with the lowest congestion score, or 0 if not every channel has been surveyed yet
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::leastCongestedChannel()
+{
+	if(_channelsSurveyed != (1 << M2M_DIRECT_MAXIMUM_CHANNEL) - 1)
+	{
+		return 0;
+	}
+	uint8_t bestChannel = 1;
+	uint32_t bestCongestion = channelCongestion(1);
+	for(uint8_t channel = 2; channel <= M2M_DIRECT_MAXIMUM_CHANNEL; channel++)
+	{
+		uint32_t congestion = channelCongestion(channel);
+		if(congestion < bestCongestion)
+		{
+			bestChannel = channel;
+			bestCongestion = congestion;
+		}
+	}
+	return bestChannel;
+}
+/*
+ *
+ *	Returns a congestion score for a channel, higher is worse
+ *	This is the surveyed activity of the channel and its overlapping neighbours, weighted by distance, plus a penalty for loss measured on the channel in use
+ *
+ */
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::channelCongestion(uint8_t channel)
+{
+	if(channel < 1 || channel > M2M_DIRECT_MAXIMUM_CHANNEL)
+	{
+		return 0xffffffff;
+	}
+	uint32_t congestion = 0;
+	for(int8_t distance = -3; distance <= 3; distance++)	//2.4Ghz channels overlap with up to three either side
+	{
+		int8_t neighbour = channel + distance;
+		if(neighbour >= 1 && neighbour <= M2M_DIRECT_MAXIMUM_CHANNEL)
+		{
+			congestion += (_channelActivity[neighbour - 1] * (4 - abs(distance))) / 4;
+		}
+	}
+	if(channel == _communicationChannel && (state == m2mDirectState::connected || state == m2mDirectState::disconnected))
+	{
+		congestion += (32 - _countBits(_sendQuality)) * M2M_DIRECT_SURVEY_LOSS_WEIGHT;	//Measured loss on the channel in use
+	}
+	return congestion;
+}
+/*
+ *
+ *	Enables channel migration. When the link degrades and the survey has found a clearly less congested channel both ends move to it
+ *	This is enabled by begin() when the channel is chosen automatically. A peer with it disabled ignores proposals
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::channelMigration(bool enabled)
+{
+	_channelMigrationEnabled = enabled;
+}
+/*
+ *
+ *	Asks the peer to move the link to a specific channel, it is carried out by housekeeping so this returns before the move
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::migrateChannel(uint8_t channel)
+{
+	if(channel < 1 || channel > M2M_DIRECT_MAXIMUM_CHANNEL || channel == _communicationChannel || state != m2mDirectState::connected || _radioShared() == true)
+	{
+		return false;
+	}
+	_requestedMigrationChannel = channel;
+	return true;
+}
+/*
+ *
+ *	Enables hunting across every channel for the peer when keepalives stop. This is enabled by begin() when the channel is chosen automatically
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::channelHunting(bool enabled)
+{
+	_channelHuntEnabled = enabled;
+}
+/*
+ *
+ *	Returns the channel currently used for communication
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::communicationChannel()
+{
+	return _communicationChannel;
+}
+/*
+ *
+ *	Runs the channel survey a slice at a time, returns true while dwelling on a survey channel so housekeeping doesn't send anything
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_channelSurveyHousekeeping()
+{
+	if(_surveyDwelling == true)
+	{
+		if(millis() - _surveyTimer < M2M_DIRECT_SURVEY_DWELL)
+		{
+			return true;
+		}
+		_stopSurveySlice();
+		return false;
+	}
+	if(_channelSurveyEnabled == false ||
+		_radioShared() == true ||						//Other links need the radio on this channel
+		state == m2mDirectState::uninitialised ||
+		state == m2mDirectState::paired ||				//Pairing handshakes are in progress, stay put
+		state == m2mDirectState::connecting ||
+		_migrationChannel != 0 || _migrationAlternateChannel != 0 || _channelHunting == true ||	//A channel migration or hunt is in progress, stay put
+		WiFi.status() == WL_CONNECTED ||				//Leaving the channel would drop the station off its AP
+		(state == m2mDirectState::connected && _channelSurveyWhileConnected == false))
+	{
+		return false;
+	}
+	if(millis() - _surveyTimer < M2M_DIRECT_SURVEY_INTERVAL)
+	{
+		return false;
+	}
+	_startSurveySlice();
+	return true;
+}
+/*
+ *
+ *	Hops to the next survey channel and starts counting frames in promiscuous mode
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_startSurveySlice()
+{
+	_surveyHomeChannel = _currentChannel();
+	_surveyFrames = 0;
+	_surveyStrength = 0;
+	_surveyingInstance = this;	//The promiscuous callback counts frames for this instance
+	#if defined(ESP8266)
+	wifi_set_promiscuous_rx_cb([](uint8_t *buffer, uint16_t length) {
+		int8_t rssi = (int8_t)buffer[0];	//RxControl starts with the RSSI
+		m2mDirectClass* instance = _surveyingInstance;
+		if(instance != nullptr)
+		{
+			instance->_surveyFrames++;
+			instance->_surveyStrength += (rssi > M2M_DIRECT_SURVEY_RSSI_FLOOR ? rssi - M2M_DIRECT_SURVEY_RSSI_FLOOR : 0);
+		}
+	});
+	wifi_promiscuous_enable(1);
+	#elif defined(ESP32)
+	wifi_promiscuous_filter_t filter = {WIFI_PROMIS_FILTER_MASK_ALL};
+	esp_wifi_set_promiscuous_filter(&filter);
+	esp_wifi_set_promiscuous_rx_cb([](void *buffer, wifi_promiscuous_pkt_type_t type) {
+		int8_t rssi = ((wifi_promiscuous_pkt_t *)buffer)->rx_ctrl.rssi;
+		m2mDirectClass* instance = _surveyingInstance;
+		if(instance != nullptr)
+		{
+			instance->_surveyFrames++;
+			instance->_surveyStrength += (rssi > M2M_DIRECT_SURVEY_RSSI_FLOOR ? rssi - M2M_DIRECT_SURVEY_RSSI_FLOOR : 0);
+		}
+	});
+	esp_wifi_set_promiscuous(true);
+	#endif
+	_changeChannel(_surveyChannel);
+	_surveyTimer = millis();
+	_surveyDwelling = true;
+}
+/*
+ *
+ *	Returns to the home channel and folds the slice into the activity for the surveyed channel
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_stopSurveySlice()
+{
+	#if defined(ESP8266)
+	wifi_promiscuous_enable(0);
+	#elif defined(M2M_DIRECT_SNIFF_METADATA)
+	_startMetadataSniffer();	//Go back to sniffing for receive metadata
+	#elif defined(ESP32)
+	esp_wifi_set_promiscuous(false);
+	#endif
+	_changeChannel(_surveyHomeChannel);
+	uint32_t dwell = millis() - _surveyTimer;
+	uint32_t activity = (_surveyStrength * 1000) / (dwell > 0 ? dwell : 1);	//Signal strength of frames seen per second
+	uint16_t channelBit = 1 << (_surveyChannel - 1);
+	if(_channelsSurveyed & channelBit)
+	{
+		_channelActivity[_surveyChannel - 1] = (_channelActivity[_surveyChannel - 1] * 3 + activity) / 4;
+	}
+	else
+	{
+		_channelActivity[_surveyChannel - 1] = activity;
+		_channelsSurveyed |= channelBit;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rChannel survey: channel %u frames %u activity %u"), _surveyChannel, _surveyFrames.load(), _channelActivity[_surveyChannel - 1]);
+	}
+	_surveyChannel = _surveyChannel < M2M_DIRECT_MAXIMUM_CHANNEL ? _surveyChannel + 1 : 1;
+	_surveyTimer = millis();
+	_surveyDwelling = false;
+	if(_surveyChannel == 1 && _automaticChannel == true && state == m2mDirectState::pairing)	//A full pass is done, advertise a better channel if there is one
+	{
+		uint8_t channel = leastCongestedChannel();
+		if(channel != 0 && channel != _communicationChannel)
+		{
+			_communicationChannel = channel;
+			_createPairingMessage();
+		}
+	}
+}
+/*
+ *
+ *	Coordinated channel migration. One end proposes a channel and a switch time, the other ACKs and both switch at that time
+ *	An unacknowledged proposal is abandoned at the switch time, but as the peer may have heard it anyway both ends remember the other channel
+ *	If no keepalive arrives within M2M_DIRECT_MIGRATION_TIMEOUT both ends hop between the two channels, at different rates so they must meet
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_channelMigrationHousekeeping()
+{
+	if(state != m2mDirectState::connecting && state != m2mDirectState::connected && state != m2mDirectState::disconnected)
+	{
+		_migrationChannel = 0;	//Pairing has been reset, drop anything in progress
+		_migrationAlternateChannel = 0;
+		_migrationHunting = false;
+		_channelHunting = false;
+		_lastKeepaliveTime = millis();	//Hunting starts from when the link is set up
+		return;
+	}
+	bool keepaliveArrived = _keepaliveReceived.exchange(false);
+	if(keepaliveArrived == true)
+	{
+		_lastKeepaliveTime = millis();
+	}
+	uint8_t proposedChannel = _receivedMigrationChannel.exchange(0);
+	if(proposedChannel != 0 && proposedChannel != _communicationChannel && _channelMigrationEnabled == true && _radioShared() == false)
+	{
+		if(_migrationChannel != 0 && _migrationInitiator == true && _tieBreak(_localMacAddress, _remoteMacAddress))
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\n\rChannel migration: tie winner, ignoring proposal from peer"));
+			}
+		}
+		else
+		{
+			_migrationChannel = proposedChannel;
+			_migrationSwitchTime = _receivedMigrationSwitchTime;
+			_migrationInitiator = false;
+			_migrationAcknowledged = true;
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rChannel migration: peer proposed channel %u in %ums"), _migrationChannel, _migrationSwitchTime - millis());
+			}
+			_createChannelChangeMessage(M2M_DIRECT_CHANNEL_CHANGE_ACK_FLAG, _migrationChannel, _migrationSwitchTime - millis());
+			_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+		}
+	}
+	uint8_t acknowledgedChannel = _receivedMigrationAck.exchange(0);
+	uint8_t requestedChannel = _requestedMigrationChannel.exchange(0);
+	if(_migrationChannel != 0)
+	{
+		if(_migrationInitiator == true && acknowledgedChannel == _migrationChannel)
+		{
+			_migrationAcknowledged = true;
+		}
+		if(int32_t(millis() - _migrationSwitchTime) >= 0)	//Time to switch
+		{
+			if(_migrationAcknowledged == true)
+			{
+				_migrationAlternateChannel = _communicationChannel;
+				_moveToChannel(_migrationChannel);
+				_keepaliveInterval = _startingKeepaliveInterval;	//Confirm the new channel quickly
+				_statistics.channelMigrations++;
+			}
+			else
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->print(F("\n\rChannel migration: not acknowledged, staying put"));
+				}
+				_migrationAlternateChannel = _migrationChannel;	//The peer may have heard the proposal even though its ACK was lost
+				_statistics.channelMigrationsAbandoned++;
+			}
+			_migrationChannel = 0;
+			_lastMigration = millis();
+			_migrationHuntTimer = millis();
+			_migrationHunting = false;
+			_sendImmediateKeepalive();
+		}
+		else if(_migrationInitiator == true && _migrationAcknowledged == false && millis() - _migrationResendTimer > M2M_DIRECT_MIGRATION_RESEND)
+		{
+			_createChannelChangeMessage(M2M_DIRECT_CHANNEL_CHANGE_FLAG, _migrationChannel, _migrationSwitchTime - millis());
+			_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+			_migrationResendTimer = millis();
+		}
+	}
+	else if(_migrationAlternateChannel != 0)
+	{
+		if(keepaliveArrived == true)	//The peer is on this channel
+		{
+			if(_migrationHunting == true)
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->printf_P(PSTR("\n\rChannel migration: found peer on channel %u"), _communicationChannel.load());
+				}
+				_sendImmediateKeepalive();	//Answer straight away, the peer may be about to hop away
+			}
+			_migrationAlternateChannel = 0;
+			_migrationHunting = false;
+		}
+		else if(millis() - _lastMigration > M2M_DIRECT_HUNT_TIMEOUT)	//Not on either channel, leave it to the full hunt
+		{
+			_migrationAlternateChannel = 0;
+			_migrationHunting = false;
+		}
+		else if(millis() - _migrationHuntTimer > (_migrationHunting == false ? M2M_DIRECT_MIGRATION_TIMEOUT : (_tieBreak(_localMacAddress, _remoteMacAddress) ? M2M_DIRECT_MIGRATION_HUNT_DWELL : M2M_DIRECT_MIGRATION_HUNT_DWELL * 3)))
+		{
+			if(_migrationHunting == false)
+			{
+				_migrationHunting = true;
+				_statistics.channelHunts++;
+			}
+			uint8_t channel = _migrationAlternateChannel;
+			_migrationAlternateChannel = _communicationChannel;
+			_moveToChannel(channel);
+			_migrationHuntTimer = millis();
+			_sendImmediateKeepalive();
+		}
+	}
+	else if(_channelHunting == true || state != m2mDirectState::connected)
+	{
+		_channelHuntHousekeeping(keepaliveArrived);
+	}
+	else if(requestedChannel != 0 && requestedChannel != _communicationChannel && state == m2mDirectState::connected && _radioShared() == false)
+	{
+		_startChannelMigration(requestedChannel);
+	}
+	else if(_channelMigrationEnabled == true && _radioShared() == false && state == m2mDirectState::connected && millis() - _lastMigration > M2M_DIRECT_MIGRATION_HOLDOFF && _countBits(linkQuality()) < M2M_DIRECT_MIGRATION_THRESHOLD)
+	{
+		uint8_t channel = leastCongestedChannel();
+		if(channel != 0 && channel != _communicationChannel &&
+			uint64_t(channelCongestion(channel)) * 100 < uint64_t(channelCongestion(_communicationChannel)) * (100 - M2M_DIRECT_MIGRATION_HYSTERESIS))
+		{
+			_startChannelMigration(channel);
+		}
+	}
+}
+/*
+ *
+ *	Re-acquires a peer on an unknown channel, for example after it rebooted onto another channel or an AP moved one end
+ *	Once no keepalive has arrived for M2M_DIRECT_HUNT_TIMEOUT both ends step through every channel, sending a keepalive on arrival
+ *	The tie-break winner dwells M2M_DIRECT_HUNT_DWELL on each channel, the loser dwells for a whole cycle of the winner's plus one dwell
+ *	so whatever their phase the winner visits the loser's channel while it is there, bounding the hunt at (channels + 1) * dwell
+ *	An end connected to an AP can't leave its channel, it follows the AP and waits to be found, within channels * (channels + 1) * dwell if it is the tie-break winner
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_channelHuntHousekeeping(bool keepaliveArrived)
+{
+	if(WiFi.status() == WL_CONNECTED)
+	{
+		if(_currentChannel() != _communicationChannel)	//The AP has moved channel, follow it
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rChannel hunt: AP moved to channel %u"), _currentChannel());
+			}
+			_moveToChannel(_currentChannel());
+			_sendImmediateKeepalive();
+		}
+		_channelHunting = false;
+		return;
+	}
+	if(_channelHunting == true)
+	{
+		if(keepaliveArrived == true)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rChannel hunt: found peer on channel %u"), _communicationChannel.load());
+			}
+			_sendImmediateKeepalive();	//Answer straight away, the peer may be about to hop away
+			_channelHunting = false;
+		}
+		else if(millis() - _channelHuntTimer > (_tieBreak(_localMacAddress, _remoteMacAddress) ? M2M_DIRECT_HUNT_DWELL : M2M_DIRECT_HUNT_DWELL * (M2M_DIRECT_MAXIMUM_CHANNEL + 1)))
+		{
+			_moveToChannel(_communicationChannel < M2M_DIRECT_MAXIMUM_CHANNEL ? _communicationChannel + 1 : 1);
+			_channelHuntTimer = millis();
+			_sendImmediateKeepalive();
+		}
+	}
+	else if(_channelHuntEnabled == true && _radioShared() == false && (state == m2mDirectState::connecting || state == m2mDirectState::disconnected) && millis() - _lastKeepaliveTime > M2M_DIRECT_HUNT_TIMEOUT)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR("\n\rChannel hunt: no keepalive for %ums, hunting"), millis() - _lastKeepaliveTime);
+		}
+		_channelHunting = true;
+		_channelHuntTimer = millis();
+		_statistics.channelHunts++;
+	}
+}
+/*
+ *
+ *	Proposes a channel migration to the peer, the proposal is repeated until ACKed or the switch time arrives
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_startChannelMigration(uint8_t channel)
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rChannel migration: proposing channel %u, congestion %u vs %u"), channel, channelCongestion(channel), channelCongestion(_communicationChannel));
+	}
+	_migrationChannel = channel;
+	_migrationSwitchTime = millis() + M2M_DIRECT_MIGRATION_DELAY;
+	_migrationInitiator = true;
+	_migrationAcknowledged = false;
+	_migrationResendTimer = millis();
+	_lastMigration = millis();
+	_createChannelChangeMessage(M2M_DIRECT_CHANNEL_CHANGE_FLAG, _migrationChannel, M2M_DIRECT_MIGRATION_DELAY);
+	_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+}
+/*
+ *
+ *	Moves the link to a new channel. The peer is removed and re-registered on the new channel by the next unicast send, as is every device in the peer table
+ *
+ *	Only the paired device agrees a move, so with a peer table this only happens when the station's AP moves and the peers have to follow it anyway
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_moveToChannel(uint8_t channel)
+{
+	_communicationChannel = channel;
+	_changeChannel(channel);
+	if(esp_now_is_peer_exist(_remoteMacAddress))
+	{
+		esp_now_del_peer(_remoteMacAddress);
+	}
+	for(uint8_t peerIndex = 0; peerIndex < M2M_DIRECT_MAXIMUM_PEERS; peerIndex++)
+	{
+		if(_peers[peerIndex].inUse == true && esp_now_is_peer_exist(_peers[peerIndex].macAddress))
+		{
+			esp_now_del_peer(_peers[peerIndex].macAddress);
+		}
+	}
+}
+/*
+ *
+ *	Returns true while other links depend on the radio staying on this channel and awake, which rules out the survey, migration, hunting and power save
+ *	These are agreed with the paired device alone, so devices in the peer table, or the links of other instances using the radio, would be left behind
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_radioShared()
+{
+	return _peerCount > 0 || _instancesRunning() > 1;
+}
+/*
+ *
+ *	Sends a keepalive straight away, used on arriving on a channel so the peer hears about it as soon as possible
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_sendImmediateKeepalive()
+{
+	_createKeepaliveMessage();
+	_sendUnicastPacket(_protocolPacketBuffer, _protocolPacketBufferPosition);
+	_advanceTimers();	//Advance the timers for keepalives
+}
+/*
+ *
+ *	This method manages the changing of the Wi-Fi channel with some verification that it happened
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_changeChannel(uint8_t channel)
+{
+	if(_currentChannel() != channel)
+	{
+		//Channel 14 is only usable in Japan
+		if (channel > 13)
 		{
 			#if defined(ESP8266)
 			wifi_country_t wiFiCountryConfiguration;
@@ -825,19 +1975,40 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseWiFi()
 			WiFi.disconnect();
 		}
 	}
-	#if defined(ESP8266)
-	wifi_get_macaddr(STATION_IF, _localMacAddress);
-	#elif defined ESP32
-	WiFi.macAddress(_localMacAddress);
-	if(WiFi.getMode() == WIFI_AP || WiFi.getMode() == WIFI_AP_STA)
-	{
-		_localMacAddress[5] = _localMacAddress[5] - 1;			//Decrement the last octet of the MAC address, it is incremented in AP mode
-	}
-	#endif
-	if(debug_uart_ != nullptr)
+	#if defined(ESP32)
+	if(_longRange == true)
 	{
-		debug_uart_->printf_P(PSTR("\n\rMAC address (STATION_IF):%02x%02x%02x%02x%02x%02x"), _localMacAddress[0], _localMacAddress[1], _localMacAddress[2], _localMacAddress[3], _localMacAddress[4], _localMacAddress[5]);
-		if(WiFi.status() == WL_CONNECTED)
+		//Keep 802.11b/g/n so normal frames, and any AP, still work
+		if(esp_wifi_set_protocol(_espNowInterface(), WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR) == ESP_OK)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\n\rLong range mode enabled"));
+			}
+		}
+		else
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\n\rUnable to enable long range mode"));
+			}
+			_longRange = false;
+		}
+	}
+	#endif
+	#if defined(ESP8266)
+	wifi_get_macaddr(STATION_IF, _localMacAddress);
+	#elif defined ESP32
+	WiFi.macAddress(_localMacAddress);
+	if(_espNowInterface() == WIFI_IF_AP)	//With the station enabled, ESP-Now uses its address unchanged
+	{
+		_localMacAddress[5] = _localMacAddress[5] - 1;			//Decrement the last octet of the MAC address, it is incremented in AP mode
+	}
+	#endif
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rMAC address (STATION_IF):%02x%02x%02x%02x%02x%02x"), _localMacAddress[0], _localMacAddress[1], _localMacAddress[2], _localMacAddress[3], _localMacAddress[4], _localMacAddress[5]);
+		if(WiFi.status() == WL_CONNECTED)
 		{
 			debug_uart_->print(F("\n\rIP address: "));
 			debug_uart_->print(WiFi.localIP());
@@ -865,7 +2036,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseWiFi()
 		{
 			if(debug_uart_ != nullptr)
 			{
-				debug_uart_->print(_communicationChannel);
+				debug_uart_->print(_communicationChannel.load());
 			}
 		}
 		else
@@ -874,11 +2045,18 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseWiFi()
 			{
 				debug_uart_->print(F("automatic"));
 			}
-			_communicationChannel = _leastCongestedChannel();
+			if(_pairingInfoRead == true && _storedChannel != 0)
+			{
+				_communicationChannel = _storedChannel;	//Reuse the channel saved with the pairing, the survey can move it later
+			}
+			else
+			{
+				_communicationChannel = _leastCongestedChannel();
+			}
 			if(debug_uart_ != nullptr)
 			{
 				debug_uart_->print(F("\n\rAutomatic channel suggestion: "));
-				debug_uart_->print(_communicationChannel);
+				debug_uart_->print(_communicationChannel.load());
 			}
 		}
 	}
@@ -888,8 +2066,47 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseWiFi()
  *
  *	This method sets up ESP-Now with peers, callbacks and so on as necessary
  *
+ *	The radio, callbacks and broadcast peer are shared, so only the first instance to get here sets them up. Later instances use what is
+ *	already running, which means they must be on the same channel, and are refused if they aren't
+ *
  */
 bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseEspNow(uint8_t channel)
+{
+	uint8_t radioState = M2M_DIRECT_RADIO_STOPPED;
+	if(_radioState.compare_exchange_strong(radioState, M2M_DIRECT_RADIO_STARTING) == false)
+	{
+		if(radioState == M2M_DIRECT_RADIO_STARTING)
+		{
+			return false;	//Another instance is part way through, try again later
+		}
+		if(_currentChannel() != channel)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rUnable to start on channel %u, another instance is using channel %u"), channel, _currentChannel());
+			}
+			return false;
+		}
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rSharing ESP-Now with another instance"));
+		}
+		return true;
+	}
+	if(_startEspNow(channel) == true)
+	{
+		_radioState = M2M_DIRECT_RADIO_STARTED;
+		return true;
+	}
+	_radioState = M2M_DIRECT_RADIO_STOPPED;
+	return false;
+}
+/*
+ *
+ *	Starts ESP-Now on a channel, registering the shared callbacks and the broadcast address. Only done once, by _initialiseEspNow()
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_startEspNow(uint8_t channel)
 {
 	if(_changeChannel(channel) == true)
 	{
@@ -907,7 +2124,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseEspNow(uint8_t channel)
 				if(_initialiseEspNowCallbacks() == true)
 				{
 					//if(esp_now_add_peer(_broadcastMacAddress,(uint8_t)ESP_NOW_ROLE_COMBO,(uint8_t)channel, NULL, 0) == ESP_OK)
-					if(_registerPeer(_broadcastMacAddress, channel))
+					if(esp_now_is_peer_exist(_broadcastMacAddress) || _registerPeer(_broadcastMacAddress, channel))
 					{
 						return true;
 					}
@@ -923,7 +2140,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseEspNow(uint8_t channel)
 			#elif defined ESP32
 			if(_initialiseEspNowCallbacks() == true)
 			{
-				if(_registerPeer(_broadcastMacAddress, channel))
+				if(esp_now_is_peer_exist(_broadcastMacAddress) || _registerPeer(_broadcastMacAddress, channel))
 				{
 					return true;
 				}
@@ -955,659 +2172,1084 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_initialiseEspNowCallbacks()
 	{
 		debug_uart_->print(F("\n\rCreating receive callback for communicating with ESP-Now peers: "));
 	}
-	//The receive callback is a somewhat length lambda function
+	//The receive callback is shared by every instance, it gathers the metadata then hands the frame to the instance it is for
 	#if defined(ESP8266)
 	if(esp_now_register_recv_cb([](uint8_t *macAddress, uint8_t *receivedMessage, uint8_t receivedMessageLength) {
-	#elif defined ESP32
+		m2mDirectFrameMetadata metadata;	//The ESP8266 SDK has no receive metadata
+	#elif defined ESP32 && defined(M2M_DIRECT_SNIFF_METADATA)
 	if(esp_now_register_recv_cb([](const uint8_t *macAddress, const uint8_t *receivedMessage, int receivedMessageLength) {
+		m2mDirectFrameMetadata metadata;
+		if(memcmp(macAddress, _sniffedMacAddress, MAC_ADDRESS_LENGTH) == 0)	//The promiscuous callback saw this frame first
+		{
+			metadata = _sniffedMetadata;
+			memset(_sniffedMacAddress, 0, MAC_ADDRESS_LENGTH);
+		}
+	#elif defined ESP32
+	if(esp_now_register_recv_cb([](const esp_now_recv_info_t *info, const uint8_t *receivedMessage, int receivedMessageLength) {
+		const uint8_t *macAddress = info->src_addr;
+		m2mDirectFrameMetadata metadata;
+		_fillMetadata(*info->rx_ctrl, metadata);
+	#endif
+		metadata.received = millis();
+		_dispatchReceivedFrame(macAddress, receivedMessage, receivedMessageLength, metadata);
+	}) == ESP_OK)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("OK"));
+		}
+	}
+	else
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("Failed"));
+		}
+		return false;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rCreating send callback for communicating with ESP-Now peers: "));
+	}
+	#if defined(ESP8266)
+	if(esp_now_register_send_cb([](uint8_t* macAddress, uint8_t status) {
+	#elif defined ESP32
+	if(esp_now_register_send_cb([](const uint8_t* macAddress, esp_now_send_status_t status) {
+	#endif
+		_dispatchSendResult(macAddress, status == ESP_OK);
+	}) == ESP_OK)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("OK"));
+		}
+	}
+	else
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("Failed"));
+		}
+		return false;
+	}
+	#if defined(M2M_DIRECT_SNIFF_METADATA)
+	_startMetadataSniffer();
+	#endif
+	return true;
+}
+/*
+ *
+ *	ESP-Now has one set of callbacks for the radio, so every instance registers here and the callbacks look up the instance a frame is for
+ *
+ */
+std::atomic<m2mDirectClass*> m2mDirectClass::_instances[M2M_DIRECT_MAXIMUM_INSTANCES];
+#if defined(M2M_DIRECT_SNIFF_METADATA)
+uint8_t m2mDirectClass::_sniffedMacAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};
+m2mDirectFrameMetadata m2mDirectClass::_sniffedMetadata;
+#endif
+std::atomic<m2mDirectClass*> m2mDirectClass::_surveyingInstance{nullptr};
+std::atomic<uint8_t> m2mDirectClass::_radioState{M2M_DIRECT_RADIO_STOPPED};
+#if defined(ESP32)
+std::atomic<uint8_t> m2mDirectClass::_radioRateIndex{M2M_DIRECT_RATE_COUNT};
+#endif
+/*
+ *
+ *	Takes the first free place among the instances sharing the ESP-Now callbacks. Other than the default instance, the place also picks where the pairing is saved
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_registerInstance()
+{
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		m2mDirectClass* empty = nullptr;
+		if(_instances[index].compare_exchange_strong(empty, this))
+		{
+			_instanceIndex = index;
+			#if defined(ESP32)
+			if(this != &m2mDirect)
+			{
+				snprintf(preferencesNamespace, sizeof(preferencesNamespace), "m2mDirect%u", index);	//Its own record, the default instance keeps the original namespace
+			}
+			#endif
+			return true;
+		}
+	}
+	return false;
+}
+/*
+ *
+ *	Returns true if this instance has somewhere of its own to save a pairing. On ESP32 each registered instance has its own Preferences namespace,
+ *	on ESP8266 there is one store in flash so only the default instance uses it
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_storeAvailable()
+{
+	#if defined(ESP8266)
+	return _instanceIndex != M2M_DIRECT_MAXIMUM_INSTANCES && this == &m2mDirect;
+	#else
+	return _instanceIndex != M2M_DIRECT_MAXIMUM_INSTANCES;
+	#endif
+}
+/*
+ *
+ *	Returns true if this instance has a place among those sharing the ESP-Now callbacks. Without one it never sees a frame, so begin() does nothing
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::instanceRegistered()
+{
+	return _instanceIndex != M2M_DIRECT_MAXIMUM_INSTANCES;
+}
+/*
+ *
+ *	Returns the instance with a link to a MAC address, as the paired device or in its peer table, nullptr if there isn't one
+ *
+ */
+m2mDirectClass* ICACHE_FLASH_ATTR m2mDirectClass::_instanceFor(const uint8_t* macAddress)
+{
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		m2mDirectClass* instance = _instances[index];
+		if(instance != nullptr && (memcmp(macAddress, instance->_remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 || instance->_findPeer(macAddress) != M2M_DIRECT_NO_PEER))
+		{
+			return instance;
+		}
+	}
+	return nullptr;
+}
+/*
+ *
+ *	Counts the instances with ESP-Now running. With more than one they share the radio, so none of them may move its channel, sleep it or change its rate
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_instancesRunning()
+{
+	uint8_t running = 0;
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		m2mDirectClass* instance = _instances[index];
+		if(instance != nullptr && instance->state != m2mDirectState::uninitialised)
+		{
+			running++;
+		}
+	}
+	return running;
+}
+/*
+ *
+ *	Returns the one instance a pairing frame or ACK is for, so two instances can't both pair with the same device. An instance already pairing with
+ *	the sender comes first, then the first one pairing that hasn't heard from anyone yet, then the first one pairing at all
+ *
+ */
+m2mDirectClass* ICACHE_FLASH_ATTR m2mDirectClass::_pairingInstanceFor(const uint8_t* macAddress)
+{
+	m2mDirectClass* unclaimed = nullptr;
+	m2mDirectClass* pairing = nullptr;
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		m2mDirectClass* instance = _instances[index];
+		if(instance == nullptr || (instance->state != m2mDirectState::pairing && instance->state != m2mDirectState::paired))
+		{
+			continue;
+		}
+		if(memcmp(macAddress, instance->_remoteMacAddress, MAC_ADDRESS_LENGTH) == 0)
+		{
+			return instance;
+		}
+		if(instance->state == m2mDirectState::pairing)
+		{
+			if(unclaimed == nullptr && instance->_remoteMacAddressSet() == false)
+			{
+				unclaimed = instance;
+			}
+			if(pairing == nullptr)
+			{
+				pairing = instance;
+			}
+		}
+	}
+	return unclaimed != nullptr ? unclaimed : pairing;
+}
+/*
+ *
+ *	Hands a received frame to the instance it is for. Frames from a linked device go to that instance and pairing frames to the one instance
+ *	_pairingInstanceFor() picks. Broadcasts go to every instance, each has its own subscriptions, and anything else to the first instance
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_dispatchReceivedFrame(const uint8_t* macAddress, const uint8_t* message, int length, const m2mDirectFrameMetadata &metadata)
+{
+	if(length < 5)
+	{
+		return;	//Too short for a type and CRC
+	}
+	m2mDirectClass* owner = nullptr;
+	if(message[0] == M2M_DIRECT_BROADCAST_FLAG)
+	{
+		for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+		{
+			m2mDirectClass* instance = _instances[index];
+			if(instance != nullptr)
+			{
+				instance->_receiveFrame(macAddress, message, length, metadata);
+			}
+		}
+		return;
+	}
+	if(message[0] == M2M_DIRECT_PAIRING_FLAG || message[0] == M2M_DIRECT_PAIRING_ACK_FLAG)
+	{
+		owner = _pairingInstanceFor(macAddress);
+	}
+	if(owner == nullptr)
+	{
+		owner = _instanceFor(macAddress);
+	}
+	for(uint8_t index = 0; owner == nullptr && index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)	//Nobody expects it, one instance is enough to count it
+	{
+		owner = _instances[index];
+	}
+	if(owner != nullptr)
+	{
+		owner->_receiveFrame(macAddress, message, length, metadata);
+	}
+}
+/*
+ *
+ *	Hands the result of a send to the instance linked to the device it went to. Results for broadcasts and unknown devices go to every instance, which ignore them
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_dispatchSendResult(const uint8_t* macAddress, bool delivered)
+{
+	m2mDirectClass* owner = _instanceFor(macAddress);
+	if(owner != nullptr)
+	{
+		owner->_sendResult(macAddress, delivered);
+		return;
+	}
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_INSTANCES; index++)
+	{
+		m2mDirectClass* instance = _instances[index];
+		if(instance != nullptr)
+		{
+			instance->_sendResult(macAddress, delivered);
+		}
+	}
+}
+/*
+ *
+ *	Handles a frame from the ESP-Now receive callback, in the WiFi task, once _dispatchReceivedFrame() has found the instance it is for
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_receiveFrame(const uint8_t* macAddress, const uint8_t* receivedMessage, int receivedMessageLength, const m2mDirectFrameMetadata &metadata)
+{
+	//Copy the received CRC32
+	uint32_t receivedCrc = receivedMessage[receivedMessageLength - 1];
+	receivedCrc+=receivedMessage[receivedMessageLength - 2] << 8;
+	receivedCrc+=receivedMessage[receivedMessageLength - 3] << 16;
+	receivedCrc+=receivedMessage[receivedMessageLength - 4] << 24;
+	_statistics.framesReceived++;
+	#ifdef M2M_DIRECT_DEBUG_RECEIVE
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rRX %03u bytes from:%02x%02x%02x%02x%02x%02x "), receivedMessageLength, macAddress[0], macAddress[1], macAddress[2], macAddress[3], macAddress[4], macAddress[5]);
+		_printPacketDescription(receivedMessage[0]);
+		//debug_uart_->printf_P(PSTR(" CRC:%08x "),  receivedCrc);
+	}
 	#endif
-		//Copy the received CRC32
-		uint32_t receivedCrc = receivedMessage[receivedMessageLength - 1];
-		receivedCrc+=receivedMessage[receivedMessageLength - 2] << 8;
-		receivedCrc+=receivedMessage[receivedMessageLength - 3] << 16;
-		receivedCrc+=receivedMessage[receivedMessageLength - 4] << 24;
+	//Calculate the received CRC32
+	CRC32 crc;
+	crc.add((uint8_t*)receivedMessage, receivedMessageLength - 4);
+	//Check the CRC32
+	if(crc.calc() == receivedCrc)
+	{
 		#ifdef M2M_DIRECT_DEBUG_RECEIVE
-		if(m2mDirect.debug_uart_ != nullptr)
+		if(debug_uart_ != nullptr)
 		{
-			m2mDirect.debug_uart_->printf_P(PSTR("\n\rRX %03u bytes from:%02x%02x%02x%02x%02x%02x "), receivedMessageLength, macAddress[0], macAddress[1], macAddress[2], macAddress[3], macAddress[4], macAddress[5]);
-			m2mDirect._printPacketDescription(receivedMessage[0]);
-			//m2mDirect.debug_uart_->printf_P(PSTR(" CRC:%08x "),  receivedCrc);
+			debug_uart_->print(F(" valid"));
+			if(metadata.rssi != M2M_DIRECT_RSSI_UNKNOWN)
+			{
+				debug_uart_->printf_P(PSTR(" %idBm"), metadata.rssi);
+			}
 		}
 		#endif
-		//Calculate the received CRC32
-		CRC32 crc;
-		crc.add((uint8_t*)receivedMessage, receivedMessageLength - 4);
-		//Check the CRC32
-		if(crc.calc() == receivedCrc)
+		if(metadata.rssi != M2M_DIRECT_RSSI_UNKNOWN && memcmp(macAddress, _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0)
+		{
+			_recordMetadata(metadata);
+		}
+		//Anything but pairing or broadcast data from a device in the peer table goes to its own state machine
+		uint8_t peerIndex = receivedMessage[0] == M2M_DIRECT_PAIRING_FLAG || receivedMessage[0] == M2M_DIRECT_PAIRING_ACK_FLAG || receivedMessage[0] == M2M_DIRECT_BROADCAST_FLAG || receivedMessage[0] == M2M_DIRECT_RELAY_FLAG ? M2M_DIRECT_NO_PEER : _findPeer(macAddress);
+		if(receivedMessage[0] == M2M_DIRECT_BROADCAST_FLAG)
+		{
+			_receiveBroadcastFrame(macAddress, receivedMessage, receivedMessageLength, metadata);	//From any device with the key, paired or not
+		}
+		else if(receivedMessage[0] == M2M_DIRECT_RELAY_FLAG)
+		{
+			_receiveRelayFrame(macAddress, receivedMessage, receivedMessageLength, metadata);	//From the paired device or a peer
+		}
+		else if(peerIndex != M2M_DIRECT_NO_PEER)
+		{
+			_receivePeerFrame(peerIndex, receivedMessage, receivedMessageLength, metadata);
+		}
+		//Pairing messages are the first stage in setting up a connection, sent broadcast
+		//These will expose at least one of the encryption keys
+		else if(receivedMessage[0] == M2M_DIRECT_PAIRING_FLAG)
 		{
-			#ifdef M2M_DIRECT_DEBUG_RECEIVE
-			if(m2mDirect.debug_uart_ != nullptr)
+			//Debug output
+			if(debug_uart_ != nullptr)
 			{
-				m2mDirect.debug_uart_->print(F(" valid"));
+				debug_uart_->printf_P(PSTR("\n\rPairing message on channel:%i from %02x%02x%02x%02x%02x%02x\n\r\tGlobal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n\r\tLocal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"),
+					receivedMessage[1],//Channel
+					receivedMessage[2],//Remote MAC address
+					receivedMessage[3],
+					receivedMessage[4],
+					receivedMessage[5],
+					receivedMessage[6],
+					receivedMessage[7],
+					receivedMessage[8],//Primary encryption key
+					receivedMessage[9],
+					receivedMessage[10],
+					receivedMessage[11],
+					receivedMessage[12],
+					receivedMessage[13],
+					receivedMessage[14],
+					receivedMessage[15],
+					receivedMessage[16],
+					receivedMessage[17],
+					receivedMessage[18],
+					receivedMessage[19],
+					receivedMessage[20],
+					receivedMessage[21],
+					receivedMessage[22],
+					receivedMessage[23],
+					receivedMessage[24],//Local encryption key
+					receivedMessage[25],
+					receivedMessage[26],
+					receivedMessage[27],
+					receivedMessage[28],
+					receivedMessage[29],
+					receivedMessage[30],
+					receivedMessage[31],
+					receivedMessage[32],
+					receivedMessage[33],
+					receivedMessage[34],
+					receivedMessage[35],
+					receivedMessage[36],
+					receivedMessage[37],
+					receivedMessage[38],
+					receivedMessage[39]
+				);
+				if(receivedMessage[40] > 0)	//There is a name
+				{
+					debug_uart_->printf_P(PSTR("\n\r\tName:'%s' length:%u"), &receivedMessage[41], receivedMessage[40]);
+				}
 			}
-			#endif
-			//Pairing messages are the first stage in setting up a connection, sent broadcast
-			//These will expose at least one of the encryption keys
-			if(receivedMessage[0] == M2M_DIRECT_PAIRING_FLAG)
+			//The normal state of things, one of the pair will get there first
+			if(state == m2mDirectState::pairing)
 			{
-				//Debug output
-				if(m2mDirect.debug_uart_ != nullptr)
+				//Copy the remote MAC address
+				memcpy(_remoteMacAddress, &receivedMessage[2], MAC_ADDRESS_LENGTH);
+				//Copy the remote name
+				if(remoteDeviceName == nullptr)
 				{
-					m2mDirect.debug_uart_->printf_P(PSTR("\n\rPairing message on channel:%i from %02x%02x%02x%02x%02x%02x\n\r\tGlobal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n\r\tLocal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"),
-						receivedMessage[1],//Channel
-						receivedMessage[2],//Remote MAC address
-						receivedMessage[3],
-						receivedMessage[4],
-						receivedMessage[5],
-						receivedMessage[6],
-						receivedMessage[7],
-						receivedMessage[8],//Primary encryption key
-						receivedMessage[9],
-						receivedMessage[10],
-						receivedMessage[11],
-						receivedMessage[12],
-						receivedMessage[13],
-						receivedMessage[14],
-						receivedMessage[15],
-						receivedMessage[16],
-						receivedMessage[17],
-						receivedMessage[18],
-						receivedMessage[19],
-						receivedMessage[20],
-						receivedMessage[21],
-						receivedMessage[22],
-						receivedMessage[23],
-						receivedMessage[24],//Local encryption key
-						receivedMessage[25],
-						receivedMessage[26],
-						receivedMessage[27],
-						receivedMessage[28],
-						receivedMessage[29],
-						receivedMessage[30],
-						receivedMessage[31],
-						receivedMessage[32],
-						receivedMessage[33],
-						receivedMessage[34],
-						receivedMessage[35],
-						receivedMessage[36],
-						receivedMessage[37],
-						receivedMessage[38],
-						receivedMessage[39]
-					);
 					if(receivedMessage[40] > 0)	//There is a name
 					{
-						m2mDirect.debug_uart_->printf_P(PSTR("\n\r\tName:'%s' length:%u"), &receivedMessage[41], receivedMessage[40]);
+						remoteDeviceName = new char[receivedMessage[40] + 1];
+						memcpy(remoteDeviceName, &receivedMessage[41], receivedMessage[40]);
+						remoteDeviceName[receivedMessage[40]] = 0;	//Null terminate this string
 					}
 				}
-				//The normal state of things, one of the pair will get there first
-				if(m2mDirect.state == m2mDirectState::pairing)
+				if(_tieBreak(_remoteMacAddress, _localMacAddress)) //Do a tie break based on MAC address
 				{
-					//Copy the remote MAC address
-					memcpy(m2mDirect._remoteMacAddress, &receivedMessage[2], MAC_ADDRESS_LENGTH);
-					//Copy the remote name
-					if(m2mDirect.remoteDeviceName == nullptr)
+					if(memcmp(_primaryEncryptionKey,&receivedMessage[8],ENCRYPTION_KEY_LENGTH !=0) ||
+						memcmp(_localEncryptionKey,&receivedMessage[24],ENCRYPTION_KEY_LENGTH !=0))
 					{
-						if(receivedMessage[40] > 0)	//There is a name
+						if(debug_uart_ != nullptr)
 						{
-							m2mDirect.remoteDeviceName = new char[receivedMessage[40] + 1];
-							memcpy(m2mDirect.remoteDeviceName, &receivedMessage[41], receivedMessage[40]);
-							m2mDirect.remoteDeviceName[receivedMessage[40]] = 0;	//Null terminate this string
+							debug_uart_->print(F("\n\rRemote device wins tie, using its keys"));
 						}
+						//Copy the expected communication channel, overriding this device's choice
+						_communicationChannel = receivedMessage[1];
+						//Copy the global encryption key, overriding this device's choice
+						memcpy(_primaryEncryptionKey, &receivedMessage[8], ENCRYPTION_KEY_LENGTH);
+						//Copy the local encryption key, overriding this device's choice
+						memcpy(_localEncryptionKey, &receivedMessage[24], ENCRYPTION_KEY_LENGTH);
 					}
-					if(m2mDirect._tieBreak(m2mDirect._remoteMacAddress, m2mDirect._localMacAddress)) //Do a tie break based on MAC address
+					else
 					{
-						if(memcmp(m2mDirect._primaryEncryptionKey,&receivedMessage[8],ENCRYPTION_KEY_LENGTH !=0) ||
-							memcmp(m2mDirect._localEncryptionKey,&receivedMessage[24],ENCRYPTION_KEY_LENGTH !=0))
-						{
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rRemote device wins tie, using its keys"));
-							}
-							//Copy the expected communication channel, overriding this device's choice
-							m2mDirect._communicationChannel = receivedMessage[1];
-							//Copy the global encryption key, overriding this device's choice
-							memcpy(m2mDirect._primaryEncryptionKey, &receivedMessage[8], ENCRYPTION_KEY_LENGTH);
-							//Copy the local encryption key, overriding this device's choice
-							memcpy(m2mDirect._localEncryptionKey, &receivedMessage[24], ENCRYPTION_KEY_LENGTH);
-						}
-						else
-						{
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rRemote device won tie, already have its keys"));
-							}
-						}
-						//Change state to confirm pairing with other device
-						if(m2mDirect.debug_uart_ != nullptr)
+						if(debug_uart_ != nullptr)
 						{
-							m2mDirect.debug_uart_->print(F("\n\rPaired"));
+							debug_uart_->print(F("\n\rRemote device won tie, already have its keys"));
 						}
-						if(m2mDirect._encyptionEnabled == true)
+					}
+					//Change state to confirm pairing with other device
+					if(debug_uart_ != nullptr)
+					{
+						debug_uart_->print(F("\n\rPaired"));
+					}
+					if(_encyptionEnabled == true)
+					{
+						if(_setPrimaryEncryptionKey() == true)	//Use the advertised primary encryption key
 						{
-							if(m2mDirect._setPrimaryEncryptionKey() == true)	//Use the advertised primary encryption key
+							if(_registerPeer(_remoteMacAddress, _communicationChannel, _localEncryptionKey) == true)
 							{
-								if(m2mDirect._registerPeer(m2mDirect._remoteMacAddress, m2mDirect._communicationChannel, m2mDirect._localEncryptionKey) == true)
+								//Move on to the paired state and start sending pairing ACKs
+								_createPairingAckMessage();
+								state = m2mDirectState::paired;
+								_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
+								if(debug_uart_ != nullptr)
 								{
-									//Move on to the paired state and start sending pairing ACKs
-									m2mDirect._createPairingAckMessage();
-									m2mDirect.state = m2mDirectState::paired;
-									m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
-									if(m2mDirect.debug_uart_ != nullptr)
-									{
-										m2mDirect._debugState();
-									}
-									if(m2mDirect.pairedCallback != nullptr)
-									{
-										m2mDirect.pairedCallback();
-									}
-								}
-							}
-						}
-						else
-						{
-							if(m2mDirect._registerPeer(m2mDirect._remoteMacAddress, m2mDirect._communicationChannel))
-							{
-								//Move on to the paired state and start sending pairing ACKs
-								m2mDirect._createPairingAckMessage();
-								m2mDirect.state = m2mDirectState::paired;
-								m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
-								if(m2mDirect.debug_uart_ != nullptr)
-								{
-									m2mDirect._debugState();
-								}
-								if(m2mDirect.pairedCallback != nullptr)
-								{
-									m2mDirect.pairedCallback();
+									_debugState();
 								}
+								_postEvent(m2mDirectEvent::paired);
 							}
 						}
 					}
 					else
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
+						if(_registerPeer(_remoteMacAddress, _communicationChannel))
 						{
-							m2mDirect.debug_uart_->print(F("\n\rLocal device wins tie"));
+							//Move on to the paired state and start sending pairing ACKs
+							_createPairingAckMessage();
+							state = m2mDirectState::paired;
+							_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
+							if(debug_uart_ != nullptr)
+							{
+								_debugState();
+							}
+							_postEvent(m2mDirectEvent::paired);
 						}
 					}
 				}
-				else if(m2mDirect.state == m2mDirectState::paired)
+				else
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					if(debug_uart_ != nullptr)
 					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring pairing message, already paired"));
+						debug_uart_->print(F("\n\rLocal device wins tie"));
 					}
+					_pairingPeerHeard = true;	//It will adopt these keys when it hears the next pairing message, so send it sooner
 				}
-				else if(m2mDirect.state == m2mDirectState::connected)
+			}
+			else if(state == m2mDirectState::paired)
+			{
+				if(debug_uart_ != nullptr)
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
-					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring pairing message, already connected"));
-					}
+					debug_uart_->print(F("\n\rIgnoring pairing message, already paired"));
 				}
-				else
+			}
+			else if(state == m2mDirectState::connected)
+			{
+				if(debug_uart_ != nullptr)
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
-					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring unexpected message"));
-					}
+					debug_uart_->print(F("\n\rIgnoring pairing message, already connected"));
 				}
 			}
-			//Pairing ACKs show that at least one end has both encryption keys and the tie is broken
-			else if(receivedMessage[0] == M2M_DIRECT_PAIRING_ACK_FLAG)
+			else
 			{
-				//Debug output
-				if(m2mDirect.debug_uart_ != nullptr)
+				if(debug_uart_ != nullptr)
 				{
-					m2mDirect.debug_uart_->printf_P(PSTR("\n\rPairing ACK message on channel:%u from %02x%02x%02x%02x%02x%02x\r\n\tGlobal Key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x for %02x%02x%02x%02x%02x%02x\r\n\tLocal Key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"),
-						receivedMessage[1],	//Channel
-						receivedMessage[2],	//Remote MAC address
-						receivedMessage[3],
-						receivedMessage[4],
-						receivedMessage[5],
-						receivedMessage[6],
-						receivedMessage[7],
-						receivedMessage[8], //Local Mac address
-						receivedMessage[9],
-						receivedMessage[10],
-						receivedMessage[11],
-						receivedMessage[12],
-						receivedMessage[13],
-						receivedMessage[14],//Global encryption key
-						receivedMessage[15],
-						receivedMessage[16],
-						receivedMessage[17],
-						receivedMessage[18],
-						receivedMessage[19],
-						receivedMessage[20],
-						receivedMessage[21],
-						receivedMessage[22],
-						receivedMessage[23],
-						receivedMessage[24],
-						receivedMessage[25],
-						receivedMessage[26],
-						receivedMessage[27],
-						receivedMessage[28],
-						receivedMessage[29],
-						receivedMessage[30], //Local encryption key
-						receivedMessage[31],
-						receivedMessage[32],
-						receivedMessage[33],
-						receivedMessage[34],
-						receivedMessage[35],
-						receivedMessage[36],
-						receivedMessage[37],
-						receivedMessage[38],
-						receivedMessage[39],
-						receivedMessage[40],
-						receivedMessage[41],
-						receivedMessage[42],
-						receivedMessage[43],
-						receivedMessage[44],
-						receivedMessage[45]
-					);
-					if(receivedMessage[46] > 0)	//There is a name
-					{
-						m2mDirect.debug_uart_->printf_P(PSTR("\n\r\tName:'%s' length:%u"), &receivedMessage[47], receivedMessage[46]);
-					}
+					debug_uart_->print(F("\n\rIgnoring unexpected message"));
+				}
+			}
+		}
+		//Pairing ACKs show that at least one end has both encryption keys and the tie is broken
+		else if(receivedMessage[0] == M2M_DIRECT_PAIRING_ACK_FLAG)
+		{
+			//Debug output
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\n\rPairing ACK message on channel:%u from %02x%02x%02x%02x%02x%02x\r\n\tGlobal Key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x for %02x%02x%02x%02x%02x%02x\r\n\tLocal Key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"),
+					receivedMessage[1],	//Channel
+					receivedMessage[2],	//Remote MAC address
+					receivedMessage[3],
+					receivedMessage[4],
+					receivedMessage[5],
+					receivedMessage[6],
+					receivedMessage[7],
+					receivedMessage[8], //Local Mac address
+					receivedMessage[9],
+					receivedMessage[10],
+					receivedMessage[11],
+					receivedMessage[12],
+					receivedMessage[13],
+					receivedMessage[14],//Global encryption key
+					receivedMessage[15],
+					receivedMessage[16],
+					receivedMessage[17],
+					receivedMessage[18],
+					receivedMessage[19],
+					receivedMessage[20],
+					receivedMessage[21],
+					receivedMessage[22],
+					receivedMessage[23],
+					receivedMessage[24],
+					receivedMessage[25],
+					receivedMessage[26],
+					receivedMessage[27],
+					receivedMessage[28],
+					receivedMessage[29],
+					receivedMessage[30], //Local encryption key
+					receivedMessage[31],
+					receivedMessage[32],
+					receivedMessage[33],
+					receivedMessage[34],
+					receivedMessage[35],
+					receivedMessage[36],
+					receivedMessage[37],
+					receivedMessage[38],
+					receivedMessage[39],
+					receivedMessage[40],
+					receivedMessage[41],
+					receivedMessage[42],
+					receivedMessage[43],
+					receivedMessage[44],
+					receivedMessage[45]
+				);
+				if(receivedMessage[46] > 0)	//There is a name
+				{
+					debug_uart_->printf_P(PSTR("\n\r\tName:'%s' length:%u"), &receivedMessage[47], receivedMessage[46]);
 				}
-				//This node sent the first pairing message and has had a pairing ACK in response
-				if(m2mDirect.state == m2mDirectState::pairing)
+			}
+			//This node sent the first pairing message and has had a pairing ACK in response
+			if(state == m2mDirectState::pairing)
+			{
+				if(_remoteMacAddressSet() == false)
 				{
-					if(m2mDirect._remoteMacAddressSet() == false)
+					//Copy the remote MAC address
+					memcpy(_remoteMacAddress, &receivedMessage[2], MAC_ADDRESS_LENGTH);
+					//Copy the remote name
+					if(remoteDeviceName == nullptr)
 					{
-						//Copy the remote MAC address
-						memcpy(m2mDirect._remoteMacAddress, &receivedMessage[2], MAC_ADDRESS_LENGTH);
-						//Copy the remote name
-						if(m2mDirect.remoteDeviceName == nullptr)
+						if(receivedMessage[46] > 0)	//There is a name
 						{
-							if(receivedMessage[46] > 0)	//There is a name
-							{
-								m2mDirect.remoteDeviceName = new char[receivedMessage[46] + 1];
-								memcpy(m2mDirect.remoteDeviceName, &receivedMessage[47], receivedMessage[46]);
-								m2mDirect.remoteDeviceName[receivedMessage[46]] = 0;	//Null terminate this string
-							}
+							remoteDeviceName = new char[receivedMessage[46] + 1];
+							memcpy(remoteDeviceName, &receivedMessage[47], receivedMessage[46]);
+							remoteDeviceName[receivedMessage[46]] = 0;	//Null terminate this string
 						}
 					}
-					if(m2mDirect._tieBreak(m2mDirect._localMacAddress, (uint8_t*)&receivedMessage[2]) && //Do a tie break based on MAC address
-						//Matches the expected communication channel
-						receivedMessage[1] == m2mDirect._communicationChannel &&
-						//Matches the remote MAC address
-						memcmp(&receivedMessage[2], m2mDirect._remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the local MAC address
-						memcmp(&receivedMessage[8], m2mDirect._localMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the global encryption key
-						memcmp(&receivedMessage[14], m2mDirect._primaryEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0 &&
-						//Matches the local encryption key
-						memcmp(&receivedMessage[30], m2mDirect._localEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0
-					)
+				}
+				if(_tieBreak(_localMacAddress, (uint8_t*)&receivedMessage[2]) && //Do a tie break based on MAC address
+					//Matches the expected communication channel
+					receivedMessage[1] == _communicationChannel &&
+					//Matches the remote MAC address
+					memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the local MAC address
+					memcmp(&receivedMessage[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the global encryption key
+					memcmp(&receivedMessage[14], _primaryEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0 &&
+					//Matches the local encryption key
+					memcmp(&receivedMessage[30], _localEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0
+				)
+				{
+					if(_encyptionEnabled == true)
 					{
-						if(m2mDirect._encyptionEnabled == true)
-						{
-							if(m2mDirect._setPrimaryEncryptionKey() == true)	//Use the advertised primary encryption key
-							{
-								if(m2mDirect._registerPeer(m2mDirect._remoteMacAddress, m2mDirect._communicationChannel, m2mDirect._localEncryptionKey) == true)
-								{
-									//Both ends match, move to paired
-									if(m2mDirect.debug_uart_ != nullptr)
-									{
-										m2mDirect.debug_uart_->print(F("\n\rPairing confirmed"));
-									}
-									//Move on to the paired state and start sending pairing ACKs
-									m2mDirect._createPairingAckMessage();
-									m2mDirect.state = m2mDirectState::paired;
-									m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
-									if(m2mDirect.debug_uart_ != nullptr)
-									{
-										m2mDirect._debugState();
-									}
-									if(m2mDirect.pairedCallback != nullptr)
-									{
-										m2mDirect.pairedCallback();
-									}
-								}
-							}
-						}
-						else
+						if(_setPrimaryEncryptionKey() == true)	//Use the advertised primary encryption key
 						{
-							if(m2mDirect._registerPeer(m2mDirect._remoteMacAddress, m2mDirect._communicationChannel))
+							if(_registerPeer(_remoteMacAddress, _communicationChannel, _localEncryptionKey) == true)
 							{
-								//Both ends match, move to Paired
-								if(m2mDirect.debug_uart_ != nullptr)
+								//Both ends match, move to paired
+								if(debug_uart_ != nullptr)
 								{
-									m2mDirect.debug_uart_->print(F("\n\rPairing confirmed"));
+									debug_uart_->print(F("\n\rPairing confirmed"));
 								}
 								//Move on to the paired state and start sending pairing ACKs
-								m2mDirect._createPairingAckMessage();
-								m2mDirect.state = m2mDirectState::paired;
-								m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
-								if(m2mDirect.debug_uart_ != nullptr)
-								{
-									m2mDirect._debugState();
-								}
-								if(m2mDirect.pairedCallback != nullptr)
+								_createPairingAckMessage();
+								state = m2mDirectState::paired;
+								_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
+								if(debug_uart_ != nullptr)
 								{
-									m2mDirect.pairedCallback();
+									_debugState();
 								}
+								_postEvent(m2mDirectEvent::paired);
 							}
 						}
 					}
 					else
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
+						if(_registerPeer(_remoteMacAddress, _communicationChannel))
 						{
-							m2mDirect.debug_uart_->print(F("\n\rUnexpected pairing ACK contents"));
-							if(receivedMessage[1] != m2mDirect._communicationChannel)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rChannel mismatch"));
-							}
-							if(memcmp(&receivedMessage[2], m2mDirect._remoteMacAddress, MAC_ADDRESS_LENGTH) != 0)
-							{
-								m2mDirect.debug_uart_->printf_P(PSTR("\n\rRemote MAC address mismatch, wanted %02x%02x%02x%02x%02x%02x have %02x%02x%02x%02x%02x%02x"),
-									m2mDirect._remoteMacAddress[0],
-									m2mDirect._remoteMacAddress[1],
-									m2mDirect._remoteMacAddress[2],
-									m2mDirect._remoteMacAddress[3],
-									m2mDirect._remoteMacAddress[4],
-									m2mDirect._remoteMacAddress[5],
-									receivedMessage[2],
-									receivedMessage[3],
-									receivedMessage[4],
-									receivedMessage[5],
-									receivedMessage[6],
-									receivedMessage[7]
-								);
-							}
-							if(memcmp(&receivedMessage[8], m2mDirect._localEncryptionKey, ENCRYPTION_KEY_LENGTH) != 0)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rLocal encryption key mismatch"));
-							}
-							if(memcmp(&receivedMessage[24], m2mDirect._localMacAddress, MAC_ADDRESS_LENGTH) != 0)
+							//Both ends match, move to Paired
+							if(debug_uart_ != nullptr)
 							{
-								m2mDirect.debug_uart_->printf_P(PSTR("\n\rLocal MAC address mismatch, wanted %02x%02x%02x%02x%02x%02x have %02x%02x%02x%02x%02x%02x"),
-									m2mDirect._localMacAddress[0],
-									m2mDirect._localMacAddress[1],
-									m2mDirect._localMacAddress[2],
-									m2mDirect._localMacAddress[3],
-									m2mDirect._localMacAddress[4],
-									m2mDirect._localMacAddress[5],
-									receivedMessage[24],
-									receivedMessage[25],
-									receivedMessage[26],
-									receivedMessage[27],
-									receivedMessage[28],
-									receivedMessage[29]
-								);
+								debug_uart_->print(F("\n\rPairing confirmed"));
 							}
-							if(memcmp(&receivedMessage[30], m2mDirect._localEncryptionKey, ENCRYPTION_KEY_LENGTH) != 0)
+							//Move on to the paired state and start sending pairing ACKs
+							_createPairingAckMessage();
+							state = m2mDirectState::paired;
+							_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_PAIRED_INTERVAL;
+							if(debug_uart_ != nullptr)
 							{
-								m2mDirect.debug_uart_->print(F("\n\rLocal encryption key"));
+								_debugState();
 							}
+							_postEvent(m2mDirectEvent::paired);
 						}
 					}
 				}
-				else if(m2mDirect.state == m2mDirectState::paired)
+				else
 				{
-					if(	//Matches the expected communication channel
-						receivedMessage[1] == m2mDirect._communicationChannel &&
-						//Matches the remote MAC address
-						memcmp(&receivedMessage[2], m2mDirect._remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the local MAC address
-						memcmp(&receivedMessage[8], m2mDirect._localMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the remote encryption key
-						memcmp(&receivedMessage[14], m2mDirect._primaryEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0 &&
-						//Matches the local encryption key
-						memcmp(&receivedMessage[30], m2mDirect._localEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0
-					)
+					if(debug_uart_ != nullptr)
 					{
-						if(m2mDirect._tieBreak(m2mDirect._localMacAddress, (uint8_t*)&receivedMessage[2]))
+						debug_uart_->print(F("\n\rUnexpected pairing ACK contents"));
+						if(receivedMessage[1] != _communicationChannel)
 						{
-							//Both ends match, move to connecting
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rTie winner, connecting"));
-							}
-							m2mDirect.state = m2mDirectState::connecting;
-							m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect._debugState();
-							}
+							debug_uart_->print(F("\n\rChannel mismatch"));
 						}
-						else
+						if(memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) != 0)
 						{
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F("\n\rTie loser, waiting for connection"));
-							}
+							debug_uart_->printf_P(PSTR("\n\rRemote MAC address mismatch, wanted %02x%02x%02x%02x%02x%02x have %02x%02x%02x%02x%02x%02x"),
+								_remoteMacAddress[0],
+								_remoteMacAddress[1],
+								_remoteMacAddress[2],
+								_remoteMacAddress[3],
+								_remoteMacAddress[4],
+								_remoteMacAddress[5],
+								receivedMessage[2],
+								receivedMessage[3],
+								receivedMessage[4],
+								receivedMessage[5],
+								receivedMessage[6],
+								receivedMessage[7]
+							);
+						}
+						if(memcmp(&receivedMessage[8], _localEncryptionKey, ENCRYPTION_KEY_LENGTH) != 0)
+						{
+							debug_uart_->print(F("\n\rLocal encryption key mismatch"));
+						}
+						if(memcmp(&receivedMessage[24], _localMacAddress, MAC_ADDRESS_LENGTH) != 0)
+						{
+							debug_uart_->printf_P(PSTR("\n\rLocal MAC address mismatch, wanted %02x%02x%02x%02x%02x%02x have %02x%02x%02x%02x%02x%02x"),
+								_localMacAddress[0],
+								_localMacAddress[1],
+								_localMacAddress[2],
+								_localMacAddress[3],
+								_localMacAddress[4],
+								_localMacAddress[5],
+								receivedMessage[24],
+								receivedMessage[25],
+								receivedMessage[26],
+								receivedMessage[27],
+								receivedMessage[28],
+								receivedMessage[29]
+							);
+						}
+						if(memcmp(&receivedMessage[30], _localEncryptionKey, ENCRYPTION_KEY_LENGTH) != 0)
+						{
+							debug_uart_->print(F("\n\rLocal encryption key"));
+						}
+					}
+				}
+			}
+			else if(state == m2mDirectState::paired)
+			{
+				if(	//Matches the expected communication channel
+					receivedMessage[1] == _communicationChannel &&
+					//Matches the remote MAC address
+					memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the local MAC address
+					memcmp(&receivedMessage[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the remote encryption key
+					memcmp(&receivedMessage[14], _primaryEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0 &&
+					//Matches the local encryption key
+					memcmp(&receivedMessage[30], _localEncryptionKey, ENCRYPTION_KEY_LENGTH) == 0
+				)
+				{
+					if(_tieBreak(_localMacAddress, (uint8_t*)&receivedMessage[2]))
+					{
+						//Both ends match, move to connecting
+						if(debug_uart_ != nullptr)
+						{
+							debug_uart_->print(F("\n\rTie winner, connecting"));
+						}
+						state = m2mDirectState::connecting;
+						_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
+						if(debug_uart_ != nullptr)
+						{
+							_debugState();
 						}
 					}
 					else
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
+						if(debug_uart_ != nullptr)
 						{
-							m2mDirect.debug_uart_->print(F("\n\rPairing ACK doesn't match"));
+							debug_uart_->print(F("\n\rTie loser, waiting for connection"));
 						}
 					}
 				}
-				else if(m2mDirect.state == m2mDirectState::connecting)
+				else
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					if(debug_uart_ != nullptr)
 					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring pairing ACK message, already connecting"));
+						debug_uart_->print(F("\n\rPairing ACK doesn't match"));
 					}
 				}
-				else if(m2mDirect.state == m2mDirectState::connected)
+			}
+			else if(state == m2mDirectState::connecting)
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->print(F("\n\rIgnoring pairing ACK message, already connecting"));
+				}
+			}
+			else if(state == m2mDirectState::connected)
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->print(F("\n\rIgnoring pairing ACK message, already connected"));
+				}
+			}
+			else
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->print(F("\n\rIgnoring pairing ACK message, unexpected state"));
+				}
+			}
+		}
+		else if(receivedMessage[0] == M2M_DIRECT_KEEPALIVE_FLAG)
+		{
+			if(receivedMessageLength < MINIMUM_MESSAGE_SIZE + 4)	//Keepalives are padded to the minimum size, the fields below reach well into it
+			{
+				_statistics.unknownMessageTypes++;
+				return;
+			}
+			//Extract the local/remote activity timers for echo quality calculations
+			uint32_t receivedTime = millis();
+			//Assemble the timers locally then store each in one go, housekeeping reads them concurrently
+			uint32_t remoteActivityTimer = uint32_t(receivedMessage[14]) << 24;
+			remoteActivityTimer+=uint32_t(receivedMessage[15]) << 16;
+			remoteActivityTimer+=uint32_t(receivedMessage[16]) << 8;
+			remoteActivityTimer+=receivedMessage[17];
+			uint32_t echoedLocalActivityTimer = uint32_t(receivedMessage[18]) << 24;
+			echoedLocalActivityTimer+=uint32_t(receivedMessage[19]) << 16;
+			echoedLocalActivityTimer+=uint32_t(receivedMessage[20]) << 8;
+			echoedLocalActivityTimer+=receivedMessage[21];
+			_remoteActivityTimer = remoteActivityTimer;
+			receivedLocalActivityTimer = echoedLocalActivityTimer;
+			//Reduce echo quality
+			_reduceEchoQuality();
+			if(state == m2mDirectState::pairing) //Getting here implies pairing failed
+			{
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->print(F("\n\rPairing failed"));
+				}
+			}
+			//Normal state of affairs. Start connecting with keepalives, which don't include keys
+			else if(state == m2mDirectState::paired)
+			{
+				if(
+					//Match the expected communication channel
+					receivedMessage[1] == _communicationChannel &&
+					//Matches the remote MAC address
+					memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the local MAC address
+					memcmp(&receivedMessage[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0
+				)
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					if(debug_uart_ != nullptr)
+					{
+						debug_uart_->print(F("\n\rPaired, connecting"));
+					}
+					if(receivedMessage[37] & M2M_DIRECT_LINK_REPORT_HANDSHAKE)
+					{
+						_handshakeReplyDue = true;	//Answer at once rather than after a keepalive interval
+					}
+					state = m2mDirectState::connecting;
+					_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
+					if(debug_uart_ != nullptr)
 					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring pairing ACK message, already connected"));
+						_debugState();
 					}
 				}
 				else
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					if(debug_uart_ != nullptr)
 					{
-						m2mDirect.debug_uart_->print(F("\n\rIgnoring pairing ACK message, unexpected state"));
+						debug_uart_->print(F(" unexpected contents"));
 					}
 				}
 			}
-			else if(receivedMessage[0] == M2M_DIRECT_KEEPALIVE_FLAG)
-			{
-				//Extract the local/remote activity timers for echo quality calculations
-				m2mDirect._remoteActivityTimer  =	receivedMessage[14] << 24;
-				m2mDirect._remoteActivityTimer+=receivedMessage[15] << 16;
-				m2mDirect._remoteActivityTimer+=receivedMessage[16] << 8;
-				m2mDirect._remoteActivityTimer+=receivedMessage[17];
-				m2mDirect.receivedLocalActivityTimer = receivedMessage[18] << 24;
-				m2mDirect.receivedLocalActivityTimer+=receivedMessage[19] << 16;
-				m2mDirect.receivedLocalActivityTimer+=receivedMessage[20] << 8;
-				m2mDirect.receivedLocalActivityTimer+=receivedMessage[21];
-				//Reduce echo quality
-				m2mDirect._echoQuality = m2mDirect._echoQuality >> 1;
-				if(m2mDirect.state == m2mDirectState::pairing) //Getting here implies pairing failed
+			else if(state == m2mDirectState::connecting || state == m2mDirectState::connected || state == m2mDirectState::disconnected)
+			{
+				if(
+					//Match the expected communication channel
+					receivedMessage[1] == _communicationChannel &&
+					//Matches the remote MAC address
+					memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+					//Matches the local MAC address
+					memcmp(&receivedMessage[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0
+				)
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					_statistics.keepalivesReceived++;
+					_keepaliveReceived = true;	//Confirms the channel after a migration or hunt
+					//Receive quality from the keepalive sequence number, older versions always send zero which counts as in sequence
+					uint8_t sequenceGap = receivedMessage[40] - _lastReceivedSequence;
+					_lastReceivedSequence = receivedMessage[40];
+					if(sequenceGap == 0)
 					{
-						m2mDirect.debug_uart_->print(F("\n\rPairing failed"));
+						sequenceGap = 1;
 					}
-				}
-				//Normal state of affairs. Start connecting with keepalives, which don't include keys
-				else if(m2mDirect.state == m2mDirectState::paired)
-				{
-					if(
-						//Match the expected communication channel
-						receivedMessage[1] == m2mDirect._communicationChannel &&
-						//Matches the remote MAC address
-						memcmp(&receivedMessage[2], m2mDirect._remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the local MAC address
-						memcmp(&receivedMessage[8], m2mDirect._localMacAddress, MAC_ADDRESS_LENGTH) == 0
-					)
+					_receiveQuality = sequenceGap >= 32 ? 0x80000000 : (_receiveQuality >> sequenceGap) | 0x80000000;
+					//Tx power and link report from the peer
+					_remoteTxPower = int8_t(receivedMessage[23]);
+					if(receivedMessage[37] & M2M_DIRECT_LINK_REPORT_VALID)
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
-						{
-							m2mDirect.debug_uart_->print(F("\n\rPaired, connecting"));
-						}
-						m2mDirect.state = m2mDirectState::connecting;
-						m2mDirect._indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_CONNECTING_INTERVAL;
-						if(m2mDirect.debug_uart_ != nullptr)
-						{
-							m2mDirect._debugState();
-						}
+						_remoteLinkReport = uint32_t(receivedMessage[37]) << 16 | uint32_t(receivedMessage[38]) << 8 | receivedMessage[39];
+					}
+					#if defined(ESP32)
+					_remoteLongRange = (receivedMessage[37] & M2M_DIRECT_LINK_REPORT_LONG_RANGE) != 0;
+					#endif
+					_remoteFec = (receivedMessage[37] & M2M_DIRECT_LINK_REPORT_FEC) != 0;
+					if(receivedMessage[37] & M2M_DIRECT_LINK_REPORT_HANDSHAKE)
+					{
+						_handshakeReplyDue = true;	//The peer is waiting on this device to complete its handshake
+					}
+					//Wake schedule the peer would like, period and window packed so they change together
+					if(receivedMessage[41] & M2M_DIRECT_POWER_SAVE_REQUESTED)
+					{
+						_remoteWakeSchedule = uint32_t(receivedMessage[42]) << 24 | uint32_t(receivedMessage[43]) << 16 | uint32_t(receivedMessage[44]) << 8 | receivedMessage[45];
 					}
 					else
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
+						_remoteWakeSchedule = 0;
+					}
+					//A hub polling this device, slot and cycle length packed so they change together
+					if(receivedMessage[37] & M2M_DIRECT_LINK_REPORT_POLL)
+					{
+						_pollSchedule = uint32_t(receivedMessage[46]) << 24 | uint32_t(receivedMessage[47]) << 16 | uint32_t(receivedMessage[48]) << 8 | receivedMessage[49];
+						_lastPollTime = receivedTime;
+						_pollDue = true;
+					}
+					//Clock synchronisation, older versions of the library leave these bytes as zero padding
+					uint32_t remoteTransmitTime = uint32_t(receivedMessage[25]) << 24 | uint32_t(receivedMessage[26]) << 16 | uint32_t(receivedMessage[27]) << 8 | receivedMessage[28];
+					uint32_t echoedTransmitTime = uint32_t(receivedMessage[29]) << 24 | uint32_t(receivedMessage[30]) << 16 | uint32_t(receivedMessage[31]) << 8 | receivedMessage[32];
+					uint32_t holdTime = uint32_t(receivedMessage[33]) << 24 | uint32_t(receivedMessage[34]) << 16 | uint32_t(receivedMessage[35]) << 8 | receivedMessage[36];
+					if(remoteTransmitTime != 0)
+					{
+						uint32_t sequence = _clockSequence.load(std::memory_order_relaxed);	//Echoed back in the next keepalive, published with the sequence lock so the two times change together
+						_clockSequence.store(sequence + 1, std::memory_order_relaxed);
+						std::atomic_thread_fence(std::memory_order_release);
+						_remoteTransmitTime = remoteTransmitTime;
+						_remoteTransmitReceived = receivedTime;
+						_clockSequence.store(sequence + 2, std::memory_order_release);
+						if(echoedTransmitTime != 0 && holdTime != 0xffffffff)
 						{
-							m2mDirect.debug_uart_->print(F(" unexpected contents"));
+							_addClockSample(echoedTransmitTime, holdTime, remoteTransmitTime, receivedTime);
 						}
 					}
-				}
-				else if(m2mDirect.state == m2mDirectState::connecting || m2mDirect.state == m2mDirectState::connected || m2mDirect.state == m2mDirectState::disconnected)
-				{
-					if(
-						//Match the expected communication channel
-						receivedMessage[1] == m2mDirect._communicationChannel &&
-						//Matches the remote MAC address
-						memcmp(&receivedMessage[2], m2mDirect._remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
-						//Matches the local MAC address
-						memcmp(&receivedMessage[8], m2mDirect._localMacAddress, MAC_ADDRESS_LENGTH) == 0
-					)
+					uint32_t previousLocalActivityTimer = _previouslocalActivityTimer.load();	//Read once, housekeeping may move it on
+					if(echoedLocalActivityTimer == previousLocalActivityTimer)
 					{
-						if(m2mDirect.receivedLocalActivityTimer == m2mDirect._previouslocalActivityTimer)
+						_echoQuality.fetch_or(0x80000000); //Improve echo quality
+						if(echoedLocalActivityTimer != 0 && state != m2mDirectState::connected)
 						{
-							m2mDirect._echoQuality = m2mDirect._echoQuality | 0x80000000; //Improve echo quality
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F(" in sequence"));
-							}
+							_handshakeVerified = true;	//One verified round trip, housekeeping declares the link up
 						}
-						else
+						if(debug_uart_ != nullptr)
 						{
-							if(m2mDirect.debug_uart_ != nullptr)
-							{
-								m2mDirect.debug_uart_->print(F(" some missed, off by "));
-								m2mDirect.debug_uart_->print(m2mDirect._previouslocalActivityTimer - m2mDirect.receivedLocalActivityTimer);
-								m2mDirect.debug_uart_->print(F("ms"));
-							}
+							debug_uart_->print(F(" in sequence"));
 						}
 					}
 					else
 					{
-						if(m2mDirect.debug_uart_ != nullptr)
+						if(debug_uart_ != nullptr)
 						{
-							m2mDirect.debug_uart_->print(F(" unexpected contents"));
+							debug_uart_->print(F(" some missed, off by "));
+							debug_uart_->print(previousLocalActivityTimer - echoedLocalActivityTimer);
+							debug_uart_->print(F("ms"));
 						}
 					}
 				}
 				else
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
+					if(debug_uart_ != nullptr)
 					{
-						m2mDirect.debug_uart_->print(F(" unexpected in state "));
-						m2mDirect._printCurrentState();
+						debug_uart_->print(F(" unexpected contents"));
 					}
 				}
 			}
-			else if(receivedMessage[0] == M2M_DIRECT_DATA_FLAG)
+			else
 			{
-				if(m2mDirect._receivedPacketBuffer[1] == 0)
+				if(debug_uart_ != nullptr)
 				{
-					memcpy(m2mDirect._receivedPacketBuffer, receivedMessage, receivedMessageLength);
-					m2mDirect._dataReceived = true;
-					if(m2mDirect.debug_uart_ != nullptr)
-					{
-						m2mDirect.debug_uart_->printf_P(PSTR(" %u fields"),m2mDirect._receivedPacketBuffer[1]);
-					}
+					debug_uart_->print(F(" unexpected in state "));
+					_printCurrentState();
+				}
+			}
+		}
+		else if(receivedMessage[0] == M2M_DIRECT_CHANNEL_CHANGE_FLAG || receivedMessage[0] == M2M_DIRECT_CHANNEL_CHANGE_ACK_FLAG)
+		{
+			if(
+				(state == m2mDirectState::connecting || state == m2mDirectState::connected || state == m2mDirectState::disconnected) &&
+				//Matches the remote MAC address
+				memcmp(&receivedMessage[2], _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+				//Matches the local MAC address
+				memcmp(&receivedMessage[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0 &&
+				//Is a usable channel
+				receivedMessage[14] >= 1 && receivedMessage[14] <= M2M_DIRECT_MAXIMUM_CHANNEL
+			)
+			{
+				//Housekeeping acts on these, the callback only hands them over
+				if(receivedMessage[0] == M2M_DIRECT_CHANNEL_CHANGE_FLAG)
+				{
+					uint32_t switchDelay = uint32_t(receivedMessage[15]) << 24 | uint32_t(receivedMessage[16]) << 16 | uint32_t(receivedMessage[17]) << 8 | receivedMessage[18];
+					_receivedMigrationSwitchTime = millis() + switchDelay;
+					_receivedMigrationChannel = receivedMessage[14];
 				}
 				else
 				{
-					if(m2mDirect.debug_uart_ != nullptr)
-					{
-						m2mDirect.debug_uart_->print(F("\n\rReceived message discarded"));
-					}
+					_receivedMigrationAck = receivedMessage[14];
+				}
+				if(debug_uart_ != nullptr)
+				{
+					debug_uart_->printf_P(PSTR(" to channel %u"), receivedMessage[14]);
 				}
 			}
 			else
 			{
-				if(m2mDirect.debug_uart_ != nullptr)
+				if(debug_uart_ != nullptr)
 				{
-					m2mDirect.debug_uart_->printf_P(PSTR("\n\rUnknown message type %i"),receivedMessage[0]);
-					m2mDirect.debug_uart_->print(F("\n\rData: "));
-					for (int i = 0; i < receivedMessageLength; i++) {
-						if(receivedMessage[i] < 0x10)
-						{
-							m2mDirect.debug_uart_->print('0');
-						}
-						m2mDirect.debug_uart_->print(receivedMessage[i], HEX);
-						m2mDirect.debug_uart_->print(' ');
-					}
+					debug_uart_->print(F(" unexpected contents"));
 				}
 			}
 		}
-		#ifdef M2M_DIRECT_DEBUG_SEND
+		else if(receivedMessage[0] == M2M_DIRECT_DATA_FLAG)
+		{
+			_queueReceivedMessage(receivedMessage, receivedMessageLength, metadata);
+		}
+		else if(receivedMessage[0] == M2M_DIRECT_FEC_DATA_FLAG || receivedMessage[0] == M2M_DIRECT_FEC_PARITY_FLAG)
+		{
+			_receiveFecFrame(receivedMessage, receivedMessageLength, metadata);
+		}
 		else
 		{
-			if(m2mDirect.debug_uart_ != nullptr)
+			_statistics.unknownMessageTypes++;
+			if(debug_uart_ != nullptr)
 			{
-				m2mDirect.debug_uart_->printf_P(PSTR(" CRC:%08x "),  receivedCrc);
-				m2mDirect.debug_uart_->printf("not valid, calculated CRC %08x",crc.calc());
+				debug_uart_->printf_P(PSTR("\n\rUnknown message type %i"),receivedMessage[0]);
+				debug_uart_->print(F("\n\rData: "));
+				for (int i = 0; i < receivedMessageLength; i++) {
+					if(receivedMessage[i] < 0x10)
+					{
+						debug_uart_->print('0');
+					}
+					debug_uart_->print(receivedMessage[i], HEX);
+					debug_uart_->print(' ');
+				}
 			}
 		}
-		#endif
-	}) == ESP_OK)
-	{
-		if(debug_uart_ != nullptr)
-		{
-			m2mDirect.debug_uart_->print(F("OK"));
-		}
 	}
 	else
 	{
+		_statistics.crcFailures++;
+		#ifdef M2M_DIRECT_DEBUG_SEND
 		if(debug_uart_ != nullptr)
 		{
-			m2mDirect.debug_uart_->print(F("Failed"));
+			debug_uart_->printf_P(PSTR(" CRC:%08x "),  receivedCrc);
+			debug_uart_->printf("not valid, calculated CRC %08x",crc.calc());
 		}
-		return false;
+		#endif
 	}
-	if(debug_uart_ != nullptr)
+}
+/*
+ *
+ *	Handles the result of a send from the ESP-Now send callback, once _dispatchSendResult() has found the instance it is for
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_sendResult(const uint8_t* macAddress, bool delivered)
+{
+	if(_waitingForSendCallback.load() == true &&
+		macAddress[0] == _remoteMacAddress[0] &&
+		macAddress[1] == _remoteMacAddress[1] &&
+		macAddress[2] == _remoteMacAddress[2] &&
+		macAddress[3] == _remoteMacAddress[3] &&
+		macAddress[4] == _remoteMacAddress[4] &&
+		macAddress[5] == _remoteMacAddress[5]
+	)
 	{
-		debug_uart_->print(F("\n\rCreating send callback for communicating with ESP-Now peers: "));
+	  if(delivered == true)
+	  {
+		_waitingForSendCallback = false;
+	  }
+	  else
+	  {
+		_statistics.sendCallbackFailures++;
+	  }
 	}
-	#if defined(ESP8266)
-	if(esp_now_register_send_cb([](uint8_t* macAddress, uint8_t status) {
-	#elif defined ESP32
-	if(esp_now_register_send_cb([](const uint8_t* macAddress, esp_now_send_status_t status) {
-	#endif
-		if(m2mDirect._waitingForSendCallback == true &&
-			macAddress[0] == m2mDirect._remoteMacAddress[0] &&
-			macAddress[1] == m2mDirect._remoteMacAddress[1] &&
-			macAddress[2] == m2mDirect._remoteMacAddress[2] &&
-			macAddress[3] == m2mDirect._remoteMacAddress[3] &&
-			macAddress[4] == m2mDirect._remoteMacAddress[4] &&
-			macAddress[5] == m2mDirect._remoteMacAddress[5]
-		)
+	else
+	{
+		uint8_t peerIndex = _peerSendWaiting.load();
+		if(peerIndex != M2M_DIRECT_NO_PEER && memcmp(macAddress, _peers[peerIndex].macAddress, MAC_ADDRESS_LENGTH) == 0)
 		{
-		  if(status == ESP_OK)
-		  {
-			m2mDirect._waitingForSendCallback = false;
-		  }
+			if(delivered == true)
+			{
+				_peerSendWaiting = M2M_DIRECT_NO_PEER;
+			}
+			else
+			{
+				_statistics.sendCallbackFailures++;
+			}
 		}
-	}) == ESP_OK)
-	{
-		if(debug_uart_ != nullptr)
+	}
+}
+#if defined(M2M_DIRECT_SNIFF_METADATA)
+/*
+ *
+ *	Older ESP32 cores don't pass radio metadata to the ESP-Now receive callback. Action frames, which carry ESP-Now, are sniffed
+ *	in promiscuous mode instead. The promiscuous callback runs first in the WiFi task and the receive callback matches it up by MAC address
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_startMetadataSniffer()
+{
+	wifi_promiscuous_filter_t filter = {WIFI_PROMIS_FILTER_MASK_MGMT};
+	esp_wifi_set_promiscuous_filter(&filter);
+	esp_wifi_set_promiscuous_rx_cb([](void *buffer, wifi_promiscuous_pkt_type_t type) {
+		wifi_promiscuous_pkt_t *packet = (wifi_promiscuous_pkt_t *)buffer;
+		if(type == WIFI_PKT_MGMT && packet->payload[0] == 0xd0)	//Action frame
 		{
-			m2mDirect.debug_uart_->print(F("OK"));
+			_fillMetadata(packet->rx_ctrl, _sniffedMetadata);
+			memcpy(_sniffedMacAddress, &packet->payload[10], MAC_ADDRESS_LENGTH);	//Transmitter address
 		}
+	});
+	esp_wifi_set_promiscuous(true);
+}
+#endif
+#if defined(ESP32)
+/*
+ *
+ *	Copies the radio metadata out of the receive control header
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_fillMetadata(const wifi_pkt_rx_ctrl_t &rxControl, m2mDirectFrameMetadata &metadata)
+{
+	metadata.rssi = rxControl.rssi;
+	metadata.noiseFloor = rxControl.noise_floor;
+	metadata.rate = rxControl.rate;
+	metadata.timestamp = rxControl.timestamp;
+}
+#endif
+/*
+ *
+ *	Aggregates the metadata of a frame from the peer into the statistics and the RSSI reported back to the peer for Tx power control
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_recordMetadata(const m2mDirectFrameMetadata &metadata)
+{
+	int8_t receivedRssi = _receivedRssi;
+	_receivedRssi = receivedRssi == M2M_DIRECT_RSSI_UNKNOWN ? metadata.rssi : int8_t((receivedRssi * 3 + metadata.rssi) / 4);
+	if(_statistics.framesWithMetadata == 0 || _signalStatisticsResetDue == true)
+	{
+		_signalStatisticsResetDue = false;
+		_statistics.rssiAverage = metadata.rssi;
+		_statistics.rssiMinimum = metadata.rssi;
+		_statistics.rssiMaximum = metadata.rssi;
+		_statistics.noiseFloorAverage = metadata.noiseFloor;
 	}
 	else
 	{
-		if(debug_uart_ != nullptr)
-		{
-			m2mDirect.debug_uart_->print(F("Failed"));
-		}
-		return false;
+		_statistics.rssiAverage = (_statistics.rssiAverage * 3 + metadata.rssi) / 4;
+		_statistics.rssiMinimum = metadata.rssi < _statistics.rssiMinimum ? metadata.rssi : _statistics.rssiMinimum;
+		_statistics.rssiMaximum = metadata.rssi > _statistics.rssiMaximum ? metadata.rssi : _statistics.rssiMaximum;
+		_statistics.noiseFloorAverage = (_statistics.noiseFloorAverage * 3 + metadata.noiseFloor) / 4;
 	}
-	return true;
+	_statistics.framesWithMetadata++;
 }
 /*
  *
@@ -1823,7 +3465,7 @@ void ICACHE_FLASH_ATTR m2mDirectClass::_createPairingMessage()
 		if(_encyptionEnabled == true)
 		{
 			debug_uart_->printf_P(PSTR("\n\rCreated pairing message with channel:%d\r\n\tlocal MAC address:%02x%02x%02x%02x%02x%02x\r\n\tGlobal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\r\n\tLocal encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\r\n\tCRC:%02x%02x%02x%02x"),
-				_communicationChannel,
+				_communicationChannel.load(),
 				_localMacAddress[0],
 				_localMacAddress[1],
 				_localMacAddress[2],
@@ -1869,7 +3511,7 @@ void ICACHE_FLASH_ATTR m2mDirectClass::_createPairingMessage()
 				);
 		} else {
 			debug_uart_->printf_P(PSTR("\n\rCreated pairing message with channel:%d local MAC address:%02x%02x%02x%02x%02x%02x, CRC:%02x%02x%02x%02x"),
-				_communicationChannel,
+				_communicationChannel.load(),
 				_localMacAddress[0],
 				_localMacAddress[1],
 				_localMacAddress[2],
@@ -2022,13 +3664,48 @@ void ICACHE_FLASH_ATTR m2mDirectClass::_createKeepaliveMessage()
 	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_localActivityTimer & 0x0000ff00) >> 8;
 	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_localActivityTimer & 0x000000ff);
 	//Add last remote timestamp
-	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_remoteActivityTimer & 0xff000000) >> 24;
-	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_remoteActivityTimer & 0x00ff0000) >> 16;
-	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_remoteActivityTimer & 0x0000ff00) >> 8;
-	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_remoteActivityTimer & 0x000000ff);
+	uint32_t remoteActivityTimer = _remoteActivityTimer;	//Read once, the receive callback may update it
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x000000ff);
 	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _minTxPower;
 	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _currentTxPower;
 	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _maxTxPower;
+	//Add clock synchronisation timestamps, transmit time, the remote's last transmit time and how long ago it arrived
+	uint32_t transmitTime = millis();
+	uint32_t remoteTransmitTime;
+	uint32_t remoteTransmitReceived;
+	_remoteTransmitSnapshot(remoteTransmitTime, remoteTransmitReceived);
+	uint32_t holdTime = remoteTransmitTime == 0 ? 0xffffffff : transmitTime - remoteTransmitReceived;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (transmitTime & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (transmitTime & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (transmitTime & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (transmitTime & 0x000000ff);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteTransmitTime & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteTransmitTime & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteTransmitTime & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteTransmitTime & 0x000000ff);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (holdTime & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (holdTime & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (holdTime & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (holdTime & 0x000000ff);
+	//Add a link report, how this end sees the peer's frames, so the peer can set its Tx power
+	int8_t receivedRssi = _receivedRssi;
+	#if defined(ESP32)
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = M2M_DIRECT_LINK_REPORT_VALID | M2M_DIRECT_LINK_REPORT_FEC | (_fastHandshake == true && state != m2mDirectState::connected ? M2M_DIRECT_LINK_REPORT_HANDSHAKE : 0) | (receivedRssi != M2M_DIRECT_RSSI_UNKNOWN ? M2M_DIRECT_LINK_REPORT_RSSI_VALID : 0) | (_longRange ? M2M_DIRECT_LINK_REPORT_LONG_RANGE : 0);
+	#else
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = M2M_DIRECT_LINK_REPORT_VALID | M2M_DIRECT_LINK_REPORT_FEC | (_fastHandshake == true && state != m2mDirectState::connected ? M2M_DIRECT_LINK_REPORT_HANDSHAKE : 0) | (receivedRssi != M2M_DIRECT_RSSI_UNKNOWN ? M2M_DIRECT_LINK_REPORT_RSSI_VALID : 0);
+	#endif
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = uint8_t(receivedRssi);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _countBits(_receiveQuality);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _keepaliveSequence++;
+	//Add the wake schedule this end would like, older versions leave these bytes as zero padding
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _powerSaveEnabled == true && _radioShared() == false ? M2M_DIRECT_POWER_SAVE_REQUESTED : 0;	//Not while peers need the radio awake
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_powerSavePeriod & 0xff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_powerSavePeriod & 0x00ff);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_powerSaveWindow & 0xff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_powerSaveWindow & 0x00ff);
 	//Pad the message
 	while(_protocolPacketBufferPosition < MINIMUM_MESSAGE_SIZE)
 	{
@@ -2046,19 +3723,62 @@ void ICACHE_FLASH_ATTR m2mDirectClass::_createKeepaliveMessage()
 
 /*
  *
- *	This method sends broadcast ESP-Now messages, mostly used for pairing
+ *	This method builds a channel change proposal or ACK, with the new channel and the time until both ends switch
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_sendBroadcastPacket(uint8_t* buffer, uint8_t length)
+void ICACHE_FLASH_ATTR m2mDirectClass::_createChannelChangeMessage(uint8_t flag, uint8_t channel, uint32_t switchDelay)
 {
-	if(debug_uart_ != nullptr)
+	_protocolPacketBufferPosition = 0;
+	//Add packet flag
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = flag;
+	//Add current communication channel
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _communicationChannel;
+	//Add local MAC address
+	memcpy(&_protocolPacketBuffer[_protocolPacketBufferPosition], _localMacAddress, MAC_ADDRESS_LENGTH);
+	_protocolPacketBufferPosition+=MAC_ADDRESS_LENGTH;
+	//Add remote MAC address
+	memcpy(&_protocolPacketBuffer[_protocolPacketBufferPosition], _remoteMacAddress, MAC_ADDRESS_LENGTH);
+	_protocolPacketBufferPosition+=MAC_ADDRESS_LENGTH;
+	//Add new channel
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = channel;
+	//Add time until the switch, relative as the clocks aren't shared
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (switchDelay & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (switchDelay & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (switchDelay & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (switchDelay & 0x000000ff);
+	//Pad the message
+	while(_protocolPacketBufferPosition < MINIMUM_MESSAGE_SIZE)
 	{
-		debug_uart_->printf_P(PSTR("\n\rTX %03u bytes broadcast on channel:%d %.2fdBm "), length, _currentChannel(), (float)_currentTxPower * 0.25);
-		_printPacketDescription(_protocolPacketBuffer[0]);
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = 0x00;
 	}
-	int result = esp_now_send(_broadcastMacAddress, buffer, length);
-	if(result == ESP_OK)
-	{
+	//Add a CRC32
+	CRC32 crc;
+	crc.add((uint8_t*)_protocolPacketBuffer, _protocolPacketBufferPosition);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x000000ff);
+}
+/*
+ *
+ *	This method sends broadcast ESP-Now messages, mostly used for pairing
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sendBroadcastPacket(uint8_t* buffer, uint8_t length)
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rTX %03u bytes broadcast on channel:%d %.2fdBm "), length, _currentChannel(), (float)_currentTxPower * 0.25);
+		_printPacketDescription(buffer[0]);
+	}
+	#if defined(ESP32)
+	_applyRate(0);	//Broadcasts aren't acknowledged so always go at the most robust rate
+	#endif
+	int result = esp_now_send(_broadcastMacAddress, buffer, length);
+	_statistics.framesSent++;
+	_statistics.broadcastFramesSent++;
+	if(result == ESP_OK)
+	{
 		if(debug_uart_ != nullptr)
 		{
 			debug_uart_->print(F(" OK"));
@@ -2071,6 +3791,7 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_sendBroadcastPacket(uint8_t* buffer, uin
 		{
 			debug_uart_->print(F(" failed"));
 		}
+		_statistics.sendFailures++;
 	}
 	return false;
 }
@@ -2099,23 +3820,58 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_sendUnicastPacket(uint8_t* buffer, uint8
 		_printPacketDescription(buffer[0]);
 	}
 	#endif
+	if(_deferredSendPending == true)
+	{
+		_resolveDeferredSend(true);	//Settle the previous send before the quality bits move on
+	}
 	_waitingForSendCallback = wait;
+	#if defined(ESP32)
+	uint32_t sendQuality = _sendQuality;
+	#endif
 	_sendQuality = _sendQuality >> 1;	//Reduce signal quality
+	#if defined(ESP32)
+	uint8_t rateIndex = _chooseRate(buffer[0] == M2M_DIRECT_KEEPALIVE_FLAG && wait == true && _deferSendConfirmation == false);	//Only keepalives sample other rates, never application messages
+	#endif
 	uint32_t packetSent = millis();
 	int result = esp_now_send(_remoteMacAddress, buffer, length);
+	_statistics.framesSent++;
+	if(buffer[0] == M2M_DIRECT_KEEPALIVE_FLAG)
+	{
+		_statistics.keepalivesSent++;
+	}
 	if(result == ESP_OK)
 	{
+		if(_deferSendConfirmation == true && wait == true)
+		{
+			_sendTimer = packetSent;	//The send callback is checked on a later tick by _resolveDeferredSend()
+			_deferredSendPending = true;
+			return true;
+		}
         while(_waitingForSendCallback && millis() - packetSent < _sendTimeout)
         {
           yield();
         }
+		#if defined(ESP32)
+		if(wait == true)
+		{
+			_recordRateResult(rateIndex, _waitingForSendCallback == false);
+		}
+		if(_rateSample == true && _waitingForSendCallback == true)
+		{
+			//A lost sample only says the sampled rate is worse than the normal one, so it stays out of the send quality and keepalive interval and the keepalive goes again at the normal rate
+			_rateSample = false;
+			_waitingForSendCallback = false;
+			_sendQuality = sendQuality;
+			return _sendUnicastPacket(buffer, length, wait);
+		}
+		#endif
 		if(_waitingForSendCallback == false)
 		{
 			_sendQuality = _sendQuality | 0x80000000;  //Improve signal quality, MSB first
 			#ifdef M2M_DIRECT_DEBUG_SEND
 			if(debug_uart_ != nullptr)
 			{
-				debug_uart_->printf(" sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality, (float)_currentTxPower * 0.25);
+				debug_uart_->printf(" sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality.load(), (float)_currentTxPower * 0.25);
 			}
 			#endif
 			if(_sendQuality == 0xffffffff)
@@ -2129,24 +3885,62 @@ bool ICACHE_FLASH_ATTR m2mDirectClass::_sendUnicastPacket(uint8_t* buffer, uint8
 			#ifdef M2M_DIRECT_DEBUG_SEND
 			if(debug_uart_ != nullptr)
 			{
-				debug_uart_->printf(" timeout sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality, (float)_currentTxPower * 0.25);
+				debug_uart_->printf(" timeout sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality.load(), (float)_currentTxPower * 0.25);
 			}
 			#endif
 			_waitingForSendCallback = false;
+			_statistics.sendTimeouts++;
 		}
 	}
 	else
 	{
+		_statistics.sendFailures++;
 		#ifdef M2M_DIRECT_DEBUG_SEND
 		if(debug_uart_ != nullptr)
 		{
-			debug_uart_->printf(" failed sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality, (float)_currentTxPower * 0.25);
+			debug_uart_->printf(" failed sendQ:%08x echoQ:%08x %.2fdBm", _sendQuality, _echoQuality.load(), (float)_currentTxPower * 0.25);
 		}
 		#endif
 	}
 	_decreaseKeepaliveInterval();
 	return false;
 }
+/*
+ *
+ *	Settles send quality for a send that didn't wait for its callback. If forced, a missing callback counts as a timeout
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_resolveDeferredSend(bool force)
+{
+	if(_waitingForSendCallback == false)
+	{
+		_deferredSendPending = false;
+		_sendQuality = _sendQuality | 0x80000000;  //Improve signal quality, MSB first
+		if(_sendQuality == 0xffffffff)
+		{
+			_increaseKeepaliveInterval();
+		}
+	}
+	else if(force == true || millis() - _sendTimer > _sendTimeout)
+	{
+		_deferredSendPending = false;
+		_waitingForSendCallback = false;
+		_statistics.sendTimeouts++;
+		_decreaseKeepaliveInterval();
+	}
+}
+/*
+ *
+ *	Shifts the echo quality down one place. This is done from both the receive callback and housekeeping so must not lose an update
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_reduceEchoQuality()
+{
+	uint32_t echoQuality = _echoQuality.load();
+	while(_echoQuality.compare_exchange_weak(echoQuality, echoQuality >> 1) == false)
+	{
+	}
+}
 /*
  *
  *	Returns the number of 1 bits in an uint32_t, used in measuring link quality
@@ -2186,6 +3980,30 @@ void ICACHE_FLASH_ATTR m2mDirectClass::_printPacketDescription(uint8_t type)
 		{
 			debug_uart_->print(F("APPLICATION"));
 		}
+		else if(type == M2M_DIRECT_CHANNEL_CHANGE_FLAG)
+		{
+			debug_uart_->print(F("CHANNEL CHG"));
+		}
+		else if(type == M2M_DIRECT_CHANNEL_CHANGE_ACK_FLAG)
+		{
+			debug_uart_->print(F("CHANNEL ACK"));
+		}
+		else if(type == M2M_DIRECT_FEC_DATA_FLAG)
+		{
+			debug_uart_->print(F("APP FEC    "));
+		}
+		else if(type == M2M_DIRECT_FEC_PARITY_FLAG)
+		{
+			debug_uart_->print(F("FEC PARITY "));
+		}
+		else if(type == M2M_DIRECT_BROADCAST_FLAG)
+		{
+			debug_uart_->print(F("BROADCAST  "));
+		}
+		else if(type == M2M_DIRECT_RELAY_FLAG)
+		{
+			debug_uart_->print(F("RELAYED    "));
+		}
 	}
 }
 void ICACHE_FLASH_ATTR m2mDirectClass::_debugState()
@@ -2298,6 +4116,15 @@ m2mDirectClass& m2mDirectClass::setMessageReceivedCallback(std::function<void()>
     this->messageReceivedCallback = function;
     return *this;
 }
+/*
+ *
+ *	This sets the callback function for when a device in the peer table connects or disconnects, peerInfo() says which
+ *
+ */
+m2mDirectClass& m2mDirectClass::setPeerStateChangedCallback(std::function<void()> function) {
+    this->peerStateChangedCallback = function;
+    return *this;
+}
 /*
  *
  *	This returns the link quality heuristic. Higher is better
@@ -2309,816 +4136,3725 @@ uint32_t ICACHE_FLASH_ATTR m2mDirectClass::linkQuality()
 }
 /*
  *
- *	Simple boolean measure of being connected
+ *	Returns a snapshot of the link counters, so the application can compute rates between two snapshots
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::connected()
+m2mDirectStatistics ICACHE_FLASH_ATTR m2mDirectClass::statistics()
 {
-	return state == m2mDirectState::connected;
+	m2mDirectStatistics snapshot = _statisticsSnapshot();
+	const m2mDirectStatistics &baseline = _statisticsBaseline;
+	snapshot.since = baseline.since;
+	snapshot.framesSent -= baseline.framesSent;
+	snapshot.broadcastFramesSent -= baseline.broadcastFramesSent;
+	snapshot.sendFailures -= baseline.sendFailures;
+	snapshot.sendCallbackFailures -= baseline.sendCallbackFailures;
+	snapshot.sendTimeouts -= baseline.sendTimeouts;
+	snapshot.keepalivesSent -= baseline.keepalivesSent;
+	snapshot.dataMessagesSent -= baseline.dataMessagesSent;
+	snapshot.framesReceived -= baseline.framesReceived;
+	snapshot.crcFailures -= baseline.crcFailures;
+	snapshot.keepalivesReceived -= baseline.keepalivesReceived;
+	snapshot.dataMessagesReceived -= baseline.dataMessagesReceived;
+	snapshot.receivedMessagesDiscarded -= baseline.receivedMessagesDiscarded;
+	snapshot.unknownMessageTypes -= baseline.unknownMessageTypes;
+	snapshot.txPowerChanges -= baseline.txPowerChanges;
+	snapshot.disconnections -= baseline.disconnections;
+	snapshot.channelMigrations -= baseline.channelMigrations;
+	snapshot.channelMigrationsAbandoned -= baseline.channelMigrationsAbandoned;
+	snapshot.channelHunts -= baseline.channelHunts;
+	snapshot.eventsCoalesced -= baseline.eventsCoalesced;
+	snapshot.eventsDropped -= baseline.eventsDropped;
+	snapshot.queuedMessagesDropped -= baseline.queuedMessagesDropped;
+	snapshot.fecParityFramesSent -= baseline.fecParityFramesSent;
+	snapshot.fecMessagesRecovered -= baseline.fecMessagesRecovered;
+	snapshot.fecBlocksUnrecoverable -= baseline.fecBlocksUnrecoverable;
+	snapshot.wakeWindows -= baseline.wakeWindows;
+	snapshot.radioSleepTime -= baseline.radioSleepTime;
+	snapshot.recordsSaved -= baseline.recordsSaved;
+	snapshot.storeErases -= baseline.storeErases;
+	snapshot.broadcastMessagesSent -= baseline.broadcastMessagesSent;
+	snapshot.broadcastMessagesReceived -= baseline.broadcastMessagesReceived;
+	snapshot.broadcastMessagesLost -= baseline.broadcastMessagesLost;
+	snapshot.broadcastDuplicates -= baseline.broadcastDuplicates;
+	snapshot.broadcastMessagesFiltered -= baseline.broadcastMessagesFiltered;
+	snapshot.broadcastAuthenticationFailures -= baseline.broadcastAuthenticationFailures;
+	snapshot.broadcastSourcesRefused -= baseline.broadcastSourcesRefused;
+	snapshot.relayedMessagesReceived -= baseline.relayedMessagesReceived;
+	snapshot.relayFramesSent -= baseline.relayFramesSent;
+	snapshot.relaySendFailures -= baseline.relaySendFailures;
+	snapshot.relayFramesForwarded -= baseline.relayFramesForwarded;
+	snapshot.relayDuplicates -= baseline.relayDuplicates;
+	snapshot.relayHopLimitDrops -= baseline.relayHopLimitDrops;
+	snapshot.framesWithMetadata -= baseline.framesWithMetadata;
+	if(snapshot.relayFramesSent == 0)	//The latency figures restart with the first relayed frame after a reset
+	{
+		snapshot.relayHopLatency = 0;
+		snapshot.relayHopLatencyMaximum = 0;
+	}
+	if(snapshot.framesWithMetadata == 0)	//As do the signal figures with the first frame with metadata
+	{
+		snapshot.rssiAverage = M2M_DIRECT_RSSI_UNKNOWN;
+		snapshot.rssiMinimum = M2M_DIRECT_RSSI_UNKNOWN;
+		snapshot.rssiMaximum = M2M_DIRECT_RSSI_UNKNOWN;
+		snapshot.noiseFloorAverage = M2M_DIRECT_RSSI_UNKNOWN;
+	}
+	return snapshot;
 }
 /*
  *
- *	Sends the message, after data has been added. Parameter 'wait' is used to specify if it should wait for confirmation
- *	It should be noted confirmation is not guarantee of delivery, but failure is guarantee of failure
+ *	The counters are written from housekeeping and the WiFi task while this copies them, so it copies until two copies in a row agree
+ *	Each counter is a single aligned word so can't tear, this stops the snapshot mixing counters from before and after a frame
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::sendMessage(bool wait)
+m2mDirectStatistics ICACHE_FLASH_ATTR m2mDirectClass::_statisticsSnapshot()
 {
-	CRC32 crc;
-	_applicationPacketBuffer[0] = M2M_DIRECT_DATA_FLAG;	//Make sure this is set as a data packet
-	while(_applicationBufferPosition < MINIMUM_MESSAGE_SIZE)
-	{
-		_applicationPacketBuffer[_applicationBufferPosition++] = 0xff;
-	}
-	crc.add((uint8_t*)_applicationPacketBuffer, _applicationBufferPosition);	//Calculate the CRC
-	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0xff000000) >> 24;	//Add the CRC
-	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
-	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
-	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x000000ff);
-	if(state == m2mDirectState::connected && _sendUnicastPacket(_applicationPacketBuffer, _applicationBufferPosition, wait))
-	{
-		_applicationBufferPosition = 2;		//Reset the buffer position for the next message
-		_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
-		//_advanceTimers();	//Advance the timers for keepalives
-		return true;
-	}
-	else
-	{
-		_applicationBufferPosition = 2;		//Reset the buffer position for the next message
-		_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+	m2mDirectStatistics previous;
+	m2mDirectStatistics snapshot = _statistics;
+	for(uint8_t attempt = 0; attempt < M2M_DIRECT_STATISTICS_SNAPSHOT_ATTEMPTS; attempt++)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);	//Stop the compiler reusing the first copy
+		previous = snapshot;
+		snapshot = _statistics;
+		if(memcmp(&previous, &snapshot, sizeof(m2mDirectStatistics)) == 0)
+		{
+			break;
+		}
 	}
-	//_advanceTimers();	//Advance the timers for keepalives
-	return false;
+	return snapshot;
 }
 /*
  *
- *	Clears any received message so another can be received. There is only one incoming packet buffer!
+ *	Returns millis() when the link first reached connected after boot, which is also the boot to connected time, or 0 if it hasn't yet
  *
  */
-void ICACHE_FLASH_ATTR m2mDirectClass::clearReceivedMessage()
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::bootToConnectedTime()
 {
-	_receivedPacketBuffer[1] = 0;		//Reset the field count for the next message
-	_receivedPacketBufferPosition = 2;	//Reset the buffer position for the next message
-	if(m2mDirect.debug_uart_ != nullptr)
-	{
-		m2mDirect.debug_uart_->print(F("\n\rReceived message cleared"));
-	}
+	return _firstConnectedTime;
 }
 /*
  *
- *	Returns the current 2.4Ghz channel
+ *	Enables or disables fast pairing, where pairing messages go in random bursts and ACKs follow quickly, rather than every pairing interval
  *
  */
-uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_currentChannel()
+void ICACHE_FLASH_ATTR m2mDirectClass::fastPairing(bool enabled)
 {
-	#if defined(ESP8266)
-	uint8_t currentChannel = wifi_get_channel();
-	#elif defined ESP32
-	//uint8_t currentChannel = 0;
-	//uint8_t secondaryChannel = 0;
-	//esp_wifi_get_channel(&currentChannel, &secondaryChannel);
-	uint8_t currentChannel = WiFi.channel();
-	#endif
-	return currentChannel;
+	_fastPairing = enabled;
 }
 /*
  *
- *	Returns the number of fields are there left in the message
+ *	Returns the time from pairing starting to the link connecting, for the last pairing, or 0 if there hasn't been one since boot
  *
  */
-uint8_t ICACHE_FLASH_ATTR m2mDirectClass::dataAvailable()
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::timeToPair()
 {
-	return _receivedPacketBuffer[1];
+	return _timeToPair;
 }
 /*
  *
- *	Returns the 'type' of the next field
+ *	Enables or disables the fast handshake, where the link comes up after one verified round trip of keepalives rather than a run of good ones
  *
  */
-uint8_t ICACHE_FLASH_ATTR m2mDirectClass::nextDataType()
+void ICACHE_FLASH_ATTR m2mDirectClass::fastHandshake(bool enabled)
 {
-	if(_receivedPacketBuffer[1] == 0)
-	{
-		return DATA_UNAVAILABLE;
-	}
-	if(_receivedPacketBuffer[_receivedPacketBufferPosition] == DATA_BOOL_TRUE)	//Handles the case of a single bool true
-	{
-		return DATA_BOOL;
-	}
-	return (_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x8f);	//Strip out any array size before returning it
+	_fastHandshake = enabled;
 }
 /*
  *
- *	Returns the 'length' of the next field for strings and arrays
+ *	Returns how long the last reconnection took, from disconnected to connected, or 0 if the link hasn't reconnected since boot
  *
  */
-uint8_t ICACHE_FLASH_ATTR m2mDirectClass::nextDataLength()
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::reconnectTime()
 {
-	if(_receivedPacketBuffer[1] == 0 || ((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x80) == 0 && _receivedPacketBuffer[_receivedPacketBufferPosition] != 0x0d))
-	{
-		return 0;
-	}
-	return _receivedPacketBuffer[_receivedPacketBufferPosition+1];
+	return _reconnectTime;
 }
 /*
  *
- *	Skip the next field
+ *	Zeroes the link counters and records when this happened. The live counters are never written here, as the WiFi task could be part way through incrementing one
+ *	Instead their values now become the baseline statistics() subtracts, and the contexts that keep the smoothed figures are asked to restart them
  *
  */
-void ICACHE_FLASH_ATTR m2mDirectClass::skipReceivedData()
+void ICACHE_FLASH_ATTR m2mDirectClass::resetStatistics()
 {
-	if(_receivedPacketBuffer[1] == 0)
-	{
-		return;
-	}
-	_receivedPacketBuffer[1]--;	//Mark the field as retrieved
-	if(_receivedPacketBuffer[1] == 0)
-	{
-		_receivedPacketBufferPosition = 2;		//Reset the buffer position for the next message
-	}
-	else
-	{
-		switch (_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x0f)
-		{
-			case DATA_BOOL:
-				_receivedPacketBufferPosition++;
-			break;
-			case DATA_BOOL_TRUE:
-				_receivedPacketBufferPosition++;
-			break;
-			case DATA_UINT8_T:
-				_receivedPacketBufferPosition+=sizeof(uint8_t)+1;
-			break;
-			case DATA_UINT16_T:
-				_receivedPacketBufferPosition+=sizeof(uint16_t)+1;
-			break;
-			case DATA_UINT32_T:
-				_receivedPacketBufferPosition+=sizeof(uint32_t)+1;
-			break;
-			case DATA_UINT64_T:
-				_receivedPacketBufferPosition+=sizeof(uint64_t)+1;
-			break;
-			case DATA_INT8_T:
-				_receivedPacketBufferPosition+=sizeof(int8_t)+1;
-			break;
-			case DATA_INT16_T:
-				_receivedPacketBufferPosition+=sizeof(int16_t)+1;
-			break;
-			case DATA_INT32_T:
-				_receivedPacketBufferPosition+=sizeof(int32_t)+1;
-			break;
-			case DATA_INT64_T:
-				_receivedPacketBufferPosition+=sizeof(int64_t)+1;
-			break;
-			case DATA_FLOAT:
-				_receivedPacketBufferPosition+=sizeof(float)+1;
-			break;
-			case DATA_DOUBLE:
-				_receivedPacketBufferPosition+=sizeof(double)+1;
-			break;
-			case DATA_CHAR:
-				_receivedPacketBufferPosition+=sizeof(char)+1;
-			break;
-			case DATA_STR:
-				//if((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) == 0)	//Medium char array, length in next byte
-				{
-					_receivedPacketBufferPosition+=_receivedPacketBuffer[_receivedPacketBufferPosition+1]+1;
-				}
-				/*
-				else if((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) < M2M_DIRECT_SMALL_ARRAY_LIMIT + 1)	//Short char array, length in type field
-				{
-					_receivedPacketBufferPosition+=((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) >> 4);	//Allows for zero length strings
-				}
-				*/
-			break;
-			case DATA_CUSTOM:
-				_receivedPacketBufferPosition+=_receivedPacketBuffer[_receivedPacketBufferPosition];
-			break;
-		}
-	}
+	m2mDirectStatistics baseline = _statisticsSnapshot();
+	baseline.since = millis();
+	_statisticsBaseline = baseline;
+	_signalStatisticsResetDue = true;
+	_relayLatencyResetDue = true;
 }
 /*
  *
- *	Prints the 'type' for a field label in debugging
+ *	Adds an NTP style clock sample from a keepalive. Times are local except the remote transmit time
+ *	The offset is remote minus local, the error of a sample is half its round trip
  *
  */
-void ICACHE_FLASH_ATTR m2mDirectClass::_dataTypeDescription(uint8_t type)
+void ICACHE_FLASH_ATTR m2mDirectClass::_addClockSample(uint32_t echoedTransmitTime, uint32_t holdTime, uint32_t remoteTransmitTime, uint32_t receivedTime)
 {
-	if(type == DATA_UNAVAILABLE)
+	int32_t roundTrip = int32_t(receivedTime - echoedTransmitTime - holdTime);
+	if(roundTrip < 0 || roundTrip > M2M_DIRECT_CLOCK_MAXIMUM_ROUND_TRIP)
 	{
-		debug_uart_->print(F("UNAVAILABLE"));
+		return;	//Stale or mismatched echo
 	}
-	else if(type == DATA_BOOL || type == DATA_BOOL_TRUE)
+	int32_t outbound = int32_t(remoteTransmitTime - holdTime - echoedTransmitTime);
+	int32_t inbound = int32_t(remoteTransmitTime - receivedTime);
+	int32_t offset = int32_t((int64_t(outbound) + inbound) / 2);
+	m2mDirectClockEstimate estimate = _clockEstimate;
+	if(estimate.synchronised == true && abs(int32_t(offset - estimate.offset)) > M2M_DIRECT_CLOCK_MAXIMUM_ROUND_TRIP)
 	{
-		debug_uart_->print(F("BOOL"));
+		//The remote device has probably restarted, start again
+		_clockSampleCount = 0;
+		_clockSampleIndex = 0;
+		estimate = m2mDirectClockEstimate();
 	}
-	else if(type == DATA_UINT8_T)
+	_clockSamples[_clockSampleIndex].offset = offset;
+	_clockSamples[_clockSampleIndex].time = receivedTime;
+	_clockSamples[_clockSampleIndex].roundTrip = roundTrip;
+	_clockSampleIndex = (_clockSampleIndex + 1) % M2M_DIRECT_CLOCK_SAMPLES;
+	if(_clockSampleCount < M2M_DIRECT_CLOCK_SAMPLES)
 	{
-		debug_uart_->print(F("UINT8_T"));
+		_clockSampleCount++;
 	}
-	else if(type == DATA_UINT16_T)
+	//Use the sample with the shortest round trip in the window, it has the least queueing delay
+	uint8_t best = 0;
+	for(uint8_t index = 1; index < _clockSampleCount; index++)
 	{
-		debug_uart_->print(F("UINT16_T"));
+		if(_clockSamples[index].roundTrip < _clockSamples[best].roundTrip)
+		{
+			best = index;
+		}
 	}
-	else if(type == DATA_UINT32_T)
+	estimate.offset = _clockSamples[best].offset;
+	estimate.reference = _clockSamples[best].time;
+	estimate.roundTrip = _clockSamples[best].roundTrip;
+	if(estimate.synchronised == false)
 	{
-		debug_uart_->print(F("UINT32_T"));
+		_clockDriftAnchor = _clockSamples[best];
 	}
-	else if(type == DATA_UINT64_T)
+	else if(estimate.reference - _clockDriftAnchor.time >= M2M_DIRECT_CLOCK_DRIFT_INTERVAL)
 	{
-		debug_uart_->print(F("UINT64_T"));
-	}
-	else if(type == DATA_INT8_T)
+		float drift = float(int32_t(estimate.offset - _clockDriftAnchor.offset)) / float(estimate.reference - _clockDriftAnchor.time);
+		if(estimate.driftValid == true)
+		{
+			estimate.drift = estimate.drift * 0.75 + drift * 0.25;
+		}
+		else
+		{
+			estimate.drift = drift;
+			estimate.driftValid = true;
+		}
+		_clockDriftAnchor = _clockSamples[best];
+	}
+	estimate.synchronised = true;
+	//Publish with a sequence lock, odd while writing, so readers in other contexts never see a torn estimate
+	uint32_t sequence = _clockSequence.load(std::memory_order_relaxed);
+	_clockSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	_clockEstimate = estimate;
+	_clockSequence.store(sequence + 2, std::memory_order_release);
+}
+/*
+ *
+ *	Takes a consistent copy of the clock estimate, retrying if the receive callback was part way through updating it
+ *
+ */
+m2mDirectClockEstimate ICACHE_FLASH_ATTR m2mDirectClass::_clockEstimateSnapshot()
+{
+	m2mDirectClockEstimate snapshot;
+	uint32_t sequence;
+	do
 	{
-		debug_uart_->print(F("INT8_t"));
+		sequence = _clockSequence.load(std::memory_order_acquire);
+		snapshot = _clockEstimate;
+		std::atomic_thread_fence(std::memory_order_acquire);
 	}
-	else if(type == DATA_INT16_T)
+	while((sequence & 1) == 1 || sequence != _clockSequence.load(std::memory_order_relaxed));
+	return snapshot;
+}
+/*
+ *
+ *	Takes a consistent copy of the remote transmit time of the last keepalive and when it arrived, as _clockEstimateSnapshot() does for the estimate
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_remoteTransmitSnapshot(uint32_t &remoteTransmitTime, uint32_t &receivedTime)
+{
+	uint32_t sequence;
+	do
 	{
-		debug_uart_->print(F("INT16_T"));
+		sequence = _clockSequence.load(std::memory_order_acquire);
+		remoteTransmitTime = _remoteTransmitTime;
+		receivedTime = _remoteTransmitReceived;
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
+	while((sequence & 1) == 1 || sequence != _clockSequence.load(std::memory_order_relaxed));
+}
+/*
+ *
+ *	Returns true once there is an estimate of the remote clock
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::clockSynchronised()
+{
+	return _clockEstimateSnapshot().synchronised;
+}
+/*
+ *
+ *	Returns the remote clock minus the local clock right now, in ms
+ *
+ */
+int32_t ICACHE_FLASH_ATTR m2mDirectClass::clockOffset()
+{
+	m2mDirectClockEstimate estimate = _clockEstimateSnapshot();
+	if(estimate.driftValid == true)
+	{
+		return estimate.offset + int32_t(estimate.drift * float(int32_t(millis() - estimate.reference)));
+	}
+	return estimate.offset;
+}
+/*
+ *
+ *	Returns the measured drift of the remote clock against the local one in parts per million, zero until measured
+ *
+ */
+float ICACHE_FLASH_ATTR m2mDirectClass::clockDrift()
+{
+	m2mDirectClockEstimate estimate = _clockEstimateSnapshot();
+	return estimate.driftValid ? estimate.drift * 1000000.0 : 0.0;
+}
+/*
+ *
+ *	Converts a millis() timestamp from the remote device to local millis(), with an error bound in ms
+ *	The bound is half the best round trip plus the drift that could have built up since it was measured
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::remoteToLocal(uint32_t remoteTime, uint32_t &localTime, uint32_t &errorBound)
+{
+	m2mDirectClockEstimate estimate = _clockEstimateSnapshot();
+	if(estimate.synchronised == false)
+	{
+		return false;
+	}
+	localTime = remoteTime - estimate.offset;
+	int32_t age = int32_t(localTime - estimate.reference);
+	if(estimate.driftValid == true)
+	{
+		localTime -= int32_t(estimate.drift * float(age));
+	}
+	uint32_t driftTolerance = estimate.driftValid ? M2M_DIRECT_CLOCK_MEASURED_DRIFT_TOLERANCE : M2M_DIRECT_CLOCK_DRIFT_TOLERANCE;
+	errorBound = estimate.roundTrip / 2 + 1 + uint32_t((uint64_t(age < 0 ? -age : age) * driftTolerance) / 1000000);	//Add 1ms for millis() resolution
+	return true;
+}
+/*
+ *
+ *	Simple boolean measure of being connected
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::connected()
+{
+	return state == m2mDirectState::connected;
+}
+/*
+ *
+ *	Sends the message, after data has been added. Parameter 'wait' is used to specify if it should wait for confirmation
+ *	It should be noted confirmation is not guarantee of delivery, but failure is guarantee of failure
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::sendMessage(bool wait)
+{
+	_finishApplicationMessage();
+	if(_holdApplicationMessage() == true)	//Hand the message to the housekeeping task/Ticker, or hold it for the next wake window or hub slot, none can wait for confirmation
+	{
+		bool queued = state == m2mDirectState::connected && _queueMessage(_applicationPacketBuffer, _applicationBufferPosition);
+		_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+		_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+		return queued;
+	}
+	if(state == m2mDirectState::connected && _sendApplicationPacket(_applicationPacketBuffer, _applicationBufferPosition, wait))
+	{
+		_statistics.dataMessagesSent++;
+		_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+		_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+		//_advanceTimers();	//Advance the timers for keepalives
+		return true;
+	}
+	else
+	{
+		_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+		_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+	}
+	//_advanceTimers();	//Advance the timers for keepalives
+	return false;
+}
+/*
+ *
+ *	Sends the message to a device in the peer table, or the paired device if that is the MAC address given
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::sendMessageTo(const uint8_t* macAddress, bool wait)
+{
+	if(macAddress == nullptr)
+	{
+		return false;
+	}
+	if(memcmp(macAddress, _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0)
+	{
+		return sendMessage(wait);
+	}
+	uint8_t peerIndex = _findPeer(macAddress);
+	bool sent = false;
+	if(peerIndex != M2M_DIRECT_NO_PEER && _peers[peerIndex].state == m2mDirectState::connected)
+	{
+		_finishApplicationMessage();
+		if(_holdApplicationMessage() == true)	//The same as sendMessage(), housekeeping owns the radio
+		{
+			sent = _queueMessage(_applicationPacketBuffer, _applicationBufferPosition, peerIndex);
+		}
+		else
+		{
+			sent = _sendPeerMessage(peerIndex, _applicationPacketBuffer, _applicationBufferPosition, wait);
+		}
+	}
+	_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+	_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+	return sent;
+}
+/*
+ *
+ *	Sends the message as a broadcast, one frame for every listener subscribed to the group. Broadcasts aren't acknowledged or encrypted,
+ *	so they carry an HMAC and a sequence number instead and the listeners count what they miss. The header takes some room from the fields
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::broadcastMessage(uint8_t group)
+{
+	bool sent = false;
+	if(state != m2mDirectState::uninitialised && _finishBroadcastMessage(group) == true)
+	{
+		if(_holdApplicationMessage() == true)	//The same as sendMessage()
+		{
+			sent = _queueMessage(_applicationPacketBuffer, _applicationBufferPosition, M2M_DIRECT_BROADCAST_PEER);
+		}
+		else if(_sendBroadcastPacket(_applicationPacketBuffer, _applicationBufferPosition))
+		{
+			_statistics.broadcastMessagesSent++;
+			sent = true;
+		}
+	}
+	_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+	_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+	return sent;
+}
+/*
+ *
+ *	Sends the message to a device that may be out of range, through relays. If the device is a link partner it goes straight there,
+ *	otherwise it goes to every connected link partner and relays pass it on until it arrives or reaches the hop limit. Relayed messages
+ *	are queued and sent by housekeeping, so this doesn't wait for confirmation
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::sendMessageRelayed(const uint8_t* macAddress, uint8_t hopLimit)
+{
+	bool queued = false;
+	if(macAddress != nullptr && hopLimit > 0 && state != m2mDirectState::uninitialised && _createSendQueue() == true && _applicationBufferPosition + M2M_DIRECT_RELAY_HEADER_LENGTH + 4 <= MAXIMUM_MESSAGE_SIZE)
+	{
+		if(_relayMessageId == 0)	//Start somewhere the relays won't mistake for a repeat of the last run
+		{
+			#if defined(ESP8266)
+			_relayMessageId = *(volatile uint32_t *)0x3FF20E44;	//Hardware random number generator
+			#elif defined(ESP32)
+			_relayMessageId = esp_random();
+			#endif
+			if(_relayMessageId == 0)
+			{
+				_relayMessageId = 1;
+			}
+		}
+		memmove(&_applicationPacketBuffer[2 + M2M_DIRECT_RELAY_HEADER_LENGTH], &_applicationPacketBuffer[2], _applicationBufferPosition - 2);
+		_applicationBufferPosition += M2M_DIRECT_RELAY_HEADER_LENGTH;
+		_applicationPacketBuffer[0] = M2M_DIRECT_RELAY_FLAG;
+		memcpy(&_applicationPacketBuffer[2], _localMacAddress, MAC_ADDRESS_LENGTH);
+		memcpy(&_applicationPacketBuffer[8], macAddress, MAC_ADDRESS_LENGTH);
+		_applicationPacketBuffer[14] = hopLimit;
+		_applicationPacketBuffer[15] = 1;	//The first link
+		_applicationPacketBuffer[16] = (_relayMessageId & 0xff000000) >> 24;
+		_applicationPacketBuffer[17] = (_relayMessageId & 0x00ff0000) >> 16;
+		_applicationPacketBuffer[18] = (_relayMessageId & 0x0000ff00) >> 8;
+		_applicationPacketBuffer[19] = (_relayMessageId & 0x000000ff);
+		_relayMessageId++;
+		while(_applicationBufferPosition < MINIMUM_MESSAGE_SIZE)
+		{
+			_applicationPacketBuffer[_applicationBufferPosition++] = 0xff;
+		}
+		CRC32 crc;
+		crc.add((uint8_t*)_applicationPacketBuffer, _applicationBufferPosition);
+		_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0xff000000) >> 24; //CRC
+		_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
+		_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
+		_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x000000ff);
+		queued = _queueRelayFrame(_applicationPacketBuffer, _applicationBufferPosition, nullptr);
+	}
+	_applicationBufferPosition = 2;		//Reset the buffer position for the next message
+	_applicationPacketBuffer[1] = 0;	//Reset the field count for the next message
+	return queued;
+}
+/*
+ *
+ *	Makes this device a relay, passing on relayed messages for other devices between its link partners, the paired device and the peer table
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::relay(bool enabled)
+{
+	if(enabled == true && _createSendQueue() == false)
+	{
+		return;	//Forwarded frames go through the send queue
+	}
+	_relayEnabled = enabled;
+}
+/*
+ *
+ *	Queues a relayed frame for the link partner it is addressed to, or if that isn't a connected partner, for every connected partner except the one it came from
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_queueRelayFrame(uint8_t* buffer, uint8_t length, const uint8_t* from)
+{
+	const uint8_t* destination = &buffer[8];
+	if(state == m2mDirectState::connected && memcmp(destination, _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0)
+	{
+		return _queueMessage(buffer, length, M2M_DIRECT_NO_PEER);
+	}
+	uint8_t peerIndex = _findPeer(destination);
+	if(peerIndex != M2M_DIRECT_NO_PEER && _peers[peerIndex].state == m2mDirectState::connected)
+	{
+		return _queueMessage(buffer, length, peerIndex);
+	}
+	bool queued = false;
+	if(state == m2mDirectState::connected && (from == nullptr || memcmp(from, _remoteMacAddress, MAC_ADDRESS_LENGTH) != 0))
+	{
+		queued = _queueMessage(buffer, length, M2M_DIRECT_NO_PEER) || queued;
+	}
+	for(peerIndex = 0; peerIndex < M2M_DIRECT_MAXIMUM_PEERS; peerIndex++)
+	{
+		if(_peers[peerIndex].inUse == true && _peers[peerIndex].state == m2mDirectState::connected && (from == nullptr || memcmp(from, _peers[peerIndex].macAddress, MAC_ADDRESS_LENGTH) != 0))
+		{
+			queued = _queueMessage(buffer, length, peerIndex) || queued;
+		}
+	}
+	return queued;
+}
+/*
+ *
+ *	Sends a queued relayed frame to the next hop. Relayed frames skip forward error correction, each hop only knows its own link
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_sendRelayFrame(m2mDirectQueuedPacket &packet)
+{
+	bool sent = false;
+	if(packet.peer != M2M_DIRECT_NO_PEER)
+	{
+		sent = _queuedPeerCurrent(packet) == true && _peers[packet.peer].state == m2mDirectState::connected && _sendPeerPacket(packet.peer, packet.buffer, packet.length);
+	}
+	else
+	{
+		sent = state == m2mDirectState::connected && _sendUnicastPacket(packet.buffer, packet.length);
+	}
+	if(sent == true)
+	{
+		uint32_t hopLatency = millis() - packet.metadata.received;
+		if(_relayLatencyResetDue == true)
+		{
+			_relayLatencyResetDue = false;
+			_statistics.relayHopLatency = 0;
+			_statistics.relayHopLatencyMaximum = 0;
+		}
+		_statistics.relayFramesSent++;
+		_statistics.relayHopLatency = _statistics.relayHopLatency == 0 ? hopLatency : (_statistics.relayHopLatency * 3 + hopLatency) / 4;
+		if(hopLatency > _statistics.relayHopLatencyMaximum)
+		{
+			_statistics.relayHopLatencyMaximum = hopLatency;
+		}
+	}
+	else
+	{
+		_statistics.relaySendFailures++;
+	}
+}
+/*
+ *
+ *	Handles a relayed frame from a link partner, in the WiFi task. Copies that arrived by another route are dropped, then it is either
+ *	delivered here, passed on if this is a relay and the hop limit allows, or dropped
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_receiveRelayFrame(const uint8_t* macAddress, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata)
+{
+	bool fromPartner = (state == m2mDirectState::connected && memcmp(macAddress, _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0) || _findPeer(macAddress) != M2M_DIRECT_NO_PEER;
+	if(fromPartner == false || length < MINIMUM_MESSAGE_SIZE + 4)
+	{
+		_statistics.unknownMessageTypes++;
+		return;
+	}
+	const uint8_t* origin = &message[2];
+	uint32_t messageId = uint32_t(message[16]) << 24 | uint32_t(message[17]) << 16 | uint32_t(message[18]) << 8 | message[19];
+	bool duplicate = memcmp(origin, _localMacAddress, MAC_ADDRESS_LENGTH) == 0;	//Our own message flooded back
+	for(uint8_t index = 0; index < M2M_DIRECT_RELAY_DUPLICATE_CACHE && duplicate == false; index++)
+	{
+		duplicate = _relaySeen[index].messageId == messageId && memcmp(_relaySeen[index].origin, origin, MAC_ADDRESS_LENGTH) == 0;
+	}
+	if(duplicate == true)
+	{
+		_statistics.relayDuplicates++;
+		return;
+	}
+	memcpy(_relaySeen[_relaySeenNext].origin, origin, MAC_ADDRESS_LENGTH);
+	_relaySeen[_relaySeenNext].messageId = messageId;
+	_relaySeenNext = (_relaySeenNext + 1) % M2M_DIRECT_RELAY_DUPLICATE_CACHE;
+	if(memcmp(&message[8], _localMacAddress, MAC_ADDRESS_LENGTH) == 0)
+	{
+		if(_queueReceivedMessage(message, length, metadata, M2M_DIRECT_NO_PEER))
+		{
+			_statistics.relayedMessagesReceived++;
+		}
+		return;
+	}
+	if(_relayEnabled == false)
+	{
+		return;	//For another device and this isn't a relay
+	}
+	if(message[15] >= message[14])
+	{
+		_statistics.relayHopLimitDrops++;
+		return;
+	}
+	memcpy(_relayPacketBuffer, message, length - 4);
+	_relayPacketBuffer[15]++;	//One more link crossed
+	CRC32 crc;
+	crc.add((uint8_t*)_relayPacketBuffer, length - 4);
+	_relayPacketBuffer[length - 4] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_relayPacketBuffer[length - 3] = (crc.calc() & 0x00ff0000) >> 16;
+	_relayPacketBuffer[length - 2] = (crc.calc() & 0x0000ff00) >> 8;
+	_relayPacketBuffer[length - 1] = (crc.calc() & 0x000000ff);
+	if(_queueRelayFrame(_relayPacketBuffer, length, macAddress))
+	{
+		_statistics.relayFramesForwarded++;
+	}
+}
+/*
+ *
+ *	Returns true if application messages must be queued for housekeeping, because it runs in the background or is waiting for a wake window or hub slot
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_holdApplicationMessage()
+{
+	return _backgroundHousekeeping == true || (_powerSaveActive == true && _wakeWindowOpen == false) || (hubScheduled() == true && _pollSlotOpen() == false && _createSendQueue() == true);
+}
+/*
+ *
+ *	Makes room for the broadcast header after the field count, then pads the message and adds the authentication tag and CRC
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_finishBroadcastMessage(uint8_t group)
+{
+	if(_applicationBufferPosition + M2M_DIRECT_BROADCAST_HEADER_LENGTH + M2M_DIRECT_BROADCAST_TAG_LENGTH + 4 > MAXIMUM_MESSAGE_SIZE)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rMessage too long to broadcast"));
+		}
+		return false;
+	}
+	if(_broadcastEpoch == 0 && _nextBroadcastEpoch() == false)	//Listeners only take a restart from a higher epoch, so one that can't be saved can't be used
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rUnable to save the broadcast epoch"));
+		}
+		return false;
+	}
+	memmove(&_applicationPacketBuffer[2 + M2M_DIRECT_BROADCAST_HEADER_LENGTH], &_applicationPacketBuffer[2], _applicationBufferPosition - 2);
+	_applicationBufferPosition += M2M_DIRECT_BROADCAST_HEADER_LENGTH;
+	_applicationPacketBuffer[0] = M2M_DIRECT_BROADCAST_FLAG;
+	memcpy(&_applicationPacketBuffer[2], _localMacAddress, MAC_ADDRESS_LENGTH);
+	_applicationPacketBuffer[8] = group;
+	_applicationPacketBuffer[9] = (_broadcastEpoch & 0xff000000) >> 24;
+	_applicationPacketBuffer[10] = (_broadcastEpoch & 0x00ff0000) >> 16;
+	_applicationPacketBuffer[11] = (_broadcastEpoch & 0x0000ff00) >> 8;
+	_applicationPacketBuffer[12] = (_broadcastEpoch & 0x000000ff);
+	_broadcastSequence++;	//The first broadcast of an epoch is 1
+	_applicationPacketBuffer[13] = (_broadcastSequence & 0xff000000) >> 24;
+	_applicationPacketBuffer[14] = (_broadcastSequence & 0x00ff0000) >> 16;
+	_applicationPacketBuffer[15] = (_broadcastSequence & 0x0000ff00) >> 8;
+	_applicationPacketBuffer[16] = (_broadcastSequence & 0x000000ff);
+	while(_applicationBufferPosition < MINIMUM_MESSAGE_SIZE)
+	{
+		_applicationPacketBuffer[_applicationBufferPosition++] = 0xff;
+	}
+	_broadcastTag(_applicationPacketBuffer, _applicationBufferPosition, &_applicationPacketBuffer[_applicationBufferPosition]);
+	_applicationBufferPosition += M2M_DIRECT_BROADCAST_TAG_LENGTH;
+	CRC32 crc;
+	crc.add((uint8_t*)_applicationPacketBuffer, _applicationBufferPosition);
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x000000ff);
+	return true;
+}
+/*
+ *
+ *	Counts this boot in the store, the first time the device broadcasts, and uses the count as the broadcast epoch. It only ever goes up, so a listener
+ *	takes a higher epoch as the publisher restarting and drops anything from a lower one as a replay
+ *
+ *	On ESP8266 the newest record is saved again and the store's sequence number is the epoch, on ESP32 it is a separate Preferences key
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_nextBroadcastEpoch()
+{
+	#if defined(ESP8266)
+		uint8_t record[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+		uint8_t length = 0;
+		if(_loadRecord(record, length) == false)
+		{
+			if(_storeNextSlot == 0xff)
+			{
+				return false;	//Couldn't read the store, so don't risk writing over the pairing
+			}
+			length = 0;	//No pairing, save an empty record
+		}
+		if(_storeRecord(record, length) == false)
+		{
+			return false;
+		}
+		_broadcastEpoch = _storeSequence;
+	#elif defined ESP32
+		settings.begin(preferencesNamespace, false);
+		uint32_t epoch = settings.getUInt(broadcastEpochKey, 0) + 1;
+		bool success = settings.putUInt(broadcastEpochKey, epoch) == sizeof(epoch);
+		settings.end();
+		if(success == false)
+		{
+			return false;
+		}
+		_broadcastEpoch = epoch;
+	#endif
+	_broadcastSequence = 0;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rBroadcast epoch %u"), _broadcastEpoch);
+	}
+	return true;
+}
+/*
+ *
+ *	Calculates the authentication tag of a broadcast, HMAC-SHA256 truncated to M2M_DIRECT_BROADCAST_TAG_LENGTH bytes. It covers the sender's MAC address
+ *	epoch and sequence number, so a frame can't be passed off as from another device or replayed as new
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_broadcastTag(const uint8_t* message, uint8_t length, uint8_t* tag)
+{
+	const uint8_t* key = _broadcastKeySet == true ? _broadcastKey : _primaryEncryptionKey;
+	uint8_t hmac[32];
+	#if defined(ESP8266)
+	br_hmac_key_context keyContext;
+	br_hmac_context context;
+	br_hmac_key_init(&keyContext, &br_sha256_vtable, key, ENCRYPTION_KEY_LENGTH);
+	br_hmac_init(&context, &keyContext, 0);
+	br_hmac_update(&context, message, length);
+	br_hmac_out(&context, hmac);
+	#elif defined(ESP32)
+	mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, ENCRYPTION_KEY_LENGTH, message, length, hmac);
+	#endif
+	memcpy(tag, hmac, M2M_DIRECT_BROADCAST_TAG_LENGTH);
+}
+/*
+ *
+ *	Handles a valid broadcast data frame, in the WiFi task. It is dropped unless the group is subscribed and the tag checks out,
+ *	then its epoch and sequence number are checked against the last ones from the same publisher to count losses and drop duplicates and replays
+ *
+ *	Within an epoch sequence numbers only go up, so anything at or behind the last one is dropped. A higher epoch is the publisher restarting
+ *	and a lower one is a replay. Only publishers unheard for M2M_DIRECT_BROADCAST_SOURCE_TIMEOUT are forgotten to make room, as a forgotten one
+ *	could be replayed. For the same reason a lower epoch is only taken as a restart once nothing has been accepted from the publisher for that long,
+ *	which is how a publisher that lost its saved epoch to a power cut gets heard again
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_receiveBroadcastFrame(const uint8_t* macAddress, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata)
+{
+	if(length < MINIMUM_MESSAGE_SIZE + M2M_DIRECT_BROADCAST_TAG_LENGTH + 4)
+	{
+		_statistics.unknownMessageTypes++;
+		return;
+	}
+	uint8_t group = message[8];
+	if((_broadcastGroups[group >> 5] & (uint32_t(1) << (group & 0x1f))) == 0)
+	{
+		_statistics.broadcastMessagesFiltered++;	//Checked first, it's cheaper than the HMAC
+		return;
+	}
+	uint8_t tag[M2M_DIRECT_BROADCAST_TAG_LENGTH];
+	_broadcastTag(message, length - 4 - M2M_DIRECT_BROADCAST_TAG_LENGTH, tag);
+	uint8_t difference = 0;
+	for(uint8_t index = 0; index < M2M_DIRECT_BROADCAST_TAG_LENGTH; index++)	//Compare all of it, so the time taken doesn't give away how much matched
+	{
+		difference |= tag[index] ^ message[length - 4 - M2M_DIRECT_BROADCAST_TAG_LENGTH + index];
+	}
+	if(difference != 0 || memcmp(&message[2], macAddress, MAC_ADDRESS_LENGTH) != 0)
+	{
+		_statistics.broadcastAuthenticationFailures++;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F(" failed authentication"));
+		}
+		return;
+	}
+	uint32_t epoch = uint32_t(message[9]) << 24 | uint32_t(message[10]) << 16 | uint32_t(message[11]) << 8 | message[12];
+	uint32_t sequence = uint32_t(message[13]) << 24 | uint32_t(message[14]) << 16 | uint32_t(message[15]) << 8 | message[16];
+	uint8_t sourceIndex = M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES;
+	uint8_t oldestIndex = 0;
+	bool freeSlot = false;
+	for(uint8_t index = 0; index < M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES; index++)
+	{
+		if(_broadcastSources[index].inUse == false)
+		{
+			oldestIndex = index;
+			freeSlot = true;
+			break;
+		}
+		if(memcmp(_broadcastSources[index].macAddress, macAddress, MAC_ADDRESS_LENGTH) == 0)
+		{
+			sourceIndex = index;
+			break;
+		}
+		if(metadata.received - _broadcastSources[index].lastHeard > metadata.received - _broadcastSources[oldestIndex].lastHeard)
+		{
+			oldestIndex = index;
+		}
+	}
+	bool restarted = false;
+	if(sourceIndex == M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES)	//A new publisher
+	{
+		if(freeSlot == false && metadata.received - _broadcastSources[oldestIndex].lastHeard < M2M_DIRECT_BROADCAST_SOURCE_TIMEOUT)
+		{
+			_statistics.broadcastSourcesRefused++;	//Every publisher tracked is still active
+			return;
+		}
+		sourceIndex = oldestIndex;
+		m2mDirectBroadcastSource &source = _broadcastSources[sourceIndex];
+		source.inUse = false;
+		memcpy(source.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+		source.received = 0;
+		source.lost = 0;
+		source.duplicates = 0;
+		source.inUse = true;
+		restarted = true;
+	}
+	m2mDirectBroadcastSource &source = _broadcastSources[sourceIndex];
+	if(restarted == false && epoch < source.epoch && metadata.received - source.lastHeard >= M2M_DIRECT_BROADCAST_SOURCE_TIMEOUT)
+	{
+		restarted = true;	//Long enough unheard to have been forgotten anyway, so its epoch was probably lost rather than this being a replay
+	}
+	if(restarted == false && (epoch < source.epoch || (epoch == source.epoch && sequence <= source.lastSequence)))
+	{
+		source.duplicates++;	//Received before, or replayed from an earlier epoch
+		_statistics.broadcastDuplicates++;
+		return;
+	}
+	if(restarted == false && epoch == source.epoch && sequence > source.lastSequence + 1)
+	{
+		source.lost += sequence - source.lastSequence - 1;
+		_statistics.broadcastMessagesLost += sequence - source.lastSequence - 1;
+	}
+	source.epoch = epoch;
+	source.lastSequence = sequence;
+	source.lastHeard = metadata.received;
+	source.received++;
+	_statistics.broadcastMessagesReceived++;
+	_queueReceivedMessage(message, length, metadata, M2M_DIRECT_NO_PEER);
+}
+/*
+ *
+ *	Sets the key broadcasts are authenticated with, every publisher and listener in a group must share it. Without one the primary encryption key is used
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::broadcastKey(const uint8_t* key)
+{
+	if(key == nullptr)
+	{
+		_broadcastKeySet = false;
+		return;
+	}
+	memcpy(_broadcastKey, key, ENCRYPTION_KEY_LENGTH);
+	_broadcastKeySet = true;
+}
+/*
+ *
+ *	Subscribes to, or unsubscribes from, a broadcast group. Listening is opt in, broadcasts to groups that aren't subscribed are ignored
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::broadcastSubscribe(uint8_t group, bool subscribed)
+{
+	if(subscribed == true)
+	{
+		_broadcastGroups[group >> 5].fetch_or(uint32_t(1) << (group & 0x1f));
+	}
+	else
+	{
+		_broadcastGroups[group >> 5].fetch_and(~(uint32_t(1) << (group & 0x1f)));
+	}
+}
+/*
+ *
+ *	Fills in a snapshot of the nth device broadcasts have been received from, counting from zero
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::broadcastSourceInfo(uint8_t index, m2mDirectBroadcastSourceInfo &info)
+{
+	for(uint8_t sourceIndex = 0; sourceIndex < M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES; sourceIndex++)
+	{
+		if(_broadcastSources[sourceIndex].inUse == true)
+		{
+			if(index == 0)
+			{
+				m2mDirectBroadcastSource &source = _broadcastSources[sourceIndex];
+				memcpy(info.macAddress, source.macAddress, MAC_ADDRESS_LENGTH);
+				info.lastHeard = source.lastHeard;
+				info.received = source.received;
+				info.lost = source.lost;
+				info.duplicates = source.duplicates;
+				info.epoch = source.epoch;
+				return true;
+			}
+			index--;
+		}
+	}
+	return false;
+}
+/*
+ *
+ *	Marks the application message as data, pads it to the minimum size and adds the CRC
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_finishApplicationMessage()
+{
+	CRC32 crc;
+	_applicationPacketBuffer[0] = M2M_DIRECT_DATA_FLAG;	//Make sure this is set as a data packet
+	while(_applicationBufferPosition < MINIMUM_MESSAGE_SIZE)
+	{
+		_applicationPacketBuffer[_applicationBufferPosition++] = 0xff;
+	}
+	crc.add((uint8_t*)_applicationPacketBuffer, _applicationBufferPosition);	//Calculate the CRC
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0xff000000) >> 24;	//Add the CRC
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
+	_applicationPacketBuffer[_applicationBufferPosition++] = (crc.calc() & 0x000000ff);
+}
+/*
+ *
+ *	Sends an application message. With forward error correction it goes out with a block number and index, and is added to the block's parity
+ *	The parity frame follows the last message in the block, so the receiver can rebuild any one lost message without a round trip
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sendApplicationPacket(uint8_t* buffer, uint8_t length, bool wait)
+{
+	if(_fecEnabled == false || _remoteFec == false || length > M2M_DIRECT_FEC_MAXIMUM_LENGTH)
+	{
+		return _sendUnicastPacket(buffer, length, wait);
+	}
+	if(_fecSendCount == 0)	//Start a new block
+	{
+		memset(_fecSendParity, 0, M2M_DIRECT_FEC_MAXIMUM_LENGTH);
+		_fecSendLengths = 0;
+		_fecSendLongest = 0;
+		_fecSendBlockStart = millis();
+	}
+	uint8_t position = 0;
+	_fecPacketBuffer[position++] = M2M_DIRECT_FEC_DATA_FLAG;
+	_fecPacketBuffer[position++] = _fecSendBlock;
+	_fecPacketBuffer[position++] = _fecSendCount;
+	_fecPacketBuffer[position++] = 0;	//Reserved
+	memcpy(&_fecPacketBuffer[position], buffer, length);
+	position+=length;
+	CRC32 crc;
+	crc.add((uint8_t*)_fecPacketBuffer, position);
+	_fecPacketBuffer[position++] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_fecPacketBuffer[position++] = (crc.calc() & 0x00ff0000) >> 16;
+	_fecPacketBuffer[position++] = (crc.calc() & 0x0000ff00) >> 8;
+	_fecPacketBuffer[position++] = (crc.calc() & 0x000000ff);
+	for(uint8_t index = 0; index < length; index++)	//Add to the parity whether or not it is delivered, that's the point
+	{
+		_fecSendParity[index] ^= buffer[index];
+	}
+	_fecSendLengths ^= length;
+	if(length > _fecSendLongest)
+	{
+		_fecSendLongest = length;
+	}
+	_fecSendCount++;
+	bool sent = _sendUnicastPacket(_fecPacketBuffer, position, wait);
+	if(_fecSendCount >= _fecBlockSize)
+	{
+		_sendFecParity();
+	}
+	return sent;
+}
+/*
+ *
+ *	Sends the parity frame for the current block and starts the next one. It isn't waited for as a late parity frame is of no use
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sendFecParity()
+{
+	uint8_t position = 0;
+	_fecPacketBuffer[position++] = M2M_DIRECT_FEC_PARITY_FLAG;
+	_fecPacketBuffer[position++] = _fecSendBlock;
+	_fecPacketBuffer[position++] = _fecSendCount;
+	_fecPacketBuffer[position++] = _fecSendLengths;
+	memcpy(&_fecPacketBuffer[position], _fecSendParity, _fecSendLongest);
+	position+=_fecSendLongest;
+	CRC32 crc;
+	crc.add((uint8_t*)_fecPacketBuffer, position);
+	_fecPacketBuffer[position++] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_fecPacketBuffer[position++] = (crc.calc() & 0x00ff0000) >> 16;
+	_fecPacketBuffer[position++] = (crc.calc() & 0x0000ff00) >> 8;
+	_fecPacketBuffer[position++] = (crc.calc() & 0x000000ff);
+	_fecSendBlock++;
+	_fecSendCount = 0;
+	_statistics.fecParityFramesSent++;
+	return _sendUnicastPacket(_fecPacketBuffer, position, false);
+}
+/*
+ *
+ *	Chooses the block size from the keepalive loss the peer reports, aiming for half a lost message per block at most
+ *	so that most blocks lose no more than the one message parity can rebuild
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_adaptFecBlockSize()
+{
+	uint8_t lost = 32 - _remoteReceiveQuality;
+	uint8_t blockSize = M2M_DIRECT_FEC_MAXIMUM_BLOCK;
+	if(lost > 0)
+	{
+		blockSize = 16 / lost > M2M_DIRECT_FEC_MINIMUM_BLOCK ? 16 / lost - 1 : M2M_DIRECT_FEC_MINIMUM_BLOCK;
+	}
+	if(blockSize > M2M_DIRECT_FEC_MAXIMUM_BLOCK)
+	{
+		blockSize = M2M_DIRECT_FEC_MAXIMUM_BLOCK;
+	}
+	if(blockSize != _fecBlockSize && debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\r\nFEC block size %u"), blockSize);
+	}
+	_fecBlockSize = blockSize;
+}
+/*
+ *
+ *	Handles a protected message or parity frame, in the WiFi task. Protected messages are delivered straight away and added to the block's parity
+ *	When the parity frame arrives with exactly one message of the block missing, that message is the XOR of the parity and everything received
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_receiveFecFrame(const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata)
+{
+	if(length < M2M_DIRECT_FEC_OVERHEAD)
+	{
+		return;
+	}
+	uint8_t block = message[1];
+	uint8_t payloadLength = length - M2M_DIRECT_FEC_OVERHEAD;
+	if(block != _fecReceiveBlock)	//Start a new block, anything left of the previous one can't be rebuilt now
+	{
+		_fecReceiveBlock = block;
+		_fecReceivedMask = 0;
+		_fecReceiveLengths = 0;
+		memset(_fecReceiveParity, 0, M2M_DIRECT_FEC_MAXIMUM_LENGTH);
+	}
+	if(message[0] == M2M_DIRECT_FEC_DATA_FLAG)
+	{
+		uint8_t index = message[2];
+		if(index >= M2M_DIRECT_FEC_MAXIMUM_BLOCK || (_fecReceivedMask & (1 << index)))
+		{
+			return;	//Unusable or duplicate
+		}
+		_fecReceivedMask |= 1 << index;
+		_fecReceiveLengths ^= payloadLength;
+		for(uint8_t position = 0; position < payloadLength; position++)
+		{
+			_fecReceiveParity[position] ^= message[position + 4];
+		}
+		_queueReceivedMessage(&message[4], payloadLength, metadata);
+		return;
+	}
+	uint8_t blockLength = message[2];
+	uint8_t missing = blockLength;
+	for(uint8_t index = 0; index < blockLength && index < M2M_DIRECT_FEC_MAXIMUM_BLOCK; index++)
+	{
+		if(_fecReceivedMask & (1 << index))
+		{
+			missing--;
+		}
+	}
+	_fecReceivedMask = 0xff;	//The block is finished with
+	if(missing == 0)
+	{
+		return;
+	}
+	if(missing > 1)
+	{
+		_statistics.fecBlocksUnrecoverable++;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR(" %u lost, unrecoverable"), missing);
+		}
+		return;
+	}
+	uint8_t recoveredLength = message[3] ^ _fecReceiveLengths;
+	if(recoveredLength < 6 || recoveredLength > payloadLength)
+	{
+		_statistics.fecBlocksUnrecoverable++;
+		return;
+	}
+	for(uint8_t position = 0; position < recoveredLength; position++)
+	{
+		_fecReceiveParity[position] ^= message[position + 4];
+	}
+	//Check the rebuilt message's own CRC before delivering it
+	uint32_t recoveredCrc = uint32_t(_fecReceiveParity[recoveredLength - 4]) << 24 | uint32_t(_fecReceiveParity[recoveredLength - 3]) << 16 | uint32_t(_fecReceiveParity[recoveredLength - 2]) << 8 | _fecReceiveParity[recoveredLength - 1];
+	CRC32 crc;
+	crc.add(_fecReceiveParity, recoveredLength - 4);
+	if(crc.calc() != recoveredCrc || _fecReceiveParity[0] != M2M_DIRECT_DATA_FLAG)
+	{
+		_statistics.fecBlocksUnrecoverable++;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F(" rebuilt message invalid"));
+		}
+		return;
+	}
+	_statistics.fecMessagesRecovered++;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F(" rebuilt lost message"));
+	}
+	_queueReceivedMessage(_fecReceiveParity, recoveredLength, metadata);
+}
+/*
+ *
+ *	Puts a received application message in the receive queue, in the WiFi task
+ *	Single producer/single consumer queue, only the receive callback moves the tail and only the application moves the head
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_queueReceivedMessage(const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata, uint8_t peer)
+{
+	uint8_t tail = _receiveQueueTail.load(std::memory_order_relaxed);
+	uint8_t nextTail = (tail + 1) % M2M_DIRECT_RECEIVE_QUEUE_LENGTH;
+	if(nextTail != _receiveQueueHead.load(std::memory_order_acquire))
+	{
+		memcpy(_receiveQueue[tail].buffer, message, length);
+		_receiveQueue[tail].length = length;
+		_receiveQueue[tail].metadata = metadata;
+		_receiveQueue[tail].peer = peer;
+		if(peer < M2M_DIRECT_MAXIMUM_PEERS)
+		{
+			memcpy(_receiveQueue[tail].macAddress, _peers[peer].macAddress, MAC_ADDRESS_LENGTH);
+		}
+		_receiveQueueTail.store(nextTail, std::memory_order_release);	//Publish the message
+		_postEvent(m2mDirectEvent::messageReceived);
+		_statistics.dataMessagesReceived++;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR(" %u fields"),message[1]);
+		}
+		return true;
+	}
+	_statistics.receivedMessagesDiscarded++;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rReceived message discarded"));
+	}
+	return false;
+}
+/*
+ *
+ *	Clears any received message so another can be received. There is only one incoming packet buffer!
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::clearReceivedMessage()
+{
+	_receivedPacketBuffer[1] = 0;		//Reset the field count for the next message
+	_receivedPacketBufferPosition = 2;	//Reset the buffer position for the next message
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rReceived message cleared"));
+	}
+}
+/*
+ *
+ *	Returns the current 2.4Ghz channel
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_currentChannel()
+{
+	#if defined(ESP8266)
+	uint8_t currentChannel = wifi_get_channel();
+	#elif defined ESP32
+	//uint8_t currentChannel = 0;
+	//uint8_t secondaryChannel = 0;
+	//esp_wifi_get_channel(&currentChannel, &secondaryChannel);
+	uint8_t currentChannel = WiFi.channel();
+	#endif
+	return currentChannel;
+}
+/*
+ *
+ *	Returns the number of fields are there left in the message
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::dataAvailable()
+{
+	return _receivedPacketBuffer[1];
+}
+/*
+ *
+ *	Returns the 'type' of the next field
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::nextDataType()
+{
+	if(_receivedPacketBuffer[1] == 0)
+	{
+		return DATA_UNAVAILABLE;
+	}
+	if(_receivedPacketBuffer[_receivedPacketBufferPosition] == DATA_BOOL_TRUE)	//Handles the case of a single bool true
+	{
+		return DATA_BOOL;
+	}
+	return (_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x8f);	//Strip out any array size before returning it
+}
+/*
+ *
+ *	Returns the 'length' of the next field for strings and arrays
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::nextDataLength()
+{
+	if(_receivedPacketBuffer[1] == 0 || ((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x80) == 0 && _receivedPacketBuffer[_receivedPacketBufferPosition] != 0x0d))
+	{
+		return 0;
+	}
+	return _receivedPacketBuffer[_receivedPacketBufferPosition+1];
+}
+/*
+ *
+ *	Skip the next field
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::skipReceivedData()
+{
+	if(_receivedPacketBuffer[1] == 0)
+	{
+		return;
+	}
+	_receivedPacketBuffer[1]--;	//Mark the field as retrieved
+	if(_receivedPacketBuffer[1] == 0)
+	{
+		_receivedPacketBufferPosition = 2;		//Reset the buffer position for the next message
+	}
+	else
+	{
+		switch (_receivedPacketBuffer[_receivedPacketBufferPosition] & 0x0f)
+		{
+			case DATA_BOOL:
+				_receivedPacketBufferPosition++;
+			break;
+			case DATA_BOOL_TRUE:
+				_receivedPacketBufferPosition++;
+			break;
+			case DATA_UINT8_T:
+				_receivedPacketBufferPosition+=sizeof(uint8_t)+1;
+			break;
+			case DATA_UINT16_T:
+				_receivedPacketBufferPosition+=sizeof(uint16_t)+1;
+			break;
+			case DATA_UINT32_T:
+				_receivedPacketBufferPosition+=sizeof(uint32_t)+1;
+			break;
+			case DATA_UINT64_T:
+				_receivedPacketBufferPosition+=sizeof(uint64_t)+1;
+			break;
+			case DATA_INT8_T:
+				_receivedPacketBufferPosition+=sizeof(int8_t)+1;
+			break;
+			case DATA_INT16_T:
+				_receivedPacketBufferPosition+=sizeof(int16_t)+1;
+			break;
+			case DATA_INT32_T:
+				_receivedPacketBufferPosition+=sizeof(int32_t)+1;
+			break;
+			case DATA_INT64_T:
+				_receivedPacketBufferPosition+=sizeof(int64_t)+1;
+			break;
+			case DATA_FLOAT:
+				_receivedPacketBufferPosition+=sizeof(float)+1;
+			break;
+			case DATA_DOUBLE:
+				_receivedPacketBufferPosition+=sizeof(double)+1;
+			break;
+			case DATA_CHAR:
+				_receivedPacketBufferPosition+=sizeof(char)+1;
+			break;
+			case DATA_STR:
+				//if((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) == 0)	//Medium char array, length in next byte
+				{
+					_receivedPacketBufferPosition+=_receivedPacketBuffer[_receivedPacketBufferPosition+1]+1;
+				}
+				/*
+				else if((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) < M2M_DIRECT_SMALL_ARRAY_LIMIT + 1)	//Short char array, length in type field
+				{
+					_receivedPacketBufferPosition+=((_receivedPacketBuffer[_receivedPacketBufferPosition] & 0xf0) >> 4);	//Allows for zero length strings
+				}
+				*/
+			break;
+			case DATA_CUSTOM:
+				_receivedPacketBufferPosition+=_receivedPacketBuffer[_receivedPacketBufferPosition];
+			break;
+		}
+	}
+}
+/*
+ *
+ *	Prints the 'type' for a field label in debugging
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_dataTypeDescription(uint8_t type)
+{
+	if(type == DATA_UNAVAILABLE)
+	{
+		debug_uart_->print(F("UNAVAILABLE"));
+	}
+	else if(type == DATA_BOOL || type == DATA_BOOL_TRUE)
+	{
+		debug_uart_->print(F("BOOL"));
+	}
+	else if(type == DATA_UINT8_T)
+	{
+		debug_uart_->print(F("UINT8_T"));
+	}
+	else if(type == DATA_UINT16_T)
+	{
+		debug_uart_->print(F("UINT16_T"));
+	}
+	else if(type == DATA_UINT32_T)
+	{
+		debug_uart_->print(F("UINT32_T"));
+	}
+	else if(type == DATA_UINT64_T)
+	{
+		debug_uart_->print(F("UINT64_T"));
+	}
+	else if(type == DATA_INT8_T)
+	{
+		debug_uart_->print(F("INT8_t"));
+	}
+	else if(type == DATA_INT16_T)
+	{
+		debug_uart_->print(F("INT16_T"));
 	}
 	else if(type == DATA_INT32_T)
 	{
-		debug_uart_->print(F("INT32_T"));
+		debug_uart_->print(F("INT32_T"));
+	}
+	else if(type == DATA_INT64_T)
+	{
+		debug_uart_->print(F("INT64_t"));
+	}
+	else if(type == DATA_FLOAT)
+	{
+		debug_uart_->print(F("FLOAT"));
+	}
+	else if(type == DATA_DOUBLE)
+	{
+		debug_uart_->print(F("DOUBLE"));
+	}
+	else if(type == DATA_CHAR)
+	{
+		debug_uart_->print(F("CHAR"));
+	}
+	else if(type == DATA_BOOL_ARRAY)
+	{
+		debug_uart_->print(F("BOOL_ARRAY"));
+	}
+	else if(type == DATA_UINT8_T_ARRAY)
+	{
+		debug_uart_->print(F("UINT8_T_ARRAY"));
+	}
+	else if(type == DATA_UINT16_T_ARRAY)
+	{
+		debug_uart_->print(F("UINT16_T_ARRAY"));
+	}
+	else if(type == DATA_UINT32_T_ARRAY)
+	{
+		debug_uart_->print(F("UINT32_T_ARRAY"));
+	}
+	else if(type == DATA_UINT64_T_ARRAY)
+	{
+		debug_uart_->print(F("UINT64_T_ARRAY"));
+	}
+	else if(type == DATA_INT8_T_ARRAY)
+	{
+		debug_uart_->print(F("INT8_t_ARRAY"));
+	}
+	else if(type == DATA_INT16_T_ARRAY)
+	{
+		debug_uart_->print(F("INT16_T_ARRAY"));
+	}
+	else if(type == DATA_INT32_T_ARRAY)
+	{
+		debug_uart_->print(F("INT32_T_ARRAY"));
+	}
+	else if(type == DATA_INT64_T_ARRAY)
+	{
+		debug_uart_->print(F("INT64_t_ARRAY"));
+	}
+	else if(type == DATA_FLOAT_ARRAY)
+	{
+		debug_uart_->print(F("FLOAT_ARRAY"));
+	}
+	else if(type == DATA_DOUBLE_ARRAY)
+	{
+		debug_uart_->print(F("DOUBLE_ARRAY"));
+	}
+	else if(type == DATA_CHAR_ARRAY)
+	{
+		debug_uart_->print(F("CHAR_ARRAY"));
+	}
+	else if(type == DATA_STR)
+	{
+		debug_uart_->print(F("DATA_STR"));
+	}
+	else if(type == DATA_CUSTOM)
+	{
+		debug_uart_->print(F("DATA_CUSTOM"));
+	}
+	else
+	{
+		debug_uart_->print(F("UNKNOWN"));
+	}
+	debug_uart_->printf_P(PSTR("(%02x)"), type);
+}
+/*
+	debug_uart_->print(F("\r\nAdding "));
+	switch (dataType)
+	{
+	  case DATA_UINT8_T:
+		debug_uart_->print(F("uint8_t"));
+	  break;
+	  case DATA_UINT16_T:
+		debug_uart_->print(F("uint16_t"));
+	  break;
+	  case DATA_UINT32_T:
+		debug_uart_->print(F("uint32_t"));
+	  break;
+	  case DATA_UINT64_T:
+		debug_uart_->print(F("uint64_t"));
+	  break;
+	  case DATA_INT8_T:
+		debug_uart_->print(F("int8_t"));
+	  break;
+	  case DATA_INT16_T:
+		debug_uart_->print(F("int16_t"));
+	  break;
+	  case DATA_INT32_T:
+		debug_uart_->print(F("int32_t"));
+	  break;
+	  case DATA_FLOAT:
+		debug_uart_->print(F("float"));
+	  break;
+	  case DATA_DOUBLE:
+		debug_uart_->print(F("double"));
+	  break;
+	  case DATA_CHAR:
+		debug_uart_->print(F("char"));
+	  break;
+	  case DATA_STR:
+		debug_uart_->print(F("str"));
+	  break;
+	  case DATA_CUSTOM:
+		debug_uart_->print(F("custom"));
+	  break;
+	  case DATA_UINT8_T_ARRAY:
+		debug_uart_->print(F("uint8_t["));
+	  break;
+	  case DATA_UINT16_T_ARRAY:
+		debug_uart_->print(F("uint16_t["));
+	  break;
+	  case DATA_UINT32_T_ARRAY:
+		debug_uart_->print(F("uint32_t["));
+	  break;
+	  case DATA_UINT64_T_ARRAY:
+		debug_uart_->print(F("uint64_t["));
+	  break;
+	  case DATA_INT8_T_ARRAY:
+		debug_uart_->print(F("int8_t["));
+	  break;
+	  case DATA_INT16_T_ARRAY:
+		debug_uart_->print(F("int16_t["));
+	  break;
+	  case DATA_INT32_T_ARRAY:
+		debug_uart_->print(F("int32_t["));
+	  break;
+	  case DATA_FLOAT_ARRAY:
+		debug_uart_->print(F("float["));
+	  break;
+	  case DATA_DOUBLE_ARRAY:
+		debug_uart_->print(F("double["));
+	  break;
+	  case DATA_CHAR_ARRAY:
+		debug_uart_->print(F("char["));
+	  break;
+	  case DATA_CUSTOM_ARRAY:
+		debug_uart_->print(F("custom["));
+	  break;
+	}
+*/
+/*
+ *
+ *	Compares two MAC addresses and returns true if the first is higher
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_tieBreak(uint8_t* macAddress1, uint8_t* macAddress2)
+{
+	if(memcmp(macAddress1,macAddress2,MAC_ADDRESS_LENGTH) > 0)
+	{
+		return true;
+	}
+	return false;
+}
+bool ICACHE_FLASH_ATTR m2mDirectClass::_remoteMacAddressSet()
+{
+	if(_remoteMacAddress[0] == 0 &&
+		_remoteMacAddress[1] == 0 &&
+		_remoteMacAddress[2] == 0 &&
+		_remoteMacAddress[3] == 0 &&
+		_remoteMacAddress[4] == 0 &&
+		_remoteMacAddress[5] == 0
+	)
+	{
+		return false;
+	}
+	return true;
+}
+/*
+ *
+ *	The pairing, channel and link parameters are saved together as one record, so they are always written and read as a whole
+ *
+ *	On ESP8266 records are appended to fixed size slots in the flash sector that would otherwise hold the EEPROM emulation, so the sketch can't use the EEPROM library as well
+ *	The newest valid record wins. If M2M_DIRECT_STORE_SPARE_SECTOR is defined, when the sector is full records move on to that sector, which is erased first, so the sector holding
+ *	the newest record is never the one erased. There is no sector that is safe to take without being told, the one before the EEPROM sector ends a filesystem or the OTA staging area
+ *	On ESP32 the record is a single Preferences blob. NVS is already log structured, CRC checked and wear levelled, and replaces a blob in one step
+ *	Each instance has its own namespace on ESP32. On ESP8266 only the default instance saves a record, as there is only the one store
+ *
+ */
+#if defined(ESP8266)
+extern "C" uint32_t _EEPROM_start;	//Start of the EEPROM emulation sector, from the linker script
+extern "C" uint32_t _FS_start;		//Start and end of the filesystem area, equal if there is no filesystem
+extern "C" uint32_t _FS_end;
+#define M2M_DIRECT_STORE_SECTOR (((uint32_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE)
+#define M2M_DIRECT_STORE_SLOTS (SPI_FLASH_SEC_SIZE / M2M_DIRECT_STORE_SLOT_SIZE)
+#endif
+/*
+ *
+ *	Read pairing from flash (ESP8266) or 'preferences' (ESP32), migrating a pairing saved by an earlier version
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_readPairingInfo()
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rReading pairing info: "));
+	}
+	uint8_t record[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+	uint8_t length = 0;
+	bool found = _loadRecord(record, length) && _unpackRecord(record, length);
+	if(found == false && _readLegacyPairingInfo() == true)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("migrating from earlier version"));
+		}
+		found = _writePairingInfo();
+	}
+	if(found == true)
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR("OK\r\n\tMAC address:%02x%02x%02x%02x%02x%02x\r\n\tPrimary encryption key:"),
+				_remoteMacAddress[0],
+				_remoteMacAddress[1],
+				_remoteMacAddress[2],
+				_remoteMacAddress[3],
+				_remoteMacAddress[4],
+				_remoteMacAddress[5]);
+			for(uint8_t index = 0; index < 16; index++)
+			{
+				debug_uart_->printf_P(PSTR("%02x"), _primaryEncryptionKey[index]);
+			}
+			debug_uart_->print(F("\r\n\tLocal encryption key: "));
+			for(uint8_t index = 0; index < 16; index++)
+			{
+				debug_uart_->printf_P(PSTR("%02x"), _localEncryptionKey[index]);
+			}
+			if(remoteDeviceName != nullptr)
+			{
+				debug_uart_->print(F("\r\n\tRemote device name:"));
+				debug_uart_->print(remoteDeviceName);
+			}
+		}
+		return true;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("none"));
+	}
+	return false;
+}
+/*
+ *
+ *	Write pairing to flash (ESP8266) or 'preferences' (ESP32)
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_writePairingInfo()
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rWriting pairing info: "));
+	}
+	_savedLinkState.channel = _communicationChannel;
+	uint8_t record[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+	uint8_t length = _packRecord(_savedLinkState, record);	//Link parameters stay marked as not valid until the link has converged
+	if(_storeRecord(record, length))
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("OK"));
+		}
+		return true;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("failed"));
+	}
+	return false;
+}
+/*
+ *
+ *	Reads a pairing saved by an earlier version, a 42 byte EEPROM image on ESP8266 or separate Preferences keys on ESP32
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_readLegacyPairingInfo()
+{
+	if(_storeAvailable() == false)
+	{
+		return false;
+	}
+	#if defined(ESP8266)
+		uint32_t legacyData[M2M_DIRECT_LEGACY_DATA_SIZE / 4];	//Flash reads are in whole words
+		if(ESP.flashRead(M2M_DIRECT_STORE_SECTOR * SPI_FLASH_SEC_SIZE, legacyData, M2M_DIRECT_LEGACY_DATA_SIZE) == false)
+		{
+			return false;
+		}
+		uint8_t* eepromData = (uint8_t*)legacyData;
+		CRC32 crc;
+		crc.add(eepromData, M2M_DIRECT_LEGACY_CHANNEL_ADDRESS - 4);
+		uint32_t crcFromEEPROM = uint32_t(eepromData[38]) << 24 | uint32_t(eepromData[39]) << 16 | uint32_t(eepromData[40]) << 8 | eepromData[41];
+		if(crc.calc() != crcFromEEPROM)
+		{
+			return false;
+		}
+		memcpy(_remoteMacAddress, &eepromData[0], 6);
+		memcpy(_primaryEncryptionKey, &eepromData[6], 16);
+		memcpy(_localEncryptionKey, &eepromData[22], 16);
+		if(eepromData[M2M_DIRECT_LEGACY_CHANNEL_ADDRESS] == uint8_t(~eepromData[M2M_DIRECT_LEGACY_CHANNEL_ADDRESS + 1]) && eepromData[M2M_DIRECT_LEGACY_CHANNEL_ADDRESS] >= 1 && eepromData[M2M_DIRECT_LEGACY_CHANNEL_ADDRESS] <= M2M_DIRECT_MAXIMUM_CHANNEL)
+		{
+			_storedChannel = eepromData[M2M_DIRECT_LEGACY_CHANNEL_ADDRESS];
+		}
+		return true;
+	#elif defined ESP32
+		uint8_t successes = 0;
+		settings.begin(preferencesNamespace, true);
+		if(settings.isKey(pairedMacKey) == false)
+		{
+			settings.end();
+			return false;
+		}
+		successes+=settings.getBytes(pairedMacKey, _remoteMacAddress, 6);
+		successes+=settings.getBytes(pairedPrimaryKey, _primaryEncryptionKey, 16);
+		successes+=settings.getBytes(pairedLocalKey, _localEncryptionKey, 16);
+		if(settings.getType(pairedNameKey) != PT_INVALID && settings.getType(pairedNameLengthKey) != PT_INVALID)	//There is a name stored
+		{
+			uint8_t len = settings.getUChar(pairedNameLengthKey, 0);
+			if(len > 0 && remoteDeviceName == nullptr)
+			{
+				remoteDeviceName = new char[len + 1];
+				settings.getString(pairedNameKey, remoteDeviceName, len + 1);
+			}
+		}
+		settings.end();
+		return successes >= 38;
+	#endif
+	return false;
+}
+/*
+ *
+ *	Packs the pairing, channel, link parameters and remote device name into a record, returning its length
+ *
+ *	[0] version, [1-6] remote MAC address, [7-22] primary key, [23-38] local key, [39] channel, [40-47] link parameters, [48] name length, then the name
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_packRecord(const m2mDirectLinkState &linkState, uint8_t* record)
+{
+	record[0] = M2M_DIRECT_RECORD_VERSION;
+	memcpy(&record[1], _remoteMacAddress, 6);
+	memcpy(&record[7], _primaryEncryptionKey, 16);
+	memcpy(&record[23], _localEncryptionKey, 16);
+	record[39] = linkState.channel;
+	_packLinkState(linkState, &record[40]);
+	uint8_t nameLength = 0;
+	if(remoteDeviceName != nullptr)
+	{
+		size_t remoteDeviceNameLength = strlen(remoteDeviceName);
+		nameLength = remoteDeviceNameLength < M2M_DIRECT_STORE_MAXIMUM_RECORD - M2M_DIRECT_RECORD_NAME_ADDRESS - 1 ? remoteDeviceNameLength : M2M_DIRECT_STORE_MAXIMUM_RECORD - M2M_DIRECT_RECORD_NAME_ADDRESS - 1;	//Long names are truncated
+		memcpy(&record[M2M_DIRECT_RECORD_NAME_ADDRESS + 1], remoteDeviceName, nameLength);
+	}
+	record[M2M_DIRECT_RECORD_NAME_ADDRESS] = nameLength;
+	return M2M_DIRECT_RECORD_NAME_ADDRESS + 1 + nameLength;
+}
+/*
+ *
+ *	Unpacks a record read from the store, returning false if it isn't one this version understands
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_unpackRecord(const uint8_t* record, uint8_t length)
+{
+	if(length <= M2M_DIRECT_RECORD_NAME_ADDRESS || record[0] != M2M_DIRECT_RECORD_VERSION || length != M2M_DIRECT_RECORD_NAME_ADDRESS + 1 + record[M2M_DIRECT_RECORD_NAME_ADDRESS])
+	{
+		return false;
+	}
+	memcpy(_remoteMacAddress, &record[1], 6);
+	memcpy(_primaryEncryptionKey, &record[7], 16);
+	memcpy(_localEncryptionKey, &record[23], 16);
+	_storedChannel = record[39] <= M2M_DIRECT_MAXIMUM_CHANNEL ? record[39] : 0;
+	_unpackLinkState(&record[40], _savedLinkState);
+	_savedLinkState.channel = _storedChannel;
+	uint8_t nameLength = record[M2M_DIRECT_RECORD_NAME_ADDRESS];
+	if(nameLength > 0)
+	{
+		if(remoteDeviceName != nullptr)
+		{
+			delete[] remoteDeviceName;
+		}
+		remoteDeviceName = new char[nameLength + 1];
+		memcpy(remoteDeviceName, &record[M2M_DIRECT_RECORD_NAME_ADDRESS + 1], nameLength);
+		remoteDeviceName[nameLength] = 0;
+	}
+	return true;
+}
+/*
+ *
+ *	Reads the newest record from the store. On ESP8266 this scans every slot, which also finds where the next record goes
+ *
+ *	Slot layout: [0-1] magic, [2-5] sequence number, [6] record length, [7] reserved, then the record, then a CRC32 of everything before it
+ *	A slot torn by a power loss fails its CRC and is skipped, leaving the previous record in place
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_loadRecord(uint8_t* record, uint8_t &length)
+{
+	if(_storeAvailable() == false)
+	{
+		return false;
+	}
+	#if defined(ESP8266)
+		uint32_t slotData[M2M_DIRECT_STORE_SLOT_SIZE / 4];	//Flash reads are in whole words
+		uint8_t* slot = (uint8_t*)slotData;
+		bool found = false;
+		uint8_t sectorEnd[2] = {0, 0};	//Slot after the last one written in each sector
+		_storeSector = 0;
+		_storeNextSlot = 0;
+		for(uint8_t sector = 0; sector < _storeSectors(); sector++)
+		{
+			for(uint8_t index = 0; index < M2M_DIRECT_STORE_SLOTS; index++)
+			{
+				if(ESP.flashRead(_storeSectorNumber(sector) * SPI_FLASH_SEC_SIZE + index * M2M_DIRECT_STORE_SLOT_SIZE, slotData, M2M_DIRECT_STORE_SLOT_SIZE) == false)
+				{
+					_storeNextSlot = 0xff;	//Try again next time
+					return false;
+				}
+				if(slotData[0] == 0xffffffff && slotData[1] == 0xffffffff)
+				{
+					continue;	//Erased
+				}
+				sectorEnd[sector] = index + 1;	//New records go after anything written, even a torn or unrecognised slot
+				uint16_t magic = uint16_t(slot[0]) << 8 | slot[1];
+				uint32_t sequence = uint32_t(slot[2]) << 24 | uint32_t(slot[3]) << 16 | uint32_t(slot[4]) << 8 | slot[5];
+				uint8_t recordLength = slot[6];
+				if(magic != M2M_DIRECT_STORE_MAGIC || recordLength > M2M_DIRECT_STORE_MAXIMUM_RECORD)
+				{
+					continue;
+				}
+				CRC32 crc;
+				crc.add(slot, M2M_DIRECT_STORE_SLOT_HEADER + recordLength);
+				uint8_t* crcBytes = &slot[M2M_DIRECT_STORE_SLOT_HEADER + recordLength];
+				uint32_t crcFromFlash = uint32_t(crcBytes[0]) << 24 | uint32_t(crcBytes[1]) << 16 | uint32_t(crcBytes[2]) << 8 | crcBytes[3];
+				if(crc.calc() != crcFromFlash)
+				{
+					continue;
+				}
+				if(found == false || int32_t(sequence - _storeSequence) > 0)
+				{
+					memcpy(record, &slot[M2M_DIRECT_STORE_SLOT_HEADER], recordLength);
+					length = recordLength;
+					_storeSequence = sequence;
+					_storeSector = sector;
+					found = true;
+				}
+			}
+		}
+		_storeNextSlot = sectorEnd[_storeSector];	//Carry on in the sector with the newest record
+		return found;
+	#elif defined ESP32
+		settings.begin(preferencesNamespace, true);
+		size_t recordLength = settings.getBytesLength(pairedRecordKey);
+		bool found = recordLength > 0 && recordLength <= M2M_DIRECT_STORE_MAXIMUM_RECORD && settings.getBytes(pairedRecordKey, record, recordLength) == recordLength;
+		settings.end();
+		if(found == true)
+		{
+			length = recordLength;
+		}
+		return found;
+	#endif
+	return false;
+}
+/*
+ *
+ *	Replaces the record in the store. On ESP8266 it is appended to the next erased slot, so the previous record stays valid until the new one is complete
+ *	When the sector is full the other sector is erased and the record starts it. That sector only holds older records, so a power loss at any point leaves the newest complete record readable
+ *	Without a spare sector there is only one to erase, and a power loss between that erase and the write that follows loses the record
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_storeRecord(const uint8_t* record, uint8_t length)
+{
+	if(length > M2M_DIRECT_STORE_MAXIMUM_RECORD || _storeAvailable() == false)
+	{
+		return false;
+	}
+	#if defined(ESP8266)
+		if(_storeNextSlot == 0xff)	//Find the end of the log
+		{
+			uint8_t scratch[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+			uint8_t scratchLength = 0;
+			_loadRecord(scratch, scratchLength);
+			if(_storeNextSlot == 0xff)
+			{
+				return false;
+			}
+		}
+		if(_storeNextSlot >= M2M_DIRECT_STORE_SLOTS)
+		{
+			uint8_t nextSector = (_storeSector + 1) % _storeSectors();
+			if(ESP.flashEraseSector(_storeSectorNumber(nextSector)) == false)
+			{
+				return false;
+			}
+			_statistics.storeErases++;
+			_storeSector = nextSector;
+			_storeNextSlot = 0;
+		}
+		uint32_t slotData[M2M_DIRECT_STORE_SLOT_SIZE / 4];
+		uint8_t* slot = (uint8_t*)slotData;
+		memset(slot, 0xff, M2M_DIRECT_STORE_SLOT_SIZE);
+		uint32_t sequence = _storeSequence + 1;
+		slot[0] = (M2M_DIRECT_STORE_MAGIC & 0xff00) >> 8;
+		slot[1] = (M2M_DIRECT_STORE_MAGIC & 0x00ff);
+		slot[2] = (sequence & 0xff000000) >> 24;
+		slot[3] = (sequence & 0x00ff0000) >> 16;
+		slot[4] = (sequence & 0x0000ff00) >> 8;
+		slot[5] = (sequence & 0x000000ff);
+		slot[6] = length;
+		memcpy(&slot[M2M_DIRECT_STORE_SLOT_HEADER], record, length);
+		CRC32 crc;
+		crc.add(slot, M2M_DIRECT_STORE_SLOT_HEADER + length);
+		uint8_t* crcBytes = &slot[M2M_DIRECT_STORE_SLOT_HEADER + length];
+		crcBytes[0] = (crc.calc() & 0xff000000) >> 24; //CRC
+		crcBytes[1] = (crc.calc() & 0x00ff0000) >> 16;
+		crcBytes[2] = (crc.calc() & 0x0000ff00) >> 8;
+		crcBytes[3] = (crc.calc() & 0x000000ff);
+		uint16_t writeLength = (M2M_DIRECT_STORE_SLOT_HEADER + length + 4 + 3) & ~3;	//Flash writes are in whole words
+		bool success = ESP.flashWrite(_storeSectorNumber(_storeSector) * SPI_FLASH_SEC_SIZE + _storeNextSlot * M2M_DIRECT_STORE_SLOT_SIZE, slotData, writeLength);
+		_storeNextSlot++;	//Even a failed write may have left something in the slot
+		if(success == true)
+		{
+			_storeSequence = sequence;
+			_statistics.recordsSaved++;
+		}
+		return success;
+	#elif defined ESP32
+		settings.begin(preferencesNamespace, false);
+		bool success = settings.putBytes(pairedRecordKey, record, length) == length;
+		settings.end();
+		if(success == true)
+		{
+			_statistics.recordsSaved++;
+		}
+		return success;
+	#endif
+	return false;
+}
+/*
+ *
+ *	Erases every record, and any pairing saved by an earlier version. On ESP8266 an empty record follows, so the sequence number never goes back
+ *
+ *	With a spare sector the empty record is written into the other sector before the one holding the newest record is erased, so a power loss
+ *	leaves either the old pairing or the empty record, and the sequence number survives. With one sector a power loss between the erase and the write
+ *	starts the sequence number again, which listeners recover from after M2M_DIRECT_BROADCAST_SOURCE_TIMEOUT
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_eraseRecords()
+{
+	if(_storeAvailable() == false)
+	{
+		return false;
+	}
+	#if defined(ESP8266)
+		if(_storeNextSlot == 0xff)	//Find the sequence number and the sector holding the newest record
+		{
+			uint8_t scratch[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+			uint8_t scratchLength = 0;
+			_loadRecord(scratch, scratchLength);
+			if(_storeNextSlot == 0xff)
+			{
+				return false;
+			}
+		}
+		uint8_t empty[1] = {0};
+		if(_storeSectors() > 1)
+		{
+			uint8_t oldSector = _storeSector;
+			uint8_t newSector = (oldSector + 1) % _storeSectors();
+			if(ESP.flashEraseSector(_storeSectorNumber(newSector)) == false)
+			{
+				_storeNextSlot = 0xff;	//Find out what is left next time
+				return false;
+			}
+			_statistics.storeErases++;
+			_storeSector = newSector;
+			_storeNextSlot = 0;
+			if(_storeSequence != 0 && _storeRecord(empty, 0) == false)	//Carry the sequence number on, it is the broadcast epoch
+			{
+				_storeNextSlot = 0xff;	//The old pairing is still there, leave it rather than lose the sequence number
+				return false;
+			}
+			if(ESP.flashEraseSector(_storeSectorNumber(oldSector)) == false)
+			{
+				_storeNextSlot = 0xff;
+				return false;
+			}
+			_statistics.storeErases++;
+			return true;
+		}
+		if(ESP.flashEraseSector(_storeSectorNumber(0)) == false)
+		{
+			_storeNextSlot = 0xff;
+			return false;
+		}
+		_statistics.storeErases++;
+		_storeSector = 0;
+		_storeNextSlot = 0;
+		if(_storeSequence != 0)
+		{
+			_storeRecord(empty, 0);	//Carry the sequence number on, it is the broadcast epoch
+		}
+		return true;
+	#elif defined ESP32
+		settings.begin(preferencesNamespace, false);
+		bool success = settings.remove(pairedRecordKey) || settings.isKey(pairedRecordKey) == false;
+		settings.remove(pairedMacKey);
+		settings.remove(pairedPrimaryKey);
+		settings.remove(pairedLocalKey);
+		settings.remove(pairedNameLengthKey);
+		settings.remove(pairedNameKey);
+		settings.end();
+		return success;
+	#endif
+	return false;
+}
+#if defined(ESP8266)
+/*
+ *
+ *	Number of sectors the store can use, two if a spare sector is defined and isn't part of a filesystem
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_storeSectors()
+{
+	#if defined(M2M_DIRECT_STORE_SPARE_SECTOR)
+	uint32_t spareAddress = 0x40200000 + M2M_DIRECT_STORE_SPARE_SECTOR * SPI_FLASH_SEC_SIZE;
+	if(spareAddress >= (uint32_t)&_FS_start && spareAddress < (uint32_t)&_FS_end)
+	{
+		return 1;
+	}
+	return 2;
+	#else
+	return 1;
+	#endif
+}
+/*
+ *
+ *	Flash sector number of the first or spare store sector
+ *
+ */
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::_storeSectorNumber(uint8_t sector)
+{
+	#if defined(M2M_DIRECT_STORE_SPARE_SECTOR)
+	return sector == 0 ? M2M_DIRECT_STORE_SECTOR : M2M_DIRECT_STORE_SPARE_SECTOR;
+	#else
+	return M2M_DIRECT_STORE_SECTOR;
+	#endif
+}
+#endif
+/*
+ *
+ *	Returns the link parameters in use now
+ *
+ */
+m2mDirectLinkState ICACHE_FLASH_ATTR m2mDirectClass::_currentLinkState()
+{
+	m2mDirectLinkState linkState;
+	linkState.channel = _communicationChannel;
+	linkState.minTxPower = _minTxPower;
+	linkState.currentTxPower = _currentTxPower;
+	linkState.keepaliveInterval = _keepaliveInterval;
+	#if defined(ESP32)
+	linkState.rateIndex = _bestRateIndex;
+	#endif
+	linkState.valid = true;
+	return linkState;
+}
+/*
+ *
+ *	Packs link parameters for saving. The channel has its own place in the record so isn't included
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_packLinkState(const m2mDirectLinkState &linkState, uint8_t* data)
+{
+	data[0] = linkState.valid ? M2M_DIRECT_LINK_STATE_VERSION : 0;
+	data[1] = uint8_t(linkState.minTxPower);
+	data[2] = uint8_t(linkState.currentTxPower);
+	data[3] = (linkState.keepaliveInterval & 0xff000000) >> 24;
+	data[4] = (linkState.keepaliveInterval & 0x00ff0000) >> 16;
+	data[5] = (linkState.keepaliveInterval & 0x0000ff00) >> 8;
+	data[6] = (linkState.keepaliveInterval & 0x000000ff);
+	data[7] = linkState.rateIndex;
+}
+/*
+ *
+ *	Unpacks saved link parameters, returning false and leaving them alone if they are missing or don't make sense
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_unpackLinkState(const uint8_t* data, m2mDirectLinkState &linkState)
+{
+	int8_t minTxPower = int8_t(data[1]);
+	int8_t currentTxPower = int8_t(data[2]);
+	uint32_t keepaliveInterval = uint32_t(data[3]) << 24 | uint32_t(data[4]) << 16 | uint32_t(data[5]) << 8 | data[6];
+	if(data[0] != M2M_DIRECT_LINK_STATE_VERSION || minTxPower < 0 || minTxPower > _maxTxPower || currentTxPower < minTxPower || currentTxPower > _maxTxPower ||
+		keepaliveInterval < _minimumKeepaliveInterval || keepaliveInterval > _maximumKeepaliveInterval
+		#if defined(ESP32)
+		|| data[7] >= M2M_DIRECT_RATE_COUNT
+		#endif
+		)
+	{
+		return false;
+	}
+	linkState.minTxPower = minTxPower;
+	linkState.currentTxPower = currentTxPower;
+	linkState.keepaliveInterval = keepaliveInterval;
+	linkState.rateIndex = data[7];
+	linkState.valid = true;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\r\n\tSaved Tx power: %.2fdBm floor: %.2fdBm keepalive: %ums"), (float)currentTxPower * 0.25, (float)minTxPower * 0.25, keepaliveInterval);
+	}
+	return true;
+}
+/*
+ *
+ *	Resumes at the saved operating point the first time the link connects after boot, so Tx power, the keepalive interval and PHY rate don't start from defaults
+ *	This waits for the connection as a saved low Tx power or long keepalive interval would make connecting slow if things have changed
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_restoreLinkState()
+{
+	_lastLinkStateSave = millis();	//Let the link settle before saving anything
+	if(_linkStateRestored == true || _savedLinkState.valid == false)
+	{
+		return;
+	}
+	_linkStateRestored = true;
+	if(_automaticTxPower == true)
+	{
+		_minTxPower = _savedLinkState.minTxPower;
+		if(esp_wifi_set_max_tx_power(_savedLinkState.currentTxPower) == ESP_OK)
+		{
+			_currentTxPower = _savedLinkState.currentTxPower;
+		}
+	}
+	_keepaliveInterval = _savedLinkState.keepaliveInterval;
+	#if defined(ESP32)
+	if(_rateAdaptation == true)
+	{
+		_bestRateIndex = _savedLinkState.rateIndex;	//Treated as reliable until the first real measurement replaces it
+		_rateStatistics[_bestRateIndex].probability = M2M_DIRECT_RATE_MINIMUM_PROBABILITY;
+	}
+	#endif
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\r\nResumed saved link parameters"));
+	}
+}
+/*
+ *
+ *	Saves the link parameters if they have moved far enough from those saved, no more often than M2M_DIRECT_LINK_STATE_SAVE_INTERVAL
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_linkStateHousekeeping()
+{
+	if((_pairingInfoRead == false && _pairingInfoWritten == false) || _provisionedTemporarily == true || millis() - _lastLinkStateSave < M2M_DIRECT_LINK_STATE_SAVE_INTERVAL)	//Saving link parameters would save a temporary pairing too
+	{
+		return;
+	}
+	m2mDirectLinkState linkState = _currentLinkState();
+	uint32_t keepaliveChange = linkState.keepaliveInterval > _savedLinkState.keepaliveInterval ? linkState.keepaliveInterval - _savedLinkState.keepaliveInterval : _savedLinkState.keepaliveInterval - linkState.keepaliveInterval;
+	if(_savedLinkState.valid == true &&
+		linkState.channel == _savedLinkState.channel &&
+		linkState.rateIndex == _savedLinkState.rateIndex &&
+		abs(linkState.minTxPower - _savedLinkState.minTxPower) < M2M_DIRECT_LINK_STATE_POWER_CHANGE &&
+		abs(linkState.currentTxPower - _savedLinkState.currentTxPower) < M2M_DIRECT_LINK_STATE_POWER_CHANGE &&
+		uint64_t(keepaliveChange) * 100 < uint64_t(_savedLinkState.keepaliveInterval) * M2M_DIRECT_LINK_STATE_KEEPALIVE_CHANGE)
+	{
+		return;	//Nothing worth the flash wear
+	}
+	_lastLinkStateSave = millis();
+	if(_writeLinkState(linkState))
+	{
+		_savedLinkState = linkState;
+	}
+}
+/*
+ *
+ *	Saves the link parameters and channel, rewriting the whole record so they stay consistent with the pairing
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_writeLinkState(const m2mDirectLinkState &linkState)
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rWriting link parameters: "));
+	}
+	uint8_t record[M2M_DIRECT_STORE_MAXIMUM_RECORD];
+	uint8_t length = _packRecord(linkState, record);
+	if(_storeRecord(record, length))
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("OK"));
+		}
+		return true;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("failed"));
+	}
+	return false;
+}
+/*
+ *
+ *	Delete pairing from flash (ESP8266) or 'preferences' (ESP32)
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_deletePairingInfo()
+{
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\n\rDeleting pairing: "));
+	}
+	if(_eraseRecords())
+	{
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("OK"));
+		}
+		esp_now_del_peer(_remoteMacAddress);
+		_savedLinkState = m2mDirectLinkState();
+		_storedChannel = 0;
+		memset(_remoteMacAddress, 0, 6);
+		memset(_primaryEncryptionKey, 0, 16);
+		memset(_localEncryptionKey, 0, 16);
+		if(remoteDeviceName != nullptr)
+		{
+			delete[] remoteDeviceName;
+			remoteDeviceName = nullptr;
+		}
+		return true;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("failed"));
+	}
+	return false;
+}
+/*
+ *
+ *	Reset pairing info and reset state to re-pair
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::resetPairing()
+{
+	if(_deletePairingInfo())
+	{
+		/*
+		if(_pairingInfoRead == false)
+		{
+			if(_encyptionEnabled == true)
+			{
+				_chooseEncryptionKeys();
+			}
+			else
+			{
+				_clearEncryptionKeys();
+			}
+		}
+		*/
+		_pairingInfoRead = false;
+		_pairingInfoWritten = false;
+		_provisioned = false;
+		_provisionedTemporarily = false;
+		if(state == m2mDirectState::connected)
+		{
+			_postEvent(m2mDirectEvent::disconnected);
+		}
+		if(state != m2mDirectState::uninitialised)	//Otherwise ESP-Now isn't running yet, it starts pairing once it is
+		{
+			state = m2mDirectState::initialised;
+			_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_INITIALISED_INTERVAL;
+			if(debug_uart_ != nullptr)
+			{
+				_debugState();
+			}
+		}
+		return true;
+	}
+	return false;
+}
+/*
+ *
+ *	Reduce Tx Power
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_reduceTxPower()
+{
+	if(_currentTxPower > _minTxPower)
+	{
+		if(esp_wifi_set_max_tx_power(_currentTxPower - 1) == ESP_OK)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\r\nReduced Tx power to: %.2fdBm"), (float)_currentTxPower * 0.25);
+			}
+			_currentTxPower--;
+			_statistics.txPowerChanges++;
+			_lastTxPowerChange = millis();
+			_lastTxPowerChangeDownwards = true;
+			return true;
+		}
+		else
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\r\nUnable to reduced Tx power"));
+			}
+			return false;
+		}
+	}
+	return false;
+}
+/*
+ *
+ *	Increase Tx Power
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_increaseTxPower()
+{
+	if(_currentTxPower < _maxTxPower)
+	{
+		if(esp_wifi_set_max_tx_power(_currentTxPower + 1) == ESP_OK)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->printf_P(PSTR("\r\nIncreased Tx power to: %.2fdBm"), (float)_currentTxPower * 0.25);
+			}
+			_currentTxPower++;
+			_statistics.txPowerChanges++;
+			_lastTxPowerChange = millis();
+			_lastTxPowerChangeDownwards = false;
+			return true;
+		}
+		else
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\r\nUnable to increase Tx power"));
+			}
+			return false;
+		}
+	}
+	return false;
+}
+/*
+ *
+ *	Sets the Tx power, clamped to the current limits
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_setTxPower(int16_t power)
+{
+	if(power < _minTxPower)
+	{
+		power = _minTxPower;
+	}
+	else if(power > _maxTxPower)
+	{
+		power = _maxTxPower;
+	}
+	if(power == _currentTxPower)
+	{
+		return false;
+	}
+	if(esp_wifi_set_max_tx_power(power) == ESP_OK)
+	{
+		_lastTxPowerChangeDownwards = power < _currentTxPower;
+		_currentTxPower = power;
+		_statistics.txPowerChanges++;
+		_lastTxPowerChange = millis();
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR("\r\nSet Tx power to: %.2fdBm"), (float)_currentTxPower * 0.25);
+		}
+		return true;
+	}
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->print(F("\r\nUnable to set Tx power"));
+	}
+	return false;
+}
+/*
+ *
+ *	Takes the latest link report from the peer, returning true if a new one arrived since the last keepalive
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_readLinkReport()
+{
+	uint32_t report = _remoteLinkReport.exchange(0);
+	if(report == 0)
+	{
+		return false;
+	}
+	_remoteLinkReportSeen = true;
+	_remoteRssi = (report >> 16) & M2M_DIRECT_LINK_REPORT_RSSI_VALID ? int8_t((report >> 8) & 0xff) : M2M_DIRECT_RSSI_UNKNOWN;
+	_remoteReceiveQuality = report & 0xff;
+	return true;
+}
+/*
+ *
+ *	Chooses the Tx power for the next keepalive. If the peer reports the RSSI of frames from this end, half the error from the target is closed each keepalive
+ *	A lost frame raises the power by a large step straight away whatever the RSSI, so interference is handled too. Without an RSSI report the power creeps down while nothing is lost
+ *	If the peer is an older version that sends no reports, the original one step walk is used
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_txPowerControl(bool reportReceived)
+{
+	if(_remoteLinkReportSeen == false)
+	{
+		if(_sendQuality == 0xffffffff)
+		{
+			if(_currentTxPower == _minTxPower && _minTxPower > 9 && millis() - _lastTxPowerChange < _keepaliveInterval * 100) //Try reducing the minimum power after 100 good keepalives at the current minimum
+			{
+				_minTxPower--;
+			}
+			_reduceTxPower();
+		}
+		else
+		{
+			if(_lastTxPowerChangeDownwards == true && millis() - _lastTxPowerChange < _keepaliveInterval * 5) //A recent power reduction _probably_ caused packet loss
+			{
+				_minTxPower++;
+			}
+			_increaseTxPower();
+		}
+		return;
+	}
+	int16_t power = _currentTxPower;
+	#if defined(ESP32)
+	bool lastFrameLost = (_sendQuality & 0x80000000) == 0 && _rateSample == false;	//Losing a rate sample says nothing about Tx power
+	#else
+	bool lastFrameLost = (_sendQuality & 0x80000000) == 0;
+	#endif
+	if(lastFrameLost == true)	//The last frame wasn't acknowledged
+	{
+		power += M2M_DIRECT_TX_POWER_LOSS_STEP;
+	}
+	else if(reportReceived == true && _remoteRssi != M2M_DIRECT_RSSI_UNKNOWN)
+	{
+		int16_t error = _remoteRssi - _txPowerTargetRssi;	//dB above the target
+		if(abs(error) > M2M_DIRECT_TX_POWER_DEADBAND)
+		{
+			power -= error * 2;	//Half the error, Tx power is in 0.25dBm steps
+		}
+	}
+	else if(_sendQuality == 0xffffffff)
+	{
+		power--;
+	}
+	_setTxPower(power);
+}
+/*
+ *
+ *	Sets the RSSI automatic Tx power aims for at the peer. Higher gives more margin against fading, lower saves power and interference
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::setTxPowerTarget(int8_t rssi)
+{
+	_txPowerTargetRssi = rssi;
+}
+/*
+ *
+ *	Returns the RSSI the peer reports for frames from this end, or M2M_DIRECT_RSSI_UNKNOWN
+ *
+ */
+int8_t ICACHE_FLASH_ATTR m2mDirectClass::remoteRssi()
+{
+	return _remoteRssi;
+}
+/*
+ *
+ *	Returns how many of the last 32 keepalives from this end the peer reports receiving
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::remoteReceiveQuality()
+{
+	return _remoteReceiveQuality;
+}
+/*
+ *
+ *	Returns the Tx power the peer reports using, in dBm
+ *
+ */
+float ICACHE_FLASH_ATTR m2mDirectClass::remoteTxPower()
+{
+	return (float)_remoteTxPower * 0.25;
+}
+/*
+ *
+ *	Returns the smoothed RSSI of frames from the peer, or M2M_DIRECT_RSSI_UNKNOWN if there is no radio metadata (ESP8266)
+ *
+ */
+int8_t ICACHE_FLASH_ATTR m2mDirectClass::rssi()
+{
+	return _receivedRssi;
+}
+/*
+ *
+ *	Returns the radio metadata for the message currently in the application buffer
+ *
+ */
+m2mDirectFrameMetadata ICACHE_FLASH_ATTR m2mDirectClass::receivedMessageMetadata()
+{
+	return _receivedMessageMetadata;
+}
+/*
+ *
+ *	Copies the MAC address of the device that sent the current received message, the paired device or one in the peer table
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::receivedMessageSender(uint8_t* macAddress)
+{
+	if(macAddress == nullptr)
+	{
+		return;
+	}
+	if(_receivedPacketBuffer[0] == M2M_DIRECT_BROADCAST_FLAG || _receivedPacketBuffer[0] == M2M_DIRECT_RELAY_FLAG)
+	{
+		memcpy(macAddress, &_receivedPacketBuffer[2], MAC_ADDRESS_LENGTH);	//The publisher or origin, from the header
+	}
+	else if(_receivedMessagePeer != M2M_DIRECT_NO_PEER)
+	{
+		memcpy(macAddress, _receivedMessagePeerAddress, MAC_ADDRESS_LENGTH);	//The peer may have been removed since
+	}
+	else
+	{
+		memcpy(macAddress, _remoteMacAddress, MAC_ADDRESS_LENGTH);
+	}
+}
+/*
+ *
+ *	Returns true if the current received message is a broadcast, rather than sent to this device
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::receivedMessageBroadcast()
+{
+	return _receivedPacketBuffer[0] == M2M_DIRECT_BROADCAST_FLAG;
+}
+/*
+ *
+ *	Returns the group of the current received broadcast, 0 for anything else
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::receivedMessageGroup()
+{
+	if(_receivedPacketBuffer[0] == M2M_DIRECT_BROADCAST_FLAG)
+	{
+		return _receivedPacketBuffer[8];
+	}
+	return 0;
+}
+/*
+ *
+ *	Returns the number of links the current received message crossed, more than one if relays passed it on
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::receivedMessageHops()
+{
+	if(_receivedPacketBuffer[0] == M2M_DIRECT_RELAY_FLAG)
+	{
+		return _receivedPacketBuffer[15];
+	}
+	return 1;
+}
+#if defined(ESP32)
+static const struct {
+	wifi_phy_rate_t rate;
+	uint16_t kbps;
+} m2mDirectRates[M2M_DIRECT_RATE_COUNT] = {	//Index 0 is used for broadcasts as every device can receive it
+	{WIFI_PHY_RATE_1M_L, 1000},
+	{WIFI_PHY_RATE_2M, 2000},
+	{WIFI_PHY_RATE_5M_L, 5500},
+	{WIFI_PHY_RATE_6M, 6000},
+	{WIFI_PHY_RATE_9M, 9000},
+	{WIFI_PHY_RATE_11M_L, 11000},
+	{WIFI_PHY_RATE_12M, 12000},
+	{WIFI_PHY_RATE_18M, 18000},
+	{WIFI_PHY_RATE_24M, 24000},
+	{WIFI_PHY_RATE_36M, 36000},
+	{WIFI_PHY_RATE_48M, 48000},
+	{WIFI_PHY_RATE_54M, 54000},
+	{WIFI_PHY_RATE_LORA_500K, 500},	//Long range rates, only usable if both ends have LR enabled
+	{WIFI_PHY_RATE_LORA_250K, 250}
+};
+/*
+ *
+ *	Chooses the PHY rate for the next unicast frame. Normally this is the best rate, or the most robust one straight after a loss
+ *	Every M2M_DIRECT_RATE_SAMPLE_INTERVAL frames one is sent at the next rate, round robin, whose nominal speed beats the best rate's throughput
+ *	If even the best rate isn't reliable, slower rates are sampled too, which is how the link falls back to long range mode
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_chooseRate(bool sampleAllowed)
+{
+	_rateSample = false;
+	if(_rateAdaptation == false || state != m2mDirectState::connected || _instancesRunning() > 1)	//Instances sharing the radio would keep changing each other's rate
+	{
+		_applyRate(0);
+		return _currentRateIndex;
+	}
+	if(millis() - _rateTimer > M2M_DIRECT_RATE_INTERVAL)
+	{
+		_updateRates();
 	}
-	else if(type == DATA_INT64_T)
+	uint8_t index = _rateFailures > 0 ? _robustRateIndex : _bestRateIndex;
+	if(_rateUsable(index) == false)	//Long range rate and the peer has stopped allowing it
 	{
-		debug_uart_->print(F("INT64_t"));
+		index = 0;
 	}
-	else if(type == DATA_FLOAT)
+	if(sampleAllowed == true && _rateFailures == 0 && ++_rateSampleCounter >= M2M_DIRECT_RATE_SAMPLE_INTERVAL)
 	{
-		debug_uart_->print(F("FLOAT"));
+		_rateSampleCounter = 0;
+		uint32_t bestThroughput = uint32_t(_rateStatistics[_bestRateIndex].probability) * m2mDirectRates[_bestRateIndex].kbps;
+		bool bestReliable = _rateStatistics[_bestRateIndex].probability >= M2M_DIRECT_RATE_MINIMUM_PROBABILITY;
+		for(uint8_t step = 1; step < M2M_DIRECT_RATE_COUNT; step++)
+		{
+			uint8_t candidate = (_rateSampleIndex + step) % M2M_DIRECT_RATE_COUNT;
+			if(candidate != _bestRateIndex && _rateUsable(candidate) &&
+				(uint32_t(m2mDirectRates[candidate].kbps) * 1000 > bestThroughput || (bestReliable == false && m2mDirectRates[candidate].kbps < m2mDirectRates[_bestRateIndex].kbps)))
+			{
+				_rateSampleIndex = candidate;
+				index = candidate;
+				_rateSample = true;
+				break;
+			}
+		}
 	}
-	else if(type == DATA_DOUBLE)
+	_applyRate(index);
+	return _currentRateIndex;
+}
+/*
+ *
+ *	The interface ESP-Now frames go out on. The station whenever it is enabled, including alongside a soft AP, so peers, protocols and rates all agree
+ *
+ */
+wifi_interface_t ICACHE_FLASH_ATTR m2mDirectClass::_espNowInterface()
+{
+	wifi_mode_t mode = WiFi.getMode();
+	return (mode == WIFI_STA || mode == WIFI_AP_STA) ? WIFI_IF_STA : WIFI_IF_AP;
+}
+/*
+ *
+ *	Configures ESP-Now for a PHY rate, if it isn't already
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_applyRate(uint8_t index)
+{
+	if(index == _radioRateIndex)	//The rate is one setting for the radio, another instance may have changed it
 	{
-		debug_uart_->print(F("DOUBLE"));
+		_currentRateIndex = index;
+		return true;
 	}
-	else if(type == DATA_CHAR)
+	if(esp_wifi_config_espnow_rate(_espNowInterface(), m2mDirectRates[index].rate) == ESP_OK)
 	{
-		debug_uart_->print(F("CHAR"));
+		_currentRateIndex = index;
+		_radioRateIndex = index;
+		return true;
 	}
-	else if(type == DATA_BOOL_ARRAY)
+	if(debug_uart_ != nullptr)
 	{
-		debug_uart_->print(F("BOOL_ARRAY"));
+		debug_uart_->printf_P(PSTR("\n\rUnable to set PHY rate %ukbps"), m2mDirectRates[index].kbps);
 	}
-	else if(type == DATA_UINT8_T_ARRAY)
+	return false;
+}
+/*
+ *
+ *	Records whether a unicast frame sent at a rate was acknowledged
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_recordRateResult(uint8_t index, bool success)
+{
+	_rateStatistics[index].attempts++;
+	if(_rateIntervalAttempts[index] < 0xffff)
 	{
-		debug_uart_->print(F("UINT8_T_ARRAY"));
+		_rateIntervalAttempts[index]++;
 	}
-	else if(type == DATA_UINT16_T_ARRAY)
+	if(success == true)
 	{
-		debug_uart_->print(F("UINT16_T_ARRAY"));
+		_rateStatistics[index].successes++;
+		if(_rateIntervalSuccesses[index] < 0xffff)
+		{
+			_rateIntervalSuccesses[index]++;
+		}
+		if(_rateSample == false)
+		{
+			_rateFailures = 0;
+		}
 	}
-	else if(type == DATA_UINT32_T_ARRAY)
+	else if(_rateSample == false && _rateFailures < 0xff)
 	{
-		debug_uart_->print(F("UINT32_T_ARRAY"));
+		_rateFailures++;
+	}
+}
+/*
+ *
+ *	Folds the last interval into the smoothed delivery probabilities then picks the best throughput rate that is reliable enough, and the most reliable rate
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_updateRates()
+{
+	_rateTimer = millis();
+	for(uint8_t index = 0; index < M2M_DIRECT_RATE_COUNT; index++)
+	{
+		if(_rateIntervalAttempts[index] > 0)
+		{
+			uint16_t probability = (uint32_t(_rateIntervalSuccesses[index]) * 1000) / _rateIntervalAttempts[index];
+			if(_rateStatistics[index].attempts == _rateIntervalAttempts[index])	//First measurement
+			{
+				_rateStatistics[index].probability = probability;
+			}
+			else
+			{
+				_rateStatistics[index].probability = (_rateStatistics[index].probability * 3 + probability) / 4;
+			}
+			_rateIntervalAttempts[index] = 0;
+			_rateIntervalSuccesses[index] = 0;
+		}
+	}
+	uint8_t bestRateIndex = 0;
+	uint32_t bestThroughput = 0;
+	uint8_t robustRateIndex = 0;
+	for(uint8_t index = 0; index < M2M_DIRECT_RATE_COUNT; index++)
+	{
+		if(_rateUsable(index) == false)
+		{
+			continue;
+		}
+		uint32_t throughput = uint32_t(_rateStatistics[index].probability) * m2mDirectRates[index].kbps;
+		if(_rateStatistics[index].probability >= M2M_DIRECT_RATE_MINIMUM_PROBABILITY && throughput > bestThroughput)
+		{
+			bestRateIndex = index;
+			bestThroughput = throughput;
+		}
+		if(_rateStatistics[index].probability > _rateStatistics[robustRateIndex].probability ||
+			(_rateStatistics[index].probability == _rateStatistics[robustRateIndex].probability && m2mDirectRates[index].kbps < m2mDirectRates[robustRateIndex].kbps))	//Slower wins a tie, so with nothing measured this is the slowest rate
+		{
+			robustRateIndex = index;
+		}
+	}
+	if(bestThroughput == 0)
+	{
+		bestRateIndex = robustRateIndex;
+	}
+	if(debug_uart_ != nullptr && bestRateIndex != _bestRateIndex)
+	{
+		debug_uart_->printf_P(PSTR("\n\rPHY rate: %ukbps, delivery %u/1000"), m2mDirectRates[bestRateIndex].kbps, _rateStatistics[bestRateIndex].probability);
+	}
+	_bestRateIndex = bestRateIndex;
+	_robustRateIndex = robustRateIndex;
+}
+/*
+ *
+ *	Long range rates can only be used if both ends have LR enabled, this is exchanged in the keepalive link report
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_rateUsable(uint8_t index)
+{
+	if(m2mDirectRates[index].rate == WIFI_PHY_RATE_LORA_250K || m2mDirectRates[index].rate == WIFI_PHY_RATE_LORA_500K)
+	{
+		return _longRange == true && _remoteLongRange == true;
+	}
+	return true;
+}
+#endif
+/*
+ *
+ *	Allows Espressif long range (LR) mode. LR is added to the WiFi protocols so both normal and LR frames can be received
+ *	If the peer allows it too the rate controller falls back to the LR rates when no normal rate is reliable
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::longRange(bool enabled)
+{
+	#if defined(ESP32)
+	_longRange = enabled;
+	#endif
+}
+/*
+ *
+ *	Returns true if both ends allow long range mode
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::longRangeAvailable()
+{
+	#if defined(ESP32)
+	return _longRange == true && _remoteLongRange == true;
+	#else
+	return false;
+	#endif
+}
+/*
+ *
+ *	Enables/disables automatic PHY rate selection. When disabled, or on ESP8266, ESP-Now uses the robust 1Mbps rate
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::rateAdaptation(bool enabled)
+{
+	#if defined(ESP32)
+	_rateAdaptation = enabled;
+	#endif
+}
+/*
+ *
+ *	Returns the PHY rate unicast frames are currently sent at, in kbit/s
+ *
+ */
+uint16_t ICACHE_FLASH_ATTR m2mDirectClass::currentRate()
+{
+	#if defined(ESP32)
+	return m2mDirectRates[_currentRateIndex].kbps;
+	#else
+	return 1000;
+	#endif
+}
+/*
+ *
+ *	Returns the number of PHY rates with statistics
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::rateCount()
+{
+	#if defined(ESP32)
+	return M2M_DIRECT_RATE_COUNT;
+	#else
+	return 0;
+	#endif
+}
+/*
+ *
+ *	Returns the delivery statistics for a PHY rate, slowest first
+ *
+ */
+m2mDirectRateStatistics ICACHE_FLASH_ATTR m2mDirectClass::rateStatistics(uint8_t index)
+{
+	m2mDirectRateStatistics statistics;
+	#if defined(ESP32)
+	if(index < M2M_DIRECT_RATE_COUNT)
+	{
+		statistics = _rateStatistics[index];
+		statistics.kbps = m2mDirectRates[index].kbps;
+	}
+	#endif
+	return statistics;
+}
+/*
+ *
+ *	Enable/disable forward error correction of application messages. A parity frame follows every blockSize messages, or a block size
+ *	from M2M_DIRECT_FEC_MINIMUM_BLOCK to M2M_DIRECT_FEC_MAXIMUM_BLOCK is chosen from the loss the peer reports if blockSize is 0
+ *	Messages are only protected if the peer reports it can decode them
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::forwardErrorCorrection(bool enabled, uint8_t blockSize)
+{
+	_fecEnabled = enabled;
+	_fecAdaptiveBlockSize = blockSize == 0;
+	if(blockSize == 0)
+	{
+		_fecBlockSize = M2M_DIRECT_FEC_MAXIMUM_BLOCK;
+	}
+	else if(blockSize < M2M_DIRECT_FEC_MINIMUM_BLOCK)
+	{
+		_fecBlockSize = M2M_DIRECT_FEC_MINIMUM_BLOCK;
+	}
+	else if(blockSize > M2M_DIRECT_FEC_MAXIMUM_BLOCK)
+	{
+		_fecBlockSize = M2M_DIRECT_FEC_MAXIMUM_BLOCK;
+	}
+	else
+	{
+		_fecBlockSize = blockSize;
+	}
+}
+/*
+ *
+ *	Returns the number of messages per parity frame, or 0 if forward error correction isn't in use
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::forwardErrorCorrectionBlockSize()
+{
+	if(_fecEnabled == true && _remoteFec == true)
+	{
+		return _fecBlockSize;
+	}
+	return 0;
+}
+/*
+ *
+ *	Enable/disable power save. Once connected, and if the peer also asks for it, both ends sleep their radios except for a short wake window each period
+ *	The tie-break winner's schedule and clock are used, the loser follows using the clock estimate. Application messages sent outside a window are held for the next one
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::powerSave(bool enabled, uint16_t period, uint16_t window)
+{
+	if(window < M2M_DIRECT_POWER_SAVE_MINIMUM_WINDOW)
+	{
+		window = M2M_DIRECT_POWER_SAVE_MINIMUM_WINDOW;
+	}
+	if(period < window * 2)
+	{
+		period = window * 2;
+	}
+	if(enabled == true && _createSendQueue() == false)
+	{
+		return;
+	}
+	_powerSavePeriod = period;
+	_powerSaveWindow = window;
+	_powerSaveEnabled = enabled;
+}
+/*
+ *
+ *	Returns true while both ends are following an agreed wake schedule
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::powerSaveActive()
+{
+	return _powerSaveActive;
+}
+/*
+ *
+ *	Returns the time until the radio is next needed, so the application can light sleep the CPU too, or 0 if the radio is awake
+ *
+ */
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::powerSaveSleepTime()
+{
+	return _powerSaveSleepTime;
+}
+/*
+ *
+ *	Follows the wake schedule. Windows start every period on the tie-break winner's millis(), which the loser estimates from the clock offset
+ *	The radio wakes a guard time early and stays awake a guard time late, the loser adds its clock error to the guard and keeps its sending that far inside the window
+ *	A keepalive goes out as each window opens. A window with no keepalive from the peer counts as a missed echo, so a lost peer still ends in disconnection
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_powerSaveHousekeeping()
+{
+	uint32_t schedule = _remoteWakeSchedule;
+	bool winner = _tieBreak(_localMacAddress, _remoteMacAddress);
+	bool active = _powerSaveEnabled == true && _radioShared() == false && schedule != 0 && state == m2mDirectState::connected && WiFi.status() != WL_CONNECTED && (winner == true || clockSynchronised() == true);
+	if(active == false)
+	{
+		if(_radioAsleep == true)
+		{
+			_sleepRadio(false);
+			_statistics.radioSleepTime += millis() - _radioSleepStart;
+		}
+		_powerSaveActive = false;
+		_wakeWindowOpen = false;
+		_powerSaveSleepTime = 0;
+		return false;
+	}
+	uint32_t period = winner ? _powerSavePeriod : schedule >> 16;
+	uint32_t window = winner ? _powerSaveWindow : schedule & 0xffff;
+	uint32_t now = millis();
+	uint32_t guard = M2M_DIRECT_POWER_SAVE_GUARD;
+	uint32_t margin = 0;	//How far inside the window sending is kept
+	if(winner == false)
+	{
+		uint32_t localTime, errorBound;
+		now = now + clockOffset();
+		remoteToLocal(now, localTime, errorBound);
+		guard += errorBound;
+		margin = errorBound < window / 4 ? errorBound : window / 4;
+	}
+	uint32_t phase = now % period;
+	bool open = phase >= margin && phase + margin < window;
+	bool awake = phase < window + guard || phase + guard >= period;
+	if(_powerSaveActive == false)
+	{
+		_powerSaveActive = true;
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->printf_P(PSTR("\r\nPower save %ums every %ums"), window, period);
+		}
+	}
+	if(awake == true)
+	{
+		if(_radioAsleep == true)
+		{
+			_sleepRadio(false);
+			_statistics.radioSleepTime += millis() - _radioSleepStart;
+			_statistics.wakeWindows++;
+			_wakeWindowKeepalives = _statistics.keepalivesReceived;
+		}
+		if(open == true && _wakeWindowOpen == false)
+		{
+			_wakeWindowKeepaliveDue = true;
+		}
+		_wakeWindowOpen = open;
+		_powerSaveSleepTime = 0;
+		return false;
+	}
+	_wakeWindowOpen = false;
+	_powerSaveSleepTime = period - guard - phase;
+	if(_radioAsleep == false)
+	{
+		if(_fecSendCount > 0)
+		{
+			_sendFecParity();	//Protect the last messages of the window
+		}
+		if(_deferredSendPending == true)
+		{
+			_resolveDeferredSend(true);
+		}
+		if(_peerDeferredSend != M2M_DIRECT_NO_PEER)
+		{
+			_resolveDeferredPeerSend(true);
+		}
+		if(_statistics.keepalivesReceived == _wakeWindowKeepalives)	//Nothing heard from the peer all window
+		{
+			_reduceEchoQuality();
+		}
+		_sleepRadio(true);
+		_radioSleepStart = millis();
+	}
+	return true;
+}
+/*
+ *
+ *	Turns the radio off for power save, or back on and onto the communication channel
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sleepRadio(bool sleep)
+{
+	bool result = false;
+	#if defined(ESP8266)
+	if(sleep == true)
+	{
+		result = WiFi.forceSleepBegin();
+	}
+	else
+	{
+		result = WiFi.forceSleepWake();
+	}
+	#elif defined(ESP32)
+	if(sleep == true)
+	{
+		result = esp_wifi_stop() == ESP_OK;
+	}
+	else
+	{
+		result = esp_wifi_start() == ESP_OK;
+		_radioRateIndex = M2M_DIRECT_RATE_COUNT;	//Restarting may lose the ESP-Now rate
+	}
+	#endif
+	if(result == true)
+	{
+		_radioAsleep = sleep;
+	}
+	if(sleep == false && result == true)
+	{
+		_changeChannel(_communicationChannel);
+		esp_wifi_set_max_tx_power(_currentTxPower);	//Restarting may lose the Tx power too
+	}
+	if(result == false && debug_uart_ != nullptr)
+	{
+		debug_uart_->print(sleep ? F("\r\nUnable to sleep radio") : F("\r\nUnable to wake radio"));
+	}
+	return result;
+}
+/*
+ *
+ *	Adds a device to the peer table, so a link to it is kept up beside the link to the paired device. Call it after begin()
+ *
+ *	The other device needs nothing special, it is paired or provisioned with this one as usual and sees an ordinary link. ESP-Now has one
+ *	primary key for the whole radio so every peer must share it. If there's no paired device the first peer's primary key is used instead
+ *	and pairing doesn't start, so a controller can keep links to many devices without one of them being special
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::addPeer(const uint8_t* macAddress, const uint8_t* primaryEncryptionKey, const uint8_t* localEncryptionKey)
+{
+	if(macAddress == nullptr || memcmp(macAddress, _broadcastMacAddress, MAC_ADDRESS_LENGTH) == 0 || memcmp(macAddress, _remoteMacAddress, MAC_ADDRESS_LENGTH) == 0 || _findPeer(macAddress) != M2M_DIRECT_NO_PEER)
+	{
+		return false;
+	}
+	bool noPairedDevice = _pairingInfoRead == false && (state == m2mDirectState::uninitialised || state == m2mDirectState::initialised);
+	if(_encyptionEnabled == true)
+	{
+		if(primaryEncryptionKey == nullptr || localEncryptionKey == nullptr)
+		{
+			return false;
+		}
+		if((noPairedDevice == false || _peerTableOnly == true) && memcmp(primaryEncryptionKey, _primaryEncryptionKey, ENCRYPTION_KEY_LENGTH) != 0)
+		{
+			if(debug_uart_ != nullptr)
+			{
+				debug_uart_->print(F("\n\rPeer primary encryption key doesn't match the one in use"));
+			}
+			return false;
+		}
 	}
-	else if(type == DATA_UINT64_T_ARRAY)
+	uint8_t peerIndex = 0;
+	while(peerIndex < M2M_DIRECT_MAXIMUM_PEERS && _peers[peerIndex].inUse == true)
 	{
-		debug_uart_->print(F("UINT64_T_ARRAY"));
+		peerIndex++;
 	}
-	else if(type == DATA_INT8_T_ARRAY)
+	if(peerIndex == M2M_DIRECT_MAXIMUM_PEERS)
 	{
-		debug_uart_->print(F("INT8_t_ARRAY"));
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rPeer table full"));
+		}
+		return false;
 	}
-	else if(type == DATA_INT16_T_ARRAY)
+	if(_encyptionEnabled == true && _encryptedPeerCount() + 1 > M2M_DIRECT_MAXIMUM_ENCRYPTED_PEERS)
 	{
-		debug_uart_->print(F("INT16_T_ARRAY"));
+		if(debug_uart_ != nullptr)
+		{
+			debug_uart_->print(F("\n\rNo room for another encrypted peer"));
+		}
+		return false;
 	}
-	else if(type == DATA_INT32_T_ARRAY)
+	if(state != m2mDirectState::uninitialised && esp_now_is_peer_exist((uint8_t*)macAddress) == 0)	//Register it now, so a full ESP-Now is reported here rather than the link silently never coming up
 	{
-		debug_uart_->print(F("INT32_T_ARRAY"));
+		bool registered = false;
+		if(_encyptionEnabled == true)
+		{
+			registered = _registerPeer((uint8_t*)macAddress, _communicationChannel, (uint8_t*)localEncryptionKey);
+		}
+		else
+		{
+			registered = _registerPeer((uint8_t*)macAddress, _communicationChannel);
+		}
+		if(registered == false)
+		{
+			return false;
+		}
 	}
-	else if(type == DATA_INT64_T_ARRAY)
+	if(noPairedDevice == true && _peerTableOnly == false)
 	{
-		debug_uart_->print(F("INT64_t_ARRAY"));
+		_peerTableOnly = true;
+		if(_encyptionEnabled == true)
+		{
+			memcpy(_primaryEncryptionKey, primaryEncryptionKey, ENCRYPTION_KEY_LENGTH);
+			if(state == m2mDirectState::initialised)
+			{
+				_setPrimaryEncryptionKey();
+			}
+		}
+		_channelSurveyEnabled = false;	//Survey, migration and hunting are agreed with the paired device, so stay on one channel
+		_channelMigrationEnabled = false;
+		_channelHuntEnabled = false;
+	}
+	m2mDirectPeer &peer = _peers[peerIndex];
+	memcpy(peer.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+	if(localEncryptionKey != nullptr)
+	{
+		memcpy(peer.localEncryptionKey, localEncryptionKey, ENCRYPTION_KEY_LENGTH);
+	}
+	_resetPeer(peerIndex);
+	peer.lastHeard = 0;
+	peer.keepalivesSent = 0;
+	peer.keepalivesReceived = 0;
+	peer.dataMessagesSent = 0;
+	peer.dataMessagesReceived = 0;
+	peer.sendFailures = 0;
+	peer.disconnections = 0;
+	peer.pollLatency = 0;
+	peer.pollLatencyMaximum = 0;
+	peer.inUse = true;
+	uint8_t slot = _peerHash(macAddress);
+	while(_peerIndex[slot] != M2M_DIRECT_NO_PEER && _peerIndex[slot] != M2M_DIRECT_PEER_REMOVED)	//The index is bigger than the table so there is always a free slot
+	{
+		slot = (slot + 1) % M2M_DIRECT_PEER_INDEX_SIZE;
+	}
+	_peerIndex[slot] = peerIndex;	//Publish the peer to the receive callback
+	_peerCount++;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rAdded peer %02x%02x%02x%02x%02x%02x"), macAddress[0], macAddress[1], macAddress[2], macAddress[3], macAddress[4], macAddress[5]);
 	}
-	else if(type == DATA_FLOAT_ARRAY)
+	return true;
+}
+/*
+ *
+ *	Removes a device from the peer table. It is taken out of the index first so the receive callback stops finding it
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::removePeer(const uint8_t* macAddress)
+{
+	uint8_t peerIndex = _findPeer(macAddress);
+	if(peerIndex == M2M_DIRECT_NO_PEER)
 	{
-		debug_uart_->print(F("FLOAT_ARRAY"));
+		return false;
 	}
-	else if(type == DATA_DOUBLE_ARRAY)
+	uint8_t slot = _peerHash(macAddress);
+	while(_peerIndex[slot] != peerIndex)
 	{
-		debug_uart_->print(F("DOUBLE_ARRAY"));
+		slot = (slot + 1) % M2M_DIRECT_PEER_INDEX_SIZE;
 	}
-	else if(type == DATA_CHAR_ARRAY)
+	_peerIndex[slot] = M2M_DIRECT_PEER_REMOVED;	//Lookups for other peers still probe past it
+	_peers[peerIndex].inUse = false;
+	_peerCount--;
+	if(_peerDeferredSend == peerIndex)
 	{
-		debug_uart_->print(F("CHAR_ARRAY"));
+		_peerDeferredSend = M2M_DIRECT_NO_PEER;	//Don't settle it against whichever peer takes the slot
+		_peerSendWaiting = M2M_DIRECT_NO_PEER;
 	}
-	else if(type == DATA_STR)
+	if(_peerCount == 0)
 	{
-		debug_uart_->print(F("DATA_STR"));
+		for(slot = 0; slot < M2M_DIRECT_PEER_INDEX_SIZE; slot++)
+		{
+			_peerIndex[slot] = M2M_DIRECT_NO_PEER;	//Nothing left to probe past
+		}
 	}
-	else if(type == DATA_CUSTOM)
+	if(state != m2mDirectState::uninitialised && esp_now_is_peer_exist(_peers[peerIndex].macAddress))
 	{
-		debug_uart_->print(F("DATA_CUSTOM"));
+		esp_now_del_peer(_peers[peerIndex].macAddress);
 	}
-	else
+	if(_peers[peerIndex].state == m2mDirectState::connected)
 	{
-		debug_uart_->print(F("UNKNOWN"));
+		_postEvent(m2mDirectEvent::peerStateChanged);
 	}
-	debug_uart_->printf_P(PSTR("(%02x)"), type);
+	return true;
 }
 /*
-	debug_uart_->print(F("\r\nAdding "));
-	switch (dataType)
-	{
-	  case DATA_UINT8_T:
-		debug_uart_->print(F("uint8_t"));
-	  break;
-	  case DATA_UINT16_T:
-		debug_uart_->print(F("uint16_t"));
-	  break;
-	  case DATA_UINT32_T:
-		debug_uart_->print(F("uint32_t"));
-	  break;
-	  case DATA_UINT64_T:
-		debug_uart_->print(F("uint64_t"));
-	  break;
-	  case DATA_INT8_T:
-		debug_uart_->print(F("int8_t"));
-	  break;
-	  case DATA_INT16_T:
-		debug_uart_->print(F("int16_t"));
-	  break;
-	  case DATA_INT32_T:
-		debug_uart_->print(F("int32_t"));
-	  break;
-	  case DATA_FLOAT:
-		debug_uart_->print(F("float"));
-	  break;
-	  case DATA_DOUBLE:
-		debug_uart_->print(F("double"));
-	  break;
-	  case DATA_CHAR:
-		debug_uart_->print(F("char"));
-	  break;
-	  case DATA_STR:
-		debug_uart_->print(F("str"));
-	  break;
-	  case DATA_CUSTOM:
-		debug_uart_->print(F("custom"));
-	  break;
-	  case DATA_UINT8_T_ARRAY:
-		debug_uart_->print(F("uint8_t["));
-	  break;
-	  case DATA_UINT16_T_ARRAY:
-		debug_uart_->print(F("uint16_t["));
-	  break;
-	  case DATA_UINT32_T_ARRAY:
-		debug_uart_->print(F("uint32_t["));
-	  break;
-	  case DATA_UINT64_T_ARRAY:
-		debug_uart_->print(F("uint64_t["));
-	  break;
-	  case DATA_INT8_T_ARRAY:
-		debug_uart_->print(F("int8_t["));
-	  break;
-	  case DATA_INT16_T_ARRAY:
-		debug_uart_->print(F("int16_t["));
-	  break;
-	  case DATA_INT32_T_ARRAY:
-		debug_uart_->print(F("int32_t["));
-	  break;
-	  case DATA_FLOAT_ARRAY:
-		debug_uart_->print(F("float["));
-	  break;
-	  case DATA_DOUBLE_ARRAY:
-		debug_uart_->print(F("double["));
-	  break;
-	  case DATA_CHAR_ARRAY:
-		debug_uart_->print(F("char["));
-	  break;
-	  case DATA_CUSTOM_ARRAY:
-		debug_uart_->print(F("custom["));
-	  break;
-	}
-*/
+ *
+ *	Returns the number of devices in the peer table
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::peerCount()
+{
+	return _peerCount;
+}
 /*
  *
- *	Compares two MAC addresses and returns true if the first is higher
+ *	Returns true if the link to a device in the peer table is connected
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_tieBreak(uint8_t* macAddress1, uint8_t* macAddress2)
+bool ICACHE_FLASH_ATTR m2mDirectClass::peerConnected(const uint8_t* macAddress)
 {
-	if(memcmp(macAddress1,macAddress2,MAC_ADDRESS_LENGTH) > 0)
+	uint8_t peerIndex = _findPeer(macAddress);
+	return peerIndex != M2M_DIRECT_NO_PEER && _peers[peerIndex].state == m2mDirectState::connected;
+}
+/*
+ *
+ *	Fills in a snapshot of the nth device in the peer table, counting from zero, so the application can walk the table
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::peerInfo(uint8_t index, m2mDirectPeerInfo &info)
+{
+	for(uint8_t peerIndex = 0; peerIndex < M2M_DIRECT_MAXIMUM_PEERS; peerIndex++)
 	{
-		return true;
+		if(_peers[peerIndex].inUse == true)
+		{
+			if(index == 0)
+			{
+				m2mDirectPeer &peer = _peers[peerIndex];
+				memcpy(info.macAddress, peer.macAddress, MAC_ADDRESS_LENGTH);
+				info.state = peer.state;
+				info.linkQuality = peer.sendQuality & peer.echoQuality;
+				info.keepaliveInterval = peer.keepaliveInterval;
+				info.lastHeard = peer.lastHeard;
+				info.rssi = peer.rssi;
+				info.keepalivesSent = peer.keepalivesSent;
+				info.keepalivesReceived = peer.keepalivesReceived;
+				info.dataMessagesSent = peer.dataMessagesSent;
+				info.dataMessagesReceived = peer.dataMessagesReceived;
+				info.sendFailures = peer.sendFailures;
+				info.disconnections = peer.disconnections;
+				info.pollLatency = peer.pollLatency;
+				info.pollLatencyMaximum = peer.pollLatencyMaximum;
+				return true;
+			}
+			index--;
+		}
 	}
 	return false;
 }
-bool ICACHE_FLASH_ATTR m2mDirectClass::_remoteMacAddressSet()
+/*
+ *
+ *	Start of the probe sequence for a MAC address in the peer index. The last bytes of a MAC address vary most between devices
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_peerHash(const uint8_t* macAddress)
 {
-	if(_remoteMacAddress[0] == 0 &&
-		_remoteMacAddress[1] == 0 &&
-		_remoteMacAddress[2] == 0 &&
-		_remoteMacAddress[3] == 0 &&
-		_remoteMacAddress[4] == 0 &&
-		_remoteMacAddress[5] == 0
-	)
-	{
-		return false;
-	}
-	return true;
+	return (macAddress[3] ^ macAddress[4] ^ macAddress[5]) % M2M_DIRECT_PEER_INDEX_SIZE;
 }
 /*
  *
- *	Read pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
+ *	Finds a device in the peer table, this is on the receive path so it is a hash lookup rather than a search of the table
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_readPairingInfo()
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_findPeer(const uint8_t* macAddress)
 {
-	#if defined(ESP8266)
-		if(m2mDirect.debug_uart_ != nullptr)
+	if(_peerCount == 0 || macAddress == nullptr)
+	{
+		return M2M_DIRECT_NO_PEER;
+	}
+	uint8_t slot = _peerHash(macAddress);
+	for(uint8_t probe = 0; probe < M2M_DIRECT_PEER_INDEX_SIZE; probe++)
+	{
+		uint8_t peerIndex = _peerIndex[slot];
+		if(peerIndex == M2M_DIRECT_NO_PEER)
 		{
-			m2mDirect.debug_uart_->print(F("\n\rReading pairing info from EEPROM: "));
+			return M2M_DIRECT_NO_PEER;	//End of the probe sequence
 		}
-		uint8_t eepromData[EEPROM_DATA_SIZE];
-		for(uint8_t address = 0; address < EEPROM_DATA_SIZE; address++)
+		if(peerIndex != M2M_DIRECT_PEER_REMOVED && _peers[peerIndex].inUse == true && memcmp(_peers[peerIndex].macAddress, macAddress, MAC_ADDRESS_LENGTH) == 0)
 		{
-			eepromData[address] = EEPROM.read(address);
+			return peerIndex;
 		}
-		CRC32 crc;
-		crc.add(eepromData, EEPROM_DATA_SIZE - 4);
-		uint32_t crcFromEEPROM = eepromData[41];
-		crcFromEEPROM+=uint32_t(eepromData[40]) << 8;
-		crcFromEEPROM+=uint32_t(eepromData[39]) << 16;
-		crcFromEEPROM+=uint32_t(eepromData[38]) << 24;
-		if(crc.calc() == crcFromEEPROM)
+		slot = (slot + 1) % M2M_DIRECT_PEER_INDEX_SIZE;
+	}
+	return M2M_DIRECT_NO_PEER;
+}
+/*
+ *
+ *	Returns a peer's link to its starting state, ready to connect
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_resetPeer(uint8_t peerIndex)
+{
+	m2mDirectPeer &peer = _peers[peerIndex];
+	peer.state = m2mDirectState::connecting;
+	peer.localActivityTimer = 0;
+	peer.remoteActivityTimer = 0;
+	peer.echoedActivityTimer = 0;
+	peer.keepaliveInterval = _startingKeepaliveInterval;
+	peer.sendQuality = _startingSendquality;
+	peer.echoQuality = _startingEchoQuality;
+	peer.receiveQuality = 0;
+	peer.lastReceivedSequence = 0;
+	peer.keepaliveSequence = 0;
+	peer.handshakeReplyDue = false;
+	peer.handshakeVerified = false;
+	peer.rssi = M2M_DIRECT_RSSI_UNKNOWN;
+}
+/*
+ *
+ *	The link state machine for the peer table. Each peer gets keepalives, a handshake and the same quality thresholds as the paired device
+ *	Tx power, PHY rate, channel changes, forward error correction and power save are only agreed with the paired device
+ *
+ *	As a hub the keepalives become polls, one peer per slot, so the peer table takes turns rather than every device sending when it likes
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_peerHousekeeping()
+{
+	uint8_t pollPeer = _hubEnabled == true ? _nextPollPeer() : M2M_DIRECT_NO_PEER;
+	for(uint8_t peerIndex = 0; peerIndex < M2M_DIRECT_MAXIMUM_PEERS; peerIndex++)
+	{
+		m2mDirectPeer &peer = _peers[peerIndex];
+		if(peer.inUse == false)
 		{
-			if(m2mDirect.debug_uart_ != nullptr)
-			{
-				m2mDirect.debug_uart_->print(F("OK CRC: "));
-				m2mDirect.debug_uart_->print(crcFromEEPROM);
-			}
-			for(uint8_t address = 0; address < 6; address++)
-			{
-				_remoteMacAddress[address] = eepromData[address];
-			}
-			for(uint8_t address = 6; address < 22; address++)
-			{
-				_primaryEncryptionKey[address - 6] = eepromData[address];
-			}
-			for(uint8_t address = 22; address < 38; address++)
-			{
-				 _localEncryptionKey[address - 22] = eepromData[address];
-			}
-			if(m2mDirect.debug_uart_ != nullptr)
-			{
-				Serial.printf_P(PSTR("OK\r\n\tMAC address:%02x%02x%02x%02x%02x%02x\r\n\tPrimary encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\r\n\tLocal encryption key: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"), _remoteMacAddress, _primaryEncryptionKey, _localEncryptionKey);
-			}
-			return true;
+			continue;
 		}
-		else
+		bool established = false;
+		if(peer.state != m2mDirectState::connected && peer.handshakeVerified.exchange(false) == true && _fastHandshake == true)
 		{
-			if(m2mDirect.debug_uart_ != nullptr)
-			{
-				m2mDirect.debug_uart_->print(F("invalid CRC32"));
-			}
+			peer.sendQuality = M2M_DIRECT_HANDSHAKE_QUALITY;
+			peer.echoQuality = M2M_DIRECT_HANDSHAKE_QUALITY;
+			established = true;
 		}
-	#elif defined ESP32
-		if(m2mDirect.debug_uart_ != nullptr)
+		bool keepaliveDue = false;
+		if(_hubEnabled == true)
 		{
-			m2mDirect.debug_uart_->print(F("\n\rReading pairing info from Preferences: "));
+			peer.handshakeReplyDue = false;	//Answered by the next poll, which carries the handshake too
+			keepaliveDue = peerIndex == pollPeer;
 		}
-		uint8_t successes = 0;
-		settings.begin(preferencesNamespace, false);
-		successes+=settings.getBytes(pairedMacKey, _remoteMacAddress, 6);
-		successes+=settings.getBytes(pairedPrimaryKey, _primaryEncryptionKey, 16);
-		successes+=settings.getBytes(pairedLocalKey, _localEncryptionKey, 16);
-		if(settings.getType(pairedNameKey) != PT_INVALID && settings.getType(pairedNameLengthKey) != PT_INVALID)	//There is a name stored
+		else
 		{
-			uint8_t len = settings.getUChar(pairedNameLengthKey, 0);
-			if(len > 0)
-			{
-				remoteDeviceName = new char[len + 1];
-				successes+=settings.getString(pairedNameKey, remoteDeviceName, len + 1);
-				//remoteDeviceName[len] = 0;
-			}
+			keepaliveDue = peer.handshakeReplyDue.exchange(false) == true || millis() - peer.localActivityTimer > peer.keepaliveInterval;
 		}
-		settings.end();
-		if(successes >= 38)
-		{
-			if(m2mDirect.debug_uart_ != nullptr)
-			{
-				Serial.printf_P(PSTR("OK\r\n\tMAC address:%02x%02x%02x%02x%02x%02x\r\n\tPrimary encryption key:%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\r\n\tLocal encryption key: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"),
-				_remoteMacAddress[0],
-				_remoteMacAddress[1],
-				_remoteMacAddress[2],
-				_remoteMacAddress[3],
-				_remoteMacAddress[4],
-				_remoteMacAddress[5],
-				_primaryEncryptionKey[0],
-				_primaryEncryptionKey[1],
-				_primaryEncryptionKey[2],
-				_primaryEncryptionKey[3],
-				_primaryEncryptionKey[4],
-				_primaryEncryptionKey[5],
-				_primaryEncryptionKey[6],
-				_primaryEncryptionKey[7],
-				_primaryEncryptionKey[8],
-				_primaryEncryptionKey[9],
-				_primaryEncryptionKey[10],
-				_primaryEncryptionKey[11],
-				_primaryEncryptionKey[12],
-				_primaryEncryptionKey[13],
-				_primaryEncryptionKey[14],
-				_primaryEncryptionKey[15],
-				_localEncryptionKey[0],
-				_localEncryptionKey[1],
-				_localEncryptionKey[2],
-				_localEncryptionKey[3],
-				_localEncryptionKey[4],
-				_localEncryptionKey[5],
-				_localEncryptionKey[6],
-				_localEncryptionKey[7],
-				_localEncryptionKey[8],
-				_localEncryptionKey[9],
-				_localEncryptionKey[10],
-				_localEncryptionKey[11],
-				_localEncryptionKey[12],
-				_localEncryptionKey[13],
-				_localEncryptionKey[14],
-				_localEncryptionKey[15]
-				);
-				if(remoteDeviceName != nullptr)
-				{
-					Serial.print(F("\r\n\tRemote device name:"));
-					Serial.print(remoteDeviceName);
-				}
+		if(keepaliveDue == true)
+		{
+			peer.localActivityTimer = millis();	//The peer echoes this back
+			_createPeerKeepaliveMessage(peerIndex, _hubEnabled);
+			_sendPeerPacket(peerIndex, _protocolPacketBuffer, _protocolPacketBufferPosition);
+			peer.keepalivesSent++;
+			uint8_t quality = _countBits(peer.sendQuality & peer.echoQuality);
+			if(peer.state == m2mDirectState::connecting && (peer.sendQuality & peer.echoQuality) > 0xFF000000)
+			{
+				established = true;
+			}
+			else if(peer.state == m2mDirectState::disconnected && quality >= M2M_DIRECT_LINK_QUALITY_UPPER_THRESHOLD)
+			{
+				established = true;
+			}
+			else if(peer.state == m2mDirectState::connected && quality < M2M_DIRECT_LINK_QUALITY_LOWER_THRESHOLD)
+			{
+				peer.disconnections++;
+				_setPeerState(peerIndex, m2mDirectState::disconnected);
 			}
-			return true;
 		}
-		if(m2mDirect.debug_uart_ != nullptr)
+		if(established == true)
 		{
-			m2mDirect.debug_uart_->print(F("failed"));
+			_setPeerState(peerIndex, m2mDirectState::connected);
 		}
-	#endif
-	return false;
+		if(peer.state == m2mDirectState::connected && millis() - peer.echoedActivityTimer > (_hubEnabled == true ? hubCycleTime() : peer.keepaliveInterval)*3)	//We've definitely missed an echo, a hub hears from each peer once a cycle
+		{
+			peer.echoedActivityTimer = millis();
+			uint32_t echoQuality = peer.echoQuality.load();
+			while(peer.echoQuality.compare_exchange_weak(echoQuality, echoQuality >> 1) == false)
+			{
+			}
+		}
+	}
 }
 /*
  *
- *	Write pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
+ *	Starts the next hub slot once the current one is over, moving round the peer table in turn
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_writePairingInfo()
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_nextPollPeer()
 {
-	#if defined(ESP8266)
-	if(m2mDirect.debug_uart_ != nullptr)
+	if(millis() - _hubSlotStart < _hubSlotLength)
 	{
-		m2mDirect.debug_uart_->print(F("\n\rWriting pairing info to EEPROM: "));
+		return M2M_DIRECT_NO_PEER;	//The polled peer is still answering
 	}
-	uint8_t eepromData[EEPROM_DATA_SIZE];
-	for(uint8_t address = 0; address < 6; address++)
+	for(uint8_t step = 1; step <= M2M_DIRECT_MAXIMUM_PEERS; step++)
+	{
+		uint8_t peerIndex = (_hubSlotPeer + step) % M2M_DIRECT_MAXIMUM_PEERS;
+		if(_peers[peerIndex].inUse == true)
+		{
+			_hubSlotPeer = peerIndex;
+			_hubSlotStart = millis();
+			return peerIndex;
+		}
+	}
+	return M2M_DIRECT_NO_PEER;
+}
+/*
+ *
+ *	Changes the state of a peer's link, the application hears about it connecting or disconnecting
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_setPeerState(uint8_t peerIndex, m2mDirectState newState)
+{
+	m2mDirectPeer &peer = _peers[peerIndex];
+	peer.state = newState;
+	if(debug_uart_ != nullptr)
+	{
+		debug_uart_->printf_P(PSTR("\n\rPeer %02x%02x%02x%02x%02x%02x %s"), peer.macAddress[0], peer.macAddress[1], peer.macAddress[2], peer.macAddress[3], peer.macAddress[4], peer.macAddress[5], newState == m2mDirectState::connected ? "connected" : "disconnected");
+	}
+	_postEvent(m2mDirectEvent::peerStateChanged);
+}
+/*
+ *
+ *	Builds a keepalive for a device in the peer table. The layout is the same as _createKeepaliveMessage() so the peer sees an ordinary link,
+ *	with the link report and handshake but no clock, forward error correction or power save fields, which older versions also leave as zero
+ *
+ *	A hub poll is a keepalive with the poll flag and the slot and cycle length in the padding, older versions ignore both and answer as normal
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_createPeerKeepaliveMessage(uint8_t peerIndex, bool poll)
+{
+	m2mDirectPeer &peer = _peers[peerIndex];
+	_protocolPacketBufferPosition = 0;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = M2M_DIRECT_KEEPALIVE_FLAG;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _communicationChannel;
+	memcpy(&_protocolPacketBuffer[_protocolPacketBufferPosition], _localMacAddress, MAC_ADDRESS_LENGTH);
+	_protocolPacketBufferPosition+=MAC_ADDRESS_LENGTH;
+	memcpy(&_protocolPacketBuffer[_protocolPacketBufferPosition], peer.macAddress, MAC_ADDRESS_LENGTH);
+	_protocolPacketBufferPosition+=MAC_ADDRESS_LENGTH;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (peer.localActivityTimer & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (peer.localActivityTimer & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (peer.localActivityTimer & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (peer.localActivityTimer & 0x000000ff);
+	uint32_t remoteActivityTimer = peer.remoteActivityTimer;	//Read once, the receive callback may update it
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0xff000000) >> 24;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (remoteActivityTimer & 0x000000ff);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _minTxPower;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _currentTxPower;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _maxTxPower;
+	while(_protocolPacketBufferPosition < 37)	//No clock synchronisation
 	{
-		eepromData[address] = _remoteMacAddress[address];
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = 0x00;
 	}
-	for(uint8_t address = 6; address < 22; address++)
+	int8_t rssi = peer.rssi;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = M2M_DIRECT_LINK_REPORT_VALID | (_fastHandshake == true && peer.state != m2mDirectState::connected ? M2M_DIRECT_LINK_REPORT_HANDSHAKE : 0) | (rssi != M2M_DIRECT_RSSI_UNKNOWN ? M2M_DIRECT_LINK_REPORT_RSSI_VALID : 0) | (poll == true ? M2M_DIRECT_LINK_REPORT_POLL : 0);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = uint8_t(rssi);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = _countBits(peer.receiveQuality);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = peer.keepaliveSequence++;
+	while(_protocolPacketBufferPosition < 46)	//No power save
 	{
-		eepromData[address] = _primaryEncryptionKey[address - 6];
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = 0x00;
 	}
-	for(uint8_t address = 22; address < 38; address++)
+	if(poll == true)
 	{
-		eepromData[address] = _localEncryptionKey[address - 22];
+		uint16_t cycleTime = hubCycleTime();
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_hubSlotLength & 0xff00) >> 8;
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = (_hubSlotLength & 0x00ff);
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = (cycleTime & 0xff00) >> 8;
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = (cycleTime & 0x00ff);
 	}
-	CRC32 crc;
-	crc.add(eepromData, EEPROM_DATA_SIZE - 4);
-	eepromData[38] = (crc.calc() & 0xff000000) >> 24; //CRC
-	eepromData[39] = (crc.calc() & 0x00ff0000) >> 16;
-	eepromData[40] = (crc.calc() & 0x0000ff00) >> 8;
-	eepromData[41] = (crc.calc() & 0x000000ff);
-	for(uint8_t address = 0; address < EEPROM_DATA_SIZE; address++)
+	while(_protocolPacketBufferPosition < MINIMUM_MESSAGE_SIZE)	//Padding
 	{
-		EEPROM.write(address,eepromData[address]);
+		_protocolPacketBuffer[_protocolPacketBufferPosition++] = 0x00;
 	}
-	if(EEPROM.commit())
+	CRC32 crc;
+	crc.add((uint8_t*)_protocolPacketBuffer, _protocolPacketBufferPosition);
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0xff000000) >> 24; //CRC
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x00ff0000) >> 16;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x0000ff00) >> 8;
+	_protocolPacketBuffer[_protocolPacketBufferPosition++] = (crc.calc() & 0x000000ff);
+}
+/*
+ *
+ *	Sends a unicast frame to a device in the peer table, keeping its send quality and keepalive interval as _sendUnicastPacket() does for the paired device
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sendPeerPacket(uint8_t peerIndex, uint8_t* buffer, uint8_t length, bool wait)
+{
+	m2mDirectPeer &peer = _peers[peerIndex];
+	if(esp_now_is_peer_exist(peer.macAddress) == 0)
 	{
-		if(m2mDirect.debug_uart_ != nullptr)
+		bool registered = false;
+		if(_encyptionEnabled == true)
 		{
-			m2mDirect.debug_uart_->print(F("OK CRC: "));
-			m2mDirect.debug_uart_->print(crc.calc());
+			registered = _registerPeer(peer.macAddress, _communicationChannel, peer.localEncryptionKey);
+		}
+		else
+		{
+			registered = _registerPeer(peer.macAddress, _communicationChannel);
+		}
+		if(registered == false)	//ESP-Now is full, perhaps from another instance
+		{
+			_statistics.sendFailures++;
+			_peerSendResult(peerIndex, false);
+			return false;
 		}
-		return true;
 	}
-	if(m2mDirect.debug_uart_ != nullptr)
+	#ifdef M2M_DIRECT_DEBUG_SEND
+	if(debug_uart_ != nullptr)
 	{
-		m2mDirect.debug_uart_->print(F("failed"));
+		debug_uart_->printf_P(PSTR("\n\rTX %03u bytes peer:%02x%02x%02x%02x%02x%02x "), length, peer.macAddress[0], peer.macAddress[1], peer.macAddress[2], peer.macAddress[3], peer.macAddress[4], peer.macAddress[5]);
+		_printPacketDescription(buffer[0]);
 	}
-	return false;
-	#elif defined ESP32
-	if(m2mDirect.debug_uart_ != nullptr)
+	#endif
+	#if defined(ESP32)
+	_applyRate(0);	//Rate adaptation is only for the paired device, peers get the most robust rate
+	#endif
+	if(_peerDeferredSend != M2M_DIRECT_NO_PEER)
 	{
-		m2mDirect.debug_uart_->print(F("\n\rWriting pairing info to Preferences: "));
+		_resolveDeferredPeerSend(true);	//Settle the previous send before the callback is watched for another
 	}
-	uint8_t successes = 0;
-	settings.begin(preferencesNamespace, false);
-	successes+=settings.putBytes(pairedMacKey, _remoteMacAddress, 6);
-	successes+=settings.putBytes(pairedPrimaryKey, _primaryEncryptionKey, 16);
-	successes+=settings.putBytes(pairedLocalKey, _localEncryptionKey, 16);
-	if(remoteDeviceName != nullptr)
+	if(wait == true)
 	{
-		successes+=settings.putUChar(pairedNameLengthKey, strlen(remoteDeviceName));
-		successes+=settings.putString(pairedNameKey, remoteDeviceName);
+		peer.sendQuality = peer.sendQuality >> 1;	//Reduce signal quality
 	}
-	settings.end();
-	if(successes >= 38)
+	_peerSendWaiting = wait ? peerIndex : M2M_DIRECT_NO_PEER;
+	uint32_t packetSent = millis();
+	int result = esp_now_send(peer.macAddress, buffer, length);
+	_statistics.framesSent++;
+	if(result == ESP_OK)
 	{
-		if(m2mDirect.debug_uart_ != nullptr)
+		if(wait == false)
+		{
+			return true;
+		}
+		if(_deferSendConfirmation == true)
 		{
-			Serial.println(F("OK"));
+			_peerSendTimer = packetSent;	//The send callback is checked on a later tick by _resolveDeferredPeerSend()
+			_peerDeferredSend = peerIndex;
+			return true;
 		}
-		return true;
+		while(_peerSendWaiting == peerIndex && millis() - packetSent < _sendTimeout)
+		{
+			yield();
+		}
+		if(_peerSendWaiting != peerIndex)
+		{
+			_peerSendResult(peerIndex, true);
+			return true;
+		}
+		_peerSendWaiting = M2M_DIRECT_NO_PEER;
+		_statistics.sendTimeouts++;
 	}
-	if(m2mDirect.debug_uart_ != nullptr)
+	else
 	{
-		m2mDirect.debug_uart_->print(F("failed"));
+		_peerSendWaiting = M2M_DIRECT_NO_PEER;
+		_statistics.sendFailures++;
 	}
+	_peerSendResult(peerIndex, false);
 	return false;
-	#endif
 }
 /*
  *
- *	Delete pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
+ *	Improves or reduces a peer's send quality for a send, adjusting its keepalive interval as _sendUnicastPacket() does for the paired device
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_deletePairingInfo()
+void ICACHE_FLASH_ATTR m2mDirectClass::_peerSendResult(uint8_t peerIndex, bool delivered)
 {
-	#if defined(ESP8266)
-		if(m2mDirect.debug_uart_ != nullptr)
+	m2mDirectPeer &peer = _peers[peerIndex];
+	if(delivered == true)
+	{
+		peer.sendQuality = peer.sendQuality | 0x80000000;  //Improve signal quality, MSB first
+		if(peer.sendQuality == 0xffffffff)
 		{
-			m2mDirect.debug_uart_->print(F("\n\rDeleting pairing from EEPROM: "));
+			peer.keepaliveInterval = peer.keepaliveInterval + 100 > _maximumKeepaliveInterval ? _maximumKeepaliveInterval : peer.keepaliveInterval + 100;
 		}
-		for(uint8_t address = 0; address < EEPROM_DATA_SIZE; address++)
+	}
+	else
+	{
+		peer.sendFailures++;
+		peer.keepaliveInterval = peer.keepaliveInterval / 2 < _minimumKeepaliveInterval ? _minimumKeepaliveInterval : peer.keepaliveInterval / 2;
+	}
+}
+/*
+ *
+ *	Settles send quality for a send to a peer that didn't wait for its callback. If forced, a missing callback counts as a timeout
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_resolveDeferredPeerSend(bool force)
+{
+	uint8_t peerIndex = _peerDeferredSend;
+	if(peerIndex == M2M_DIRECT_NO_PEER)
+	{
+		return;
+	}
+	if(_peerSendWaiting != peerIndex)
+	{
+		_peerDeferredSend = M2M_DIRECT_NO_PEER;
+		_peerSendResult(peerIndex, true);
+	}
+	else if(force == true || millis() - _peerSendTimer > _sendTimeout)
+	{
+		_peerDeferredSend = M2M_DIRECT_NO_PEER;
+		_peerSendWaiting = M2M_DIRECT_NO_PEER;
+		_statistics.sendTimeouts++;
+		_peerSendResult(peerIndex, false);
+	}
+}
+/*
+ *
+ *	Counts the encrypted ESP-Now peers this instance uses, the paired device and the peer table. ESP-Now only holds a few
+ *
+ */
+uint8_t ICACHE_FLASH_ATTR m2mDirectClass::_encryptedPeerCount()
+{
+	if(_encyptionEnabled == false)
+	{
+		return 0;
+	}
+	return _peerCount + (_peerTableOnly == true ? 0 : 1);	//A paired device is assumed unless the peer table stands in for it
+}
+/*
+ *
+ *	Sends an application message to a device in the peer table, if its link is connected
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_sendPeerMessage(uint8_t peerIndex, uint8_t* buffer, uint8_t length, bool wait)
+{
+	if(_peers[peerIndex].inUse == false || _peers[peerIndex].state != m2mDirectState::connected)
+	{
+		return false;
+	}
+	if(_sendPeerPacket(peerIndex, buffer, length, wait))
+	{
+		_peers[peerIndex].dataMessagesSent++;
+		_statistics.dataMessagesSent++;
+		return true;
+	}
+	return false;
+}
+/*
+ *
+ *	Handles a valid frame from a device in the peer table, in the WiFi task. Keepalives update its link, data goes in the receive queue tagged with the peer
+ *
+ */
+void ICACHE_FLASH_ATTR m2mDirectClass::_receivePeerFrame(uint8_t peerIndex, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata)
+{
+	m2mDirectPeer &peer = _peers[peerIndex];
+	peer.lastHeard = metadata.received;
+	if(metadata.rssi != M2M_DIRECT_RSSI_UNKNOWN)
+	{
+		int8_t rssi = peer.rssi;
+		peer.rssi = rssi == M2M_DIRECT_RSSI_UNKNOWN ? metadata.rssi : int8_t((rssi * 3 + metadata.rssi) / 4);
+	}
+	if(message[0] == M2M_DIRECT_KEEPALIVE_FLAG)
+	{
+		if(length < MINIMUM_MESSAGE_SIZE + 4)	//Keepalives are padded to the minimum size, the fields below reach well into it
 		{
-			EEPROM.write(address,address);
+			_statistics.unknownMessageTypes++;
+			return;
 		}
-		if(EEPROM.commit())
+		if(message[1] != _communicationChannel || memcmp(&message[2], peer.macAddress, MAC_ADDRESS_LENGTH) != 0 || memcmp(&message[8], _localMacAddress, MAC_ADDRESS_LENGTH) != 0)
 		{
-			if(m2mDirect.debug_uart_ != nullptr)
-			{
-				m2mDirect.debug_uart_->print(F("OK"));
-			}
-			esp_now_del_peer(_remoteMacAddress);
-			for(uint8_t address = 0; address < 6; address++)
-			{
-				_remoteMacAddress[address] = 0;
-			}
-			for(uint8_t address = 0; address < 16; address++)
-			{
-				_primaryEncryptionKey[address - 6] = 0;
-				_localEncryptionKey[address - 22] = 0;
-			}
-			if(remoteDeviceName != nullptr)
+			if(debug_uart_ != nullptr)
 			{
-				delete[] remoteDeviceName;
-				remoteDeviceName = nullptr;
+				debug_uart_->print(F(" unexpected contents"));
 			}
-			return true;
+			return;
 		}
-	#elif defined ESP32
-		if(m2mDirect.debug_uart_ != nullptr)
+		peer.keepalivesReceived++;
+		peer.remoteActivityTimer = uint32_t(message[14]) << 24 | uint32_t(message[15]) << 16 | uint32_t(message[16]) << 8 | message[17];
+		uint32_t echoedActivityTimer = uint32_t(message[18]) << 24 | uint32_t(message[19]) << 16 | uint32_t(message[20]) << 8 | message[21];
+		peer.echoedActivityTimer = echoedActivityTimer;
+		uint8_t sequenceGap = message[40] - peer.lastReceivedSequence;
+		peer.lastReceivedSequence = message[40];
+		if(sequenceGap == 0)
 		{
-			m2mDirect.debug_uart_->print(F("\n\rDeleting pairing from Preferences: "));
+			sequenceGap = 1;
 		}
-		uint8_t successes = 0;
-		settings.begin(preferencesNamespace, false);
-		successes+=(settings.remove(pairedMacKey) ? 1 : 0);
-		successes+=(settings.remove(pairedPrimaryKey) ? 1 : 0);
-		successes+=(settings.remove(pairedLocalKey) ? 1 : 0);
-		successes+=(settings.remove(pairedNameLengthKey) ? 1 : 0);
-		successes+=(settings.remove(pairedNameKey) ? 1 : 0);
-		settings.end();
-		successes+=(esp_now_del_peer(_remoteMacAddress) == ESP_OK ? 1 : 0);
-		for(uint8_t address = 0; address < 6; address++)
+		peer.receiveQuality = sequenceGap >= 32 ? 0x80000000 : (peer.receiveQuality >> sequenceGap) | 0x80000000;
+		if(message[37] & M2M_DIRECT_LINK_REPORT_HANDSHAKE)
 		{
-			_remoteMacAddress[address] = 0;
+			peer.handshakeReplyDue = true;
 		}
-		for(uint8_t address = 0; address < 16; address++)
+		uint32_t echoQuality = peer.echoQuality.load();
+		while(peer.echoQuality.compare_exchange_weak(echoQuality, echoQuality >> 1) == false)
 		{
-			_primaryEncryptionKey[address - 6] = 0;
-			_localEncryptionKey[address - 22] = 0;
 		}
-		if(successes >= 4)
+		if(echoedActivityTimer != 0 && echoedActivityTimer == peer.localActivityTimer)
 		{
-			if(m2mDirect.debug_uart_ != nullptr)
+			peer.echoQuality.fetch_or(0x80000000); //Improve echo quality
+			if(peer.state != m2mDirectState::connected)
 			{
-				m2mDirect.debug_uart_->print(F("OK"));
+				peer.handshakeVerified = true;
+			}
+			if(_hubEnabled == true)	//Answer to a poll, so this is how long the peer took to get its turn on the air
+			{
+				uint32_t pollLatency = metadata.received - peer.localActivityTimer;
+				uint32_t smoothedLatency = peer.pollLatency;
+				peer.pollLatency = smoothedLatency == 0 ? pollLatency : (smoothedLatency * 3 + pollLatency) / 4;
+				if(pollLatency > peer.pollLatencyMaximum)
+				{
+					peer.pollLatencyMaximum = pollLatency;
+				}
 			}
 		}
-		if(remoteDeviceName != nullptr)
+	}
+	else if(message[0] == M2M_DIRECT_DATA_FLAG)
+	{
+		if(_queueReceivedMessage(message, length, metadata, peerIndex))
 		{
-			delete[] remoteDeviceName;
-			remoteDeviceName = nullptr;
+			peer.dataMessagesReceived++;
 		}
-		return true;
-	#endif
-	if(m2mDirect.debug_uart_ != nullptr)
+	}
+	else
 	{
-		m2mDirect.debug_uart_->print(F("failed"));
+		_statistics.unknownMessageTypes++;	//Channel changes and forward error correction are only used with the paired device
 	}
-	return false;
 }
 /*
  *
- *	Reset pairing info and reset state to re-pair
+ *	Makes this device a hub for the peer table. Each peer is polled in turn and answers, with its keepalive and any queued messages, only in its slot
+ *	so spokes don't collide. The worst case wait to send is one cycle, the slot length times the number of peers. The hub's own messages to the
+ *	peers aren't scheduled, the hub is the only device sending outside a slot
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::resetPairing()
+void ICACHE_FLASH_ATTR m2mDirectClass::hub(bool enabled, uint16_t slotLength)
 {
-	if(_deletePairingInfo())
+	if(slotLength < M2M_DIRECT_HUB_MINIMUM_SLOT_LENGTH)
 	{
-		/*
-		if(_pairingInfoRead == false)
-		{
-			if(_encyptionEnabled == true)
-			{
-				_chooseEncryptionKeys();
-			}
-			else
-			{
-				_clearEncryptionKeys();
-			}
-		}
-		*/
-		_pairingInfoRead = false;
-		_pairingInfoWritten = false;
-		if(state == m2mDirectState::connected)
-		{
-			if(disconnectedCallback != nullptr)
-			{
-				disconnectedCallback();
-			}
-		}
-		state = m2mDirectState::initialised;
-		_indicatorTimerInterval = M2M_DIRECT_INDICATOR_LED_INITIALISED_INTERVAL;
-		if(debug_uart_ != nullptr)
-		{
-			_debugState();
-		}
-		return true;
+		slotLength = M2M_DIRECT_HUB_MINIMUM_SLOT_LENGTH;
 	}
-	return false;
+	else if(slotLength > 0xffff / M2M_DIRECT_MAXIMUM_PEERS)
+	{
+		slotLength = 0xffff / M2M_DIRECT_MAXIMUM_PEERS;	//The cycle length must fit in a poll
+	}
+	_hubSlotLength = slotLength;
+	_hubSlotPeer = M2M_DIRECT_NO_PEER;
+	_hubSlotStart = millis() - slotLength;	//Poll the first peer straight away
+	_hubEnabled = enabled;
 }
 /*
  *
- *	Reduce Tx Power
+ *	Returns the time to poll every peer once, which is the longest a spoke waits to send
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_reduceTxPower()
+uint32_t ICACHE_FLASH_ATTR m2mDirectClass::hubCycleTime()
 {
-	if(_currentTxPower > _minTxPower)
+	if(_hubEnabled == false)
 	{
-		if(esp_wifi_set_max_tx_power(_currentTxPower - 1) == ESP_OK)
-		{
-			if(debug_uart_ != nullptr)
-			{
-				debug_uart_->printf_P(PSTR("\r\nReduced Tx power to: %.2fdBm"), (float)_currentTxPower * 0.25);
-			}
-			_currentTxPower--;
-			_lastTxPowerChange = millis();
-			_lastTxPowerChangeDownwards = true;
-			return true;
-		}
-		else
-		{
-			if(debug_uart_ != nullptr)
-			{
-				debug_uart_->print(F("\r\nUnable to reduced Tx power"));
-			}
-			return false;
-		}
+		return 0;
 	}
-	return false;
+	return uint32_t(_hubSlotLength) * _peerCount;
 }
 /*
  *
- *	Increase Tx Power
+ *	Returns true if a hub is polling this device, it then sends only in its slot. Polls stopping for a few cycles hands the link back to the keepalive interval
  *
  */
-bool ICACHE_FLASH_ATTR m2mDirectClass::_increaseTxPower()
+bool ICACHE_FLASH_ATTR m2mDirectClass::hubScheduled()
 {
-	if(_currentTxPower < _maxTxPower)
+	uint32_t pollSchedule = _pollSchedule;
+	if(pollSchedule == 0 || state != m2mDirectState::connected)
 	{
-		if(esp_wifi_set_max_tx_power(_currentTxPower + 1) == ESP_OK)
-		{
-			if(debug_uart_ != nullptr)
-			{
-				debug_uart_->printf_P(PSTR("\r\nIncreased Tx power to: %.2fdBm"), (float)_currentTxPower * 0.25);
-			}
-			_currentTxPower++;
-			_lastTxPowerChange = millis();
-			_lastTxPowerChangeDownwards = false;
-			return true;
-		}
-		else
-		{
-			if(debug_uart_ != nullptr)
-			{
-				debug_uart_->print(F("\r\nUnable to increase Tx power"));
-			}
-			return false;
-		}
+		return false;
 	}
-	return false;
+	uint32_t lastPollTime = _lastPollTime;
+	return millis() - lastPollTime < (pollSchedule & 0xffff) * M2M_DIRECT_HUB_POLL_TIMEOUT;
+}
+/*
+ *
+ *	Returns true if the slot following the hub's last poll is still open, leaving a guard time before the next spoke is polled
+ *
+ */
+bool ICACHE_FLASH_ATTR m2mDirectClass::_pollSlotOpen()
+{
+	uint32_t lastPollTime = _lastPollTime;
+	return millis() - lastPollTime + M2M_DIRECT_HUB_GUARD < (_pollSchedule >> 16);
 }
 /*
  *
@@ -3129,5 +7865,5 @@ void ICACHE_FLASH_ATTR m2mDirectClass::setAutomaticTxPower(bool setting)
 {
 	_automaticTxPower = setting;
 }
-m2mDirectClass m2mDirect;	//Create an instance of the class, as only one is practically usable at a time
+m2mDirectClass m2mDirect;	//The default instance, more can be created for separate links, begin() refuses any not on the channel already in use
 #endif
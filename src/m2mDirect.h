@@ -11,6 +11,7 @@
 #ifndef m2mDirect_h
 #define m2mDirect_h
 #include <Arduino.h>
+#include <atomic>
 //Include the ESP32 WiFi and ESP-Now libraries
 #if defined(ESP8266)
 	#include "ESP8266WiFi.h"
@@ -18,9 +19,10 @@
 		#include <espnow.h>
 		#include <user_interface.h>
 	}
-	#include <EEPROM.h>
+	#include <bearssl/bearssl_hmac.h>	//HMAC for authenticated broadcasts
 	#define ESP_OK 0
-	#define EEPROM_DATA_SIZE 42
+	#define M2M_DIRECT_LEGACY_DATA_SIZE 44	//Pairing as saved with the EEPROM library by earlier versions, read once to migrate it
+	#define M2M_DIRECT_LEGACY_CHANNEL_ADDRESS 42	//Channel and its complement, after the CRC protected pairing
 #elif defined(ESP32)
 	#include <WiFi.h>
 	#include <Preferences.h>
@@ -28,10 +30,17 @@
 		#include <esp_now.h>
 		#include <esp_wifi.h> // only for esp_wifi_set_channel()
 	}
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+	#include <freertos/queue.h>
+	#include <mbedtls/md.h>	//HMAC for authenticated broadcasts
+	#if !defined(ESP_ARDUINO_VERSION_MAJOR) || ESP_ARDUINO_VERSION_MAJOR < 3
+		#define M2M_DIRECT_SNIFF_METADATA	//Older cores don't pass radio metadata to the receive callback, so it is sniffed in promiscuous mode
+	#endif
 #endif
 
 #ifdef ESP8266
-//#include <Ticker.h>
+#include <Ticker.h>
 #endif
 
 
@@ -44,6 +53,12 @@
 #define M2M_DIRECT_PAIRING_ACK_FLAG 1
 #define M2M_DIRECT_KEEPALIVE_FLAG 2
 #define M2M_DIRECT_DATA_FLAG 3
+#define M2M_DIRECT_CHANNEL_CHANGE_FLAG 4
+#define M2M_DIRECT_CHANNEL_CHANGE_ACK_FLAG 5
+#define M2M_DIRECT_FEC_DATA_FLAG 6
+#define M2M_DIRECT_FEC_PARITY_FLAG 7
+#define M2M_DIRECT_BROADCAST_FLAG 8
+#define M2M_DIRECT_RELAY_FLAG 9
 #define M2M_DIRECT_SMALL_ARRAY_LIMIT 13
 
 #define MAC_ADDRESS_LENGTH 6
@@ -61,6 +76,109 @@
 
 #define M2M_DIRECT_LINK_QUALITY_UPPER_THRESHOLD 18
 #define M2M_DIRECT_LINK_QUALITY_LOWER_THRESHOLD 12
+#define M2M_DIRECT_HANDSHAKE_QUALITY ((uint32_t(1) << (M2M_DIRECT_LINK_QUALITY_UPPER_THRESHOLD + 1)) - 1)	//History a verified handshake starts with, one above the upper threshold in the oldest bits so losses count straight away
+
+#define M2M_DIRECT_HOUSEKEEPING_INTERVAL 10		//How often background housekeeping runs, in ms
+#define M2M_DIRECT_HOUSEKEEPING_TASK_STACK 4096	//Stack for the ESP32 housekeeping task
+#define M2M_DIRECT_HOUSEKEEPING_TASK_PRIORITY 2	//Priority for the ESP32 housekeeping task, above the Arduino loop
+#define M2M_DIRECT_SEND_QUEUE_LENGTH 4			//Application messages that can wait to be sent by background housekeeping
+#define M2M_DIRECT_EVENT_QUEUE_LENGTH 8			//Events that can wait to be dispatched to the application callbacks
+#define M2M_DIRECT_RECEIVE_QUEUE_LENGTH 4		//Received application messages that can wait for the application
+#define M2M_DIRECT_STATISTICS_SNAPSHOT_ATTEMPTS 4		//Copies statistics() makes of the counters looking for two that agree
+
+#define M2M_DIRECT_MAXIMUM_CHANNEL 11				//Highest channel used, 12-13 are not legal everywhere and 14 only in Japan
+#define M2M_DIRECT_SURVEY_DWELL 30					//How long the channel survey listens on each channel, in ms
+#define M2M_DIRECT_SURVEY_INTERVAL 500				//Time between channel survey dwells, in ms
+#define M2M_DIRECT_SURVEY_RSSI_FLOOR -95			//Frames weaker than this don't count towards congestion, in dBm
+#define M2M_DIRECT_SURVEY_LOSS_WEIGHT 200			//Congestion added per lost frame (of 32) on the channel in use
+
+#define M2M_DIRECT_MIGRATION_THRESHOLD 24			//Link quality (bits set of 32) below which a better channel is looked for
+#define M2M_DIRECT_MIGRATION_HYSTERESIS 25			//A new channel must be at least this percentage less congested than the current one
+#define M2M_DIRECT_MIGRATION_HOLDOFF 30000			//Minimum time between channel migrations, in ms
+#define M2M_DIRECT_MIGRATION_DELAY 500				//Time from proposing a channel change to both ends switching, in ms
+#define M2M_DIRECT_MIGRATION_RESEND 50				//Time between repeats of an unacknowledged proposal, in ms
+#define M2M_DIRECT_MIGRATION_TIMEOUT 1000			//Time without a keepalive after switching before hunting for the peer, in ms
+#define M2M_DIRECT_MIGRATION_HUNT_DWELL 250			//Time the tie-break winner stays on each channel while hunting, the loser stays three times as long
+#define M2M_DIRECT_HUNT_TIMEOUT 3000				//Time without a keepalive before hunting across every channel for the peer, in ms
+#define M2M_DIRECT_HUNT_DWELL 100					//Time the tie-break winner stays on each channel, the loser stays for a whole cycle of the winner's
+
+#define M2M_DIRECT_CLOCK_SAMPLES 8						//Clock samples kept, the one with the shortest round trip is used
+#define M2M_DIRECT_CLOCK_MAXIMUM_ROUND_TRIP 500			//Clock samples with a longer round trip are discarded, in ms
+#define M2M_DIRECT_CLOCK_DRIFT_INTERVAL 10000			//Minimum time between drift measurements, in ms
+#define M2M_DIRECT_CLOCK_DRIFT_TOLERANCE 100			//Assumed drift before it is measured, in ppm
+#define M2M_DIRECT_CLOCK_MEASURED_DRIFT_TOLERANCE 20	//Assumed error in measured drift, in ppm
+
+#define M2M_DIRECT_RSSI_UNKNOWN 127						//RSSI value used when there is no measurement
+#define M2M_DIRECT_LINK_REPORT_VALID 0x01				//Keepalive carries a link report, older versions leave this byte as zero padding
+#define M2M_DIRECT_LINK_REPORT_RSSI_VALID 0x02			//The link report includes an RSSI measurement
+#define M2M_DIRECT_LINK_REPORT_LONG_RANGE 0x04			//The sender can receive Espressif long range (LR) frames
+#define M2M_DIRECT_LINK_REPORT_FEC 0x08					//The sender can decode forward error corrected messages
+#define M2M_DIRECT_LINK_REPORT_HANDSHAKE 0x10			//The sender isn't connected and wants a keepalive straight back, to complete the handshake
+#define M2M_DIRECT_LINK_REPORT_POLL 0x20				//The sender is a hub polling this device, which answers straight away and otherwise waits for the next poll
+#define M2M_DIRECT_TX_POWER_TARGET_RSSI -70				//RSSI the peer should see from this end, a margin above ESP-Now sensitivity, in dBm
+#define M2M_DIRECT_TX_POWER_DEADBAND 2					//RSSI error that is left alone to avoid chasing fading, in dB
+#define M2M_DIRECT_TX_POWER_LOSS_STEP 12				//Tx power added when a frame goes unacknowledged, in 0.25dBm steps
+
+#define M2M_DIRECT_RATE_COUNT 14						//PHY rates the rate controller chooses from, including two long range rates (ESP32 only)
+#define M2M_DIRECT_RATE_INTERVAL 1000					//How often delivery probabilities are updated, in ms
+#define M2M_DIRECT_RATE_SAMPLE_INTERVAL 8				//One keepalive in this many is sent at a rate that might do better
+#define M2M_DIRECT_RATE_MINIMUM_PROBABILITY 900			//Delivery probability a rate needs to be used normally, in 1/1000
+
+#define M2M_DIRECT_FEC_OVERHEAD 8						//Header and CRC added to a protected message or parity frame
+#define M2M_DIRECT_FEC_MAXIMUM_LENGTH (MAXIMUM_MESSAGE_SIZE - M2M_DIRECT_FEC_OVERHEAD)	//Longer messages are sent unprotected
+#define M2M_DIRECT_FEC_MINIMUM_BLOCK 2					//Fewest messages per parity frame, 50% overhead
+#define M2M_DIRECT_FEC_MAXIMUM_BLOCK 8					//Most messages per parity frame, 12.5% overhead
+#define M2M_DIRECT_FEC_FLUSH_INTERVAL 100				//A partly filled block has its parity sent after this long, in ms
+
+#define M2M_DIRECT_POWER_SAVE_REQUESTED 0x01			//Keepalive flag, the sender wants to sleep its radio between wake windows
+#define M2M_DIRECT_POWER_SAVE_PERIOD 1000				//Default time between the starts of wake windows, in ms
+#define M2M_DIRECT_POWER_SAVE_WINDOW 50					//Default length of a wake window, in ms
+#define M2M_DIRECT_POWER_SAVE_MINIMUM_WINDOW 20			//Shortest usable wake window, in ms
+#define M2M_DIRECT_POWER_SAVE_GUARD 5					//Time the radio wakes before and stays awake after a window, in ms
+
+#define M2M_DIRECT_PAIRING_BURST_LENGTH 3				//Pairing messages sent back to back in fast pairing
+#define M2M_DIRECT_PAIRING_BURST_SPACING 20				//Time between the messages in a burst, in ms
+#define M2M_DIRECT_PAIRING_BACKOFF_MINIMUM 200			//Shortest random gap between bursts, in ms
+#define M2M_DIRECT_PAIRING_BACKOFF_MAXIMUM 600			//Longest random gap between bursts, in ms
+#define M2M_DIRECT_PAIRING_ACK_INTERVAL 100				//Time between pairing messages and ACKs once a peer is heard, in ms
+
+#define M2M_DIRECT_LINK_STATE_SIZE 8					//Bytes of saved link parameters
+#define M2M_DIRECT_LINK_STATE_VERSION 1					//Format of the saved link parameters
+#define M2M_DIRECT_LINK_STATE_SAVE_INTERVAL 600000		//Minimum time between saves of the link parameters, to limit flash wear, in ms
+#define M2M_DIRECT_LINK_STATE_POWER_CHANGE 4			//Tx power change worth saving, in 0.25dBm steps
+#define M2M_DIRECT_LINK_STATE_KEEPALIVE_CHANGE 25		//Keepalive interval change worth saving, in percent
+#define M2M_DIRECT_RECORD_VERSION 1						//Format of the saved pairing record
+#define M2M_DIRECT_RECORD_NAME_ADDRESS 48				//Remote device name length, then the name, follows the fixed part of the record
+#define M2M_DIRECT_STORE_SLOT_SIZE 128					//Flash is written a slot at a time, erased a sector at a time (ESP8266)
+#define M2M_DIRECT_STORE_SLOT_HEADER 8					//Magic number, sequence number and record length at the start of each slot
+#define M2M_DIRECT_STORE_MAGIC 0x6d32					//Marks a slot that has been written
+#define M2M_DIRECT_STORE_MAXIMUM_RECORD (M2M_DIRECT_STORE_SLOT_SIZE - M2M_DIRECT_STORE_SLOT_HEADER - 4)	//Largest record, leaving room for the CRC
+#define M2M_DIRECT_PROVISIONING_BLOB_SIZE M2M_DIRECT_STORE_MAXIMUM_RECORD	//Largest provisioning blob, which is a saved record
+
+#define M2M_DIRECT_MAXIMUM_PEERS 18						//Devices in the peer table, ESP-Now holds 20 peers less the paired device and the broadcast address
+#define M2M_DIRECT_MAXIMUM_ENCRYPTED_PEERS 6			//Encrypted ESP-Now peers, including the paired device. The ESP8266 limit and the ESP32 default
+#define M2M_DIRECT_MAXIMUM_INSTANCES 4					//Instances of the class that can share the ESP-Now callbacks
+#define M2M_DIRECT_RADIO_STOPPED 0						//ESP-Now isn't running
+#define M2M_DIRECT_RADIO_STARTING 1						//An instance is starting ESP-Now
+#define M2M_DIRECT_RADIO_STARTED 2						//ESP-Now is running, instances that start later share it
+#define M2M_DIRECT_PEER_INDEX_SIZE 40					//Slots in the hash index of the peer table, at least twice the number of peers
+#define M2M_DIRECT_NO_PEER 0xff							//Peer index meaning none, or the paired device
+#define M2M_DIRECT_PEER_REMOVED 0xfe					//Hash index slot of a removed peer, lookups carry on past it
+
+#define M2M_DIRECT_HUB_SLOT_LENGTH 30					//Default time each spoke has to answer a poll, in ms
+#define M2M_DIRECT_HUB_MINIMUM_SLOT_LENGTH 10			//Shortest slot, a spoke must answer within its housekeeping interval
+#define M2M_DIRECT_HUB_GUARD 5							//Time at the end of a slot a spoke leaves quiet, in ms
+#define M2M_DIRECT_HUB_POLL_TIMEOUT 3					//Cycles without a poll before a spoke goes back to sending when it likes
+
+#define M2M_DIRECT_BROADCAST_HEADER_LENGTH 15			//Publisher MAC address, group, epoch and sequence number, between the field count and the fields
+#define M2M_DIRECT_BROADCAST_TAG_LENGTH 8				//Truncated HMAC-SHA256 authenticating a broadcast, before the CRC
+#define M2M_DIRECT_BROADCAST_PEER 0xfd					//Send queue peer index of a broadcast
+#define M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES 8			//Publishers a listener tracks sequence numbers for, the least recently heard is replaced
+#define M2M_DIRECT_BROADCAST_SOURCE_TIMEOUT 600000		//A publisher is only forgotten to make room for another after this long unheard, in ms
+
+#define M2M_DIRECT_RELAY_HEADER_LENGTH 18				//Origin and destination MAC addresses, hop limit, hop count and message ID, between the field count and the fields
+#define M2M_DIRECT_RELAY_HOP_LIMIT 4					//Default most links a relayed message may cross
+#define M2M_DIRECT_RELAY_DUPLICATE_CACHE 16				//Recent relayed messages remembered to drop copies arriving by another route
 
 enum class m2mDirectState: std::uint8_t {
 	uninitialised,
@@ -74,6 +192,185 @@ enum class m2mDirectState: std::uint8_t {
 	disconnected
 };
 
+enum class m2mDirectEvent: std::uint8_t {											//Events queued for the application callbacks
+	pairing,
+	paired,
+	connected,
+	disconnected,
+	messageReceived,
+	peerStateChanged
+};
+
+struct m2mDirectFrameMetadata {													//Radio metadata for a received frame, not available on ESP8266
+	int8_t rssi = M2M_DIRECT_RSSI_UNKNOWN;											//Signal strength, in dBm
+	int8_t noiseFloor = M2M_DIRECT_RSSI_UNKNOWN;									//Noise floor, in dBm
+	uint8_t rate = 0;																//PHY rate index reported by the radio
+	uint32_t timestamp = 0;															//Radio receive timestamp, in us
+	uint32_t received = 0;															//millis() when the frame reached the receive callback
+};
+
+struct m2mDirectStatistics {														//Monotonic link counters, returned as a snapshot by statistics()
+	uint32_t since = 0;																//millis() when the counters were last reset
+	uint32_t framesSent = 0;														//Frames handed to ESP-Now, unicast and broadcast
+	uint32_t broadcastFramesSent = 0;												//Broadcast frames handed to ESP-Now, mostly pairing
+	uint32_t sendFailures = 0;														//esp_now_send() returned an error
+	uint32_t sendCallbackFailures = 0;												//The send callback reported a failed delivery
+	uint32_t sendTimeouts = 0;														//No send callback arrived within the send timeout
+	uint32_t keepalivesSent = 0;													//Keepalives sent
+	uint32_t dataMessagesSent = 0;													//Application messages sent successfully
+	uint32_t framesReceived = 0;													//Frames received, valid or not
+	uint32_t crcFailures = 0;														//Frames received with a bad CRC
+	uint32_t keepalivesReceived = 0;												//Valid keepalives received
+	uint32_t dataMessagesReceived = 0;												//Valid application messages received
+	uint32_t receivedMessagesDiscarded = 0;											//Application messages dropped because the receive buffer was full
+	uint32_t unknownMessageTypes = 0;												//Valid frames with an unknown type
+	uint32_t txPowerChanges = 0;													//Changes of Tx power made by automatic Tx power
+	uint32_t disconnections = 0;													//Transitions from connected to disconnected
+	uint32_t channelMigrations = 0;													//Agreed changes of communication channel
+	uint32_t channelMigrationsAbandoned = 0;										//Proposed changes of channel that were never acknowledged
+	uint32_t channelHunts = 0;														//Times the link had to hunt for the peer after a change of channel
+	uint32_t eventsCoalesced = 0;													//Events merged with one already queued
+	uint32_t eventsDropped = 0;														//Events lost because the event queue was full
+	uint32_t queuedMessagesDropped = 0;												//Queued messages never sent, because the link was down or the send failed
+	uint32_t fecParityFramesSent = 0;												//Forward error correction parity frames sent
+	uint32_t fecMessagesRecovered = 0;												//Lost application messages rebuilt from parity
+	uint32_t fecBlocksUnrecoverable = 0;											//Blocks with more lost messages than parity can rebuild
+	uint32_t wakeWindows = 0;														//Power save wake windows the radio woke for
+	uint32_t radioSleepTime = 0;													//Time the radio spent asleep in power save, in ms
+	uint32_t recordsSaved = 0;														//Pairing records written to flash
+	uint32_t storeErases = 0;														//Flash sectors erased to make room for records (ESP8266)
+	uint32_t broadcastMessagesSent = 0;												//Broadcast application messages sent
+	uint32_t broadcastMessagesReceived = 0;											//Authenticated broadcast messages received in a subscribed group
+	uint32_t broadcastMessagesLost = 0;												//Gaps in the sequence numbers of broadcasts received
+	uint32_t broadcastDuplicates = 0;												//Broadcasts received again, or replayed
+	uint32_t broadcastMessagesFiltered = 0;											//Broadcasts ignored because the group isn't subscribed
+	uint32_t broadcastAuthenticationFailures = 0;									//Broadcasts with a bad authentication tag
+	uint32_t broadcastSourcesRefused = 0;											//Broadcasts dropped because every publisher tracked was heard too recently to forget
+	uint32_t relayedMessagesReceived = 0;											//Relayed messages delivered to this device
+	uint32_t relayFramesSent = 0;													//Relayed frames, originated or forwarded, acknowledged by the next hop
+	uint32_t relaySendFailures = 0;													//Relayed frames the next hop didn't acknowledge, the loss on this device's hops
+	uint32_t relayFramesForwarded = 0;												//Frames for another device passed on by this relay
+	uint32_t relayDuplicates = 0;													//Relayed frames dropped as already seen
+	uint32_t relayHopLimitDrops = 0;												//Relayed frames dropped for reaching their hop limit
+	uint32_t relayHopLatency = 0;													//Smoothed time from queueing a relayed frame to the next hop acknowledging it, in ms
+	uint32_t relayHopLatencyMaximum = 0;											//Longest time from queueing a relayed frame to the next hop acknowledging it, in ms
+	uint32_t framesWithMetadata = 0;												//Frames from the peer with radio metadata, the signal fields below are only valid if this is non-zero
+	int8_t rssiAverage = M2M_DIRECT_RSSI_UNKNOWN;									//Smoothed RSSI of frames from the peer, in dBm
+	int8_t rssiMinimum = M2M_DIRECT_RSSI_UNKNOWN;									//Weakest frame from the peer, in dBm
+	int8_t rssiMaximum = M2M_DIRECT_RSSI_UNKNOWN;									//Strongest frame from the peer, in dBm
+	int8_t noiseFloorAverage = M2M_DIRECT_RSSI_UNKNOWN;								//Smoothed noise floor, in dBm
+};
+
+struct m2mDirectRateStatistics {													//Delivery statistics for one PHY rate
+	uint16_t kbps = 0;																//Nominal bit rate, in kbit/s
+	uint32_t attempts = 0;															//Unicast frames sent at this rate
+	uint32_t successes = 0;															//Unicast frames acknowledged at this rate
+	uint16_t probability = 0;														//Smoothed delivery probability, in 1/1000
+};
+
+struct m2mDirectQueuedPacket {														//An application message waiting to be sent or delivered
+	uint8_t length = 0;
+	uint8_t buffer[MAXIMUM_MESSAGE_SIZE];
+	m2mDirectFrameMetadata metadata;												//Radio metadata, for received messages. Only the time is used for messages to send, when it was queued
+	uint8_t peer = M2M_DIRECT_NO_PEER;												//Peer table index it is to or from, M2M_DIRECT_NO_PEER for the paired device
+	uint8_t macAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};							//MAC address of that peer, so a slot reused after removePeer() isn't taken for it
+};
+
+struct m2mDirectPeerInfo {															//Snapshot of a device in the peer table, returned by peerInfo()
+	uint8_t macAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};							//MAC address of the peer
+	m2mDirectState state = m2mDirectState::uninitialised;							//State of the link, connecting, connected or disconnected
+	uint32_t linkQuality = 0;														//AND of send and echo quality, as linkQuality() is for the paired device
+	uint32_t keepaliveInterval = 0;													//Current keepalive interval, in ms
+	uint32_t lastHeard = 0;															//millis() when a valid frame last arrived from the peer, 0 if none has
+	int8_t rssi = M2M_DIRECT_RSSI_UNKNOWN;											//Smoothed RSSI of frames from the peer, in dBm
+	uint32_t keepalivesSent = 0;													//Keepalives sent to the peer
+	uint32_t keepalivesReceived = 0;												//Valid keepalives received from the peer
+	uint32_t dataMessagesSent = 0;													//Application messages sent to the peer successfully
+	uint32_t dataMessagesReceived = 0;												//Application messages received from the peer
+	uint32_t sendFailures = 0;														//Frames to the peer that failed or timed out
+	uint32_t disconnections = 0;													//Transitions from connected to disconnected
+	uint32_t pollLatency = 0;														//Smoothed time from a poll to the answer, in ms (hub only)
+	uint32_t pollLatencyMaximum = 0;												//Longest time from a poll to the answer, in ms (hub only)
+};
+
+struct m2mDirectPeer {																//A device in the peer table, with its own link state machine. Atomics are shared with the receive callback
+	std::atomic<bool> inUse{false};													//Slot holds a peer, set last when adding and cleared first when removing
+	uint8_t macAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};							//MAC address of the peer
+	uint8_t localEncryptionKey[ENCRYPTION_KEY_LENGTH] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};	//Local encryption key shared with the peer
+	std::atomic<m2mDirectState> state{m2mDirectState::uninitialised};				//State of the link
+	uint32_t localActivityTimer = 0;												//Time of the last keepalive sent
+	uint32_t previousLocalActivityTimer = 0;										//Time of the keepalive before, which the peer echoes
+	std::atomic<uint32_t> remoteActivityTimer{0};									//Timer from the last keepalive received, echoed back
+	std::atomic<uint32_t> echoedActivityTimer{0};									//Local timer the peer last echoed, 0 once housekeeping has seen it
+	uint32_t keepaliveInterval = 0;													//Keepalive interval for this peer
+	uint32_t sendQuality = 0;														//Send quality, from ESP-Now ACKs
+	std::atomic<uint32_t> echoQuality{0};											//Echo quality, from keepalive echoes
+	std::atomic<uint32_t> receiveQuality{0};										//History of keepalives received, by sequence number
+	uint8_t lastReceivedSequence = 0;												//Sequence number of the last keepalive received, only used by the receive callback
+	uint8_t keepaliveSequence = 0;													//Sequence number of the next keepalive sent
+	std::atomic<bool> handshakeReplyDue{false};										//The peer is waiting on a keepalive to complete its handshake
+	std::atomic<bool> handshakeVerified{false};										//A keepalive echoed the last one sent while not connected
+	std::atomic<int8_t> rssi{M2M_DIRECT_RSSI_UNKNOWN};								//Smoothed RSSI of frames from the peer
+	std::atomic<uint32_t> lastHeard{0};												//millis() when a valid frame last arrived
+	uint32_t keepalivesSent = 0;													//Counters, the received ones written by the receive callback and the rest by housekeeping. peerInfo() copies them one at a time
+	uint32_t keepalivesReceived = 0;
+	uint32_t dataMessagesSent = 0;
+	uint32_t dataMessagesReceived = 0;
+	uint32_t sendFailures = 0;
+	uint32_t disconnections = 0;
+	std::atomic<uint32_t> pollLatency{0};											//Smoothed time from a poll to the answer (hub)
+	std::atomic<uint32_t> pollLatencyMaximum{0};									//Longest time from a poll to the answer (hub)
+};
+
+struct m2mDirectBroadcastSourceInfo {												//Snapshot of a device broadcasts have been received from, returned by broadcastSourceInfo()
+	uint8_t macAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};							//MAC address of the publisher
+	uint32_t lastHeard = 0;															//millis() when a broadcast last arrived
+	uint32_t received = 0;															//Broadcasts received
+	uint32_t lost = 0;																//Broadcasts missed, from gaps in the sequence numbers
+	uint32_t duplicates = 0;														//Broadcasts received again, or replayed
+	uint32_t epoch = 0;																//Boot count the publisher is sending with
+};
+
+struct m2mDirectBroadcastSource {													//A publisher's sequence numbers, only written by the receive callback
+	std::atomic<bool> inUse{false};
+	uint8_t macAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};
+	uint32_t epoch = 0;
+	uint32_t lastSequence = 0;
+	uint32_t lastHeard = 0;
+	uint32_t received = 0;
+	uint32_t lost = 0;
+	uint32_t duplicates = 0;
+};
+
+struct m2mDirectRelayRecord {														//A relayed message already seen, for duplicate suppression
+	uint8_t origin[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};
+	uint32_t messageId = 0;
+};
+
+struct m2mDirectLinkState {															//Converged link parameters saved alongside the pairing
+	uint8_t channel = 0;															//Communication channel
+	int8_t minTxPower = 0;															//Tx power floor, in 0.25dBm steps
+	int8_t currentTxPower = 0;														//Tx power, in 0.25dBm steps
+	uint32_t keepaliveInterval = 0;													//Keepalive interval, in ms
+	uint8_t rateIndex = 0;															//Best PHY rate (ESP32 only)
+	bool valid = false;																//Parameters have been saved or read
+};
+
+struct m2mDirectClockSample {														//One NTP style exchange carried in keepalives
+	int32_t offset = 0;																//Remote clock minus local clock, in ms
+	uint32_t time = 0;																//Local time the sample was taken
+	int32_t roundTrip = 0;															//Round trip excluding the time the remote device held the echo
+};
+
+struct m2mDirectClockEstimate {														//The current estimate of the remote clock
+	int32_t offset = 0;																//Remote clock minus local clock at the reference time, in ms
+	uint32_t reference = 0;															//Local time of the sample the offset came from
+	int32_t roundTrip = 0;															//Round trip of that sample, half of it is the error
+	float drift = 0;																//Change in offset per ms
+	bool driftValid = false;														//Drift has been measured
+	bool synchronised = false;														//There is an estimate
+};
+
 bool initialiseEspNowCallbacks();													//Initialise the ESP-Now callbacks
 
 class m2mDirectClass	{
@@ -88,17 +385,77 @@ class m2mDirectClass	{
 		char* remoteName();															//Returns a pointer to the remote device name (or nullptr if not set)
 		void disableEncryption();													//Disable encryption (why?)
 		void begin(uint8_t communicationChannel = 0, uint8_t pairingChannel = 1);	//Start the m2mDirectClass library
+		bool instanceRegistered();													//This instance got a place among the M2M_DIRECT_MAXIMUM_INSTANCES sharing the callbacks, begin() does nothing otherwise
+		bool provision(const uint8_t* remoteMacAddress, const uint8_t* primaryEncryptionKey, const uint8_t* localEncryptionKey, uint8_t channel = 0, bool save = false);	//Use a pre-provisioned pairing instead of pairing over the air
+		bool provision(const uint8_t* record, uint8_t length, bool save = false);	//Use a pre-provisioned pairing from a provisioning blob
+		uint8_t pairingRecord(uint8_t* buffer);										//Copy the pairing as a provisioning blob, returns its length or 0 if not paired
 		void pairingButtonGpio(uint8_t pin = 255, bool inverted = false);			//Set pin used for pairing button GPIO
 		void indicatorGpio(uint8_t pin = 255, bool inverted = false);				//Set pin used for indicator GPIO
 		void housekeeping();														//Maintain keepalives etc.
+		bool backgroundHousekeeping(uint32_t interval = M2M_DIRECT_HOUSEKEEPING_INTERVAL, int8_t core = -1);	//Run link housekeeping in an RTOS task (ESP32) or Ticker (ESP8266)
+		bool backgroundHousekeepingRunning();										//Is link housekeeping running in the background
 		m2mDirectClass& setPairingCallback(std::function<void()> function);				//Set the pairing start callback (mostly for information if the pairing button is pushed)
 		m2mDirectClass& setPairedCallback(std::function<void()> function);				//Set the paired callback
 		m2mDirectClass& setConnectedCallback(std::function<void()> function);			//Set the connected callback
 		m2mDirectClass& setDisconnectedCallback(std::function<void()> function);			//Set the disconnected callback
 		m2mDirectClass& setMessageReceivedCallback(std::function<void()> function);		//Set the message received callback
+		void dispatchEvents();														//Run the callbacks for any queued events
+		void manualEventDispatch(bool setting = true);								//Dispatch events from dispatchEvents() only, not housekeeping()
 		bool connected();															//Simple boolean measure of being connected
 		uint32_t linkQuality();														//A measure of link quality
+		m2mDirectStatistics statistics();											//Snapshot of the link counters
+		uint32_t bootToConnectedTime();												//millis() when the link first connected, 0 until then
+		void fastPairing(bool enabled = true);										//Pair with random bursts and quick ACKs, rather than every pairing interval
+		uint32_t timeToPair();														//Time from pairing starting to connected for the last pairing, 0 if there hasn't been one
+		void fastHandshake(bool enabled = true);									//Connect after one verified round trip of keepalives, rather than a run of good ones
+		uint32_t reconnectTime();													//How long the last reconnection took, from disconnected to connected, in ms
+		void resetStatistics();														//Zero the link counters
+		bool clockSynchronised();													//Is there an estimate of the remote clock
+		int32_t clockOffset();														//Remote millis() minus local millis(), now
+		float clockDrift();															//Drift of the remote clock in ppm
+		bool remoteToLocal(uint32_t remoteTime, uint32_t &localTime, uint32_t &errorBound);	//Convert a remote millis() timestamp to local time with an error bound in ms
+		void channelSurvey(bool enabled = true, bool whileConnected = false);		//Enable the background channel survey
+		uint8_t leastCongestedChannel();											//Least congested channel from the survey, 0 if incomplete
+		uint32_t channelCongestion(uint8_t channel);								//Congestion score for a channel from the survey, higher is worse
+		void channelMigration(bool enabled = true);									//Move the link to a better channel when it degrades
+		bool migrateChannel(uint8_t channel);										//Ask the peer to move the link to a specific channel
+		uint8_t communicationChannel();												//The channel currently used for communication
+		void channelHunting(bool enabled = true);									//Hunt across every channel for the peer when keepalives stop
 		void setAutomaticTxPower(bool setting = true);								//Enable/disable automatic Tx power
+		void setTxPowerTarget(int8_t rssi = M2M_DIRECT_TX_POWER_TARGET_RSSI);		//Set the RSSI automatic Tx power aims for at the peer
+		int8_t remoteRssi();														//RSSI the peer reports for frames from this end, M2M_DIRECT_RSSI_UNKNOWN if none
+		uint8_t remoteReceiveQuality();												//Keepalives from this end the peer received, of the last 32
+		float remoteTxPower();														//Tx power the peer reports using, in dBm
+		int8_t rssi();																//Smoothed RSSI of frames from the peer, M2M_DIRECT_RSSI_UNKNOWN if none
+		m2mDirectFrameMetadata receivedMessageMetadata();							//Radio metadata for the current received message
+		void receivedMessageSender(uint8_t* macAddress);							//Copy the MAC address of the device that sent the current received message
+		bool receivedMessageBroadcast();											//The current received message is a broadcast
+		uint8_t receivedMessageGroup();												//Group of the current received broadcast
+		uint8_t receivedMessageHops();												//Links the current received message crossed, 1 unless it was relayed
+		void relay(bool enabled = true);											//Forward relayed messages between this device's link partners
+		void broadcastKey(const uint8_t* key);										//Set the key broadcasts are authenticated with, otherwise the primary encryption key is used
+		void broadcastSubscribe(uint8_t group, bool subscribed = true);				//Receive broadcasts sent to a group, none are received until one is subscribed
+		bool broadcastSourceInfo(uint8_t index, m2mDirectBroadcastSourceInfo &info);	//Snapshot of the nth device broadcasts have been received from, false if there isn't one
+		bool addPeer(const uint8_t* macAddress, const uint8_t* primaryEncryptionKey = nullptr, const uint8_t* localEncryptionKey = nullptr);	//Add a device to the peer table, call after begin()
+		bool removePeer(const uint8_t* macAddress);									//Remove a device from the peer table
+		uint8_t peerCount();														//Number of devices in the peer table
+		bool peerConnected(const uint8_t* macAddress);								//Is the link to a device in the peer table connected
+		bool peerInfo(uint8_t index, m2mDirectPeerInfo &info);						//Snapshot of the nth device in the peer table, false if there isn't one
+		m2mDirectClass& setPeerStateChangedCallback(std::function<void()> function);	//Set the callback for a peer connecting or disconnecting
+		void hub(bool enabled = true, uint16_t slotLength = M2M_DIRECT_HUB_SLOT_LENGTH);	//Poll the devices in the peer table one slot at a time, rather than each sending when it likes
+		uint32_t hubCycleTime();													//Time to poll every peer once, the longest a spoke waits to send, 0 if not a hub
+		bool hubScheduled();														//This device is being polled by a hub, so only sends in its slot
+		void rateAdaptation(bool enabled = true);									//Enable/disable automatic PHY rate selection (ESP32 only)
+		void longRange(bool enabled = true);										//Allow Espressif long range (LR) mode, call before begin() (ESP32 only)
+		bool longRangeAvailable();													//Both ends allow long range mode
+		uint16_t currentRate();														//PHY rate unicast frames are sent at, in kbit/s
+		uint8_t rateCount();														//Number of PHY rates with statistics, 0 on ESP8266
+		m2mDirectRateStatistics rateStatistics(uint8_t index);						//Delivery statistics for a PHY rate, slowest first
+		void forwardErrorCorrection(bool enabled = true, uint8_t blockSize = 0);	//Send a parity frame every blockSize messages, 0 adapts the block size to link loss
+		uint8_t forwardErrorCorrectionBlockSize();									//Messages per parity frame, 0 if not in use
+		void powerSave(bool enabled = true, uint16_t period = M2M_DIRECT_POWER_SAVE_PERIOD, uint16_t window = M2M_DIRECT_POWER_SAVE_WINDOW);	//Sleep the radio between wake windows agreed with the peer
+		bool powerSaveActive();														//Both ends have agreed a wake schedule and are using it
+		uint32_t powerSaveSleepTime();												//Time until the radio is next needed, 0 if it is awake, in ms
 		void debug(Stream &);														//Start debugging on a stream
 
 		bool ICACHE_FLASH_ATTR addStr(char* dataToAdd)								//Specific method to add a null terminated C string, which sorts out null termination
@@ -290,6 +647,9 @@ class m2mDirectClass	{
 		}
 		//Consider making a variadic function for adding multiple items of heterogenous types in one go https://en.cppreference.com/w/cpp/utility/variadic
 		bool sendMessage(bool wait = true);																				//Send the accumulated message
+		bool sendMessageTo(const uint8_t* macAddress, bool wait = true);												//Send the accumulated message to a device in the peer table
+		bool broadcastMessage(uint8_t group = 0);																		//Send the accumulated message once to every listener subscribed to the group
+		bool sendMessageRelayed(const uint8_t* macAddress, uint8_t hopLimit = M2M_DIRECT_RELAY_HOP_LIMIT);			//Send the accumulated message to a device that may be out of range, through relays
 		static const uint8_t DATA_UNAVAILABLE =    0xff;			//Used to denote no more data left, this is never packed in a packet, but can be returned to the application
 		static const uint8_t DATA_BOOL =           0x00;			//Used to denote boolean, it also implies the boolean is false
 		static const uint8_t DATA_BOOL_TRUE =      0x01;			//Used to denote boolean, it also implies the boolean is true
@@ -561,16 +921,29 @@ class m2mDirectClass	{
 	private:
 		//Variables
 		#if defined ESP8266
-			//Ticker houseKeepingticker;													//The Ticker used to run regular housekeeping tasks
+			Ticker houseKeepingticker;													//The Ticker used to run regular housekeeping tasks
+			m2mDirectQueuedPacket _sendQueue[M2M_DIRECT_SEND_QUEUE_LENGTH];			//Ring buffer of application messages, the Ticker never preempts loop() so this needs no locking
+			uint8_t _sendQueueHead = 0;												//Next queued message to send
+			uint8_t _sendQueueTail = 0;												//Next free slot in the queue
 		#elif defined ESP32
 			Preferences settings;													//Instance of preferences used to store settings
-			char preferencesNamespace[10] = "m2mDirect";							//Preferences namespace used to store pairing info
+			char preferencesNamespace[12] = "m2mDirect";							//Preferences namespace used to store pairing info, other instances add their registry index
 			char pairedMacKey[8] = "pairMac";										//Key in namespace for paired MAC address
 			char pairedPrimaryKey[7] = "priKey";									//Key in namespace for primary encryption key
 			char pairedLocalKey[7] = "locKey";										//Key in namespace for local encryption key
 			char pairedNameKey[5] = "name";											//Key in namespace for remote device name
 			char pairedNameLengthKey[4] = "len";									//Key in namespace for remote device name length
+			char pairedRecordKey[7] = "record";										//Key in namespace for the pairing record, the keys above are only read to migrate older pairings
+			char broadcastEpochKey[6] = "epoch";									//Key in namespace for the count of boots that broadcast
+			TaskHandle_t _housekeepingTaskHandle = nullptr;							//Handle of the housekeeping task
+			std::atomic<bool> _housekeepingTaskStop{false};							//Asks the housekeeping task to finish, set by the destructor
+			std::atomic<bool> _housekeepingTaskRunning{false};						//Cleared by the housekeeping task as it finishes
+			QueueHandle_t _sendQueue = nullptr;										//Queue of application messages for the housekeeping task
 		#endif
+		bool _backgroundHousekeeping = false;										//Link housekeeping runs in a task/Ticker, not from housekeeping()
+		uint32_t _housekeepingInterval = M2M_DIRECT_HOUSEKEEPING_INTERVAL;			//How often background housekeeping runs
+		bool _deferSendConfirmation = false;										//Don't wait for the send callback, check it on the next tick instead (ESP8266 background housekeeping)
+		bool _deferredSendPending = false;											//A send is waiting for confirmation on a later tick
 		Stream *debug_uart_ = nullptr;												//The stream used for the debugging
 		uint8_t _pairingButtonGpio = 255;											//The GPIO pin used as a pairing button 255=unused
 		bool _pairingButtonGpioNc = false;											//GPIO button pin is normally closed
@@ -580,26 +953,81 @@ class m2mDirectClass	{
 		bool _indicatorState = false;												//State of indicator LED
 		uint32_t _indicatorTimer = 0;												//Time of last state change of indicator LED
 		uint32_t _indicatorTimerInterval = 0;										//How often the indicator changes state
-		m2mDirectState state = m2mDirectState::uninitialised;						//State of the connection
+		//Fields shared between the ESP-Now callbacks (WiFi task on ESP32) and housekeeping are atomic
+		//Remote MAC address, keys and channel are written by the receive callback before it stores a new state, so a reader that sees the state sees them too
+		std::atomic<m2mDirectState> state{m2mDirectState::uninitialised};			//State of the connection
 		uint8_t _pairingChannel = 0;												//Channel used for pairing
-		uint8_t _communicationChannel = 0;											//Channel used for communication
+		std::atomic<uint8_t> _communicationChannel{0};								//Channel used for communication, moved by housekeeping during a channel migration
 		bool _encyptionEnabled = true;												//Whether to encrypt communication
-		uint32_t _localActivityTimer = 0;											//General timer for periodic activity like keepalives
-		uint32_t _previouslocalActivityTimer = 0;									//Need the previous timer value for checking keepalive echoes
-		uint32_t _remoteActivityTimer = 0;											//General timer for periodic activity like keepalives
-		uint32_t receivedLocalActivityTimer = 0;									//Used in echo quality detection
+		std::atomic<uint32_t> _localActivityTimer{0};								//General timer for periodic activity like keepalives
+		std::atomic<uint32_t> _previouslocalActivityTimer{0};						//Timer sent in the last keepalive, read by the receive callback to check echoes
+		std::atomic<uint32_t> _remoteActivityTimer{0};								//General timer for periodic activity like keepalives
+		std::atomic<uint32_t> receivedLocalActivityTimer{0};						//Used in echo quality detection
+		//Channel survey
+		bool _automaticChannel = false;												//Communication channel is chosen by the library
+		bool _channelSurveyEnabled = false;											//Run the background channel survey
+		bool _channelSurveyWhileConnected = false;									//Also survey while connected, which costs some frames
+		bool _surveyDwelling = false;												//Currently listening on a survey channel
+		uint8_t _surveyChannel = 1;													//Channel being, or next to be, surveyed
+		uint8_t _surveyHomeChannel = 0;												//Channel to return to after a dwell
+		uint32_t _surveyTimer = 0;													//Start of the current dwell or end of the last one
+		std::atomic<uint32_t> _surveyFrames{0};										//Frames seen in this dwell, counted in the promiscuous callback
+		std::atomic<uint32_t> _surveyStrength{0};									//Sum of signal strength above the floor in this dwell
+		uint32_t _channelActivity[M2M_DIRECT_MAXIMUM_CHANNEL] = {};					//Smoothed activity for each channel
+		uint16_t _channelsSurveyed = 0;												//Bitmask of channels with survey data
+		//Channel migration, only housekeeping changes channel, the receive callback hands proposals over through the atomics
+		bool _channelMigrationEnabled = false;										//Move the link when it degrades
+		uint8_t _migrationChannel = 0;												//Channel being migrated to, 0 if none
+		uint32_t _migrationSwitchTime = 0;											//Local time both ends switch
+		bool _migrationInitiator = false;											//This end proposed the migration
+		bool _migrationAcknowledged = false;										//The peer has agreed to the migration
+		uint32_t _migrationResendTimer = 0;											//Last time the proposal was sent
+		uint32_t _lastMigration = 0;												//Time of the last migration, for the holdoff
+		uint8_t _migrationAlternateChannel = 0;										//Other channel the peer may be on after a migration, 0 once the link is confirmed
+		uint32_t _migrationHuntTimer = 0;											//Time of the switch, then of the last hop while hunting
+		bool _migrationHunting = false;												//Hopping between the two channels looking for the peer
+		std::atomic<uint8_t> _receivedMigrationChannel{0};							//Channel proposed by the peer, 0 if none
+		std::atomic<uint32_t> _receivedMigrationSwitchTime{0};						//Local time the peer will switch, stored before the channel
+		std::atomic<uint8_t> _receivedMigrationAck{0};								//Channel the peer acknowledged, 0 if none
+		std::atomic<uint8_t> _requestedMigrationChannel{0};							//Channel asked for by migrateChannel(), 0 if none
+		std::atomic<bool> _keepaliveReceived{false};								//A valid keepalive arrived since housekeeping last looked
+		uint32_t _lastKeepaliveTime = 0;											//When housekeeping last saw a valid keepalive
+		//Channel re-acquisition
+		bool _channelHuntEnabled = false;											//Hunt across every channel when keepalives stop
+		bool _channelHunting = false;												//Currently hunting
+		uint32_t _channelHuntTimer = 0;												//Arrival on the current hunt channel
+		//Clock synchronisation
+		uint32_t _remoteTransmitTime = 0;											//Remote transmit time of the last keepalive, 0 if none, protected by _clockSequence
+		uint32_t _remoteTransmitReceived = 0;										//Local time it arrived, protected by _clockSequence
+		m2mDirectClockSample _clockSamples[M2M_DIRECT_CLOCK_SAMPLES];				//Recent clock samples, only used by the receive callback
+		uint8_t _clockSampleIndex = 0;												//Next sample to overwrite
+		uint8_t _clockSampleCount = 0;												//Number of valid samples
+		m2mDirectClockSample _clockDriftAnchor;										//Sample drift is measured from
+		m2mDirectClockEstimate _clockEstimate;										//Published estimate, protected by _clockSequence
+		std::atomic<uint32_t> _clockSequence{0};									//Sequence lock for the estimate and remote transmit time, odd while they are being written by the receive callback
 		//uint32_t _lastTimestamp = 0;												//Last timestamp in a sent packet
 		uint32_t _startingKeepaliveInterval = 250;									//Starting keepalive time for a paired connection
 		uint32_t _minimumKeepaliveInterval = 50;									//Minimum keepalive time for a paired connection
 		uint32_t _maximumKeepaliveInterval = 100000000;									//Maximum keepalive time for a paired connection
 		uint32_t _keepaliveInterval = 250;											//Keepalive time for a paired connection
 		uint32_t _pairingInterval = 5000;											//How often to send pairing packets
+		bool _fastPairing = true;													//Send pairing messages in random bursts, then quickly once a peer is heard
+		std::atomic<bool> _pairingPeerHeard{false};									//A pairing message arrived from a peer that will adopt this device's keys
+		uint8_t _pairingBurstCount = 0;												//Pairing messages sent in the current burst
+		uint32_t _nextPairingInterval = 0;											//Time until the next pairing message or ACK, in ms
+		uint32_t _pairingStartTime = 0;												//millis() when pairing started, 0 once connected
+		uint32_t _timeToPair = 0;													//Time pairing took, the last time it completed, in ms
+		bool _fastHandshake = true;													//Connect after one verified round trip
+		std::atomic<bool> _handshakeReplyDue{false};								//The peer is waiting on a keepalive to complete its handshake
+		std::atomic<bool> _handshakeVerified{false};								//A keepalive echoed the last one sent while not connected
+		uint32_t _disconnectedTime = 0;												//millis() when the link last disconnected
+		uint32_t _reconnectTime = 0;												//How long the last reconnection took, in ms
 		uint32_t _sendTimer = 0;													//Timer for sent packets
 		uint32_t _sendTimeout = 100;												//How long to wait for confirmation of a sent packet
-		bool _waitingForSendCallback = false;										//Flag that we're waiting for a callback
+		std::atomic<bool> _waitingForSendCallback{false};							//Flag that we're waiting for a callback
 		uint32_t _sendQuality = 0x00000000;											//A measure of send quality, using built in ACKs from ESP-Now
 		uint32_t _startingSendquality = 0x00000000;
-		uint32_t _echoQuality = 0x00000000;											//A measure of echo quality, using keepalive echoes
+		std::atomic<uint32_t> _echoQuality{0x00000000};								//A measure of echo quality, using keepalive echoes
 		uint32_t _startingEchoQuality = 0x00000000;
 		bool _automaticTxPower = true;												//Enable/disable automatic TxPower
 		int8_t _currentTxPower = 0;													//Current Tx power
@@ -607,16 +1035,90 @@ class m2mDirectClass	{
 		int8_t _maxTxPower = 80;													//Maximum Tx power 20dBm (80 * 0.25)
 		uint32_t _lastTxPowerChange = 0;
 		bool _lastTxPowerChangeDownwards = false;
-		uint8_t _primaryEncryptionKey[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};		//Primary encryption key
+		int8_t _txPowerTargetRssi = M2M_DIRECT_TX_POWER_TARGET_RSSI;				//RSSI the Tx power controller aims for at the peer
+		bool _remoteLinkReportSeen = false;											//The peer sends link reports, so the closed loop controller can be used
+		std::atomic<uint32_t> _remoteLinkReport{0};									//Latest link report from the peer, flags/RSSI/quality packed so they change together, 0 once used
+		int8_t _remoteRssi = M2M_DIRECT_RSSI_UNKNOWN;								//RSSI the peer last reported for frames from this end
+		uint8_t _remoteReceiveQuality = 0;											//Keepalives the peer last reported receiving, of 32
+		std::atomic<int8_t> _remoteTxPower{0};										//Tx power the peer last reported
+		std::atomic<int8_t> _receivedRssi{M2M_DIRECT_RSSI_UNKNOWN};				//RSSI of frames from the peer, reported back to it
+		std::atomic<uint32_t> _receiveQuality{0};									//History of keepalives received from the peer, by sequence number
+		uint8_t _lastReceivedSequence = 0;											//Sequence number of the last keepalive from the peer, only used by the receive callback
+		uint8_t _keepaliveSequence = 0;												//Sequence number of the next keepalive sent
+		m2mDirectFrameMetadata _receivedMessageMetadata;							//Radio metadata for the message in the application buffer
+		#if defined(ESP32)
+		//PHY rate adaptation, Minstrel style. Frames normally go at the best throughput rate that is reliable enough, with occasional samples of rates that might do better
+		bool _rateAdaptation = true;												//Choose the PHY rate automatically
+		m2mDirectRateStatistics _rateStatistics[M2M_DIRECT_RATE_COUNT];				//Delivery statistics for each rate
+		uint16_t _rateIntervalAttempts[M2M_DIRECT_RATE_COUNT] = {};					//Attempts since probabilities were last updated
+		uint16_t _rateIntervalSuccesses[M2M_DIRECT_RATE_COUNT] = {};				//Successes since probabilities were last updated
+		uint8_t _currentRateIndex = 0;												//Rate this instance last sent at
+		static std::atomic<uint8_t> _radioRateIndex;								//Rate ESP-Now is configured for, one setting for the whole radio, M2M_DIRECT_RATE_COUNT if not known
+		uint8_t _bestRateIndex = 0;													//Best throughput among reliable rates
+		uint8_t _robustRateIndex = 0;												//Highest delivery probability, used after a loss
+		uint8_t _rateSampleCounter = 0;												//Frames since the last sample
+		uint8_t _rateSampleIndex = 0;												//Last rate sampled, sampling goes round robin
+		uint8_t _rateFailures = 0;													//Consecutive failures at the normal rate
+		uint32_t _rateTimer = 0;													//Last probability update
+		bool _rateSample = false;													//The last unicast frame was a sample
+		bool _longRange = false;													//LR is added to the WiFi protocols so LR frames can be received
+		std::atomic<bool> _remoteLongRange{false};									//The peer reports it can receive LR frames
+		#endif
+		//Power save, both ends sleep their radios between wake windows on the tie-break winner's clock
+		bool _powerSaveEnabled = false;												//This end wants to use power save
+		uint16_t _powerSavePeriod = M2M_DIRECT_POWER_SAVE_PERIOD;					//Requested time between the starts of wake windows
+		uint16_t _powerSaveWindow = M2M_DIRECT_POWER_SAVE_WINDOW;					//Requested length of a wake window
+		std::atomic<uint32_t> _remoteWakeSchedule{0};								//Period and window the peer requests, 0 if it doesn't want power save
+		std::atomic<bool> _powerSaveActive{false};									//A wake schedule is agreed and in use
+		std::atomic<bool> _wakeWindowOpen{false};									//Inside a wake window, sending is allowed
+		std::atomic<uint32_t> _powerSaveSleepTime{0};								//Time until the next wake, for the application
+		bool _radioAsleep = false;													//The radio is off between wake windows
+		bool _wakeWindowKeepaliveDue = false;										//Send a keepalive as soon as the window opens
+		uint32_t _radioSleepStart = 0;												//When the radio last went to sleep
+		uint32_t _wakeWindowKeepalives = 0;											//Keepalives received before this wake, to spot a window with none
+		//Forward error correction, XOR parity across a block of application messages
+		bool _fecEnabled = false;													//Protect application messages with parity
+		bool _fecAdaptiveBlockSize = true;											//Choose the block size from the loss the peer reports
+		uint8_t _fecBlockSize = M2M_DIRECT_FEC_MAXIMUM_BLOCK;						//Messages per parity frame
+		std::atomic<bool> _remoteFec{false};										//The peer reports it can decode protected messages
+		uint8_t _fecSendBlock = 0;													//Number of the block being sent
+		uint8_t _fecSendCount = 0;													//Messages sent in the current block
+		uint8_t _fecSendLengths = 0;												//XOR of the message lengths in the current block
+		uint8_t _fecSendLongest = 0;												//Longest message in the current block
+		uint32_t _fecSendBlockStart = 0;											//When the first message of the current block was sent
+		uint8_t _fecSendParity[M2M_DIRECT_FEC_MAXIMUM_LENGTH];						//XOR of the messages in the current block
+		uint8_t _fecPacketBuffer[MAXIMUM_MESSAGE_SIZE];								//Protected message or parity frame being sent
+		uint8_t _fecReceiveBlock = 0;												//Number of the block being received, only used by the receive callback
+		uint8_t _fecReceivedMask = 0;												//Messages received in the current block, by index
+		uint8_t _fecReceiveLengths = 0;												//XOR of the received message lengths
+		uint8_t _fecReceiveParity[M2M_DIRECT_FEC_MAXIMUM_LENGTH];					//XOR of the received messages
+		#if defined(M2M_DIRECT_SNIFF_METADATA)
+		static uint8_t _sniffedMacAddress[MAC_ADDRESS_LENGTH];						//Transmitter of the last sniffed action frame, shared by every instance as there is one radio
+		static m2mDirectFrameMetadata _sniffedMetadata;								//Metadata of the last sniffed action frame, only used in the WiFi task
+		#endif
+		uint8_t _primaryEncryptionKey[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};		//Primary encryption key, published by the state that follows it
 		uint8_t _localEncryptionKey[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};		//Encryption key for this device
 		uint8_t _localMacAddress[6] = {0, 0, 0, 0, 0, 0};							//MAC address of this device
-		uint8_t _remoteMacAddress[6] = {0, 0, 0, 0, 0, 0};							//MAC address of paired device
+		uint8_t _remoteMacAddress[6] = {0, 0, 0, 0, 0, 0};							//MAC address of paired device, published by the state that follows it
 		//uint8_t _remoteEncryptionKey[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};		//Encryption key of paired device
 		uint8_t _broadcastMacAddress[6] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};			//Broadcast MAC address, used for pairing
 		char* localDeviceName = nullptr;
 		char* remoteDeviceName = nullptr;
 		bool _pairingInfoRead = false;
 		bool _pairingInfoWritten = false;
+		bool _provisioned = false;													//The application supplied the pairing, so it isn't read from flash
+		bool _provisionedTemporarily = false;										//The supplied pairing isn't saved, so neither are link parameters
+		uint8_t _storedChannel = 0;													//Communication channel saved with the pairing, 0 if there isn't one
+		bool _fastStart = true;														//With a saved pairing, initialise straight away rather than after the pairing interval
+		uint32_t _firstConnectedTime = 0;											//millis() when the link first connected
+		m2mDirectLinkState _savedLinkState;											//Link parameters as last saved or read
+		bool _linkStateRestored = false;											//Saved link parameters have been applied this boot
+		uint32_t _lastLinkStateSave = 0;											//When the link parameters were last saved, or the link connected
+		#if defined(ESP8266)
+		uint8_t _storeSector = 0;													//Store sector holding the newest record, 0 for the EEPROM sector and 1 for the spare
+		uint8_t _storeNextSlot = 0xff;												//Next erased slot in that sector, 0xff until the sectors have been scanned
+		uint32_t _storeSequence = 0;												//Sequence number of the newest record in flash
+		#endif
 		//Packet buffers
 		uint8_t _protocolPacketBuffer[MAXIMUM_MESSAGE_SIZE];						//Packet buffer for m2mDirect protocol packets, pairing, naming etc.
 		uint8_t _protocolPacketBufferPosition = 0;
@@ -624,23 +1126,118 @@ class m2mDirectClass	{
 		uint8_t _applicationBufferPosition = 2;
 		uint8_t _receivedPacketBuffer[MAXIMUM_MESSAGE_SIZE];						//Packet buffer for application data packets
 		uint8_t _receivedPacketBufferPosition = 2;									//Position in received data buffer
-		bool _dataReceived = false;													//Flag to trigger callback when data is received
+		m2mDirectQueuedPacket _receiveQueue[M2M_DIRECT_RECEIVE_QUEUE_LENGTH];		//Lock free queue of received messages, filled by the receive callback
+		std::atomic<uint8_t> _receiveQueueHead{0};									//Next message for the application, only moved by the application
+		std::atomic<uint8_t> _receiveQueueTail{0};									//Next free slot, only moved by the receive callback
+		uint8_t _receivedMessagePeer = M2M_DIRECT_NO_PEER;							//Peer table index of the sender of the message in the application buffer
+		uint8_t _receivedMessagePeerAddress[MAC_ADDRESS_LENGTH] = {0,0,0,0,0,0};	//Its MAC address, kept in case the peer is removed
+		//Peer table, devices linked beside the paired device. The receive callback finds them through a hash index of their MAC addresses
+		m2mDirectPeer _peers[M2M_DIRECT_MAXIMUM_PEERS];								//The peers, each with its own link state machine
+		std::atomic<uint8_t> _peerIndex[M2M_DIRECT_PEER_INDEX_SIZE];				//Hash of MAC address to peer, open addressing with linear probing
+		std::atomic<uint8_t> _peerCount{0};											//Devices in the peer table
+		std::atomic<uint8_t> _peerSendWaiting{M2M_DIRECT_NO_PEER};					//Peer a send is waiting on the callback for
+		uint8_t _peerDeferredSend = M2M_DIRECT_NO_PEER;								//Peer a send is waiting for confirmation on a later tick
+		uint32_t _peerSendTimer = 0;												//When the deferred peer send went
+		bool _peerTableOnly = false;												//There is no paired device, the peer table set the primary key and pairing doesn't start
+		//Hub and spoke, a hub polls its peers in turn and each answers only in its slot
+		bool _hubEnabled = false;													//This device is a hub polling the peer table
+		uint16_t _hubSlotLength = M2M_DIRECT_HUB_SLOT_LENGTH;						//Time each peer has to answer
+		uint32_t _hubSlotStart = 0;													//When the current slot started
+		uint8_t _hubSlotPeer = M2M_DIRECT_NO_PEER;									//Peer polled in the current slot
+		std::atomic<uint32_t> _pollSchedule{0};										//Slot and cycle length from the hub's last poll, packed so they change together, 0 if not polled
+		std::atomic<uint32_t> _lastPollTime{0};										//When the hub's last poll arrived
+		std::atomic<bool> _pollDue{false};											//A poll arrived and hasn't been answered
+		//Broadcast data, authenticated with an HMAC as ESP-Now can't encrypt broadcasts
+		uint8_t _broadcastKey[ENCRYPTION_KEY_LENGTH] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};	//Key broadcasts are authenticated with
+		bool _broadcastKeySet = false;												//Use _broadcastKey rather than the primary encryption key
+		uint32_t _broadcastEpoch = 0;												//Saved count of boots that broadcast, so listeners can tell a restart from a replay. 0 until the first broadcast
+		uint32_t _broadcastSequence = 0;											//Sequence number of the next broadcast this epoch
+		std::atomic<uint32_t> _broadcastGroups[8];									//Bitmap of subscribed groups, read by the receive callback
+		m2mDirectBroadcastSource _broadcastSources[M2M_DIRECT_MAXIMUM_BROADCAST_SOURCES];	//Publishers heard from, for loss accounting
+		//Relaying, messages flood across link partners with duplicate suppression and a hop limit
+		bool _relayEnabled = false;													//Forward relayed messages for other devices
+		uint32_t _relayMessageId = 0;												//ID of the next relayed message originated here, starts at random
+		m2mDirectRelayRecord _relaySeen[M2M_DIRECT_RELAY_DUPLICATE_CACHE];			//Ring of recent relayed messages, only used by the receive callback
+		uint8_t _relaySeenNext = 0;													//Oldest entry in the ring, replaced next
+		uint8_t _relayPacketBuffer[MAXIMUM_MESSAGE_SIZE];							//Frame being forwarded, only used by the receive callback
+		//Event queue
+		m2mDirectEvent _eventQueue[M2M_DIRECT_EVENT_QUEUE_LENGTH];					//Ring buffer of events waiting for the application callbacks
+		uint8_t _eventQueueHead = 0;												//Next event to dispatch
+		uint8_t _eventQueueTail = 0;												//Next free slot in the event queue
+		bool _messageReceivedEventQueued = false;									//A message received event is waiting, used for coalescing
+		bool _manualEventDispatch = false;											//The application calls dispatchEvents() itself
+		#if defined(ESP32)
+		portMUX_TYPE _eventQueueLock = portMUX_INITIALIZER_UNLOCKED;				//Events are posted from the WiFi task as well as housekeeping
+		#endif
+		//Statistics
+		m2mDirectStatistics _statistics;											//Link counters, never reset, written from housekeeping and the WiFi task and read with _statisticsSnapshot()
+		m2mDirectStatistics _statisticsBaseline;									//Counters at the last resetStatistics(), subtracted by statistics()
+		std::atomic<bool> _signalStatisticsResetDue{false};							//resetStatistics() was called, the receive callback restarts the RSSI figures
+		std::atomic<bool> _relayLatencyResetDue{false};								//resetStatistics() was called, relaying restarts the hop latency figures
 		//Callbacks
 		std::function<void()> pairingCallback = nullptr;							//Pointer to the pairing start callback
 		std::function<void()> pairedCallback = nullptr;								//Pointer to the paired callback
 		std::function<void()> connectedCallback = nullptr;							//Pointer to the connected callback
 		std::function<void()> disconnectedCallback = nullptr;						//Pointer to the disconnected callback
 		std::function<void()> messageReceivedCallback = nullptr;					//Pointer to the message received callback
+		std::function<void()> peerStateChangedCallback = nullptr;					//Pointer to the peer state changed callback
 		//Methods
+		void _linkHousekeeping();													//The link state machine, called from housekeeping() or in the background
+		#if defined(ESP32)
+		static void _housekeepingTask(void* instance);								//ESP32 RTOS task for background housekeeping
+		#elif defined(ESP8266)
+		static void _housekeepingTick(m2mDirectClass* instance);					//ESP8266 scheduled Ticker callback for background housekeeping
+		#endif
+		bool _createSendQueue();													//Create the send queue for background housekeeping or power save
+		bool _queueMessage(uint8_t* buffer, uint8_t length, uint8_t peer = M2M_DIRECT_NO_PEER);	//Queue an application message for background housekeeping
+		void _sendQueuedMessages();													//Send any queued application messages
+		void _resolveDeferredSend(bool force = false);								//Settle send quality for a deferred send
+		void _postEvent(m2mDirectEvent event);										//Queue an event for the application callbacks
+		bool _nextEvent(m2mDirectEvent &event);										//Take the next event from the queue
+		void _deliverReceivedMessages();											//Move received messages to the application buffer and run the callback
+		void _reduceEchoQuality();													//Atomically shift down the echo quality
+		void _addClockSample(uint32_t echoedTransmitTime, uint32_t holdTime, uint32_t remoteTransmitTime, uint32_t receivedTime);	//Add a clock sample and update the estimate
+		m2mDirectClockEstimate _clockEstimateSnapshot();							//Consistent copy of the clock estimate
+		void _remoteTransmitSnapshot(uint32_t &remoteTransmitTime, uint32_t &receivedTime);	//Consistent copy of the remote transmit time of the last keepalive
 		void _advanceTimers();														//Swap current/previous activity timers
-		bool _readPairingInfo();													//Read pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
-		bool _writePairingInfo();													//Write pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
-		bool _deletePairingInfo();													//Delete pairing from EEPROM (ESP8266) or 'preferences' (ESP32)
+		void _sendPairingMessage();													//Broadcast the pairing message or ACK when it is due
+		bool _handshakeHousekeeping();												//Check for a completed handshake and seed the link quality if there is one
+		bool _readPairingInfo();													//Read pairing from flash (ESP8266) or 'preferences' (ESP32)
+		bool _writePairingInfo();													//Write pairing to flash (ESP8266) or 'preferences' (ESP32)
+		bool _deletePairingInfo();													//Delete pairing from flash (ESP8266) or 'preferences' (ESP32)
+		bool _usePairing(bool save);												//Connect with a provisioned pairing, saving it if asked
+		bool _readLegacyPairingInfo();												//Read a pairing saved by an earlier version, so it can be migrated
+		uint8_t _packRecord(const m2mDirectLinkState &linkState, uint8_t* record);	//Pack the pairing, channel and link parameters into one record
+		bool _unpackRecord(const uint8_t* record, uint8_t length);					//Unpack and check a saved record
+		bool _loadRecord(uint8_t* record, uint8_t &length);							//Read the newest record from the store
+		bool _storeRecord(const uint8_t* record, uint8_t length);					//Atomically replace the record in the store
+		bool _eraseRecords();														//Erase every record, and any older saved pairing
+		#if defined(ESP8266)
+		uint8_t _storeSectors();													//Sectors the store can use, 1 unless a spare is defined outside any filesystem
+		uint32_t _storeSectorNumber(uint8_t sector);								//Flash sector number of a store sector
+		#endif
+		m2mDirectLinkState _currentLinkState();										//The link parameters in use now
+		void _packLinkState(const m2mDirectLinkState &linkState, uint8_t* data);	//Pack link parameters for saving
+		bool _unpackLinkState(const uint8_t* data, m2mDirectLinkState &linkState);	//Unpack and check saved link parameters
+		void _restoreLinkState();													//Resume at the saved operating point once connected
+		void _linkStateHousekeeping();												//Save the link parameters if they have moved, rate limited
+		bool _writeLinkState(const m2mDirectLinkState &linkState);					//Save the link parameters alongside the pairing
 		bool _initialiseWiFi();														//Initialise the WiFi interface, which varies depending on if connected etc.
-		bool _initialiseEspNow(uint8_t channel);									//Initialise ESP-Now
+		bool _initialiseEspNow(uint8_t channel);									//Initialise ESP-Now, or share it if another instance already has
+		bool _startEspNow(uint8_t channel);											//Start ESP-Now and the shared callbacks
 		bool _initialiseEspNowCallbacks();											//Initialise the ESP-Now callbacks
-		uint8_t _leastCongestedChannel();											//Scan the neighbourhood for the least congested channel with a dumb heuristic
+		uint8_t _leastCongestedChannel();											//Least congested channel from the survey, or the pairing channel
+		bool _channelSurveyHousekeeping();											//Run the channel survey a slice at a time
+		void _startSurveySlice();													//Hop to a survey channel and start counting
+		void _stopSurveySlice();													//Return to the home channel and record the result
 		bool _changeChannel(uint8_t channel);										//Change the channel
+		void _channelMigrationHousekeeping();										//Propose, agree and carry out channel migrations
+		void _startChannelMigration(uint8_t channel);								//Propose a channel migration to the peer
+		void _moveToChannel(uint8_t channel);										//Move the link, and the peer registrations, to a new channel
+		bool _radioShared();														//Other links need the radio to stay on this channel and awake
+		void _createChannelChangeMessage(uint8_t flag, uint8_t channel, uint32_t switchDelay);	//Create a channel change proposal or ACK
+		void _sendImmediateKeepalive();												//Send a keepalive straight away on arriving on a channel
+		void _channelHuntHousekeeping(bool keepaliveArrived);						//Rendezvous with a peer that is on an unknown channel
 		void _chooseEncryptionKeys();												//Choose encryption keys
 		void _clearEncryptionKeys();												//Clear encryption keys
 		bool _setPrimaryEncryptionKey();											//Set the primary encryption key
@@ -651,6 +1248,36 @@ class m2mDirectClass	{
 		void _createKeepaliveMessage();												//Create the connection keepalive message
 		bool _sendBroadcastPacket(uint8_t* buffer, uint8_t length);					//Send broadcast messages, mostly for pairing
 		bool _sendUnicastPacket(uint8_t* buffer, uint8_t length, bool wait = true);	//Send unicast messages
+		bool _sendApplicationPacket(uint8_t* buffer, uint8_t length, bool wait = true);	//Send an application message, with forward error correction if enabled
+		bool _sendFecParity();														//Send the parity frame for the current block
+		void _adaptFecBlockSize();													//Choose the block size from the loss the peer reports
+		void _receiveFecFrame(const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata);	//Deliver a protected message or rebuild a lost one from parity
+		bool _queueReceivedMessage(const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata, uint8_t peer = M2M_DIRECT_NO_PEER);	//Put a received application message in the receive queue
+		void _finishApplicationMessage();											//Pad the application message and add its CRC
+		bool _finishBroadcastMessage(uint8_t group);								//Add the broadcast header, pad the message and add its authentication tag and CRC
+		bool _nextBroadcastEpoch();													//Count this boot in the store and use it as the broadcast epoch
+		bool _holdApplicationMessage();												//Application messages must be queued rather than sent now
+		void _broadcastTag(const uint8_t* message, uint8_t length, uint8_t* tag);	//Truncated HMAC of a broadcast
+		bool _queueRelayFrame(uint8_t* buffer, uint8_t length, const uint8_t* from);	//Queue a relayed frame to its destination, or flood it to every other link partner
+		void _sendRelayFrame(m2mDirectQueuedPacket &packet);						//Send a queued relayed frame to the next hop and record the hop statistics
+		bool _queuedPeerCurrent(const m2mDirectQueuedPacket &packet);				//The peer a queued message is for is still in its slot
+		void _receiveRelayFrame(const uint8_t* macAddress, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata);	//Deliver, forward or drop a relayed frame from a link partner, in the WiFi task
+		void _receiveBroadcastFrame(const uint8_t* macAddress, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata);	//Handle a valid broadcast data frame, in the WiFi task
+		uint8_t _peerHash(const uint8_t* macAddress);								//Start of the probe sequence for a MAC address in the peer index
+		uint8_t _findPeer(const uint8_t* macAddress);								//Peer table index for a MAC address, M2M_DIRECT_NO_PEER if it isn't there
+		void _resetPeer(uint8_t peerIndex);											//Return a peer's link to its starting state
+		void _peerHousekeeping();													//Run the link state machine for each device in the peer table
+		void _setPeerState(uint8_t peerIndex, m2mDirectState newState);				//Change a peer's state and tell the application
+		void _createPeerKeepaliveMessage(uint8_t peerIndex, bool poll = false);		//Create a keepalive, or hub poll, for a device in the peer table
+		uint8_t _nextPollPeer();													//Peer to poll when a new hub slot starts, M2M_DIRECT_NO_PEER otherwise
+		bool _pollSlotOpen();														//This spoke's slot, after the hub's last poll, is still open
+		bool _queuedSendAllowed();													//Queued messages may be sent now, not waiting for a wake window or slot
+		bool _sendPeerPacket(uint8_t peerIndex, uint8_t* buffer, uint8_t length, bool wait = true);	//Send a unicast frame to a device in the peer table
+		void _peerSendResult(uint8_t peerIndex, bool delivered);					//Update a peer's send quality and keepalive interval for a send
+		void _resolveDeferredPeerSend(bool force = false);							//Settle send quality for a deferred send to a peer
+		uint8_t _encryptedPeerCount();												//Encrypted ESP-Now peers this instance uses, including the paired device
+		bool _sendPeerMessage(uint8_t peerIndex, uint8_t* buffer, uint8_t length, bool wait = true);	//Send an application message to a connected peer
+		void _receivePeerFrame(uint8_t peerIndex, const uint8_t* message, uint8_t length, const m2mDirectFrameMetadata &metadata);	//Handle a valid frame from a device in the peer table
 		uint8_t _countBits(uint32_t);												//Count the number of set bits in an uint32_t
 		bool _registerPeer(uint8_t* macaddress, uint8_t channel);					//Register an unencrypted peer
 		bool _registerPeer(uint8_t* macaddress, uint8_t channel, uint8_t* key);		//Register an encrypted peer
@@ -717,6 +1344,40 @@ class m2mDirectClass	{
 		void _indicatorOff();
 		bool _reduceTxPower();														//Reduce the Tx power
 		bool _increaseTxPower();													//Increase the Tx power
+		void _recordMetadata(const m2mDirectFrameMetadata &metadata);				//Aggregate metadata of a frame from the peer into the statistics
+		m2mDirectStatistics _statisticsSnapshot();									//Copy the counters until two copies agree, so the copy is from one moment
+		#if defined(ESP32)
+		static void _fillMetadata(const wifi_pkt_rx_ctrl_t &rxControl, m2mDirectFrameMetadata &metadata);	//Copy radio metadata from the receive control header
+		#endif
+		#if defined(M2M_DIRECT_SNIFF_METADATA)
+		void _startMetadataSniffer();												//Sniff action frames in promiscuous mode for their radio metadata
+		#endif
+		#if defined(ESP32)
+		uint8_t _chooseRate(bool sampleAllowed);									//Choose the PHY rate for the next unicast frame, sampling another rate if allowed
+		bool _applyRate(uint8_t index);												//Configure ESP-Now for a PHY rate
+		wifi_interface_t _espNowInterface();										//Interface ESP-Now frames go out on
+		void _recordRateResult(uint8_t index, bool success);						//Record the delivery of a frame sent at a rate
+		void _updateRates();														//Update delivery probabilities and choose the best rates
+		bool _rateUsable(uint8_t index);											//Is a rate usable with this peer
+		#endif
+		bool _setTxPower(int16_t power);											//Set the Tx power, clamped to the current limits
+		bool _powerSaveHousekeeping();												//Follow the wake schedule, returns true while the radio is asleep
+		bool _sleepRadio(bool sleep);												//Turn the radio off or back on for power save
+		bool _readLinkReport();														//Take the latest link report from the peer, true if there was one
+		void _txPowerControl(bool reportReceived);									//Choose the Tx power for the next keepalive
+		static std::atomic<m2mDirectClass*> _instances[M2M_DIRECT_MAXIMUM_INSTANCES];	//Every instance, so the shared ESP-Now callbacks can find the one a frame is for
+		uint8_t _instanceIndex = M2M_DIRECT_MAXIMUM_INSTANCES;						//Place in _instances, M2M_DIRECT_MAXIMUM_INSTANCES if there wasn't one
+		bool _registerInstance();													//Take a place in _instances and pick where this instance saves its pairing
+		bool _storeAvailable();														//This instance has its own place to save a pairing
+		static std::atomic<m2mDirectClass*> _surveyingInstance;						//Instance running a channel survey, which the promiscuous callback counts frames for
+		static std::atomic<uint8_t> _radioState;									//Whether ESP-Now is running, it is started once by the first instance and shared by the rest
+		static uint8_t _instancesRunning();											//Instances with ESP-Now running, more than one means they share the radio
+		static m2mDirectClass* _pairingInstanceFor(const uint8_t* macAddress);		//Find the one instance a pairing frame is for
+		static m2mDirectClass* _instanceFor(const uint8_t* macAddress);				//Find the instance linked to a MAC address
+		static void _dispatchReceivedFrame(const uint8_t* macAddress, const uint8_t* message, int length, const m2mDirectFrameMetadata &metadata);	//Hand a received frame to its instance(s)
+		static void _dispatchSendResult(const uint8_t* macAddress, bool delivered);	//Hand a send result to its instance(s)
+		void _receiveFrame(const uint8_t* macAddress, const uint8_t* receivedMessage, int receivedMessageLength, const m2mDirectFrameMetadata &metadata);	//Process a received frame, in the WiFi task
+		void _sendResult(const uint8_t* macAddress, bool delivered);				//Process the result of a send, in the WiFi task
 };
-extern m2mDirectClass m2mDirect;	//Create an instance of the class, as only one is practically usable at a time
+extern m2mDirectClass m2mDirect;	//The default instance, more can be created for separate links, begin() refuses any not on the channel already in use
 #endif